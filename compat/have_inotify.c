@@ -0,0 +1,11 @@
+#include <sys/inotify.h>
+
+int main()
+{
+    int fd;
+
+    fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    (void) inotify_add_watch (fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO);
+
+    return 0;
+}
@@ -230,7 +230,7 @@ _notmuch_dump()
     ! $split &&
     case "${cur}" in
 	-*)
-	    local options="--gzip --format= --output= ${_notmuch_shared_options}"
+	    local options="--gzip --format= --output= --jobs= --since-revision= ${_notmuch_shared_options}"
 	    compopt -o nospace
 	    COMPREPLY=( $(compgen -W "$options" -- ${cur}) )
 	    ;;
@@ -328,7 +328,7 @@ _notmuch_new()
     ! $split &&
     case "${cur}" in
 	-*)
-	    local options="--no-hooks --decrypt= --quiet ${_notmuch_shared_options}"
+	    local options="--no-hooks --decrypt= --jobs= --watch --quiet ${_notmuch_shared_options}"
 	    compopt -o nospace
 	    COMPREPLY=( $(compgen -W "${options}" -- ${cur}) )
 	    ;;
@@ -380,7 +380,7 @@ _notmuch_restore()
 	    COMPREPLY=( $( compgen -W "sup batch-tag auto" -- "${cur}" ) )
 	    return
 	    ;;
-	--input)
+	--input|--checkpoint)
 	    _filedir
 	    return
 	    ;;
@@ -389,7 +389,7 @@ _notmuch_restore()
     ! $split &&
     case "${cur}" in
 	-*)
-	    local options="--format= --accumulate --input= ${_notmuch_shared_options}"
+	    local options="--format= --accumulate --input= --checkpoint= ${_notmuch_shared_options}"
 	    compopt -o nospace
 	    COMPREPLY=( $(compgen -W "$options" -- ${cur}) )
 	    ;;
@@ -492,7 +492,7 @@ _notmuch_address()
     ! $split &&
     case "${cur}" in
 	-*)
-	    local options="--format= --output= --sort= --exclude= --deduplicate= ${_notmuch_shared_options}"
+	    local options="--format= --output= --sort= --exclude= --deduplicate= --top= ${_notmuch_shared_options}"
 	    compopt -o nospace
 	    COMPREPLY=( $(compgen -W "$options" -- ${cur}) )
 	    ;;
@@ -579,7 +579,7 @@ _notmuch_tag()
 
 _notmuch()
 {
-    local _notmuch_commands="compact config count dump help insert new reply restore reindex search address setup show tag emacs-mua"
+    local _notmuch_commands="compact config count dump help insert new reply restore reindex search address server setup show tag emacs-mua"
     local arg cur prev words cword split
 
     # require bash-completion with _init_completion
@@ -128,6 +128,10 @@ man_pages = [
      u'syntax for notmuch queries',
      [notmuch_authors], 7),
 
+    ('man1/notmuch-server', 'notmuch-server',
+     u'answer notmuch requests from a long-running process',
+     [notmuch_authors], 1),
+
     ('man1/notmuch-show', 'notmuch-show',
      u'show messages matching the given search terms',
      [notmuch_authors], 1),
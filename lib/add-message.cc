@@ -170,7 +170,8 @@ _resolve_message_id_to_thread_id_old (notmuch_database_t *notmuch,
 					_notmuch_database_generate_thread_id (notmuch));
 	db->set_metadata (metadata_key, *thread_id_ret);
     } else {
-	*thread_id_ret = talloc_strdup (ctx, thread_id_string.c_str());
+	*thread_id_ret = _notmuch_database_resolve_thread_alias (
+	    notmuch, ctx, talloc_strdup (ctx, thread_id_string.c_str()));
     }
 
     talloc_free (metadata_key);
@@ -178,40 +179,155 @@ _resolve_message_id_to_thread_id_old (notmuch_database_t *notmuch,
     return NOTMUCH_STATUS_SUCCESS;
 }
 
+/* Return the thread ID at the end of the chain of aliases starting
+ * at 'thread_id'. */
+static std::string
+_resolve_thread_alias (Xapian::Database *db, const std::string &thread_id)
+{
+    std::set<std::string> seen;
+    std::string current = thread_id;
+    std::string next;
+
+    /* The guard against cycles is only paranoia: a merged thread has
+     * no messages left, and thread IDs are never reused. */
+    while (seen.insert (current).second) {
+	next = db->get_metadata (NOTMUCH_METADATA_THREAD_ALIAS_PREFIX + current);
+	if (next.empty ())
+	    break;
+	current = next;
+    }
+
+    return current;
+}
+
+/* Return the ID of the thread that 'thread_id' was merged into,
+ * following any chain of merges, or 'thread_id' itself if it was
+ * never merged.  The result may belong to 'ctx'.
+ *
+ * This is reached from query parsing, so it never writes; chains are
+ * shortened by _notmuch_database_compact_thread_aliases. */
+const char *
+_notmuch_database_resolve_thread_alias (notmuch_database_t *notmuch,
+					void *ctx,
+					const char *thread_id)
+{
+    std::string resolved = _resolve_thread_alias (notmuch->xapian_db,
+						  thread_id);
+
+    if (resolved == thread_id)
+	return thread_id;
+
+    return talloc_strdup (ctx, resolved.c_str ());
+}
+
+/* Point each thread alias directly at the thread at the end of its
+ * chain, and drop the aliases leading to a thread without any
+ * documents left, since nothing can be found through them.  The
+ * changes are committed, so this must not be called in an atomic
+ * section. */
+notmuch_status_t
+_notmuch_database_compact_thread_aliases (notmuch_database_t *notmuch)
+{
+    const std::string prefix = NOTMUCH_METADATA_THREAD_ALIAS_PREFIX;
+    const std::string thread_prefix = _find_prefix ("thread");
+    Xapian::WritableDatabase *db;
+    std::vector<std::pair<std::string, std::string> > changes;
+    Xapian::TermIterator t, t_end;
+
+    if (notmuch->mode != NOTMUCH_DATABASE_MODE_READ_WRITE)
+	return NOTMUCH_STATUS_READ_ONLY_DATABASE;
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+
+    try {
+	/* Collect the changes first, since changing the metadata
+	 * invalidates the iterator. */
+	t_end = db->metadata_keys_end (prefix);
+	for (t = db->metadata_keys_begin (prefix); t != t_end; t++) {
+	    std::string target = db->get_metadata (*t);
+	    std::string resolved;
+
+	    if (target.empty ())
+		continue;
+
+	    resolved = _resolve_thread_alias (db, target);
+	    if (! db->term_exists (thread_prefix + resolved))
+		changes.push_back (std::make_pair (*t, std::string ()));
+	    else if (resolved != target)
+		changes.push_back (std::make_pair (*t, resolved));
+	}
+
+	for (size_t i = 0; i < changes.size (); i++)
+	    db->set_metadata (changes[i].first, changes[i].second);
+	if (! changes.empty ())
+	    db->commit ();
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch, "A Xapian exception occurred compacting thread aliases: %s\n",
+			       error.get_msg ().c_str ());
+	notmuch->exception_reported = true;
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+/* Move all the documents (mail and ghost) of thread
+ * 'loser_thread_id' to thread 'winner_thread_id'.
+ *
+ * Only the thread term, the thread ID value and the last modification
+ * change, so the documents are rewritten directly by doc ID rather
+ * than through a notmuch_message_t each, and they all get the same
+ * revision.  The writes are part of the caller's atomic section.
+ *
+ * The merge is recorded as an alias from the loser to the winner, so
+ * that a thread ID obtained before the merge (or, without ghost
+ * messages, stored in a thread_id_* metadata key) can still be
+ * resolved with _notmuch_database_resolve_thread_alias. */
 static notmuch_status_t
 _merge_threads (notmuch_database_t *notmuch,
 		const char *winner_thread_id,
 		const char *loser_thread_id)
 {
+    Xapian::WritableDatabase *db;
     Xapian::PostingIterator loser, loser_end;
-    notmuch_message_t *message = NULL;
-    notmuch_private_status_t private_status;
-    notmuch_status_t ret = NOTMUCH_STATUS_SUCCESS;
+    std::vector<Xapian::docid> doc_ids;
+    const std::string thread_prefix = _find_prefix ("thread");
+    const std::string loser_term = thread_prefix + loser_thread_id;
+    const std::string winner_term = thread_prefix + winner_thread_id;
+    std::string last_mod;
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
 
+    /* Collect the doc IDs first, since rewriting the documents
+     * changes the posting list. */
     _notmuch_database_find_doc_ids (notmuch, "thread", loser_thread_id, &loser, &loser_end);
+    for ( ; loser != loser_end; loser++)
+	doc_ids.push_back (*loser);
 
-    for ( ; loser != loser_end; loser++) {
-	message = _notmuch_message_create (notmuch, notmuch,
-					   *loser, &private_status);
-	if (message == NULL) {
-	    ret = COERCE_STATUS (private_status,
-				 "Cannot find document for doc_id from query");
-	    goto DONE;
-	}
+    if (! doc_ids.empty () &&
+	notmuch->features & NOTMUCH_FEATURE_LAST_MOD)
+	last_mod = Xapian::sortable_serialise (
+	    _notmuch_database_new_revision (notmuch));
 
-	_notmuch_message_remove_term (message, "thread", loser_thread_id);
-	_notmuch_message_add_term (message, "thread", winner_thread_id);
-	_notmuch_message_sync (message);
+    for (size_t i = 0; i < doc_ids.size (); i++) {
+	Xapian::Document doc = db->get_document (doc_ids[i]);
 
-	notmuch_message_destroy (message);
-	message = NULL;
+	doc.remove_term (loser_term);
+	doc.add_term (winner_term, 0);
+	doc.add_value (NOTMUCH_VALUE_THREAD_ID, winner_thread_id);
+	if (! last_mod.empty ())
+	    doc.add_value (NOTMUCH_VALUE_LAST_MOD, last_mod);
+
+	db->replace_document (doc_ids[i], doc);
     }
 
-  DONE:
-    if (message)
-	notmuch_message_destroy (message);
+    db->set_metadata (std::string (NOTMUCH_METADATA_THREAD_ALIAS_PREFIX) +
+		      loser_thread_id, winner_thread_id);
 
-    return ret;
+    _notmuch_database_thread_changed (notmuch, winner_thread_id);
+    _notmuch_database_thread_changed (notmuch, loser_thread_id);
+
+    return NOTMUCH_STATUS_SUCCESS;
 }
 
 static void
@@ -378,7 +494,9 @@ _consume_metadata_thread_id (void *ctx, notmuch_database_t *notmuch,
 	 * anymore. */
 	db->set_metadata (metadata_key, "");
 
-	return talloc_strdup (ctx, stored_id.c_str ());
+	/* The thread may have been merged since the ID was stored. */
+	return talloc_strdup (ctx, _notmuch_database_resolve_thread_alias (
+				  notmuch, ctx, stored_id.c_str ()));
     }
 }
 
@@ -422,8 +540,12 @@ _notmuch_database_link_message (notmuch_database_t *notmuch,
 
     /* Check if the message already had a thread ID */
     if (notmuch->features & NOTMUCH_FEATURE_GHOSTS) {
-	if (is_ghost)
+	if (is_ghost) {
 	    thread_id = notmuch_message_get_thread_id (message);
+	    /* Ghosts from before NOTMUCH_FEATURE_THREAD_ID_VALUES
+	     * only have the thread term. */
+	    _notmuch_message_upgrade_thread_id_value (message, thread_id);
+	}
     } else {
 	thread_id = _consume_metadata_thread_id (local, notmuch, message);
 	if (thread_id)
@@ -467,45 +589,35 @@ _notmuch_database_link_message (notmuch_database_t *notmuch,
     return status;
 }
 
-notmuch_status_t
-notmuch_database_index_file (notmuch_database_t *notmuch,
-			     const char *filename,
-			     notmuch_indexopts_t *indexopts,
-			     notmuch_message_t **message_ret)
+/* Add the (already opened and parsed) 'message_file' to the database,
+ * using the header values previously extracted from it.
+ *
+ * If 'terms' is not NULL, it is a detached message holding the terms
+ * generated from the file by notmuch_database_prepare_file, so the
+ * (expensive) term generation is skipped here.
+ */
+static notmuch_status_t
+_notmuch_database_index_message_file (notmuch_database_t *notmuch,
+				      notmuch_message_file_t *message_file,
+				      const char *date,
+				      const char *from,
+				      const char *subject,
+				      const char *message_id,
+				      notmuch_indexopts_t *indexopts,
+				      notmuch_message_t *terms,
+				      notmuch_message_t **message_ret)
 {
-    notmuch_message_file_t *message_file;
     notmuch_message_t *message = NULL;
     notmuch_status_t ret = NOTMUCH_STATUS_SUCCESS, ret2;
     notmuch_private_status_t private_status;
     bool is_ghost = false, is_new = false;
     notmuch_indexopts_t *def_indexopts = NULL;
 
-    const char *date;
-    const char *from, *to, *subject;
-    char *message_id = NULL;
-
-    if (message_ret)
-	*message_ret = NULL;
-
-    ret = _notmuch_database_ensure_writable (notmuch);
-    if (ret)
-	return ret;
-
-    message_file = _notmuch_message_file_open (notmuch, filename);
-    if (message_file == NULL)
-	return NOTMUCH_STATUS_FILE_ERROR;
-
     /* Adding a message may change many documents.  Do this all
      * atomically. */
     ret = notmuch_database_begin_atomic (notmuch);
     if (ret)
-	goto DONE;
-
-    ret = _notmuch_message_file_get_headers (message_file,
-					     &from, &subject, &to, &date,
-					     &message_id);
-    if (ret)
-	goto DONE;
+	return ret;
 
     try {
 	/* Now that we have a message ID, we get a message object,
@@ -516,8 +628,6 @@ notmuch_database_index_file (notmuch_database_t *notmuch,
 							  message_id,
 							  &private_status);
 
-	talloc_free (message_id);
-
 	/* We cannot call notmuch_message_get_flag for a new message */
 	switch (private_status) {
 	case NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND:
@@ -534,13 +644,16 @@ notmuch_database_index_file (notmuch_database_t *notmuch,
 	    goto DONE;
 	}
 
-	_notmuch_message_add_filename (message, filename);
+	_notmuch_message_add_filename (message,
+				       _notmuch_message_file_get_filename (message_file));
 
 	if (is_new || is_ghost) {
 	    _notmuch_message_add_term (message, "type", "mail");
-	    if (is_ghost)
+	    if (is_ghost) {
 		/* Convert ghost message to a regular message */
 		_notmuch_message_remove_term (message, "type", "ghost");
+		_notmuch_message_upgrade_message_id_trigrams (message);
+	    }
 	}
 
 	ret = _notmuch_database_link_message (notmuch, message,
@@ -548,17 +661,23 @@ notmuch_database_index_file (notmuch_database_t *notmuch,
 	if (ret)
 	    goto DONE;
 
-	if (is_new || is_ghost)
+	if (is_new || is_ghost) {
 	    _notmuch_message_set_header_values (message, date, from, subject);
-
-	if (!indexopts) {
-	    def_indexopts = notmuch_database_get_default_indexopts (notmuch);
-	    indexopts = def_indexopts;
+	    _notmuch_message_set_file_header_values (message, message_file);
 	}
 
-	ret = _notmuch_message_index_file (message, indexopts, message_file);
-	if (ret)
-	    goto DONE;
+	if (terms) {
+	    _notmuch_message_add_detached_terms (message, terms);
+	} else {
+	    if (!indexopts) {
+		def_indexopts = notmuch_database_get_default_indexopts (notmuch);
+		indexopts = def_indexopts;
+	    }
+
+	    ret = _notmuch_message_index_file (message, indexopts, message_file);
+	    if (ret)
+		goto DONE;
+	}
 
 	if (! is_new && !is_ghost)
 	    ret = NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID;
@@ -584,9 +703,6 @@ notmuch_database_index_file (notmuch_database_t *notmuch,
 	    notmuch_message_destroy (message);
     }
 
-    if (message_file)
-	_notmuch_message_file_close (message_file);
-
     ret2 = notmuch_database_end_atomic (notmuch);
     if ((ret == NOTMUCH_STATUS_SUCCESS ||
 	 ret == NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID) &&
@@ -596,6 +712,176 @@ notmuch_database_index_file (notmuch_database_t *notmuch,
     return ret;
 }
 
+notmuch_status_t
+notmuch_database_index_file (notmuch_database_t *notmuch,
+			     const char *filename,
+			     notmuch_indexopts_t *indexopts,
+			     notmuch_message_t **message_ret)
+{
+    notmuch_message_file_t *message_file;
+    notmuch_status_t ret;
+
+    const char *date;
+    const char *from, *to, *subject;
+    char *message_id = NULL;
+
+    if (message_ret)
+	*message_ret = NULL;
+
+    ret = _notmuch_database_ensure_writable (notmuch);
+    if (ret)
+	return ret;
+
+    message_file = _notmuch_message_file_open (notmuch, filename);
+    if (message_file == NULL)
+	return NOTMUCH_STATUS_FILE_ERROR;
+
+    ret = _notmuch_message_file_get_headers (message_file,
+					     &from, &subject, &to, &date,
+					     &message_id);
+    if (ret == NOTMUCH_STATUS_SUCCESS)
+	ret = _notmuch_database_index_message_file (notmuch, message_file,
+						    date, from, subject,
+						    message_id, indexopts,
+						    NULL, message_ret);
+
+    _notmuch_message_file_close (message_file);
+
+    return ret;
+}
+
+struct _notmuch_prepared_file {
+    char *filename;
+    notmuch_message_file_t *message_file;
+    notmuch_indexopts_t *indexopts;
+
+    /* Result of opening and parsing the file, reported by
+     * notmuch_database_index_prepared_file. */
+    notmuch_status_t status;
+    int file_errno;
+
+    const char *date;
+    const char *from;
+    const char *subject;
+    char *message_id;
+
+    /* Detached message holding the generated terms, or NULL if they
+     * must be generated when the file is indexed. */
+    notmuch_message_t *terms;
+};
+
+notmuch_status_t
+notmuch_database_prepare_file (notmuch_database_t *notmuch,
+			       void *ctx,
+			       const char *filename,
+			       notmuch_indexopts_t *indexopts,
+			       notmuch_prepared_file_t **prepared_ret)
+{
+    notmuch_prepared_file_t *prepared;
+    const char *to;
+
+    *prepared_ret = NULL;
+
+    /* This runs concurrently with other uses of 'notmuch', so we
+     * neither log nor call anything that could touch the database. */
+    if (notmuch->mode == NOTMUCH_DATABASE_MODE_READ_ONLY)
+	return NOTMUCH_STATUS_READ_ONLY_DATABASE;
+
+    prepared = talloc_zero (ctx, notmuch_prepared_file_t);
+    if (unlikely (prepared == NULL))
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    prepared->filename = talloc_strdup (prepared, filename);
+    prepared->indexopts = indexopts;
+
+    prepared->message_file = _notmuch_message_file_open_ctx (NULL, prepared,
+							     filename);
+    if (prepared->message_file == NULL) {
+	prepared->status = NOTMUCH_STATUS_FILE_ERROR;
+	prepared->file_errno = errno;
+	goto DONE;
+    }
+
+    prepared->status = _notmuch_message_file_get_headers (prepared->message_file,
+							  &prepared->from,
+							  &prepared->subject,
+							  &to,
+							  &prepared->date,
+							  &prepared->message_id);
+    if (prepared->status)
+	goto DONE;
+
+    /* Decryption needs access to the database (for session keys and
+     * properties), so leave such messages to be indexed later. */
+    if (! indexopts ||
+	(notmuch_indexopts_get_decrypt_policy (indexopts) != NOTMUCH_DECRYPT_FALSE &&
+	 _notmuch_message_file_has_encrypted_part (prepared->message_file)))
+	goto DONE;
+
+    try {
+	prepared->terms = _notmuch_message_create_detached (prepared);
+	if (prepared->terms &&
+	    _notmuch_message_index_file (prepared->terms, indexopts,
+					 prepared->message_file)) {
+	    notmuch_message_destroy (prepared->terms);
+	    prepared->terms = NULL;
+	}
+    } catch (const Xapian::Error &error) {
+	/* Nowhere to report this; just generate the terms again
+	 * when indexing the file. */
+	if (prepared->terms)
+	    notmuch_message_destroy (prepared->terms);
+	prepared->terms = NULL;
+    }
+
+  DONE:
+    *prepared_ret = prepared;
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_status_t
+notmuch_database_index_prepared_file (notmuch_database_t *notmuch,
+				      notmuch_prepared_file_t *prepared,
+				      notmuch_message_t **message_ret)
+{
+    notmuch_status_t ret;
+
+    if (message_ret)
+	*message_ret = NULL;
+
+    ret = _notmuch_database_ensure_writable (notmuch);
+    if (ret)
+	return ret;
+
+    if (prepared->status == NOTMUCH_STATUS_FILE_ERROR &&
+	! prepared->message_file) {
+	_notmuch_database_log (notmuch, "Error opening %s: %s\n",
+			       prepared->filename,
+			       strerror (prepared->file_errno));
+	return prepared->status;
+    }
+
+    if (prepared->status)
+	return prepared->status;
+
+    return _notmuch_database_index_message_file (notmuch,
+						 prepared->message_file,
+						 prepared->date,
+						 prepared->from,
+						 prepared->subject,
+						 prepared->message_id,
+						 prepared->indexopts,
+						 prepared->terms,
+						 message_ret);
+}
+
+void
+notmuch_prepared_file_destroy (notmuch_prepared_file_t *prepared)
+{
+    talloc_free (prepared);
+}
+
 notmuch_status_t
 notmuch_database_add_message (notmuch_database_t *notmuch,
 			      const char *filename,
@@ -54,6 +54,8 @@ notmuch_database_set_config (notmuch_database_t *notmuch,
     try {
 	db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
 	db->set_metadata (CONFIG_PREFIX + key, value);
+	if (STRNCMP_LITERAL (key, "query.") == 0)
+	    _notmuch_database_forget_saved_queries (notmuch);
     } catch (const Xapian::Error &error) {
 	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
 	notmuch->exception_reported = true;
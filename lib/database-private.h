@@ -37,6 +37,7 @@
 #endif
 
 #include <xapian.h>
+#include <set>
 
 /* Bit masks for _notmuch_database::features.  Features are named,
  * independent aspects of the database schema.
@@ -114,6 +115,29 @@ enum _notmuch_features {
      *
      * Introduced: version 3. */
     NOTMUCH_FEATURE_UNPREFIX_BODY_ONLY = 1 << 7,
+
+    /* If set, mail documents store their thread ID in
+     * NOTMUCH_VALUE_THREAD_ID (in addition to the thread term).
+     *
+     * Introduced: version 3. */
+    NOTMUCH_FEATURE_THREAD_ID_VALUES = 1 << 8,
+
+    /* If set, the values in NOTMUCH_VALUE_FROM,
+     * NOTMUCH_VALUE_SUBJECT and NOTMUCH_VALUE_MESSAGE_ID are also
+     * indexed as trigram terms, which regexp searches use to find
+     * candidate messages.  Only set while the index.regexp_trigrams
+     * configuration is true.
+     *
+     * Introduced: version 3. */
+    NOTMUCH_FEATURE_REGEXP_TRIGRAMS = 1 << 9,
+
+    /* If set, the To, Cc, Bcc, Date and References headers are
+     * stored in NOTMUCH_VALUE_TO and the following values of each
+     * mail document whose file could be read, which is marked by a
+     * non-empty NOTMUCH_VALUE_FILE_HEADERS.
+     *
+     * Introduced: version 3. */
+    NOTMUCH_FEATURE_FILE_HEADER_VALUES = 1 << 10,
 };
 
 /* In C++, a named enum is its own type, so define bitwise operators
@@ -193,6 +217,11 @@ struct _notmuch_database {
     int atomic_nesting;
     /* true if changes have been made in this atomic section */
     bool atomic_dirty;
+    /* Number of atomic sections per commit of the current batch, or
+     * 0 if no batch is in progress. */
+    unsigned int batch_size;
+    /* Atomic sections completed since the last commit of the batch */
+    unsigned int batch_pending;
     Xapian::Database *xapian_db;
 
     /* Bit mask of features used by this database.  This is a
@@ -216,6 +245,49 @@ struct _notmuch_database {
      * (or other global invalidations of notmuch's caching)
      */
     unsigned long view;
+
+    /* Paths of directory documents, keyed by document ID, as
+     * resolved for the database view 'directory_paths_view', at
+     * revision 'directory_paths_revision' and with last document ID
+     * 'directory_paths_last_doc_id'. */
+    GHashTable *directory_paths;
+    unsigned long directory_paths_view;
+    unsigned long directory_paths_revision;
+    unsigned int directory_paths_last_doc_id;
+
+    /* Queries for thread:{subquery}, keyed by subquery string, as
+     * evaluated for 'thread_subqueries_view' and
+     * 'thread_subqueries_revision' (see thread-fp.cc). */
+    GHashTable *thread_subqueries;
+    unsigned long thread_subqueries_view;
+    unsigned long thread_subqueries_revision;
+
+    /* Parsed query:name saved queries, keyed by name, as read for
+     * 'saved_queries_view' and 'saved_queries_revision' (see
+     * query-fp.cc), and the names of the saved queries being parsed,
+     * to detect cycles. */
+    GHashTable *saved_queries;
+    unsigned long saved_queries_view;
+    unsigned long saved_queries_revision;
+    GHashTable *saved_queries_expanding;
+
+    /* Recently parsed query strings (see query.cc), keyed by query
+     * string, as parsed for 'parsed_queries_view' and
+     * 'parsed_queries_revision', and the same, most recently used
+     * first.  'parsed_queries_hits' and 'parsed_queries_misses' count
+     * the lookups that found a parsed query or not. */
+    GHashTable *parsed_queries;
+    GQueue *parsed_queries_lru;
+    unsigned long parsed_queries_view;
+    unsigned long parsed_queries_revision;
+    unsigned long parsed_queries_hits;
+    unsigned long parsed_queries_misses;
+
+    /* IDs of the threads whose summary documents must be written
+     * when the database is closed, or NULL if thread summaries are
+     * disabled (see the index.thread_summaries configuration). */
+    GHashTable *dirty_thread_summaries;
+
     Xapian::QueryParser *query_parser;
     Xapian::TermGenerator *term_gen;
     Xapian::ValueRangeProcessor *value_range_processor;
@@ -235,11 +307,14 @@ struct _notmuch_database {
  * NOTMUCH_FEATURE_FROM_SUBJECT_ID_VALUES and
  * NOTMUCH_FEATURE_INDEXED_MIMETYPES are not included because upgrade
  * doesn't currently introduce the features (though brand new databases
- * will have it). */
+ * will have it).  NOTMUCH_FEATURE_REGEXP_TRIGRAMS is not included
+ * because it is only wanted if the index.regexp_trigrams
+ * configuration is set. */
 #define NOTMUCH_FEATURES_CURRENT \
     (NOTMUCH_FEATURE_FILE_TERMS | NOTMUCH_FEATURE_DIRECTORY_DOCS | \
      NOTMUCH_FEATURE_BOOL_FOLDER | NOTMUCH_FEATURE_GHOSTS | \
-     NOTMUCH_FEATURE_LAST_MOD)
+     NOTMUCH_FEATURE_LAST_MOD | NOTMUCH_FEATURE_THREAD_ID_VALUES | \
+     NOTMUCH_FEATURE_FILE_HEADER_VALUES)
 
 /* Return the list of terms from the given iterator matching a prefix.
  * The prefix will be stripped from the strings in the returned list.
@@ -258,4 +333,44 @@ _notmuch_database_find_doc_ids (notmuch_database_t *notmuch,
 				const char *value,
 				Xapian::PostingIterator *begin,
 				Xapian::PostingIterator *end);
+
+/* Add to 'thread_ids' the thread ID of each message matching 'query'.
+ * With NOTMUCH_FEATURE_THREAD_ID_VALUES, these are read from the
+ * values, without creating any message. */
+notmuch_status_t
+_notmuch_query_get_thread_ids (notmuch_query_t *query,
+			       std::set<std::string> &thread_ids);
+
+/* Empty the parse cache of 'notmuch'. */
+void
+_notmuch_database_forget_parsed_queries (notmuch_database_t *notmuch);
+
+/* Forget the parsed saved queries, e.g. after a query.* configuration
+ * key changed. */
+void
+_notmuch_database_forget_saved_queries (notmuch_database_t *notmuch);
+
+/* The prefix of the trigram terms indexing the value slot 'slot', or
+ * NULL if that slot is not indexed by trigrams. */
+const char *
+_notmuch_trigram_prefix (Xapian::valueno slot);
+
+/* Add to 'terms' a term made of 'prefix' and each three consecutive
+ * bytes of 'str'. */
+void
+_notmuch_trigram_terms (const char *prefix, const std::string &str,
+			std::set<std::string> &terms);
+
+/* Set the value 'slot' of 'doc' to 'value'.  With
+ * NOTMUCH_FEATURE_REGEXP_TRIGRAMS, the trigram terms of the previous
+ * value are replaced by those of the new one. */
+void
+_notmuch_document_set_regexp_value (notmuch_database_t *notmuch,
+				    Xapian::Document &doc,
+				    Xapian::valueno slot,
+				    const std::string &value);
+
+void
+_notmuch_message_upgrade_regexp_trigrams (notmuch_message_t *message,
+					  const std::set<std::string> &terms);
 #endif
@@ -60,8 +60,8 @@ typedef struct {
 
 /* Here's the current schema for our database (for NOTMUCH_DATABASE_VERSION):
  *
- * We currently have three different types of documents (mail, ghost,
- * and directory) and also some metadata.
+ * We currently have four different types of documents (mail, ghost,
+ * directory and thread summary) and also some metadata.
  *
  * There are two kinds of prefixes used in notmuch. There are the
  * human friendly 'prefix names' like "thread:", which are also used
@@ -108,7 +108,13 @@ typedef struct {
  *      property:       Has a property with key=value
  *                 FIXME: if no = is present, should match on any value
  *
- *    A mail document also has four values:
+ *	from-trigram, subject-trigram, mid-trigram:
+ *			Every three consecutive bytes of the FROM,
+ *			SUBJECT and MESSAGE_ID values (see below), if
+ *			NOTMUCH_FEATURE_REGEXP_TRIGRAMS.  These are
+ *			used to narrow down regexp searches.
+ *
+ *    A mail document also has these values:
  *
  *	TIMESTAMP:	The time_t value corresponding to the message's
  *			Date header.
@@ -122,6 +128,17 @@ typedef struct {
  *	LAST_MOD:	The revision number as of the last tag or
  *			filename change.
  *
+ *	THREAD_ID:	The thread ID of the message (see "thread"
+ *			above), for counting threads without
+ *			reading each document's terms.
+ *
+ *	TO, CC, BCC,	The values of the "To", "Cc", "Bcc", "Date"
+ *	DATE,		and "References" headers, as
+ *	REFERENCES:	notmuch_message_get_header returns them.
+ *
+ *	FILE_HEADERS:	"1" if the five values above were stored, in
+ *			which case empty values are empty headers.
+ *
  * The prefixed terms described above are also searchable without an
  * explicit field name, but as of notmuch 0.29 this is due to
  * query-parser setup, not extra terms in the database.  In addition,
@@ -173,6 +190,22 @@ typedef struct {
  * The data portion of a directory document contains the path of the
  * directory (relative to the database path).
  *
+ * Thread summary document [if index.thread_summaries is set]
+ * ----------------------------------------------------------
+ * A thread summary document caches what a search for all messages
+ * shows of a thread, so that such searches need not read the
+ * messages of the thread.
+ *
+ * All thread summary documents contain one term:
+ *
+ *	thread-summary:	The ID of the summarized thread
+ *
+ * The data portion of a thread summary document holds the number of
+ * documents of the thread and their highest LAST_MOD value when the
+ * summary was written, which tell whether it is still up to date,
+ * followed by the counts, dates, authors, subjects and tags of the
+ * thread (see thread.cc).  Thread summary documents have no values.
+ *
  * Database metadata
  * -----------------
  * Xapian allows us to store arbitrary name-value pairs as
@@ -215,6 +248,43 @@ typedef struct {
  *			query 'notmuch'), but it is not enforced by the
  *			API.
  *
+ *	D*		metadata keys starting with D, followed by a
+ *			message ID, record that the message was deleted.
+ *			The value is the revision of the deletion, as a
+ *			base-10 ASCII integer.  See
+ *			notmuch_database_get_deleted_messages.  They
+ *			are kept until a client drops them with
+ *			notmuch_database_prune_deleted_messages.
+ *
+ *	last_deletion	The revision of the latest deletion recorded
+ *			in D* keys, as a base-10 ASCII integer.  No
+ *			document may carry that revision, so it is
+ *			taken into account when finding the database
+ *			revision.
+ *
+ *	upgrade_checkpoint
+ *			The progress of an upgrade that was
+ *			interrupted: the features being added, as a
+ *			hexadecimal mask, and the last doc ID whose
+ *			per-message upgrade was committed, separated
+ *			by a space.  It is removed once the upgrade
+ *			completes.
+ *
+ *	thread_summaries_complete
+ *			Set to "1" once every thread has a thread
+ *			summary document.  Only
+ *			changed threads are summarized again after
+ *			that.
+ *
+ *	thread_alias_*	The thread ID a thread was merged into. Any
+ *			particular name is formed by concatenating
+ *			"thread_alias_" with the ID of the merged
+ *			thread, which no document carries anymore.
+ *			The value may itself be an alias, in which
+ *			case the chain is shortened when the
+ *			database is compacted.  Aliases leading to a
+ *			thread without documents are dropped then.
+ *
  * Obsolete metadata
  * -----------------
  *
@@ -269,6 +339,10 @@ prefix_t prefix_table[] = {
     { "directory",		"XDIRECTORY",	NOTMUCH_FIELD_NO_FLAGS },
     { "file-direntry",		"XFDIRENTRY",	NOTMUCH_FIELD_NO_FLAGS },
     { "directory-direntry",	"XDDIRENTRY",	NOTMUCH_FIELD_NO_FLAGS },
+    { "from-trigram",		"XTRIFROM:",	NOTMUCH_FIELD_NO_FLAGS },
+    { "subject-trigram",	"XTRISUBJECT:",	NOTMUCH_FIELD_NO_FLAGS },
+    { "mid-trigram",		"XTRIMID:",	NOTMUCH_FIELD_NO_FLAGS },
+    { "thread-summary",		"XTHREADSUMMARY", NOTMUCH_FIELD_NO_FLAGS },
     { "body",			"",		NOTMUCH_FIELD_EXTERNAL |
 						NOTMUCH_FIELD_PROBABILISTIC},
     { "thread",			"G",		NOTMUCH_FIELD_EXTERNAL |
@@ -403,6 +477,18 @@ static const struct {
      * 'body:' */
     { NOTMUCH_FEATURE_UNPREFIX_BODY_ONLY,
       "index body and headers separately", "w"},
+    /* Thread IDs are still available from the thread terms, so a
+     * reader that doesn't know about the values can ignore them. */
+    { NOTMUCH_FEATURE_THREAD_ID_VALUES,
+      "thread IDs in database values", "w"},
+    /* Without the trigram terms, regexp searches scan the values as
+     * before. */
+    { NOTMUCH_FEATURE_REGEXP_TRIGRAMS,
+      "trigram terms for regexp search", "w"},
+    /* As with from/subject/message-ID, a reader can fall back to the
+     * message file. */
+    { NOTMUCH_FEATURE_FILE_HEADER_VALUES,
+      "to/cc/bcc/date/references in database", "w"},
 };
 
 const char *
@@ -825,6 +911,79 @@ notmuch_database_open (const char *path,
     return status;
 }
 
+/* Get the current highest revision number from the database. */
+static unsigned long
+_notmuch_database_read_revision (notmuch_database_t *notmuch)
+{
+    string last_mod, last_deletion;
+    unsigned long revision = 0;
+
+    last_mod = notmuch->xapian_db->get_value_upper_bound (
+	NOTMUCH_VALUE_LAST_MOD);
+    if (! last_mod.empty ())
+	revision = Xapian::sortable_unserialise (last_mod);
+    last_deletion = notmuch->xapian_db->get_metadata ("last_deletion");
+    if (! last_deletion.empty ()) {
+	unsigned long deletion = strtoul (last_deletion.c_str (), NULL, 10);
+	if (deletion > revision)
+	    revision = deletion;
+    }
+
+    return revision;
+}
+
+/* Whether the configuration asks for thread summary documents. */
+static bool
+_thread_summaries_enabled (notmuch_database_t *notmuch)
+{
+    char *value;
+    bool enabled = false;
+
+    if (notmuch_database_get_config (notmuch, "index.thread_summaries", &value))
+	return false;
+
+    if (value)
+	enabled = (! strcasecmp (value, "true") ||
+		   ! strcasecmp (value, "yes") ||
+		   ! strcasecmp (value, "1"));
+
+    free (value);
+    return enabled;
+}
+
+/* Whether the configuration asks for trigram terms for regexp
+ * search. */
+static bool
+_regexp_trigrams_enabled (notmuch_database_t *notmuch)
+{
+    char *value;
+    bool enabled = false;
+
+    if (notmuch_database_get_config (notmuch, "index.regexp_trigrams", &value))
+	return false;
+
+    if (value)
+	enabled = (! strcasecmp (value, "true") ||
+		   ! strcasecmp (value, "yes") ||
+		   ! strcasecmp (value, "1"));
+
+    free (value);
+    return enabled;
+}
+
+/* The features an upgrade should give this database: the current
+ * ones, plus the optional ones enabled by its configuration. */
+static enum _notmuch_features
+_notmuch_database_target_features (notmuch_database_t *notmuch)
+{
+    enum _notmuch_features features = NOTMUCH_FEATURES_CURRENT;
+
+    if (_regexp_trigrams_enabled (notmuch))
+	features |= NOTMUCH_FEATURE_REGEXP_TRIGRAMS;
+
+    return features;
+}
+
 notmuch_status_t
 notmuch_database_open_verbose (const char *path,
 			       notmuch_database_mode_t mode,
@@ -893,10 +1052,20 @@ notmuch_database_open_verbose (const char *path,
 
     notmuch->mode = mode;
     notmuch->atomic_nesting = 0;
+    notmuch->batch_size = 0;
+    notmuch->batch_pending = 0;
     notmuch->view = 1;
+    notmuch->directory_paths = NULL;
+    notmuch->thread_subqueries = NULL;
+    notmuch->saved_queries = NULL;
+    notmuch->saved_queries_expanding = NULL;
+    notmuch->parsed_queries = NULL;
+    notmuch->parsed_queries_lru = NULL;
+    notmuch->parsed_queries_hits = 0;
+    notmuch->parsed_queries_misses = 0;
+    notmuch->dirty_thread_summaries = NULL;
     try {
 	string last_thread_id;
-	string last_mod;
 
 	if (mode == NOTMUCH_DATABASE_MODE_READ_WRITE) {
 	    notmuch->xapian_db = new Xapian::WritableDatabase (xapian_path,
@@ -955,13 +1124,7 @@ notmuch_database_open_verbose (const char *path,
 		INTERNAL_ERROR ("Malformed database last_thread_id: %s", str);
 	}
 
-	/* Get current highest revision number. */
-	last_mod = notmuch->xapian_db->get_value_upper_bound (
-	    NOTMUCH_VALUE_LAST_MOD);
-	if (last_mod.empty ())
-	    notmuch->revision = 0;
-	else
-	    notmuch->revision = Xapian::sortable_unserialise (last_mod);
+	notmuch->revision = _notmuch_database_read_revision (notmuch);
 	notmuch->uuid = talloc_strdup (
 	    notmuch, notmuch->xapian_db->get_uuid ().c_str ());
 
@@ -986,6 +1149,25 @@ notmuch_database_open_verbose (const char *path,
 		_setup_query_field (prefix, notmuch);
 	    }
 	}
+
+	/* Once the trigram terms are disabled, new messages no longer
+	 * get them, so stop relying on them for regexp search.  The
+	 * terms already indexed are left in place. */
+	if ((notmuch->features & NOTMUCH_FEATURE_REGEXP_TRIGRAMS) &&
+	    ! _regexp_trigrams_enabled (notmuch)) {
+	    notmuch->features &= ~NOTMUCH_FEATURE_REGEXP_TRIGRAMS;
+	    if (mode == NOTMUCH_DATABASE_MODE_READ_WRITE) {
+		Xapian::WritableDatabase *db =
+		    static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+		db->set_metadata ("features",
+				  _print_features (local, notmuch->features));
+	    }
+	}
+
+	if (mode == NOTMUCH_DATABASE_MODE_READ_WRITE &&
+	    _thread_summaries_enabled (notmuch))
+	    notmuch->dirty_thread_summaries = g_hash_table_new_full (
+		g_str_hash, g_str_equal, free, NULL);
     } catch (const Xapian::Error &error) {
 	IGNORE_RESULT (asprintf (&message, "A Xapian exception occurred opening database: %s\n",
 				 error.get_msg().c_str()));
@@ -1011,6 +1193,156 @@ notmuch_database_open_verbose (const char *path,
     return status;
 }
 
+/* Note that the documents of the thread 'thread_id' changed, so its
+ * summary must be written again when the database is closed. */
+void
+_notmuch_database_thread_changed (notmuch_database_t *notmuch,
+				  const char *thread_id)
+{
+    if (notmuch->dirty_thread_summaries == NULL || thread_id == NULL ||
+	*thread_id == '\0')
+	return;
+
+    g_hash_table_add (notmuch->dirty_thread_summaries, xstrdup (thread_id));
+}
+
+#define THREAD_SUMMARY_BATCH_SIZE 100
+
+/* Write the summaries of the 'count' threads in 'thread_ids' in a
+ * transaction of their own, so that the work done so far is kept
+ * even if a later batch fails. */
+static notmuch_status_t
+_notmuch_database_commit_thread_summaries (notmuch_database_t *notmuch,
+					   const char **thread_ids,
+					   unsigned int count)
+{
+    Xapian::WritableDatabase *db;
+    notmuch_status_t status;
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+
+    db->begin_transaction (true);
+    status = _notmuch_thread_update_summaries (notmuch, thread_ids, count);
+    if (status)
+	db->cancel_transaction ();
+    else
+	db->commit_transaction ();
+
+    return status;
+}
+
+/* Write the summaries of the threads changed since the database was
+ * opened, and first of all threads if not every thread has a summary
+ * yet.  Each batch of threads is committed separately, and the marker
+ * recording that every thread has a summary is only set once all of
+ * them were written, so an interrupted backfill is simply started
+ * again by the next writer.  If summaries are disabled, only forget
+ * that they were complete, so that they are all written again once
+ * re-enabled. */
+static notmuch_status_t
+_notmuch_database_update_thread_summaries (notmuch_database_t *notmuch)
+{
+    const char *marker = "thread_summaries_complete";
+    Xapian::WritableDatabase *db;
+    void *local = talloc_new (notmuch);
+    void *batch = NULL;
+    const char **thread_ids;
+    unsigned int count = 0;
+    bool backfill;
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+
+    thread_ids = talloc_array (local, const char *, THREAD_SUMMARY_BATCH_SIZE);
+    if (unlikely (thread_ids == NULL)) {
+	status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+	goto DONE;
+    }
+
+    try {
+	if (notmuch->dirty_thread_summaries == NULL ||
+	    ! (notmuch->features & NOTMUCH_FEATURE_LAST_MOD)) {
+	    if (! db->get_metadata (marker).empty ())
+		db->set_metadata (marker, "");
+	    goto DONE;
+	}
+
+	backfill = db->get_metadata (marker).empty ();
+
+	if (backfill) {
+	    const std::string prefix = _find_prefix ("thread");
+	    Xapian::TermIterator t, t_end = db->allterms_end (prefix);
+
+	    for (t = db->allterms_begin (prefix); t != t_end; t++) {
+		if (batch == NULL) {
+		    batch = talloc_new (local);
+		    if (unlikely (batch == NULL)) {
+			status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+			goto DONE;
+		    }
+		}
+		thread_ids[count] = talloc_strdup (batch, (*t).c_str () + prefix.size ());
+		if (unlikely (thread_ids[count] == NULL)) {
+		    status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+		    goto DONE;
+		}
+		if (++count == THREAD_SUMMARY_BATCH_SIZE) {
+		    status = _notmuch_database_commit_thread_summaries (notmuch, thread_ids,
+									count);
+		    if (status)
+			goto DONE;
+		    talloc_free (batch);
+		    batch = NULL;
+		    count = 0;
+		}
+	    }
+	    if (count) {
+		status = _notmuch_database_commit_thread_summaries (notmuch, thread_ids,
+								    count);
+		if (status)
+		    goto DONE;
+		count = 0;
+	    }
+	}
+
+	/* Threads that lost all their messages have no thread term
+	 * left, but their summaries must still be removed. */
+	GHashTableIter iter;
+	gpointer thread_id;
+
+	g_hash_table_iter_init (&iter, notmuch->dirty_thread_summaries);
+	while (g_hash_table_iter_next (&iter, &thread_id, NULL)) {
+	    thread_ids[count++] = (const char *) thread_id;
+	    if (count == THREAD_SUMMARY_BATCH_SIZE) {
+		status = _notmuch_database_commit_thread_summaries (notmuch, thread_ids,
+								    count);
+		if (status)
+		    goto DONE;
+		count = 0;
+	    }
+	}
+	if (count) {
+	    status = _notmuch_database_commit_thread_summaries (notmuch, thread_ids,
+								count);
+	    if (status)
+		goto DONE;
+	}
+
+	if (backfill)
+	    db->set_metadata (marker, "1");
+	g_hash_table_remove_all (notmuch->dirty_thread_summaries);
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch, "A Xapian exception occurred writing thread summaries: %s\n",
+			       error.get_msg ().c_str ());
+	notmuch->exception_reported = true;
+	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+  DONE:
+    talloc_free (local);
+    return status;
+}
+
 notmuch_status_t
 notmuch_database_close (notmuch_database_t *notmuch)
 {
@@ -1030,6 +1362,8 @@ notmuch_database_close (notmuch_database_t *notmuch)
 		notmuch->atomic_nesting)
 		(static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db))
 		    ->cancel_transaction ();
+	    else if (notmuch->mode == NOTMUCH_DATABASE_MODE_READ_WRITE)
+		status = _notmuch_database_update_thread_summaries (notmuch);
 
 	    /* Close the database.  This implicitly flushes
 	     * outstanding changes. */
@@ -1081,6 +1415,52 @@ _notmuch_database_reopen (notmuch_database_t *notmuch)
     return NOTMUCH_STATUS_SUCCESS;
 }
 
+notmuch_status_t
+notmuch_database_reopen (notmuch_database_t *notmuch)
+{
+    unsigned long revision;
+    unsigned int last_doc_id;
+
+    if (notmuch->mode != NOTMUCH_DATABASE_MODE_READ_ONLY)
+	return NOTMUCH_STATUS_UNSUPPORTED_OPERATION;
+
+    try {
+	notmuch->xapian_db->reopen ();
+	revision = _notmuch_database_read_revision (notmuch);
+	last_doc_id = notmuch->xapian_db->get_lastdocid ();
+    } catch (const Xapian::Error &error) {
+	if (! notmuch->exception_reported) {
+	    _notmuch_database_log (notmuch, "Error: A Xapian exception reopening database: %s\n",
+				   error.get_msg ().c_str ());
+	    notmuch->exception_reported = true;
+	}
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    /* Every change to a message either adds a document or records a
+     * new revision, so if neither moved, the objects cached for the
+     * current view are still valid.  Without revisions, assume a
+     * change.
+     *
+     * Changes to directory documents alone (notmuch_directory_set_mtime,
+     * or deleting an empty directory) move neither, and no cache
+     * depends on them: parsed queries and thread:{...} subqueries only
+     * depend on messages, directory objects are read afresh each time,
+     * and the cached path of a deleted directory is left over under a
+     * document ID which is never reused or looked up again. */
+    if (revision != notmuch->revision || last_doc_id != notmuch->last_doc_id ||
+	! (notmuch->features & NOTMUCH_FEATURE_LAST_MOD)) {
+	notmuch->revision = revision;
+	notmuch->last_doc_id = last_doc_id;
+	notmuch->view++;
+    }
+
+    /* Configuration changes record no revision. */
+    _notmuch_database_forget_saved_queries (notmuch);
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
 static int
 unlink_cb (const char *path,
 	   unused (const struct stat *sb),
@@ -1209,6 +1589,10 @@ notmuch_database_compact (const char *path,
      */
     (void) rmtree (compact_xapian_path);
 
+    ret = _notmuch_database_compact_thread_aliases (notmuch);
+    if (ret)
+	goto DONE;
+
     try {
 	NotmuchCompactor compactor (status_cb, closure);
 
@@ -1271,6 +1655,24 @@ notmuch_database_destroy (notmuch_database_t *notmuch)
     notmuch_status_t status;
 
     status = notmuch_database_close (notmuch);
+
+    if (notmuch->directory_paths)
+	g_hash_table_unref (notmuch->directory_paths);
+    if (notmuch->thread_subqueries)
+	g_hash_table_unref (notmuch->thread_subqueries);
+    if (notmuch->saved_queries)
+	g_hash_table_unref (notmuch->saved_queries);
+    if (notmuch->saved_queries_expanding)
+	g_hash_table_unref (notmuch->saved_queries_expanding);
+    /* Queries still using parsed queries keep them. */
+    _notmuch_database_forget_parsed_queries (notmuch);
+    if (notmuch->parsed_queries)
+	g_hash_table_unref (notmuch->parsed_queries);
+    if (notmuch->parsed_queries_lru)
+	g_queue_free (notmuch->parsed_queries_lru);
+    if (notmuch->dirty_thread_summaries)
+	g_hash_table_unref (notmuch->dirty_thread_summaries);
+
     talloc_free (notmuch);
 
     return status;
@@ -1309,7 +1711,7 @@ notmuch_bool_t
 notmuch_database_needs_upgrade (notmuch_database_t *notmuch)
 {
     return notmuch->mode == NOTMUCH_DATABASE_MODE_READ_WRITE &&
-	((NOTMUCH_FEATURES_CURRENT & ~notmuch->features) ||
+	((_notmuch_database_target_features (notmuch) & ~notmuch->features) ||
 	 (notmuch_database_get_version (notmuch) < NOTMUCH_DATABASE_VERSION));
 }
 
@@ -1321,6 +1723,363 @@ handle_sigalrm (unused (int signal))
     do_progress_notify = 1;
 }
 
+/* The per-message upgrade is committed in chunks of this many doc
+ * IDs, so that an interrupted upgrade can be resumed and that each
+ * transaction stays small. */
+#define NOTMUCH_UPGRADE_CHUNK_SIZE 1000
+
+#define NOTMUCH_METADATA_UPGRADE_CHECKPOINT "upgrade_checkpoint"
+
+/* The mail documents with doc IDs in [first, last], and the parts of
+ * their upgrade which only depend on the documents themselves: their
+ * thread ID and the trigram terms of their values.  These are
+ * computed by a worker thread, from a read-only database of its own,
+ * while the previous chunks are written.
+ *
+ * Ghost documents in the same range follow the mail documents, with
+ * 'ghosts' set, since they need their thread ID value and message ID
+ * trigrams as well: both are kept when a ghost becomes a mail
+ * document. */
+typedef struct {
+    std::string xapian_path;
+    enum _notmuch_features new_features;
+    Xapian::docid first;
+    Xapian::docid last;
+
+    std::vector<Xapian::docid> doc_ids;
+    std::vector<std::string> thread_ids;
+    std::vector<std::set<std::string> > trigrams;
+    std::vector<bool> ghosts;
+    std::string error;
+
+    GMutex lock;
+    GCond cond;
+    bool done;
+} upgrade_chunk_t;
+
+/* Read the documents of type 'type' in the range of 'chunk'. */
+static void
+_upgrade_chunk_read (Xapian::Database &db, upgrade_chunk_t *chunk,
+		     const char *type)
+{
+    const Xapian::valueno slots[] = {
+	NOTMUCH_VALUE_FROM,
+	NOTMUCH_VALUE_SUBJECT,
+	NOTMUCH_VALUE_MESSAGE_ID,
+    };
+    const std::string type_term = std::string (_find_prefix ("type")) + type;
+    const std::string thread_prefix = _find_prefix ("thread");
+    Xapian::PostingIterator p = db.postlist_begin (type_term);
+    Xapian::PostingIterator p_end = db.postlist_end (type_term);
+
+    if (p != p_end)
+	p.skip_to (chunk->first);
+
+    for (; p != p_end && *p <= chunk->last; p++) {
+	Xapian::Document doc = db.get_document (*p);
+	std::string thread_id;
+	std::set<std::string> terms;
+
+	if (chunk->new_features & NOTMUCH_FEATURE_THREAD_ID_VALUES) {
+	    Xapian::TermIterator t = doc.termlist_begin ();
+
+	    t.skip_to (thread_prefix);
+	    if (t != doc.termlist_end () &&
+		(*t).compare (0, thread_prefix.size (), thread_prefix) == 0)
+		thread_id = (*t).substr (thread_prefix.size ());
+	}
+
+	if (chunk->new_features & NOTMUCH_FEATURE_REGEXP_TRIGRAMS) {
+	    for (size_t i = 0; i < ARRAY_SIZE (slots); i++)
+		_notmuch_trigram_terms (_notmuch_trigram_prefix (slots[i]),
+					doc.get_value (slots[i]), terms);
+	}
+
+	chunk->doc_ids.push_back (*p);
+	chunk->thread_ids.push_back (thread_id);
+	chunk->trigrams.push_back (terms);
+	chunk->ghosts.push_back (strcmp (type, "ghost") == 0);
+    }
+}
+
+static void
+_upgrade_chunk_compute (upgrade_chunk_t *chunk)
+{
+    Xapian::Database db (chunk->xapian_path);
+
+    for (;;) {
+	try {
+	    chunk->doc_ids.clear ();
+	    chunk->thread_ids.clear ();
+	    chunk->trigrams.clear ();
+	    chunk->ghosts.clear ();
+
+	    _upgrade_chunk_read (db, chunk, "mail");
+	    if (chunk->new_features & (NOTMUCH_FEATURE_THREAD_ID_VALUES |
+				       NOTMUCH_FEATURE_REGEXP_TRIGRAMS))
+		_upgrade_chunk_read (db, chunk, "ghost");
+
+	    return;
+	} catch (const Xapian::DatabaseModifiedError &) {
+	    /* Too many chunks were committed while reading this one;
+	     * none of them touched this range, so start over from the
+	     * latest revision. */
+	    db.reopen ();
+	}
+    }
+}
+
+static void
+_upgrade_chunk_worker (gpointer data, unused (gpointer user_data))
+{
+    upgrade_chunk_t *chunk = static_cast <upgrade_chunk_t *> (data);
+
+    try {
+	_upgrade_chunk_compute (chunk);
+    } catch (const Xapian::Error &error) {
+	chunk->error = error.get_msg ();
+    }
+
+    g_mutex_lock (&chunk->lock);
+    chunk->done = true;
+    g_cond_signal (&chunk->cond);
+    g_mutex_unlock (&chunk->lock);
+}
+
+static void
+_upgrade_chunk_destroy (upgrade_chunk_t *chunk)
+{
+    g_mutex_clear (&chunk->lock);
+    g_cond_clear (&chunk->cond);
+    delete chunk;
+}
+
+/* Upgrade the documents of 'chunk' and commit them, along with
+ * a checkpoint after the chunk. */
+static notmuch_status_t
+_upgrade_chunk_apply (notmuch_database_t *notmuch,
+		      upgrade_chunk_t *chunk,
+		      enum _notmuch_features new_features,
+		      void (*progress_notify) (void *closure,
+					       double progress),
+		      void *closure,
+		      unsigned int *count,
+		      unsigned int total)
+{
+    Xapian::WritableDatabase *db;
+    notmuch_private_status_t private_status;
+    notmuch_message_t *message;
+    char *filename, *checkpoint;
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+
+    db->begin_transaction (true);
+
+    for (size_t i = 0; i < chunk->doc_ids.size (); i++) {
+	if (do_progress_notify) {
+	    progress_notify (closure, (double) *count / total);
+	    do_progress_notify = 0;
+	}
+
+	message = _notmuch_message_create (notmuch, notmuch,
+					   chunk->doc_ids[i], &private_status);
+	if (message == NULL) {
+	    db->cancel_transaction ();
+	    return COERCE_STATUS (private_status,
+				  "Cannot find document for doc_id from upgrade");
+	}
+
+	/* Ghost messages have no file, headers or tags; they only
+	 * need the value of their thread ID and the trigrams of
+	 * their message ID. */
+	if (chunk->ghosts[i]) {
+	    if (new_features & NOTMUCH_FEATURE_THREAD_ID_VALUES)
+		_notmuch_message_upgrade_thread_id_value (
+		    message, chunk->thread_ids[i].c_str ());
+	    if (new_features & NOTMUCH_FEATURE_REGEXP_TRIGRAMS)
+		_notmuch_message_upgrade_regexp_trigrams (message,
+							  chunk->trigrams[i]);
+	    _notmuch_message_sync (message);
+	    notmuch_message_destroy (message);
+	    continue;
+	}
+
+	/* Before version 1, each message document had its
+	 * filename in the data field. Copy that into the new
+	 * format by calling notmuch_message_add_filename.
+	 */
+	if (new_features & NOTMUCH_FEATURE_FILE_TERMS) {
+	    filename = _notmuch_message_talloc_copy_data (message);
+	    if (filename && *filename != '\0') {
+		_notmuch_message_add_filename (message, filename);
+		_notmuch_message_clear_data (message);
+	    }
+	    talloc_free (filename);
+	}
+
+	/* Prior to version 2, the "folder:" prefix was
+	 * probabilistic and stemmed. Change it to the current
+	 * boolean prefix. Add "path:" prefixes while at it.
+	 */
+	if (new_features & NOTMUCH_FEATURE_BOOL_FOLDER)
+	    _notmuch_message_upgrade_folder (message);
+
+	/* Prior to NOTMUCH_FEATURE_LAST_MOD, messages did not
+	 * track modification revisions.  Give all messages the
+	 * next available revision; since we just started tracking
+	 * revisions for this database, that will be 1.
+	 */
+	if (new_features & NOTMUCH_FEATURE_LAST_MOD)
+	    _notmuch_message_upgrade_last_mod (message);
+
+	/* Prior to NOTMUCH_FEATURE_THREAD_ID_VALUES, the thread
+	 * ID was only stored as a term. Copy it into its value
+	 * slot so that threads can be counted from the values.
+	 */
+	if (new_features & NOTMUCH_FEATURE_THREAD_ID_VALUES)
+	    _notmuch_message_upgrade_thread_id_value (
+		message, chunk->thread_ids[i].c_str ());
+
+	/* Prior to NOTMUCH_FEATURE_REGEXP_TRIGRAMS, regexp
+	 * searches had to scan every value.  Index the trigrams
+	 * of the values already stored.
+	 */
+	if (new_features & NOTMUCH_FEATURE_REGEXP_TRIGRAMS)
+	    _notmuch_message_upgrade_regexp_trigrams (message,
+						      chunk->trigrams[i]);
+
+	/* Prior to NOTMUCH_FEATURE_FILE_HEADER_VALUES, the To, Cc,
+	 * Bcc, Date and References headers were only in the message
+	 * file.  Read them from there once.
+	 */
+	if (new_features & NOTMUCH_FEATURE_FILE_HEADER_VALUES)
+	    _notmuch_message_upgrade_file_header_values (message);
+
+	_notmuch_message_sync (message);
+
+	notmuch_message_destroy (message);
+
+	(*count)++;
+    }
+
+    checkpoint = talloc_asprintf (notmuch, "%x %u",
+				  (unsigned int) new_features, chunk->last);
+    db->set_metadata (NOTMUCH_METADATA_UPGRADE_CHECKPOINT, checkpoint);
+    talloc_free (checkpoint);
+
+    db->commit_transaction ();
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+/* Perform the per-message upgrades adding 'new_features' to the mail
+ * documents, in chunks of NOTMUCH_UPGRADE_CHUNK_SIZE doc IDs, each
+ * committed on its own.  If a previous upgrade adding the same
+ * features was interrupted, resume it after its last committed
+ * chunk. */
+static notmuch_status_t
+_notmuch_database_upgrade_messages (notmuch_database_t *notmuch,
+				    enum _notmuch_features new_features,
+				    void (*progress_notify) (void *closure,
+							     double progress),
+				    void *closure,
+				    unsigned int *count,
+				    unsigned int total)
+{
+    Xapian::WritableDatabase *db;
+    std::string checkpoint;
+    Xapian::docid next = 1, last;
+    unsigned int features, doc_id;
+    unsigned int jobs = g_get_num_processors ();
+    GThreadPool *pool;
+    GQueue *pending;
+    upgrade_chunk_t *chunk;
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+    last = db->get_lastdocid ();
+
+    checkpoint = db->get_metadata (NOTMUCH_METADATA_UPGRADE_CHECKPOINT);
+    if (sscanf (checkpoint.c_str (), "%x %u", &features, &doc_id) == 2 &&
+	features == (unsigned int) new_features) {
+	const std::string mail_term = std::string (_find_prefix ("type")) + "mail";
+	Xapian::PostingIterator p, p_end;
+
+	next = doc_id + 1;
+
+	/* Account for the messages already upgraded. */
+	p_end = db->postlist_end (mail_term);
+	for (p = db->postlist_begin (mail_term); p != p_end && *p <= doc_id; p++)
+	    (*count)++;
+    }
+
+    pool = g_thread_pool_new (_upgrade_chunk_worker, NULL, jobs, true, NULL);
+    pending = g_queue_new ();
+
+    try {
+	while (status == NOTMUCH_STATUS_SUCCESS &&
+	       (next <= last || ! g_queue_is_empty (pending))) {
+	    /* Keep the workers busy, with a bounded number of chunks
+	     * in memory. */
+	    while (next <= last && g_queue_get_length (pending) <= jobs) {
+		chunk = new upgrade_chunk_t ();
+		chunk->xapian_path = std::string (notmuch->path) + "/.notmuch/xapian";
+		chunk->new_features = new_features;
+		chunk->first = next;
+		if (last - next < NOTMUCH_UPGRADE_CHUNK_SIZE)
+		    chunk->last = last;
+		else
+		    chunk->last = next + NOTMUCH_UPGRADE_CHUNK_SIZE - 1;
+		g_mutex_init (&chunk->lock);
+		g_cond_init (&chunk->cond);
+		next = chunk->last + 1;
+
+		g_queue_push_tail (pending, chunk);
+		g_thread_pool_push (pool, chunk, NULL);
+	    }
+
+	    chunk = static_cast <upgrade_chunk_t *> (g_queue_pop_head (pending));
+
+	    g_mutex_lock (&chunk->lock);
+	    while (! chunk->done)
+		g_cond_wait (&chunk->cond, &chunk->lock);
+	    g_mutex_unlock (&chunk->lock);
+
+	    if (! chunk->error.empty ()) {
+		_notmuch_database_log (notmuch, "A Xapian exception occurred upgrading database: %s\n",
+				       chunk->error.c_str ());
+		notmuch->exception_reported = true;
+		status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+	    } else {
+		status = _upgrade_chunk_apply (notmuch, chunk, new_features,
+					       progress_notify, closure,
+					       count, total);
+	    }
+
+	    _upgrade_chunk_destroy (chunk);
+	}
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch, "A Xapian exception occurred upgrading database: %s\n",
+			       error.get_msg ().c_str ());
+	notmuch->exception_reported = true;
+	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+	try {
+	    db->cancel_transaction ();
+	} catch (const Xapian::Error &) {
+	    /* No transaction was in progress. */
+	}
+    }
+
+    /* Wait for the workers before freeing the chunks they may still
+     * be computing. */
+    g_thread_pool_free (pool, false, true);
+    while ((chunk = static_cast <upgrade_chunk_t *> (g_queue_pop_head (pending))))
+	_upgrade_chunk_destroy (chunk);
+    g_queue_free (pending);
+
+    return status;
+}
+
 /* Upgrade the current database.
  *
  * After opening a database in read-write mode, the client should
@@ -1345,7 +2104,8 @@ notmuch_database_upgrade (notmuch_database_t *notmuch,
     struct sigaction action;
     struct itimerval timerval;
     bool timer_is_active = false;
-    enum _notmuch_features target_features, new_features;
+    bool in_transaction = false;
+    enum _notmuch_features old_features, target_features, new_features;
     notmuch_status_t status;
     notmuch_private_status_t private_status;
     notmuch_query_t *query = NULL;
@@ -1357,8 +2117,9 @@ notmuch_database_upgrade (notmuch_database_t *notmuch,
 
     db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
 
-    target_features = notmuch->features | NOTMUCH_FEATURES_CURRENT;
-    new_features = NOTMUCH_FEATURES_CURRENT & ~notmuch->features;
+    old_features = notmuch->features;
+    target_features = notmuch->features | _notmuch_database_target_features (notmuch);
+    new_features = target_features & ~notmuch->features;
 
     if (! notmuch_database_needs_upgrade (notmuch))
 	return NOTMUCH_STATUS_SUCCESS;
@@ -1384,7 +2145,9 @@ notmuch_database_upgrade (notmuch_database_t *notmuch,
     /* Figure out how much total work we need to do. */
     if (new_features &
 	(NOTMUCH_FEATURE_FILE_TERMS | NOTMUCH_FEATURE_BOOL_FOLDER |
-	 NOTMUCH_FEATURE_LAST_MOD)) {
+	 NOTMUCH_FEATURE_LAST_MOD | NOTMUCH_FEATURE_THREAD_ID_VALUES |
+	 NOTMUCH_FEATURE_REGEXP_TRIGRAMS |
+	 NOTMUCH_FEATURE_FILE_HEADER_VALUES)) {
 	query = notmuch_query_create (notmuch, "");
 	unsigned msg_count;
 
@@ -1409,76 +2172,27 @@ notmuch_database_upgrade (notmuch_database_t *notmuch,
 	    ++total;
     }
 
-    /* Perform the upgrade in a transaction. */
-    db->begin_transaction (true);
-
     /* Set the target features so we write out changes in the desired
      * format. */
     notmuch->features = target_features;
 
-    /* Perform per-message upgrades. */
+    /* Perform per-message upgrades, in committed chunks. */
     if (new_features &
 	(NOTMUCH_FEATURE_FILE_TERMS | NOTMUCH_FEATURE_BOOL_FOLDER |
-	 NOTMUCH_FEATURE_LAST_MOD)) {
-	notmuch_messages_t *messages;
-	notmuch_message_t *message;
-	char *filename;
-
-	query = notmuch_query_create (notmuch, "");
-
-	status = notmuch_query_search_messages (query, &messages);
+	 NOTMUCH_FEATURE_LAST_MOD | NOTMUCH_FEATURE_THREAD_ID_VALUES |
+	 NOTMUCH_FEATURE_REGEXP_TRIGRAMS |
+	 NOTMUCH_FEATURE_FILE_HEADER_VALUES)) {
+	status = _notmuch_database_upgrade_messages (notmuch, new_features,
+						     progress_notify, closure,
+						     &count, total);
 	if (status)
 	    goto DONE;
-	for (;
-	     notmuch_messages_valid (messages);
-	     notmuch_messages_move_to_next (messages))
-	{
-	    if (do_progress_notify) {
-		progress_notify (closure, (double) count / total);
-		do_progress_notify = 0;
-	    }
-
-	    message = notmuch_messages_get (messages);
-
-	    /* Before version 1, each message document had its
-	     * filename in the data field. Copy that into the new
-	     * format by calling notmuch_message_add_filename.
-	     */
-	    if (new_features & NOTMUCH_FEATURE_FILE_TERMS) {
-		filename = _notmuch_message_talloc_copy_data (message);
-		if (filename && *filename != '\0') {
-		    _notmuch_message_add_filename (message, filename);
-		    _notmuch_message_clear_data (message);
-		}
-		talloc_free (filename);
-	    }
-
-	    /* Prior to version 2, the "folder:" prefix was
-	     * probabilistic and stemmed. Change it to the current
-	     * boolean prefix. Add "path:" prefixes while at it.
-	     */
-	    if (new_features & NOTMUCH_FEATURE_BOOL_FOLDER)
-		_notmuch_message_upgrade_folder (message);
-
-	    /* Prior to NOTMUCH_FEATURE_LAST_MOD, messages did not
-	     * track modification revisions.  Give all messages the
-	     * next available revision; since we just started tracking
-	     * revisions for this database, that will be 1.
-	     */
-	    if (new_features & NOTMUCH_FEATURE_LAST_MOD)
-		_notmuch_message_upgrade_last_mod (message);
-
-	    _notmuch_message_sync (message);
-
-	    notmuch_message_destroy (message);
-
-	    count++;
-	}
-
-	notmuch_query_destroy (query);
-	query = NULL;
     }
 
+    /* Perform the remaining upgrades in a transaction. */
+    db->begin_transaction (true);
+    in_transaction = true;
+
     /* Perform per-directory upgrades. */
 
     /* Before version 1 we stored directory timestamps in
@@ -1577,12 +2291,20 @@ notmuch_database_upgrade (notmuch_database_t *notmuch,
     status = NOTMUCH_STATUS_SUCCESS;
     db->set_metadata ("features", _print_features (local, notmuch->features));
     db->set_metadata ("version", STRINGIFY (NOTMUCH_DATABASE_VERSION));
+    db->set_metadata (NOTMUCH_METADATA_UPGRADE_CHECKPOINT, "");
 
  DONE:
-    if (status == NOTMUCH_STATUS_SUCCESS)
-	db->commit_transaction ();
-    else
-	db->cancel_transaction ();
+    if (in_transaction) {
+	if (status == NOTMUCH_STATUS_SUCCESS)
+	    db->commit_transaction ();
+	else
+	    db->cancel_transaction ();
+    }
+
+    /* Messages upgraded so far are committed, but the database is
+     * still in the old format until the upgrade completes. */
+    if (status)
+	notmuch->features = old_features;
 
     if (timer_is_active) {
 	/* Now stop the timer. */
@@ -1628,6 +2350,38 @@ DONE:
     return NOTMUCH_STATUS_SUCCESS;
 }
 
+/* Commit the changes made so far in the current batch, and start a
+ * new transaction for the rest of the batch. */
+static notmuch_status_t
+_notmuch_database_commit_batch (notmuch_database_t *notmuch)
+{
+    Xapian::WritableDatabase *db;
+
+    notmuch->batch_pending = 0;
+
+    if (notmuch->mode == NOTMUCH_DATABASE_MODE_READ_ONLY)
+	return NOTMUCH_STATUS_SUCCESS;
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+    try {
+	db->commit_transaction ();
+	db->commit ();
+	db->begin_transaction (false);
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch, "A Xapian exception occurred committing batch: %s.\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = true;
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    if (notmuch->atomic_dirty) {
+	++notmuch->revision;
+	notmuch->atomic_dirty = false;
+    }
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
 notmuch_status_t
 notmuch_database_end_atomic (notmuch_database_t *notmuch)
 {
@@ -1636,6 +2390,11 @@ notmuch_database_end_atomic (notmuch_database_t *notmuch)
     if (notmuch->atomic_nesting == 0)
 	return NOTMUCH_STATUS_UNBALANCED_ATOMIC;
 
+    /* The outermost section of a batch is ended by
+     * notmuch_database_end_batch. */
+    if (notmuch->batch_size && notmuch->atomic_nesting == 1)
+	return NOTMUCH_STATUS_UNBALANCED_ATOMIC;
+
     if (notmuch->mode == NOTMUCH_DATABASE_MODE_READ_ONLY ||
 	notmuch->atomic_nesting > 1)
 	goto DONE;
@@ -1664,6 +2423,63 @@ notmuch_database_end_atomic (notmuch_database_t *notmuch)
 
 DONE:
     notmuch->atomic_nesting--;
+
+    /* Each atomic section directly within a batch is one unit of the
+     * batch. */
+    if (notmuch->batch_size && notmuch->atomic_nesting == 1 &&
+	++notmuch->batch_pending >= notmuch->batch_size)
+	return _notmuch_database_commit_batch (notmuch);
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_status_t
+notmuch_database_begin_batch (notmuch_database_t *notmuch,
+			      unsigned int batch_size)
+{
+    notmuch_status_t status;
+
+    if (notmuch->batch_size || notmuch->atomic_nesting)
+	return NOTMUCH_STATUS_UNBALANCED_ATOMIC;
+
+    /* The batch is held open as an outermost atomic section. */
+    status = notmuch_database_begin_atomic (notmuch);
+    if (status)
+	return status;
+
+    notmuch->batch_size = batch_size ? batch_size : 1;
+    notmuch->batch_pending = 0;
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_status_t
+notmuch_database_end_batch (notmuch_database_t *notmuch)
+{
+    notmuch_status_t status;
+
+    if (! notmuch->batch_size || notmuch->atomic_nesting != 1)
+	return NOTMUCH_STATUS_UNBALANCED_ATOMIC;
+
+    notmuch->batch_size = 0;
+    notmuch->batch_pending = 0;
+
+    status = notmuch_database_end_atomic (notmuch);
+    if (status)
+	return status;
+
+    if (notmuch->mode == NOTMUCH_DATABASE_MODE_READ_ONLY)
+	return NOTMUCH_STATUS_SUCCESS;
+
+    try {
+	(static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db))->commit ();
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch, "A Xapian exception occurred committing batch: %s.\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = true;
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
     return NOTMUCH_STATUS_SUCCESS;
 }
 
@@ -1799,16 +2615,55 @@ _notmuch_database_find_directory_id (notmuch_database_t *notmuch,
     return NOTMUCH_STATUS_SUCCESS;
 }
 
+/* Return the path of the directory document 'doc_id' (talloc'ed
+ * under 'ctx').
+ *
+ * Many messages share a few directories, so resolved paths are
+ * cached, but only until the database is reopened or its revision
+ * or last document ID moves, as notmuch_database_reopen checks.
+ * Renaming directories or compacting the database may change which
+ * directory a document ID stands for. */
 const char *
 _notmuch_database_get_directory_path (void *ctx,
 				      notmuch_database_t *notmuch,
 				      unsigned int doc_id)
 {
     Xapian::Document document;
+    char *path;
+
+    if (notmuch->directory_paths == NULL) {
+	notmuch->directory_paths = g_hash_table_new_full (NULL, NULL,
+							  NULL, free);
+    } else if (notmuch->directory_paths_view != notmuch->view ||
+	       notmuch->directory_paths_revision != notmuch->revision ||
+	       notmuch->directory_paths_last_doc_id != notmuch->last_doc_id) {
+	g_hash_table_remove_all (notmuch->directory_paths);
+    }
+    notmuch->directory_paths_view = notmuch->view;
+    notmuch->directory_paths_revision = notmuch->revision;
+    notmuch->directory_paths_last_doc_id = notmuch->last_doc_id;
+
+    path = (char *) g_hash_table_lookup (notmuch->directory_paths,
+					 GUINT_TO_POINTER (doc_id));
+    if (path == NULL) {
+	document = find_document_for_doc_id (notmuch, doc_id);
+	path = xstrdup (document.get_data ().c_str ());
+	g_hash_table_insert (notmuch->directory_paths,
+			     GUINT_TO_POINTER (doc_id), path);
+    }
 
-    document = find_document_for_doc_id (notmuch, doc_id);
+    return talloc_strdup (ctx, path);
+}
 
-    return talloc_strdup (ctx, document.get_data ().c_str ());
+/* Drop the cached path of the directory document 'doc_id', which is
+ * being deleted. */
+void
+_notmuch_database_forget_directory_path (notmuch_database_t *notmuch,
+					 unsigned int doc_id)
+{
+    if (notmuch->directory_paths)
+	g_hash_table_remove (notmuch->directory_paths,
+			     GUINT_TO_POINTER (doc_id));
 }
 
 /* Given a legal 'filename' for the database, (either relative to
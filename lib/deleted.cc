@@ -0,0 +1,222 @@
+/* deleted.cc - Records of the messages deleted from the database
+ *
+ * This file is part of notmuch.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch.h"
+#include "notmuch-private.h"
+#include "database-private.h"
+
+/* Messages deleted from the database are recorded in metadata keys
+ * made of this prefix and their message-id, with the revision of the
+ * deletion as value. */
+static const std::string DELETED_PREFIX = "D";
+
+struct _notmuch_deleted_messages {
+    char **message_ids;
+    unsigned long *revisions;
+    size_t count;
+    size_t index;
+};
+
+/* Record that the message 'message_id' is being deleted, so that
+ * notmuch_database_get_deleted_messages can report it. */
+notmuch_status_t
+_notmuch_database_record_deletion (notmuch_database_t *notmuch,
+				   const char *message_id)
+{
+    Xapian::WritableDatabase *db;
+    char *revision;
+
+    if (! (notmuch->features & NOTMUCH_FEATURE_LAST_MOD))
+	return NOTMUCH_STATUS_SUCCESS;
+
+    revision = talloc_asprintf (notmuch, "%lu",
+				_notmuch_database_new_revision (notmuch));
+    if (revision == NULL)
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    try {
+	db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+	db->set_metadata (DELETED_PREFIX + message_id, revision);
+	db->set_metadata ("last_deletion", revision);
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch, "Error: A Xapian exception occurred recording a deletion: %s\n",
+			       error.get_msg().c_str());
+	notmuch->exception_reported = true;
+	talloc_free (revision);
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    talloc_free (revision);
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_status_t
+notmuch_database_get_deleted_messages (notmuch_database_t *notmuch,
+				       unsigned long since_revision,
+				       notmuch_deleted_messages_t **out)
+{
+    notmuch_deleted_messages_t *list;
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+    size_t allocated = 0;
+
+    if (out == NULL)
+	return NOTMUCH_STATUS_NULL_POINTER;
+
+    *out = NULL;
+
+    if (! (notmuch->features & NOTMUCH_FEATURE_LAST_MOD))
+	return NOTMUCH_STATUS_UPGRADE_REQUIRED;
+
+    list = talloc_zero (notmuch, notmuch_deleted_messages_t);
+    if (list == NULL)
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    try {
+	Xapian::TermIterator i, end;
+
+	end = notmuch->xapian_db->metadata_keys_end (DELETED_PREFIX);
+	for (i = notmuch->xapian_db->metadata_keys_begin (DELETED_PREFIX);
+	     i != end; i++) {
+	    const char *message_id = (*i).c_str () + DELETED_PREFIX.length ();
+	    std::string value = notmuch->xapian_db->get_metadata (*i);
+	    unsigned long revision = strtoul (value.c_str (), NULL, 10);
+	    notmuch_message_t *message;
+	    bool is_present;
+
+	    if (revision <= since_revision)
+		continue;
+
+	    /* The message may have been added back since. */
+	    status = notmuch_database_find_message (notmuch, message_id,
+						    &message);
+	    if (status)
+		goto DONE;
+	    is_present = message &&
+		! notmuch_message_get_flag (message, NOTMUCH_MESSAGE_FLAG_GHOST);
+	    notmuch_message_destroy (message);
+	    if (is_present)
+		continue;
+
+	    if (list->count == allocated) {
+		allocated = allocated ? 2 * allocated : 16;
+		list->message_ids = talloc_realloc (list, list->message_ids,
+						    char *, allocated);
+		list->revisions = talloc_realloc (list, list->revisions,
+						  unsigned long, allocated);
+		if (list->message_ids == NULL || list->revisions == NULL) {
+		    status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+		    goto DONE;
+		}
+	    }
+	    list->message_ids[list->count] = talloc_strdup (list, message_id);
+	    if (list->message_ids[list->count] == NULL) {
+		status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+		goto DONE;
+	    }
+	    list->revisions[list->count] = revision;
+	    list->count++;
+	}
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch, "A Xapian exception occurred getting deleted messages: %s.\n",
+			       error.get_msg().c_str());
+	notmuch->exception_reported = true;
+	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+  DONE:
+    if (status)
+	talloc_free (list);
+    else
+	*out = list;
+
+    return status;
+}
+
+notmuch_status_t
+notmuch_database_prune_deleted_messages (notmuch_database_t *notmuch,
+					 unsigned long up_to_revision)
+{
+    Xapian::WritableDatabase *db;
+    notmuch_status_t status;
+
+    status = _notmuch_database_ensure_writable (notmuch);
+    if (status)
+	return status;
+
+    if (! (notmuch->features & NOTMUCH_FEATURE_LAST_MOD))
+	return NOTMUCH_STATUS_UPGRADE_REQUIRED;
+
+    try {
+	Xapian::TermIterator i, end;
+	std::vector<std::string> keys;
+
+	db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+
+	/* Collect the keys first, rather than changing the metadata
+	 * while iterating over it. */
+	end = db->metadata_keys_end (DELETED_PREFIX);
+	for (i = db->metadata_keys_begin (DELETED_PREFIX); i != end; i++) {
+	    std::string value = db->get_metadata (*i);
+
+	    if (strtoul (value.c_str (), NULL, 10) <= up_to_revision)
+		keys.push_back (*i);
+	}
+
+	/* "last_deletion" is kept, as the database revision must not
+	 * go back. */
+	for (size_t j = 0; j < keys.size (); j++)
+	    db->set_metadata (keys[j], "");
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch, "A Xapian exception occurred pruning deleted messages: %s.\n",
+			       error.get_msg().c_str());
+	notmuch->exception_reported = true;
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_bool_t
+notmuch_deleted_messages_valid (notmuch_deleted_messages_t *deleted)
+{
+    return deleted && deleted->index < deleted->count;
+}
+
+const char *
+notmuch_deleted_messages_get_message_id (notmuch_deleted_messages_t *deleted)
+{
+    return deleted->message_ids[deleted->index];
+}
+
+unsigned long
+notmuch_deleted_messages_get_revision (notmuch_deleted_messages_t *deleted)
+{
+    return deleted->revisions[deleted->index];
+}
+
+void
+notmuch_deleted_messages_move_to_next (notmuch_deleted_messages_t *deleted)
+{
+    deleted->index++;
+}
+
+void
+notmuch_deleted_messages_destroy (notmuch_deleted_messages_t *deleted)
+{
+    talloc_free (deleted);
+}
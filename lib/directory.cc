@@ -297,6 +297,8 @@ notmuch_directory_delete (notmuch_directory_t *directory)
     try {
 	db = static_cast <Xapian::WritableDatabase *> (directory->notmuch->xapian_db);
 	db->delete_document (directory->document_id);
+	_notmuch_database_forget_directory_path (directory->notmuch,
+						 directory->document_id);
     } catch (const Xapian::Error &error) {
 	_notmuch_database_log (directory->notmuch,
 			       "A Xapian exception occurred deleting directory entry: %s.\n",
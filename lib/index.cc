@@ -369,6 +369,27 @@ static void
 _index_encrypted_mime_part (notmuch_message_t *message, notmuch_indexopts_t *indexopts,
 			    GMimeMultipartEncrypted *part);
 
+/* Log a warning about the indexing of 'message'. Detached messages
+ * (see _notmuch_message_create_detached) have no database to log to,
+ * so warnings about them are dropped. */
+static void
+_index_warning (notmuch_message_t *message, const char *format, ...)
+{
+    notmuch_database_t *notmuch = notmuch_message_get_database (message);
+    va_list va_args;
+    char *msg;
+
+    if (! notmuch)
+	return;
+
+    va_start (va_args, format);
+    msg = talloc_vasprintf (message, format, va_args);
+    va_end (va_args);
+
+    _notmuch_database_log (notmuch, "%s", msg);
+    talloc_free (msg);
+}
+
 /* Callback to generate terms for each mime part of a message. */
 static void
 _index_mime_part (notmuch_message_t *message,
@@ -385,8 +406,7 @@ _index_mime_part (notmuch_message_t *message,
     const char *charset;
 
     if (! part) {
-	_notmuch_database_log (notmuch_message_get_database (message),
-			      "Warning: Not indexing empty mime part.\n");
+	_index_warning (message, "Warning: Not indexing empty mime part.\n");
 	return;
     }
 
@@ -410,8 +430,8 @@ _index_mime_part (notmuch_message_t *message,
 					 g_mime_multipart_get_part (multipart, i));
 		    continue;
 		} else if (i != GMIME_MULTIPART_SIGNED_CONTENT) {
-		    _notmuch_database_log (notmuch_message_get_database (message),
-					   "Warning: Unexpected extra parts of multipart/signed. Indexing anyway.\n");
+		    _index_warning (message,
+				    "Warning: Unexpected extra parts of multipart/signed. Indexing anyway.\n");
 		}
 	    }
 	    if (GMIME_IS_MULTIPART_ENCRYPTED (multipart)) {
@@ -422,8 +442,8 @@ _index_mime_part (notmuch_message_t *message,
 					       GMIME_MULTIPART_ENCRYPTED (part));
 		} else {
 		    if (i != GMIME_MULTIPART_ENCRYPTED_VERSION) {
-			_notmuch_database_log (notmuch_message_get_database (message),
-					       "Warning: Unexpected extra parts of multipart/encrypted.\n");
+			_index_warning (message,
+					"Warning: Unexpected extra parts of multipart/encrypted.\n");
 		    }
 		}
 		continue;
@@ -445,9 +465,8 @@ _index_mime_part (notmuch_message_t *message,
     }
 
     if (! (GMIME_IS_PART (part))) {
-	_notmuch_database_log (notmuch_message_get_database (message),
-			      "Warning: Not indexing unknown mime part: %s.\n",
-			      g_type_name (G_OBJECT_TYPE (part)));
+	_index_warning (message, "Warning: Not indexing unknown mime part: %s.\n",
+			g_type_name (G_OBJECT_TYPE (part)));
 	return;
     }
 
@@ -605,3 +624,45 @@ _notmuch_message_index_file (notmuch_message_t *message,
 
     return NOTMUCH_STATUS_SUCCESS;
 }
+
+static bool
+_mime_part_is_encrypted (GMimeObject *part)
+{
+    if (GMIME_IS_MULTIPART_ENCRYPTED (part))
+	return true;
+
+    if (GMIME_IS_MULTIPART (part)) {
+	GMimeMultipart *multipart = GMIME_MULTIPART (part);
+
+	for (int i = 0; i < g_mime_multipart_get_count (multipart); i++) {
+	    if (_mime_part_is_encrypted (g_mime_multipart_get_part (multipart, i)))
+		return true;
+	}
+    }
+
+    if (GMIME_IS_MESSAGE_PART (part)) {
+	GMimeMessage *mime_message;
+
+	mime_message = g_mime_message_part_get_message (GMIME_MESSAGE_PART (part));
+	if (mime_message)
+	    return _mime_part_is_encrypted (g_mime_message_get_mime_part (mime_message));
+    }
+
+    return false;
+}
+
+/* Does indexing 'message_file' possibly involve decrypting some of
+ * its parts? */
+bool
+_notmuch_message_file_has_encrypted_part (notmuch_message_file_t *message_file)
+{
+    GMimeMessage *mime_message;
+    GMimeObject *part;
+
+    if (_notmuch_message_file_get_mime_message (message_file, &mime_message))
+	return false;
+
+    part = g_mime_message_get_mime_part (mime_message);
+
+    return part && _mime_part_is_encrypted (part);
+}
@@ -53,7 +53,11 @@ _notmuch_message_file_destructor (notmuch_message_file_t *message)
 }
 
 /* Create a new notmuch_message_file_t for 'filename' with 'ctx' as
- * the talloc owner. */
+ * the talloc owner.
+ *
+ * 'notmuch' is only used to report errors, and may be NULL when the
+ * file is opened from a thread other than the one using the database
+ * (see notmuch_database_prepare_file). */
 notmuch_message_file_t *
 _notmuch_message_file_open_ctx (notmuch_database_t *notmuch,
 				void *ctx, const char *filename)
@@ -77,8 +81,9 @@ _notmuch_message_file_open_ctx (notmuch_database_t *notmuch,
     return message;
 
   FAIL:
-    _notmuch_database_log (notmuch, "Error opening %s: %s\n",
-			  filename, strerror (errno));
+    if (notmuch)
+	_notmuch_database_log (notmuch, "Error opening %s: %s\n",
+			       filename, strerror (errno));
     _notmuch_message_file_close (message);
 
     return NULL;
@@ -124,7 +129,7 @@ _notmuch_message_file_parse (notmuch_message_file_t *message)
 {
     GMimeParser *parser;
     notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
-    static int initialized = 0;
+    static gsize initialized = 0;
     bool is_mbox;
 
     if (message->message)
@@ -132,9 +137,10 @@ _notmuch_message_file_parse (notmuch_message_file_t *message)
 
     is_mbox = _is_mbox (message->stream);
 
-    if (! initialized) {
+    /* Messages may be parsed from several threads at once. */
+    if (g_once_init_enter (&initialized)) {
 	g_mime_init ();
-	initialized = 1;
+	g_once_init_leave (&initialized, 1);
     }
 
     message->headers = g_hash_table_new_full (strcase_hash, strcase_equal,
@@ -57,6 +57,10 @@ struct _notmuch_message {
 
     Xapian::Document doc;
     Xapian::termcount termpos;
+
+    /* Term generator of a detached message, (otherwise the
+     * database's term generator is used). */
+    Xapian::TermGenerator *term_gen;
 };
 
 #define ARRAY_SIZE(arr) (sizeof (arr) / sizeof (arr[0]))
@@ -87,6 +91,9 @@ _notmuch_message_destructor (notmuch_message_t *message)
 {
     message->doc.~Document ();
 
+    if (message->term_gen)
+	delete message->term_gen;
+
     return 0;
 }
 
@@ -155,6 +162,32 @@ _notmuch_message_create_for_document (const void *talloc_owner,
 
     message->doc = doc;
     message->termpos = 0;
+    message->term_gen = NULL;
+
+    return message;
+}
+
+/* Create a new notmuch_message_t object which is not associated with
+ * any database or document.
+ *
+ * A detached message can only be used to collect the terms generated
+ * by _notmuch_message_index_file, which can later be added to a real
+ * message with _notmuch_message_add_detached_terms. Since it does not
+ * touch the database, this can be done in a different thread than
+ * the one using the database.
+ */
+notmuch_message_t *
+_notmuch_message_create_detached (const void *talloc_owner)
+{
+    notmuch_message_t *message;
+
+    message = _notmuch_message_create_for_document (talloc_owner, NULL, 0,
+						    Xapian::Document (), NULL);
+    if (unlikely (message == NULL))
+	return NULL;
+
+    message->term_gen = new Xapian::TermGenerator;
+    message->term_gen->set_stemmer (Xapian::Stem ("english"));
 
     return message;
 }
@@ -270,7 +303,9 @@ _notmuch_message_create_for_message_id (notmuch_database_t *notmuch,
 	doc.add_term (term, 0);
 	talloc_free (term);
 
-	doc.add_value (NOTMUCH_VALUE_MESSAGE_ID, message_id);
+	_notmuch_document_set_regexp_value (notmuch, doc,
+					    NOTMUCH_VALUE_MESSAGE_ID,
+					    message_id);
 
 	doc_id = _notmuch_database_generate_doc_id (notmuch);
     } catch (const Xapian::Error &error) {
@@ -530,10 +565,24 @@ _notmuch_message_ensure_message_file (notmuch_message_t *message)
 	notmuch_message_get_database (message), message, filename);
 }
 
+/* Headers stored in values by _notmuch_message_set_file_header_values,
+ * exactly as read from the message file. */
+static const struct {
+    const char *header;
+    Xapian::valueno slot;
+} file_header_values[] = {
+    { "to",		NOTMUCH_VALUE_TO },
+    { "cc",		NOTMUCH_VALUE_CC },
+    { "bcc",		NOTMUCH_VALUE_BCC },
+    { "date",		NOTMUCH_VALUE_DATE },
+    { "references",	NOTMUCH_VALUE_REFERENCES },
+};
+
 const char *
 notmuch_message_get_header (notmuch_message_t *message, const char *header)
 {
     Xapian::valueno slot = Xapian::BAD_VALUENO;
+    bool file_header = false;
 
     /* Fetch header from the appropriate xapian value field if
      * available */
@@ -544,16 +593,30 @@ notmuch_message_get_header (notmuch_message_t *message, const char *header)
     else if (strcasecmp (header, "message-id") == 0)
 	slot = NOTMUCH_VALUE_MESSAGE_ID;
 
+    for (size_t i = 0; i < ARRAY_SIZE (file_header_values); i++) {
+	if (strcasecmp (header, file_header_values[i].header) == 0) {
+	    slot = file_header_values[i].slot;
+	    file_header = true;
+	}
+    }
+
     if (slot != Xapian::BAD_VALUENO) {
 	try {
 	    std::string value = message->doc.get_value (slot);
 
-	    /* If we have NOTMUCH_FEATURE_FROM_SUBJECT_ID_VALUES, then
-	     * empty values indicate empty headers.  If we don't, then
-	     * it could just mean we didn't record the header. */
-	    if ((message->notmuch->features &
-		 NOTMUCH_FEATURE_FROM_SUBJECT_ID_VALUES) ||
-		! value.empty())
+	    bool recorded;
+
+	    /* If we have NOTMUCH_FEATURE_FROM_SUBJECT_ID_VALUES, or
+	     * for the other headers the document is marked as having
+	     * them, then empty values indicate empty headers.  If not,
+	     * then it could just mean we didn't record the header. */
+	    if (file_header)
+		recorded = ! message->doc.get_value (NOTMUCH_VALUE_FILE_HEADERS).empty ();
+	    else
+		recorded = message->notmuch->features &
+			   NOTMUCH_FEATURE_FROM_SUBJECT_ID_VALUES;
+
+	    if (recorded || ! value.empty ())
 		return talloc_strdup (message, value.c_str ());
 
 	} catch (Xapian::Error &error) {
@@ -1223,11 +1286,60 @@ _notmuch_message_set_header_values (notmuch_message_t *message,
 
     message->doc.add_value (NOTMUCH_VALUE_TIMESTAMP,
 			    Xapian::sortable_serialise (time_value));
-    message->doc.add_value (NOTMUCH_VALUE_FROM, from);
-    message->doc.add_value (NOTMUCH_VALUE_SUBJECT, subject);
+    _notmuch_document_set_regexp_value (message->notmuch, message->doc,
+					NOTMUCH_VALUE_FROM, from);
+    _notmuch_document_set_regexp_value (message->notmuch, message->doc,
+					NOTMUCH_VALUE_SUBJECT, subject);
     message->modified = true;
 }
 
+/* Store the headers of 'message_file' that notmuch_message_get_header
+ * would otherwise have to read from the file in the message's values,
+ * and mark the message as having them.  A missing header is stored as
+ * an empty value.  If the file cannot be parsed, the marker is
+ * removed and no value is changed, so the headers are looked up in
+ * the file. */
+void
+_notmuch_message_set_file_header_values (notmuch_message_t *message,
+					 notmuch_message_file_t *message_file)
+{
+    const char *values[ARRAY_SIZE (file_header_values)];
+
+    for (size_t i = 0; i < ARRAY_SIZE (file_header_values); i++) {
+	values[i] = _notmuch_message_file_get_header (
+	    message_file, file_header_values[i].header);
+
+	if (values[i] == NULL) {
+	    message->doc.remove_value (NOTMUCH_VALUE_FILE_HEADERS);
+	    message->modified = true;
+	    return;
+	}
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE (file_header_values); i++)
+	message->doc.add_value (file_header_values[i].slot, values[i]);
+    message->doc.add_value (NOTMUCH_VALUE_FILE_HEADERS, "1");
+    message->modified = true;
+}
+
+/* Upgrade a message to support NOTMUCH_FEATURE_FILE_HEADER_VALUES by
+ * reading its message file.  A message whose file cannot be read is
+ * left without the NOTMUCH_VALUE_FILE_HEADERS marker, so that its
+ * headers are still looked up in the file.  The caller must call
+ * _notmuch_message_sync. */
+void
+_notmuch_message_upgrade_file_header_values (notmuch_message_t *message)
+{
+    _notmuch_message_ensure_message_file (message);
+    if (message->message_file == NULL)
+	return;
+
+    _notmuch_message_set_file_header_values (message, message->message_file);
+
+    _notmuch_message_file_close (message->message_file);
+    message->message_file = NULL;
+}
+
 /* Upgrade a message to support NOTMUCH_FEATURE_LAST_MOD.  The caller
  * must call _notmuch_message_sync. */
 void
@@ -1238,6 +1350,52 @@ _notmuch_message_upgrade_last_mod (notmuch_message_t *message)
     message->modified = true;
 }
 
+/* Upgrade a message to support NOTMUCH_FEATURE_THREAD_ID_VALUES,
+ * given its 'thread_id' as read from its thread term.  The caller
+ * must call _notmuch_message_sync. */
+void
+_notmuch_message_upgrade_thread_id_value (notmuch_message_t *message,
+					  const char *thread_id)
+{
+    if (thread_id && *thread_id) {
+	message->doc.add_value (NOTMUCH_VALUE_THREAD_ID, thread_id);
+	message->modified = true;
+    }
+}
+
+/* Upgrade a message to support NOTMUCH_FEATURE_REGEXP_TRIGRAMS,
+ * given the trigram 'terms' of its values.  The caller must call
+ * _notmuch_message_sync. */
+void
+_notmuch_message_upgrade_regexp_trigrams (notmuch_message_t *message,
+					  const std::set<std::string> &terms)
+{
+    std::set<std::string>::const_iterator it;
+
+    for (it = terms.begin (); it != terms.end (); ++it)
+	message->doc.add_term (*it, 0);
+
+    if (! terms.empty ())
+	message->modified = true;
+}
+
+/* Index the trigram terms of the message ID of 'message', which
+ * ghost messages created before NOTMUCH_FEATURE_REGEXP_TRIGRAMS lack.
+ * The caller must call _notmuch_message_sync. */
+void
+_notmuch_message_upgrade_message_id_trigrams (notmuch_message_t *message)
+{
+    std::set<std::string> terms;
+
+    if (! (message->notmuch->features & NOTMUCH_FEATURE_REGEXP_TRIGRAMS))
+	return;
+
+    _notmuch_trigram_terms (_notmuch_trigram_prefix (NOTMUCH_VALUE_MESSAGE_ID),
+			    message->doc.get_value (NOTMUCH_VALUE_MESSAGE_ID),
+			    terms);
+    _notmuch_message_upgrade_regexp_trigrams (message, terms);
+}
+
 /* Synchronize changes made to message->doc out into the database. */
 void
 _notmuch_message_sync (notmuch_message_t *message)
@@ -1265,6 +1423,10 @@ _notmuch_message_sync (notmuch_message_t *message)
     db = static_cast <Xapian::WritableDatabase *> (message->notmuch->xapian_db);
     db->replace_document (message->doc_id, message->doc);
     message->modified = false;
+
+    if (message->notmuch->dirty_thread_summaries)
+	_notmuch_database_thread_changed (message->notmuch,
+					  _notmuch_message_get_thread_id_only (message));
 }
 
 /* Delete a message document from the database, leaving a ghost
@@ -1292,6 +1454,7 @@ _notmuch_message_delete (notmuch_message_t *message)
 
     db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
     db->delete_document (message->doc_id);
+    _notmuch_database_thread_changed (notmuch, tid);
 
     /* if this was a ghost to begin with, we are done */
     private_status = _notmuch_message_has_term (message, "type", "ghost", &is_ghost);
@@ -1301,6 +1464,10 @@ _notmuch_message_delete (notmuch_message_t *message)
     if (is_ghost)
 	return NOTMUCH_STATUS_SUCCESS;
 
+    status = _notmuch_database_record_deletion (notmuch, mid);
+    if (status)
+	return status;
+
     query_string = talloc_asprintf (message, "thread:%s", tid);
     query = notmuch_query_create (notmuch, query_string);
     if (query == NULL)
@@ -1411,6 +1578,12 @@ _notmuch_message_add_term (notmuch_message_t *message,
     message->doc.add_term (term, 0);
     message->modified = true;
 
+    /* A message belongs to exactly one thread, so its thread ID is
+     * also kept in a value slot, which can be read without the
+     * document's termlist. */
+    if (strcmp ("thread", prefix_name) == 0)
+	message->doc.add_value (NOTMUCH_VALUE_THREAD_ID, value);
+
     talloc_free (term);
 
     _notmuch_message_invalidate_metadata (message, prefix_name);
@@ -1427,11 +1600,14 @@ _notmuch_message_gen_terms (notmuch_message_t *message,
 			    const char *prefix_name,
 			    const char *text)
 {
-    Xapian::TermGenerator *term_gen = message->notmuch->term_gen;
+    Xapian::TermGenerator *term_gen = message->term_gen;
 
     if (text == NULL)
 	return NOTMUCH_PRIVATE_STATUS_NULL_POINTER;
 
+    if (term_gen == NULL)
+	term_gen = message->notmuch->term_gen;
+
     term_gen->set_document (message->doc);
     term_gen->set_termpos (message->termpos);
 
@@ -1449,6 +1625,36 @@ _notmuch_message_gen_terms (notmuch_message_t *message,
     return NOTMUCH_PRIVATE_STATUS_SUCCESS;
 }
 
+/* Add all terms of the detached message 'terms' (see
+ * _notmuch_message_create_detached) to 'message', just as if they
+ * had been generated for 'message' in the first place.
+ *
+ * This change will not be reflected in the database until the next
+ * call to _notmuch_message_sync. */
+void
+_notmuch_message_add_detached_terms (notmuch_message_t *message,
+				     notmuch_message_t *terms)
+{
+    Xapian::termpos offset = message->termpos;
+
+    for (Xapian::TermIterator i = terms->doc.termlist_begin ();
+	 i != terms->doc.termlist_end (); i++) {
+	const std::string term = *i;
+
+	for (Xapian::PositionIterator pos = i.positionlist_begin ();
+	     pos != i.positionlist_end (); pos++)
+	    message->doc.add_posting (term, *pos + offset, 0);
+
+	message->doc.add_term (term, i.get_wdf ());
+    }
+
+    message->termpos = offset + terms->termpos;
+    message->modified = true;
+
+    /* Indexing may add tags such as "attachment" or "signed". */
+    _notmuch_message_invalidate_metadata (message, "tag");
+}
+
 /* Remove a name:value term from 'message', (the actual term will be
  * encoded by prefixing the value with a short prefix). See
  * NORMAL_PREFIX and BOOLEAN_PREFIX arrays for the mapping of term
@@ -1475,6 +1681,8 @@ _notmuch_message_remove_term (notmuch_message_t *message,
     try {
 	message->doc.remove_term (term);
 	message->modified = true;
+	if (strcmp ("thread", prefix_name) == 0)
+	    message->doc.remove_value (NOTMUCH_VALUE_THREAD_ID);
     } catch (const Xapian::InvalidArgumentError) {
 	/* We'll let the philosophers try to wrestle with the
 	 * question of whether failing to remove that which was not
@@ -1880,6 +2088,19 @@ _new_maildir_filename (void *ctx,
     return filename_new;
 }
 
+notmuch_bool_t
+notmuch_tag_is_maildir_flag (const char *tag)
+{
+    unsigned i;
+
+    for (i = 0; i < ARRAY_SIZE (flag2tag); i++) {
+	if (strcmp (tag, flag2tag[i].tag) == 0)
+	    return true;
+    }
+
+    return false;
+}
+
 notmuch_status_t
 notmuch_message_tags_to_maildir_flags (notmuch_message_t *message)
 {
@@ -2150,8 +2371,10 @@ notmuch_message_reindex (notmuch_message_t *message,
 
 	_notmuch_message_add_term (message, "thread", thread_id);
 	/* Take header values only from first filename */
-	if (found == 0)
+	if (found == 0) {
 	    _notmuch_message_set_header_values (message, date, from, subject);
+	    _notmuch_message_set_file_header_values (message, message_file);
+	}
 
 	ret = _notmuch_message_index_file (message, indexopts, message_file);
 
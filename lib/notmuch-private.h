@@ -105,6 +105,13 @@ typedef enum {
     NOTMUCH_VALUE_FROM,
     NOTMUCH_VALUE_SUBJECT,
     NOTMUCH_VALUE_LAST_MOD,
+    NOTMUCH_VALUE_THREAD_ID,
+    NOTMUCH_VALUE_TO,
+    NOTMUCH_VALUE_CC,
+    NOTMUCH_VALUE_BCC,
+    NOTMUCH_VALUE_DATE,
+    NOTMUCH_VALUE_REFERENCES,
+    NOTMUCH_VALUE_FILE_HEADERS,
 } notmuch_value_t;
 
 /* Xapian (with flint backend) complains if we provide a term longer
@@ -113,6 +120,7 @@ typedef enum {
 #define NOTMUCH_TERM_MAX 245
 
 #define NOTMUCH_METADATA_THREAD_ID_PREFIX "thread_id_"
+#define NOTMUCH_METADATA_THREAD_ALIAS_PREFIX "thread_alias_"
 
 /* For message IDs we have to be even more restrictive. Beyond fitting
  * into the term limit, we also use message IDs to construct
@@ -201,6 +209,10 @@ _notmuch_database_log_append (notmuch_database_t *notmuch,
 unsigned long
 _notmuch_database_new_revision (notmuch_database_t *notmuch);
 
+void
+_notmuch_database_thread_changed (notmuch_database_t *notmuch,
+				  const char *thread_id);
+
 const char *
 _notmuch_database_relative_path (notmuch_database_t *notmuch,
 				 const char *path);
@@ -234,6 +246,10 @@ _notmuch_database_get_directory_path (void *ctx,
 				      notmuch_database_t *notmuch,
 				      unsigned int doc_id);
 
+void
+_notmuch_database_forget_directory_path (notmuch_database_t *notmuch,
+					 unsigned int doc_id);
+
 notmuch_status_t
 _notmuch_database_filename_to_direntry (void *ctx,
 					notmuch_database_t *notmuch,
@@ -241,6 +257,12 @@ _notmuch_database_filename_to_direntry (void *ctx,
 					notmuch_find_flags_t flags,
 					char **direntry);
 
+/* deleted.cc */
+
+notmuch_status_t
+_notmuch_database_record_deletion (notmuch_database_t *notmuch,
+				   const char *message_id);
+
 /* directory.cc */
 
 notmuch_directory_t *
@@ -265,6 +287,9 @@ _notmuch_message_create_for_message_id (notmuch_database_t *notmuch,
 					const char *message_id,
 					notmuch_private_status_t *status);
 
+notmuch_message_t *
+_notmuch_message_create_detached (const void *talloc_owner);
+
 unsigned int
 _notmuch_message_get_doc_id (notmuch_message_t *message);
 
@@ -292,6 +317,10 @@ _notmuch_message_gen_terms (notmuch_message_t *message,
 			    const char *prefix_name,
 			    const char *text);
 
+void
+_notmuch_message_add_detached_terms (notmuch_message_t *message,
+				     notmuch_message_t *terms);
+
 void
 _notmuch_message_upgrade_filename_storage (notmuch_message_t *message);
 
@@ -319,9 +348,23 @@ _notmuch_message_set_header_values (notmuch_message_t *message,
 				    const char *from,
 				    const char *subject);
 
+void
+_notmuch_message_set_file_header_values (notmuch_message_t *message,
+					 notmuch_message_file_t *message_file);
+
+void
+_notmuch_message_upgrade_file_header_values (notmuch_message_t *message);
+
 void
 _notmuch_message_upgrade_last_mod (notmuch_message_t *message);
 
+void
+_notmuch_message_upgrade_thread_id_value (notmuch_message_t *message,
+					  const char *thread_id);
+
+void
+_notmuch_message_upgrade_message_id_trigrams (notmuch_message_t *message);
+
 void
 _notmuch_message_sync (notmuch_message_t *message);
 
@@ -445,6 +488,15 @@ _notmuch_database_link_message_to_parents (notmuch_database_t *notmuch,
 					   notmuch_message_t *message,
 					   notmuch_message_file_t *message_file,
 					   const char **thread_id);
+
+const char *
+_notmuch_database_resolve_thread_alias (notmuch_database_t *notmuch,
+					void *ctx,
+					const char *thread_id);
+
+notmuch_status_t
+_notmuch_database_compact_thread_aliases (notmuch_database_t *notmuch);
+
 /* index.cc */
 
 notmuch_status_t
@@ -452,6 +504,9 @@ _notmuch_message_index_file (notmuch_message_t *message,
 			     notmuch_indexopts_t *indexopts,
 			     notmuch_message_file_t *message_file);
 
+bool
+_notmuch_message_file_has_encrypted_part (notmuch_message_file_t *message_file);
+
 /* messages.c */
 
 typedef struct _notmuch_message_node {
@@ -501,6 +556,12 @@ _notmuch_mset_messages_get (notmuch_messages_t *messages);
 void
 _notmuch_mset_messages_move_to_next (notmuch_messages_t *messages);
 
+/* Create a set of the document IDs in 'arr', a GArray of unsigned
+ * int. Returns NULL if out of memory. */
+notmuch_doc_id_set_t *
+_notmuch_doc_id_set_create (void *ctx,
+			    GArray *arr);
+
 bool
 _notmuch_doc_id_set_contains (notmuch_doc_id_set_t *doc_ids,
 			      unsigned int doc_id);
@@ -519,6 +580,11 @@ notmuch_status_t
 _notmuch_query_count_documents (notmuch_query_t *query,
 				const char *type,
 				unsigned *count_out);
+
+/* Whether what 'query_string' parses or evaluates to may be cached
+ * until the database changes. */
+bool
+_notmuch_query_string_cacheable (const char *query_string);
 /* message-id.c */
 
 /* Parse an RFC 822 message-id, discarding whitespace, any RFC 822
@@ -661,14 +727,28 @@ _notmuch_filenames_create (const void *ctx,
 
 /* thread.cc */
 
+notmuch_status_t
+_notmuch_thread_create_batch (void *ctx,
+			      notmuch_database_t *notmuch,
+			      const char **thread_ids,
+			      unsigned int count,
+			      notmuch_doc_id_set_t *match_set,
+			      notmuch_string_list_t *excluded_terms,
+			      notmuch_exclude_t omit_exclude,
+			      notmuch_sort_t sort,
+			      notmuch_thread_t **threads);
+
 notmuch_thread_t *
-_notmuch_thread_create (void *ctx,
-			notmuch_database_t *notmuch,
-			unsigned int seed_doc_id,
-			notmuch_doc_id_set_t *match_set,
-			notmuch_string_list_t *excluded_terms,
-			notmuch_exclude_t omit_exclude,
-			notmuch_sort_t sort);
+_notmuch_thread_create_from_summary (void *ctx,
+				     notmuch_database_t *notmuch,
+				     const char *thread_id,
+				     notmuch_string_list_t *exclude_terms,
+				     notmuch_sort_t sort);
+
+notmuch_status_t
+_notmuch_thread_update_summaries (notmuch_database_t *notmuch,
+				  const char **thread_ids,
+				  unsigned int count);
 
 /* indexopts.c */
 
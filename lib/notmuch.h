@@ -58,7 +58,7 @@ NOTMUCH_BEGIN_DECLS
  * version in Makefile.local.
  */
 #define LIBNOTMUCH_MAJOR_VERSION	5
-#define LIBNOTMUCH_MINOR_VERSION	2
+#define LIBNOTMUCH_MINOR_VERSION	3
 #define LIBNOTMUCH_MICRO_VERSION	0
 
 
@@ -236,7 +236,9 @@ typedef struct _notmuch_tags notmuch_tags_t;
 typedef struct _notmuch_directory notmuch_directory_t;
 typedef struct _notmuch_filenames notmuch_filenames_t;
 typedef struct _notmuch_config_list notmuch_config_list_t;
+typedef struct _notmuch_deleted_messages notmuch_deleted_messages_t;
 typedef struct _notmuch_indexopts notmuch_indexopts_t;
+typedef struct _notmuch_prepared_file notmuch_prepared_file_t;
 #endif /* __DOXYGEN__ */
 
 /**
@@ -387,6 +389,44 @@ notmuch_database_status_string (const notmuch_database_t *notmuch);
 notmuch_status_t
 notmuch_database_close (notmuch_database_t *database);
 
+/**
+ * Bring a read-only database up to date with the latest changes
+ * committed by writers.
+ *
+ * Objects derived from the database before this call may be invalid
+ * afterwards if the database changed in the meantime.  If it did not
+ * change, this is cheap and cached data is kept.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: The database now shows the latest changes.
+ *
+ * NOTMUCH_STATUS_UNSUPPORTED_OPERATION: The database was opened
+ *	read-write (and always shows its own changes).
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred.
+ *
+ * @since libnotmuch 5.3 (notmuch 0.29)
+ */
+notmuch_status_t
+notmuch_database_reopen (notmuch_database_t *database);
+
+/**
+ * Get the statistics of the parse cache of 'database', which keeps
+ * recently parsed query strings, so that queries created again with
+ * the same string are not parsed again.
+ *
+ * '*hits' is set to the number of queries that found their string
+ * already parsed, and '*misses' to the number that had to be parsed
+ * and could be cached.  Either pointer may be NULL.
+ *
+ * @since libnotmuch 5.3 (notmuch 0.29)
+ */
+void
+notmuch_database_get_parse_cache_stats (notmuch_database_t *database,
+					unsigned long *hits,
+					unsigned long *misses);
+
 /**
  * A callback invoked by notmuch_database_compact to notify the user
  * of the progress of the compaction process.
@@ -458,6 +498,14 @@ notmuch_database_needs_upgrade (notmuch_database_t *database);
  * function before making any modifications.  If
  * notmuch_database_needs_upgrade returns FALSE, this will be a no-op.
  *
+ * The messages are upgraded in chunks, each committed on its own,
+ * and the database only switches to the new format once all of them
+ * are done.  If the upgrade is interrupted, calling this function
+ * again resumes it after the last committed chunk.  Nothing stops
+ * other writers from opening the database in between; they see it
+ * in its old format, and the messages they add are upgraded when the
+ * upgrade resumes.
+ *
  * The optional progress_notify callback can be used by the caller to
  * provide progress indication to the user. If non-NULL it will be
  * called periodically with 'progress' as a floating-point value in
@@ -509,6 +557,61 @@ notmuch_database_begin_atomic (notmuch_database_t *notmuch);
 notmuch_status_t
 notmuch_database_end_atomic (notmuch_database_t *notmuch);
 
+/**
+ * Begin a batch of atomic database operations.
+ *
+ * Within a batch, the changes of consecutive atomic sections (see
+ * notmuch_database_begin_atomic) are grouped into larger
+ * transactions: they are committed to disk once every 'batch_size'
+ * atomic sections, and when the batch ends.  This greatly reduces
+ * the cost of adding many messages in a row.
+ *
+ * Atomicity is then guaranteed at the granularity of a batch: if
+ * notmuch crashes, or the database is closed without calling
+ * notmuch_database_end_batch, the changes made since the last commit
+ * of the batch are discarded, but the database is left in a
+ * consistent state.
+ *
+ * A 'batch_size' of 0 is treated as 1.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: Successfully started the batch.
+ *
+ * NOTMUCH_STATUS_UNBALANCED_ATOMIC: A batch or an atomic section is
+ *	already in progress.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred;
+ *	batch not started.
+ *
+ * NOTMUCH_STATUS_UPGRADE_REQUIRED: The database must be upgraded
+ *	first.
+ *
+ * @since libnotmuch 5.3 (notmuch 0.29)
+ */
+notmuch_status_t
+notmuch_database_begin_batch (notmuch_database_t *notmuch,
+			      unsigned int batch_size);
+
+/**
+ * End a batch of atomic database operations, committing the changes
+ * made since the last commit of the batch.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: Successfully completed the batch.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred;
+ *	batch not ended.
+ *
+ * NOTMUCH_STATUS_UNBALANCED_ATOMIC: The database is not currently in
+ *	a batch, or an atomic section of the batch is still open.
+ *
+ * @since libnotmuch 5.3 (notmuch 0.29)
+ */
+notmuch_status_t
+notmuch_database_end_batch (notmuch_database_t *notmuch);
+
 /**
  * Return the committed database revision and UUID.
  *
@@ -527,6 +630,115 @@ unsigned long
 notmuch_database_get_revision (notmuch_database_t *notmuch,
 				const char **uuid);
 
+/**
+ * Get the messages deleted from the database after revision
+ * 'since_revision' (see notmuch_database_get_revision).
+ *
+ * Each time the last file of a message is removed, the message-id
+ * and the revision of the deletion are recorded, so that a client
+ * keeping a copy of the tags up to date (e.g. with "notmuch dump
+ * --since-revision") can also learn about deletions.  Messages
+ * which have been added back since they were deleted are not
+ * reported.  Deletion records are kept until they are dropped with
+ * notmuch_database_prune_deleted_messages, so a message may be
+ * reported again later, with its original revision.
+ *
+ * The returned iterator lists the messages in no particular order,
+ * and should be destroyed with notmuch_deleted_messages_destroy.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: '*deleted' has been initialized.
+ *
+ * NOTMUCH_STATUS_NULL_POINTER: 'deleted' is NULL.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Out of memory.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred.
+ *
+ * NOTMUCH_STATUS_UPGRADE_REQUIRED: The database does not track
+ *	revisions, and must be upgraded first.
+ *
+ * @since libnotmuch 5.3 (notmuch 0.29)
+ */
+notmuch_status_t
+notmuch_database_get_deleted_messages (notmuch_database_t *notmuch,
+				       unsigned long since_revision,
+				       notmuch_deleted_messages_t **deleted);
+
+/**
+ * Is the given 'deleted' iterator pointing at a valid message.
+ *
+ * @since libnotmuch 5.3 (notmuch 0.29)
+ */
+notmuch_bool_t
+notmuch_deleted_messages_valid (notmuch_deleted_messages_t *deleted);
+
+/**
+ * Get the message-id of the current deleted message.
+ *
+ * The returned string belongs to the iterator.
+ *
+ * @since libnotmuch 5.3 (notmuch 0.29)
+ */
+const char *
+notmuch_deleted_messages_get_message_id (notmuch_deleted_messages_t *deleted);
+
+/**
+ * Get the revision at which the current message was deleted.
+ *
+ * @since libnotmuch 5.3 (notmuch 0.29)
+ */
+unsigned long
+notmuch_deleted_messages_get_revision (notmuch_deleted_messages_t *deleted);
+
+/**
+ * Move the 'deleted' iterator to the next message.
+ *
+ * @since libnotmuch 5.3 (notmuch 0.29)
+ */
+void
+notmuch_deleted_messages_move_to_next (notmuch_deleted_messages_t *deleted);
+
+/**
+ * Destroy a notmuch_deleted_messages_t object.
+ *
+ * @since libnotmuch 5.3 (notmuch 0.29)
+ */
+void
+notmuch_deleted_messages_destroy (notmuch_deleted_messages_t *deleted);
+
+/**
+ * Drop the records of the messages deleted up to and including
+ * revision 'up_to_revision'.
+ *
+ * A record is added for each deleted message and is otherwise kept
+ * forever.  A client that has seen all deletions up to some revision
+ * (e.g. the revision of its last "notmuch dump --since-revision")
+ * will never ask for them again, and can call this function with
+ * that revision.  Once dropped, these deletions are no longer
+ * reported by notmuch_database_get_deleted_messages, including to
+ * other clients that have not seen them yet, so with several such
+ * clients, pass the oldest revision any of them has seen.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: The records have been dropped.
+ *
+ * NOTMUCH_STATUS_READ_ONLY_DATABASE: Database was opened in read-only
+ *	mode so no records can be dropped.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred.
+ *
+ * NOTMUCH_STATUS_UPGRADE_REQUIRED: The database does not track
+ *	revisions, and must be upgraded first.
+ *
+ * @since libnotmuch 5.3 (notmuch 0.29)
+ */
+notmuch_status_t
+notmuch_database_prune_deleted_messages (notmuch_database_t *notmuch,
+					 unsigned long up_to_revision);
+
 /**
  * Retrieve a directory object from the database for 'path'.
  *
@@ -624,6 +836,85 @@ notmuch_database_index_file (notmuch_database_t *database,
 			     notmuch_indexopts_t *indexopts,
 			     notmuch_message_t **message);
 
+/**
+ * Do the parts of indexing a message file that don't need access to
+ * the database, so that they can be done in parallel.
+ *
+ * This parses the message file 'filename' and generates the search
+ * terms for its contents, storing the result in '*prepared'. The
+ * file can then be added to the database with
+ * notmuch_database_index_prepared_file, which does the same as
+ * notmuch_database_index_file but is considerably cheaper.
+ *
+ * Unlike any other function taking a notmuch_database_t, it is safe
+ * to call this function from several threads at once, concurrently
+ * with another thread using 'database' (which must not be closed or
+ * destroyed in the meantime). Each resulting notmuch_prepared_file_t
+ * may then only be used by one thread at a time.
+ *
+ * The result is allocated under the talloc context 'ctx'.  As talloc
+ * is not thread-safe, each concurrent call needs a context of its
+ * own, allocated beforehand by the calling program and not used by
+ * any other thread until this function returns.  'ctx' must not be
+ * NULL when calling this function from several threads, since all
+ * allocations under NULL share the same list.
+ *
+ * The 'indexopts' parameter has the same meaning as for
+ * notmuch_database_index_file, and must stay valid until the file is
+ * indexed. If it is NULL, or if the message may need to be decrypted,
+ * the search terms are only generated by
+ * notmuch_database_index_prepared_file, since that needs the
+ * database.
+ *
+ * Errors with the file itself (e.g. NOTMUCH_STATUS_FILE_ERROR or
+ * NOTMUCH_STATUS_FILE_NOT_EMAIL) are not reported here, but by
+ * notmuch_database_index_prepared_file.
+ *
+ * The caller should call notmuch_prepared_file_destroy when finished
+ * with '*prepared'.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: '*prepared' has been initialized.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Out of memory, '*prepared' is set
+ *	to NULL.
+ *
+ * NOTMUCH_STATUS_READ_ONLY_DATABASE: Database was opened in read-only
+ *	mode so no message can be added. '*prepared' is set to NULL.
+ *
+ * @since libnotmuch 5.3 (notmuch 0.29)
+ */
+notmuch_status_t
+notmuch_database_prepare_file (notmuch_database_t *database,
+			       void *ctx,
+			       const char *filename,
+			       notmuch_indexopts_t *indexopts,
+			       notmuch_prepared_file_t **prepared);
+
+/**
+ * Add a message file prepared by notmuch_database_prepare_file to the
+ * database.
+ *
+ * This behaves exactly like notmuch_database_index_file, (including
+ * the meaning of 'message' and of the return values), called with the
+ * filename and indexopts passed to notmuch_database_prepare_file.
+ *
+ * @since libnotmuch 5.3 (notmuch 0.29)
+ */
+notmuch_status_t
+notmuch_database_index_prepared_file (notmuch_database_t *database,
+				      notmuch_prepared_file_t *prepared,
+				      notmuch_message_t **message);
+
+/**
+ * Destroy a notmuch_prepared_file_t object.
+ *
+ * @since libnotmuch 5.3 (notmuch 0.29)
+ */
+void
+notmuch_prepared_file_destroy (notmuch_prepared_file_t *prepared);
+
 /**
  * Deprecated alias for notmuch_database_index_file called with
  * NULL indexopts.
@@ -847,6 +1138,28 @@ void
 notmuch_query_set_omit_excluded (notmuch_query_t *query,
 				 notmuch_exclude_t omit_excluded);
 
+/**
+ * Specify whether notmuch_query_search_threads may build threads from
+ * thread summary documents.  By default, this is set to FALSE.
+ *
+ * Thread summary documents are maintained if the database
+ * configuration "index.thread_summaries" is true.  They are used only
+ * for queries matching all messages ("" or "*"), for threads without
+ * excluded tags, and only while they are up to date; any other thread
+ * is built from its messages as usual.
+ *
+ * A thread built from its summary has the same thread ID, subject,
+ * authors, counts, dates and tags as one built from its messages, but
+ * has no messages: notmuch_thread_get_toplevel_messages and
+ * notmuch_thread_get_messages return empty lists for it.  Only set
+ * this if the caller does not need the messages of threads.
+ *
+ * @since libnotmuch 5.3 (notmuch 0.29)
+ */
+void
+notmuch_query_set_use_thread_summaries (notmuch_query_t *query,
+					notmuch_bool_t use_thread_summaries);
+
 /**
  * Specify the sorting desired for this query.
  */
@@ -917,6 +1230,21 @@ notmuch_query_add_tag_exclude (notmuch_query_t *query, const char *tag);
  * notmuch_threads_destroy function, but there's no good reason
  * to call it if the query is about to be destroyed).
  *
+ * On a database opened read-only, the matches are fetched in growing
+ * windows as the iterator advances, so that the first threads come
+ * quickly.  Since a read-only database does not see later changes
+ * until notmuch_database_reopen, the results are those of the
+ * database when the query ran.
+ *
+ * On a database opened read-write, the matched messages are all
+ * fetched by this function, so that changing the database while
+ * iterating (e.g. tagging each thread so that it no longer matches)
+ * neither skips nor repeats threads.  The threads are the ones whose
+ * messages matched the query when it ran, and their matched messages
+ * are those that matched then.  The rest of each thread, its tags
+ * and its other messages, reflect the database when the thread is
+ * built, which can be before notmuch_threads_get is called for it.
+ *
  * @since libnotmuch 5.0 (notmuch 0.25)
  */
 notmuch_status_t
@@ -1047,6 +1375,31 @@ notmuch_threads_get (notmuch_threads_t *threads);
 void
 notmuch_threads_move_to_next (notmuch_threads_t *threads);
 
+/**
+ * Move the 'threads' iterator forward over the next 'count' threads,
+ * as if by calling notmuch_threads_move_to_next 'count' times, but
+ * without building the threads passed over.
+ *
+ * If fewer than 'count' threads remain, the iterator is moved just
+ * beyond the last thread.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: The iterator was moved forward.
+ *
+ * NOTMUCH_STATUS_NULL_POINTER: 'threads' is NULL.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Memory allocation failed.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred
+ *	finding the threads to pass over.  The position of the
+ *	iterator is then unspecified.
+ *
+ * @since libnotmuch 5.3 (notmuch 0.29)
+ */
+notmuch_status_t
+notmuch_threads_skip (notmuch_threads_t *threads, unsigned int count);
+
 /**
  * Destroy a notmuch_threads_t object.
  *
@@ -1061,7 +1414,9 @@ notmuch_threads_destroy (notmuch_threads_t *threads);
  * Return the number of messages matching a search.
  *
  * This function performs a search and returns the number of matching
- * messages.
+ * messages.  As for notmuch_query_count_threads, excluded messages
+ * are only left out if the query omits them (see
+ * notmuch_query_set_omit_excluded).
  *
  * @returns
  *
@@ -1121,6 +1476,47 @@ NOTMUCH_DEPRECATED(5,0)
 notmuch_status_t
 notmuch_query_count_threads_st (notmuch_query_t *query, unsigned *count);
 
+/**
+ * Change the tags of all messages matching 'query'.
+ *
+ * If 'remove_all' is true, all tags of each message are removed
+ * first.  Then the tags of the NULL-terminated array 'remove_tags'
+ * are removed, and the tags of the NULL-terminated array 'add_tags'
+ * are added.  Either array may be NULL.
+ *
+ * This has the same effect as calling notmuch_message_remove_all_tags,
+ * notmuch_message_remove_tag and notmuch_message_add_tag on each
+ * message, but is much cheaper for many messages: the documents are
+ * changed in place, without creating message objects, and the
+ * changes are committed once per batch of messages.  Messages whose
+ * tags do not change are not modified.
+ *
+ * Unlike notmuch_message_tags_to_maildir_flags, the maildir flags of
+ * the message files are not updated.  Message objects created before
+ * the call do not see the new tags.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: The tags of all matching messages have
+ *	been changed.
+ *
+ * NOTMUCH_STATUS_TAG_TOO_LONG: One of the tags is longer than
+ *	NOTMUCH_TAG_MAX.  No message is changed.
+ *
+ * NOTMUCH_STATUS_READ_ONLY_DATABASE: Database was opened in read-only
+ *	mode so no message can be modified.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred.  The
+ *	batches committed so far are kept.
+ *
+ * @since libnotmuch 5.3 (notmuch 0.29)
+ */
+notmuch_status_t
+notmuch_query_apply_tag_ops (notmuch_query_t *query,
+			     const char **add_tags,
+			     const char **remove_tags,
+			     notmuch_bool_t remove_all);
+
 /**
  * Get the thread ID of 'thread'.
  *
@@ -1687,6 +2083,16 @@ notmuch_message_has_maildir_flag (notmuch_message_t *message, char flag);
 notmuch_status_t
 notmuch_message_tags_to_maildir_flags (notmuch_message_t *message);
 
+/**
+ * Return TRUE if 'tag' is one of the tags which
+ * notmuch_message_tags_to_maildir_flags and
+ * notmuch_message_maildir_flags_to_tags map to a maildir flag.
+ *
+ * @since libnotmuch 5.3 (notmuch 0.29)
+ */
+notmuch_bool_t
+notmuch_tag_is_maildir_flag (const char *tag);
+
 /**
  * Freeze the current state of 'message' within the database.
  *
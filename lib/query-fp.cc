@@ -24,20 +24,96 @@
 #include "query-fp.h"
 #include <iostream>
 
+void
+_notmuch_database_forget_saved_queries (notmuch_database_t *notmuch)
+{
+    if (notmuch->saved_queries)
+	g_hash_table_remove_all (notmuch->saved_queries);
+}
+
 #if HAVE_XAPIAN_FIELD_PROCESSOR
 
+static void
+_saved_query_free (gpointer data)
+{
+    delete static_cast <Xapian::Query *> (data);
+}
+
+/* Return the cache of parsed saved queries, emptied if the database
+ * changed since they were parsed, as for thread:{subquery}, since a
+ * saved query may contain one.  Setting a query.* configuration key
+ * empties it too.  Returns NULL if changes can't be detected. */
+static GHashTable *
+_saved_query_cache (notmuch_database_t *notmuch)
+{
+    if (! (notmuch->features & NOTMUCH_FEATURE_LAST_MOD) ||
+	notmuch->atomic_dirty)
+	return NULL;
+
+    if (notmuch->saved_queries == NULL) {
+	notmuch->saved_queries = g_hash_table_new_full (g_str_hash, g_str_equal,
+							g_free,
+							_saved_query_free);
+    } else if (notmuch->saved_queries_view != notmuch->view ||
+	       notmuch->saved_queries_revision != notmuch->revision) {
+	g_hash_table_remove_all (notmuch->saved_queries);
+    }
+    notmuch->saved_queries_view = notmuch->view;
+    notmuch->saved_queries_revision = notmuch->revision;
+
+    return notmuch->saved_queries;
+}
+
 Xapian::Query
 QueryFieldProcessor::operator() (const std::string & name)
 {
     std::string key = "query." + name;
+    GHashTable *cache = _saved_query_cache (notmuch);
+    Xapian::Query *cached = NULL;
+    Xapian::Query query;
     char *expansion;
+    bool cacheable;
     notmuch_status_t status;
 
+    if (cache)
+	cached = static_cast <Xapian::Query *> (
+	    g_hash_table_lookup (cache, name.c_str ()));
+    if (cached)
+	return *cached;
+
+    if (notmuch->saved_queries_expanding == NULL)
+	notmuch->saved_queries_expanding = g_hash_table_new_full (g_str_hash,
+								  g_str_equal,
+								  g_free, NULL);
+    if (g_hash_table_contains (notmuch->saved_queries_expanding, name.c_str ()))
+	throw Xapian::QueryParserError ("saved query '" + name + "' refers to itself");
+
     status = notmuch_database_get_config (notmuch, key.c_str (), &expansion);
     if (status) {
 	throw Xapian::QueryParserError ("error looking up key" + name);
     }
 
-    return parser.parse_query (expansion, NOTMUCH_QUERY_PARSER_FLAGS);
+    /* Saved queries used by this one are parsed (and cached) while
+     * it is marked as being expanded. */
+    g_hash_table_add (notmuch->saved_queries_expanding, g_strdup (name.c_str ()));
+    try {
+	query = parser.parse_query (expansion, NOTMUCH_QUERY_PARSER_FLAGS);
+    } catch (...) {
+	g_hash_table_remove (notmuch->saved_queries_expanding, name.c_str ());
+	free (expansion);
+	throw;
+    }
+    g_hash_table_remove (notmuch->saved_queries_expanding, name.c_str ());
+    cacheable = _notmuch_query_string_cacheable (expansion);
+    free (expansion);
+
+    /* Parsing may have changed the cache (through nested saved
+     * queries), so look it up again. */
+    cache = _saved_query_cache (notmuch);
+    if (cache && cacheable)
+	g_hash_table_insert (cache, g_strdup (name.c_str ()),
+			     new Xapian::Query (query));
+
+    return query;
 }
 #endif
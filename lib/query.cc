@@ -21,7 +21,9 @@
 #include "notmuch-private.h"
 #include "database-private.h"
 
-#include <glib.h> /* GHashTable, GPtrArray */
+#include <glib.h> /* GHashTable, GPtrArray, GQueue */
+
+typedef struct _notmuch_parsed_query notmuch_parsed_query_t;
 
 struct _notmuch_query {
     notmuch_database_t *notmuch;
@@ -29,11 +31,40 @@ struct _notmuch_query {
     notmuch_sort_t sort;
     notmuch_string_list_t *exclude_terms;
     notmuch_exclude_t omit_excluded;
-    bool parsed;
+    bool use_thread_summaries;
+    /* The parse of query_string, shared with the parse cache and
+     * other queries, or NULL until the query is parsed. */
+    notmuch_parsed_query_t *parsed;
+    Xapian::Query xapian_query;
+};
+
+/* A parsed query string. Once parsed it is not modified, and it is
+ * shared by the parse cache of the database (see
+ * _notmuch_query_ensure_parsed) and the queries of the same string. */
+struct _notmuch_parsed_query {
+    std::string query_string;
     Xapian::Query xapian_query;
+    /* Xapian doesn't support skip_to on terms from a query since
+     * they are unordered, so keep a copy of all terms in something
+     * searchable. */
     std::set<std::string> terms;
+    /* Number of holders: the parse cache and each query. */
+    unsigned int refs;
+    /* The link of the parsed query in the cache's LRU list, or NULL
+     * if it is not in the cache. */
+    GList *lru_link;
 };
 
+/* Number of parsed query strings kept by a database. */
+#define NOTMUCH_PARSE_CACHE_SIZE 256
+
+static void
+_notmuch_parsed_query_unref (notmuch_parsed_query_t *parsed)
+{
+    if (--parsed->refs == 0)
+	delete parsed;
+}
+
 typedef struct _notmuch_mset_messages {
     notmuch_messages_t base;
     notmuch_database_t *notmuch;
@@ -49,16 +80,65 @@ struct _notmuch_doc_id_set {
 #define DOCIDSET_WORD(bit) ((bit) / CHAR_BIT)
 #define DOCIDSET_BIT(bit) ((bit) % CHAR_BIT)
 
+/* Number of matches fetched by the first window of a thread search.
+ * Each following window is twice as large as the previous one. */
+#define NOTMUCH_THREADS_FIRST_WINDOW 64
+
+/* Number of threads built together by the first batch of a thread
+ * search, and the limit that the batch size doubles up to. */
+#define NOTMUCH_THREADS_FIRST_BATCH 8
+#define NOTMUCH_THREADS_MAX_BATCH 128
+
+/* Number of messages after which no more threads are added to a
+ * batch, since all the members of its threads are loaded at once and
+ * kept until the threads are destroyed. */
+#define NOTMUCH_THREADS_MAX_BATCH_MESSAGES 2048
+
+/* Number of threads passed over together by notmuch_threads_skip. */
+#define NOTMUCH_THREADS_SKIP_BATCH 1024
+
+/* A thread built ahead of the iterator. Once 'thread' has been
+ * handed to the caller it is NULL, and the thread is rebuilt from
+ * 'thread_id' if asked for again. */
+typedef struct _notmuch_batched_thread {
+    char *thread_id;
+    notmuch_thread_t *thread;
+} notmuch_batched_thread_t;
+
 struct _notmuch_threads {
     notmuch_query_t *query;
 
-    /* The ordered list of doc ids matched by the query. */
-    GArray *doc_ids;
-    /* Our iterator's current position in doc_ids. */
-    unsigned int doc_id_pos;
-    /* The set of matched docid's that have not been assigned to a
-     * thread. Initially, this contains every docid in doc_ids. */
-    notmuch_doc_id_set_t match_set;
+    /* The messages matched by the query, in sort order. Rather than
+     * collecting every match up front, they are fetched one window
+     * (mset) at a time as the iterator advances, so the first
+     * threads cost time proportional to their number, not to the
+     * number of matches. */
+    Xapian::Query match_query;
+    Xapian::Enquire *enquire;
+    Xapian::MSet mset;
+    /* Our iterator's current position in mset. */
+    Xapian::doccount mset_pos;
+    /* Size of the next window to fetch. */
+    Xapian::doccount window_size;
+    /* Whether mset is the last window of matches. */
+    bool last_window;
+    /* Whether fetching a window failed, which also ends the matches. */
+    bool window_failed;
+    /* On a writable database, changes made while iterating would
+     * move the later windows and the matches of the later threads.
+     * There, all the matches are fetched in the first window, and
+     * the matched messages of each thread are taken from them. */
+    bool snapshot;
+    notmuch_doc_id_set_t snapshot_doc_ids;
+    /* The matched doc ids that have already been assigned to a
+     * thread. This grows as threads are built. */
+    GHashTable *seen_doc_ids;
+
+    /* Threads built together by a single query, in result order. The
+     * head of the queue is the current thread. */
+    GQueue *batch;
+    /* Number of threads to build in the next batch. */
+    unsigned int batch_size;
 };
 
 /* We need this in the message functions so forward declare. */
@@ -78,7 +158,8 @@ _debug_query (void)
 static int
 _notmuch_query_destructor (notmuch_query_t *query) {
     query->xapian_query.~Query();
-    query->terms.~set<std::string>();
+    if (query->parsed)
+	_notmuch_parsed_query_unref (query->parsed);
     return 0;
 }
 
@@ -96,8 +177,7 @@ notmuch_query_create (notmuch_database_t *notmuch,
 	return NULL;
 
     new (&query->xapian_query) Xapian::Query ();
-    new (&query->terms) std::set<std::string> ();
-    query->parsed = false;
+    query->parsed = NULL;
 
     talloc_set_destructor (query, _notmuch_query_destructor);
 
@@ -111,47 +191,166 @@ notmuch_query_create (notmuch_database_t *notmuch,
 
     query->omit_excluded = NOTMUCH_EXCLUDE_TRUE;
 
+    query->use_thread_summaries = false;
+
     return query;
 }
 
+/* Remove 'parsed' from the parse cache of 'notmuch'. Queries using it
+ * keep it. */
+static void
+_parse_cache_remove (notmuch_database_t *notmuch,
+		     notmuch_parsed_query_t *parsed)
+{
+    g_hash_table_remove (notmuch->parsed_queries,
+			 parsed->query_string.c_str ());
+    g_queue_delete_link (notmuch->parsed_queries_lru, parsed->lru_link);
+    parsed->lru_link = NULL;
+    _notmuch_parsed_query_unref (parsed);
+}
+
+void
+_notmuch_database_forget_parsed_queries (notmuch_database_t *notmuch)
+{
+    if (! notmuch->parsed_queries_lru)
+	return;
+
+    while (! g_queue_is_empty (notmuch->parsed_queries_lru))
+	_parse_cache_remove (notmuch, (notmuch_parsed_query_t *)
+			     g_queue_peek_head (notmuch->parsed_queries_lru));
+}
+
+/* Return the parse cache of 'notmuch', emptied if the database
+ * changed since the queries were parsed, as for thread:{subquery}:
+ * parsing resolves thread aliases, expands regexps over terms and
+ * evaluates thread subqueries.  Returns NULL if changes can't be
+ * detected. */
+static GHashTable *
+_parse_cache (notmuch_database_t *notmuch)
+{
+    if (! (notmuch->features & NOTMUCH_FEATURE_LAST_MOD) ||
+	notmuch->atomic_dirty)
+	return NULL;
+
+    if (notmuch->parsed_queries == NULL) {
+	notmuch->parsed_queries = g_hash_table_new (g_str_hash, g_str_equal);
+	notmuch->parsed_queries_lru = g_queue_new ();
+    } else if (notmuch->parsed_queries_view != notmuch->view ||
+	       notmuch->parsed_queries_revision != notmuch->revision) {
+	_notmuch_database_forget_parsed_queries (notmuch);
+    }
+    notmuch->parsed_queries_view = notmuch->view;
+    notmuch->parsed_queries_revision = notmuch->revision;
+
+    return notmuch->parsed_queries;
+}
+
+/* Whether the parse of 'query_string' may be cached.  Relative dates
+ * depend on the current time, and named queries have their own cache
+ * (see query-fp.cc), which also notices configuration changes.  The
+ * expansions of named queries and thread:{...} subqueries are only
+ * cached under the same condition, since a named query may contain
+ * relative dates, or be changed, after the query using it is
+ * cached. */
+bool
+_notmuch_query_string_cacheable (const char *query_string)
+{
+    return (strstr (query_string, "date:") == NULL &&
+	    strstr (query_string, "query:") == NULL);
+}
+
 static notmuch_status_t
 _notmuch_query_ensure_parsed (notmuch_query_t *query)
 {
+    notmuch_database_t *notmuch = query->notmuch;
+    notmuch_parsed_query_t *parsed = NULL;
+    GHashTable *cache = NULL;
+    bool cacheable;
+
     if (query->parsed)
 	return NOTMUCH_STATUS_SUCCESS;
 
-    try {
-	query->xapian_query =
-	    query->notmuch->query_parser->
-		parse_query (query->query_string, NOTMUCH_QUERY_PARSER_FLAGS);
-
-       /* Xapian doesn't support skip_to on terms from a query since
-	*  they are unordered, so cache a copy of all terms in
-	*  something searchable.
-	*/
-
-	for (Xapian::TermIterator t = query->xapian_query.get_terms_begin ();
-	     t != query->xapian_query.get_terms_end (); ++t)
-	    query->terms.insert (*t);
+    cacheable = _notmuch_query_string_cacheable (query->query_string);
+    if (cacheable)
+	cache = _parse_cache (notmuch);
+
+    if (cache) {
+	parsed = (notmuch_parsed_query_t *)
+		 g_hash_table_lookup (cache, query->query_string);
+	if (parsed) {
+	    notmuch->parsed_queries_hits++;
+	    g_queue_unlink (notmuch->parsed_queries_lru, parsed->lru_link);
+	    g_queue_push_head_link (notmuch->parsed_queries_lru, parsed->lru_link);
+	} else {
+	    notmuch->parsed_queries_misses++;
+	}
+    }
 
-	query->parsed = true;
+    if (! parsed) {
+	parsed = new notmuch_parsed_query_t;
+	parsed->query_string = query->query_string;
+	parsed->refs = 0;
+	parsed->lru_link = NULL;
+
+	try {
+	    parsed->xapian_query =
+		notmuch->query_parser->
+		    parse_query (query->query_string, NOTMUCH_QUERY_PARSER_FLAGS);
+
+	    for (Xapian::TermIterator t = parsed->xapian_query.get_terms_begin ();
+		 t != parsed->xapian_query.get_terms_end (); ++t)
+		parsed->terms.insert (*t);
+
+	} catch (const Xapian::Error &error) {
+	    if (!notmuch->exception_reported) {
+		_notmuch_database_log (notmuch,
+				       "A Xapian exception occurred parsing query: %s\n",
+				       error.get_msg ().c_str ());
+		_notmuch_database_log_append (notmuch,
+					      "Query string was: %s\n",
+					      query->query_string);
+		notmuch->exception_reported = true;
+	    }
 
-    } catch (const Xapian::Error &error) {
-	if (!query->notmuch->exception_reported) {
-	    _notmuch_database_log (query->notmuch,
-				   "A Xapian exception occurred parsing query: %s\n",
-				   error.get_msg ().c_str ());
-	    _notmuch_database_log_append (query->notmuch,
-					  "Query string was: %s\n",
-					  query->query_string);
-	    query->notmuch->exception_reported = true;
+	    delete parsed;
+	    return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
 	}
 
-	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+	/* Parsing may have changed the cache (through subqueries), so
+	 * look it up again. */
+	cache = cacheable ? _parse_cache (notmuch) : NULL;
+	if (cache && ! g_hash_table_contains (cache, query->query_string)) {
+	    parsed->refs++;
+	    g_queue_push_head (notmuch->parsed_queries_lru, parsed);
+	    parsed->lru_link = g_queue_peek_head_link (notmuch->parsed_queries_lru);
+	    g_hash_table_insert (cache, (void *) parsed->query_string.c_str (),
+				 parsed);
+
+	    if (g_queue_get_length (notmuch->parsed_queries_lru) >
+		NOTMUCH_PARSE_CACHE_SIZE)
+		_parse_cache_remove (notmuch, (notmuch_parsed_query_t *)
+				     g_queue_peek_tail (notmuch->parsed_queries_lru));
+	}
     }
+
+    parsed->refs++;
+    query->parsed = parsed;
+    query->xapian_query = parsed->xapian_query;
+
     return NOTMUCH_STATUS_SUCCESS;
 }
 
+void
+notmuch_database_get_parse_cache_stats (notmuch_database_t *notmuch,
+					unsigned long *hits,
+					unsigned long *misses)
+{
+    if (hits)
+	*hits = notmuch->parsed_queries_hits;
+    if (misses)
+	*misses = notmuch->parsed_queries_misses;
+}
+
 const char *
 notmuch_query_get_query_string (const notmuch_query_t *query)
 {
@@ -165,6 +364,13 @@ notmuch_query_set_omit_excluded (notmuch_query_t *query,
     query->omit_excluded = omit_excluded;
 }
 
+void
+notmuch_query_set_use_thread_summaries (notmuch_query_t *query,
+					notmuch_bool_t use_thread_summaries)
+{
+    query->use_thread_summaries = use_thread_summaries;
+}
+
 void
 notmuch_query_set_sort (notmuch_query_t *query, notmuch_sort_t sort)
 {
@@ -188,7 +394,7 @@ notmuch_query_add_tag_exclude (notmuch_query_t *query, const char *tag)
 	return status;
 
     term = talloc_asprintf (query, "%s%s", _find_prefix ("tag"), tag);
-    if (query->terms.count(term) != 0)
+    if (query->parsed->terms.count(term) != 0)
 	return NOTMUCH_STATUS_IGNORED;
 
     _notmuch_string_list_append (query->exclude_terms, term);
@@ -226,6 +432,52 @@ _notmuch_exclude_tags (notmuch_query_t *query)
     return exclude_query;
 }
 
+/* Return a query matching the documents of the given 'type' which are
+ * matched by 'query', leaving out excluded documents if they are to
+ * be omitted. The query must already have been parsed. */
+static Xapian::Query
+_notmuch_query_match_query (notmuch_query_t *query, const char *type)
+{
+    Xapian::Query mail_query (std::string (_find_prefix ("type")) + type);
+    Xapian::Query final_query;
+
+    if (strcmp (query->query_string, "") == 0 ||
+	strcmp (query->query_string, "*") == 0)
+    {
+	final_query = mail_query;
+    } else {
+	final_query = Xapian::Query (Xapian::Query::OP_AND,
+				     mail_query, query->xapian_query);
+    }
+
+    if (query->omit_excluded == NOTMUCH_EXCLUDE_TRUE ||
+	query->omit_excluded == NOTMUCH_EXCLUDE_ALL)
+    {
+	final_query = Xapian::Query (Xapian::Query::OP_AND_NOT,
+				     final_query, _notmuch_exclude_tags (query));
+    }
+
+    return final_query;
+}
+
+static void
+_notmuch_enquire_set_sort (Xapian::Enquire &enquire, notmuch_sort_t sort)
+{
+    switch (sort) {
+    case NOTMUCH_SORT_OLDEST_FIRST:
+	enquire.set_sort_by_value (NOTMUCH_VALUE_TIMESTAMP, false);
+	break;
+    case NOTMUCH_SORT_NEWEST_FIRST:
+	enquire.set_sort_by_value (NOTMUCH_VALUE_TIMESTAMP, true);
+	break;
+    case NOTMUCH_SORT_MESSAGE_ID:
+	enquire.set_sort_by_value (NOTMUCH_VALUE_MESSAGE_ID, false);
+	break;
+    case NOTMUCH_SORT_UNSORTED:
+	break;
+    }
+}
+
 
 notmuch_status_t
 notmuch_query_search_messages_st (notmuch_query_t *query,
@@ -247,7 +499,6 @@ _notmuch_query_search_documents (notmuch_query_t *query,
 				 notmuch_messages_t **out)
 {
     notmuch_database_t *notmuch = query->notmuch;
-    const char *query_string = query->query_string;
     notmuch_mset_messages_t *messages;
     notmuch_status_t status;
 
@@ -270,69 +521,39 @@ _notmuch_query_search_documents (notmuch_query_t *query,
 	talloc_set_destructor (messages, _notmuch_messages_destructor);
 
 	Xapian::Enquire enquire (*notmuch->xapian_db);
-	Xapian::Query mail_query (talloc_asprintf (query, "%s%s",
-						   _find_prefix ("type"),
-						   type));
 	Xapian::Query final_query, exclude_query;
 	Xapian::MSet mset;
 	Xapian::MSetIterator iterator;
 
-	if (strcmp (query_string, "") == 0 ||
-	    strcmp (query_string, "*") == 0)
-	{
-	    final_query = mail_query;
-	} else {
-	    final_query = Xapian::Query (Xapian::Query::OP_AND,
-					 mail_query, query->xapian_query);
-	}
+	final_query = _notmuch_query_match_query (query, type);
 	messages->base.excluded_doc_ids = NULL;
 
-	if ((query->omit_excluded != NOTMUCH_EXCLUDE_FALSE) && (query->exclude_terms)) {
-	    exclude_query = _notmuch_exclude_tags (query);
-
-	    if (query->omit_excluded == NOTMUCH_EXCLUDE_TRUE ||
-		query->omit_excluded == NOTMUCH_EXCLUDE_ALL)
-	    {
-		final_query = Xapian::Query (Xapian::Query::OP_AND_NOT,
-					     final_query, exclude_query);
-	    } else { /* NOTMUCH_EXCLUDE_FLAG */
-		exclude_query = Xapian::Query (Xapian::Query::OP_AND,
-					   exclude_query, final_query);
-
-		enquire.set_weighting_scheme (Xapian::BoolWeight());
-		enquire.set_query (exclude_query);
-
-		mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
-
-		GArray *excluded_doc_ids = g_array_new (false, false, sizeof (unsigned int));
-
-		for (iterator = mset.begin (); iterator != mset.end (); iterator++) {
-		    unsigned int doc_id = *iterator;
-		    g_array_append_val (excluded_doc_ids, doc_id);
-		}
-		messages->base.excluded_doc_ids = talloc (messages, _notmuch_doc_id_set);
-		_notmuch_doc_id_set_init (query, messages->base.excluded_doc_ids,
-					  excluded_doc_ids);
-		g_array_unref (excluded_doc_ids);
+	if (query->omit_excluded == NOTMUCH_EXCLUDE_FLAG && query->exclude_terms) {
+	    exclude_query = Xapian::Query (Xapian::Query::OP_AND,
+					   _notmuch_exclude_tags (query),
+					   final_query);
+
+	    enquire.set_weighting_scheme (Xapian::BoolWeight());
+	    enquire.set_query (exclude_query);
+
+	    mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+
+	    GArray *excluded_doc_ids = g_array_new (false, false, sizeof (unsigned int));
+
+	    for (iterator = mset.begin (); iterator != mset.end (); iterator++) {
+		unsigned int doc_id = *iterator;
+		g_array_append_val (excluded_doc_ids, doc_id);
 	    }
+	    messages->base.excluded_doc_ids = talloc (messages, _notmuch_doc_id_set);
+	    _notmuch_doc_id_set_init (query, messages->base.excluded_doc_ids,
+				      excluded_doc_ids);
+	    g_array_unref (excluded_doc_ids);
 	}
 
 
 	enquire.set_weighting_scheme (Xapian::BoolWeight());
 
-	switch (query->sort) {
-	case NOTMUCH_SORT_OLDEST_FIRST:
-	    enquire.set_sort_by_value (NOTMUCH_VALUE_TIMESTAMP, false);
-	    break;
-	case NOTMUCH_SORT_NEWEST_FIRST:
-	    enquire.set_sort_by_value (NOTMUCH_VALUE_TIMESTAMP, true);
-	    break;
-	case NOTMUCH_SORT_MESSAGE_ID:
-	    enquire.set_sort_by_value (NOTMUCH_VALUE_MESSAGE_ID, false);
-	    break;
-	case NOTMUCH_SORT_UNSORTED:
-	    break;
-	}
+	_notmuch_enquire_set_sort (enquire, query->sort);
 
 	if (_debug_query ()) {
 	    fprintf (stderr, "Exclude query is:\n%s\n",
@@ -375,19 +596,6 @@ _notmuch_mset_messages_valid (notmuch_messages_t *messages)
     return (mset_messages->iterator != mset_messages->iterator_end);
 }
 
-static Xapian::docid
-_notmuch_mset_messages_get_doc_id (notmuch_messages_t *messages)
-{
-    notmuch_mset_messages_t *mset_messages;
-
-    mset_messages = (notmuch_mset_messages_t *) messages;
-
-    if (! _notmuch_mset_messages_valid (&mset_messages->base))
-	return 0;
-
-    return *mset_messages->iterator;
-}
-
 notmuch_message_t *
 _notmuch_mset_messages_get (notmuch_messages_t *messages)
 {
@@ -456,6 +664,23 @@ _notmuch_doc_id_set_init (void *ctx,
     return true;
 }
 
+notmuch_doc_id_set_t *
+_notmuch_doc_id_set_create (void *ctx,
+			    GArray *arr)
+{
+    notmuch_doc_id_set_t *doc_ids = talloc (ctx, notmuch_doc_id_set_t);
+
+    if (unlikely (doc_ids == NULL))
+	return NULL;
+
+    if (! _notmuch_doc_id_set_init (doc_ids, doc_ids, arr)) {
+	talloc_free (doc_ids);
+	return NULL;
+    }
+
+    return doc_ids;
+}
+
 bool
 _notmuch_doc_id_set_contains (notmuch_doc_id_set_t *doc_ids,
 			      unsigned int doc_id)
@@ -473,19 +698,346 @@ _notmuch_doc_id_set_remove (notmuch_doc_id_set_t *doc_ids,
 	doc_ids->bitmap[DOCIDSET_WORD(doc_id)] &= ~(1 << DOCIDSET_BIT(doc_id));
 }
 
-/* Glib objects force use to use a talloc destructor as well, (but not
- * nearly as ugly as the for messages due to C++ objects). At
- * this point, I'd really like to have some talloc-friendly
- * equivalents for the few pieces of glib that I'm using. */
+/* We need a talloc destructor for the C++ and glib objects of a
+ * threads iterator, for the same reasons as for messages. */
 static int
 _notmuch_threads_destructor (notmuch_threads_t *threads)
 {
-    if (threads->doc_ids)
-	g_array_unref (threads->doc_ids);
+    if (threads->seen_doc_ids)
+	g_hash_table_unref (threads->seen_doc_ids);
+
+    /* The elements themselves are talloc children of threads. */
+    if (threads->batch)
+	g_queue_free (threads->batch);
+
+    delete threads->enquire;
+    threads->match_query.~Query ();
+    threads->mset.~MSet ();
 
     return 0;
 }
 
+/* Fetch the window of matches following the current one. On a Xapian
+ * exception, log it and return false, leaving no further matches. */
+static bool
+_notmuch_threads_next_window (notmuch_threads_t *threads)
+{
+    notmuch_database_t *notmuch = threads->query->notmuch;
+    Xapian::doccount first;
+
+    try {
+	first = threads->mset.get_firstitem () + threads->mset.size ();
+	threads->mset = threads->enquire->get_mset (first, threads->window_size);
+	threads->mset_pos = 0;
+	threads->last_window = threads->mset.size () < threads->window_size;
+	threads->window_size *= 2;
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch,
+			       "A Xapian exception occurred performing query: %s\n",
+			       error.get_msg ().c_str ());
+	_notmuch_database_log_append (notmuch,
+				      "Query string was: %s\n",
+				      threads->query->query_string);
+	notmuch->exception_reported = true;
+	threads->mset = Xapian::MSet ();
+	threads->mset_pos = 0;
+	threads->last_window = true;
+	threads->window_failed = true;
+	return false;
+    }
+
+    return true;
+}
+
+static unsigned int
+_notmuch_threads_get_doc_id (notmuch_threads_t *threads)
+{
+    return *threads->mset[threads->mset_pos];
+}
+
+/* Initialize 'match_set' (talloc'ed under 'ctx') to the messages of
+ * the 'count' threads in 'thread_ids' which are matched by the query
+ * of 'threads' (or were when it ran, for a snapshot), and record them
+ * as assigned to a thread. */
+static notmuch_status_t
+_notmuch_threads_get_match_set (notmuch_threads_t *threads,
+				void *ctx,
+				const char **thread_ids,
+				unsigned int count,
+				notmuch_doc_id_set_t *match_set)
+{
+    notmuch_database_t *notmuch = threads->query->notmuch;
+    GArray *doc_ids;
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+
+    doc_ids = g_array_new (false, false, sizeof (unsigned int));
+
+    try {
+	Xapian::Enquire enquire (*notmuch->xapian_db);
+	std::vector<std::string> thread_terms;
+	Xapian::Query thread_query;
+	Xapian::MSet mset;
+
+	for (unsigned int i = 0; i < count; i++)
+	    thread_terms.push_back (std::string (_find_prefix ("thread")) +
+				    thread_ids[i]);
+	thread_query = Xapian::Query (Xapian::Query::OP_OR,
+				      thread_terms.begin (),
+				      thread_terms.end ());
+
+	enquire.set_weighting_scheme (Xapian::BoolWeight ());
+	if (threads->snapshot)
+	    enquire.set_query (thread_query);
+	else
+	    enquire.set_query (Xapian::Query (Xapian::Query::OP_AND,
+					      threads->match_query,
+					      thread_query));
+
+	mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+
+	for (Xapian::MSetIterator i = mset.begin (); i != mset.end (); i++) {
+	    unsigned int doc_id = *i;
+	    if (threads->snapshot &&
+		! _notmuch_doc_id_set_contains (&threads->snapshot_doc_ids,
+						doc_id))
+		continue;
+	    g_array_append_val (doc_ids, doc_id);
+	    g_hash_table_insert (threads->seen_doc_ids,
+				 GUINT_TO_POINTER (doc_id), NULL);
+	}
+
+	if (! _notmuch_doc_id_set_init (ctx, match_set, doc_ids))
+	    status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch,
+			       "A Xapian exception occurred finding thread matches: %s\n",
+			       error.get_msg ().c_str ());
+	notmuch->exception_reported = true;
+	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    g_array_unref (doc_ids);
+
+    return status;
+}
+
+/* Whether the threads of 'threads' may be built from thread summary
+ * documents, which describe threads as matched by a query for all
+ * messages. */
+static bool
+_notmuch_threads_use_summaries (notmuch_threads_t *threads)
+{
+    const char *query_string = threads->query->query_string;
+
+    return (threads->query->use_thread_summaries &&
+	    (strcmp (query_string, "") == 0 ||
+	     strcmp (query_string, "*") == 0));
+}
+
+/* Build the thread 'thread_id' from its summary, if it has an
+ * up-to-date one, and record its messages as assigned to a
+ * thread. Returns NULL if the thread must be built from its
+ * messages. */
+static notmuch_thread_t *
+_notmuch_threads_create_from_summary (notmuch_threads_t *threads,
+				      void *ctx,
+				      const char *thread_id)
+{
+    notmuch_database_t *notmuch = threads->query->notmuch;
+    const std::string term = std::string (_find_prefix ("thread")) + thread_id;
+    notmuch_thread_t *thread;
+
+    thread = _notmuch_thread_create_from_summary (ctx, notmuch, thread_id,
+						  threads->query->exclude_terms,
+						  threads->query->sort);
+    if (thread == NULL)
+	return NULL;
+
+    try {
+	Xapian::PostingIterator p, p_end = notmuch->xapian_db->postlist_end (term);
+
+	for (p = notmuch->xapian_db->postlist_begin (term); p != p_end; p++)
+	    g_hash_table_insert (threads->seen_doc_ids,
+				 GUINT_TO_POINTER (*p), NULL);
+    } catch (const Xapian::Error &) {
+	/* Build the thread from its messages instead. */
+	talloc_free (thread);
+	return NULL;
+    }
+
+    return thread;
+}
+
+/* Store in 'thread_ids' (talloc'ed under 'ctx') the IDs of up to
+ * 'max' distinct threads of the next unseen matches, skipping over
+ * matches belonging to threads already built. If 'max_messages' is
+ * not 0, stop after the first thread which brings the number of
+ * documents in the threads found to 'max_messages'. Returns the
+ * number of thread IDs stored. */
+static unsigned int
+_notmuch_threads_next_thread_ids (notmuch_threads_t *threads,
+				  void *ctx,
+				  const char **thread_ids,
+				  unsigned int max,
+				  unsigned int max_messages)
+{
+    notmuch_database_t *notmuch = threads->query->notmuch;
+    GHashTable *batch_ids;
+    unsigned int count = 0;
+    Xapian::doccount messages = 0;
+
+    batch_ids = g_hash_table_new (g_str_hash, g_str_equal);
+
+    while (count < max) {
+	notmuch_message_t *seed_message;
+	const char *thread_id;
+	unsigned int doc_id;
+
+	if (threads->mset_pos >= threads->mset.size ()) {
+	    if (threads->last_window ||
+		! _notmuch_threads_next_window (threads))
+		break;
+	    continue;
+	}
+
+	doc_id = _notmuch_threads_get_doc_id (threads);
+	threads->mset_pos++;
+
+	if (g_hash_table_lookup_extended (threads->seen_doc_ids,
+					  GUINT_TO_POINTER (doc_id),
+					  NULL, NULL))
+	    continue;
+
+	/* Most seeds are skipped, so read their thread ID from the
+	 * value if there is one, without creating a message. */
+	thread_id = NULL;
+	if (notmuch->features & NOTMUCH_FEATURE_THREAD_ID_VALUES) {
+	    try {
+		std::string value = notmuch->xapian_db->get_document (doc_id)
+				    .get_value (NOTMUCH_VALUE_THREAD_ID);
+
+		if (! value.empty ())
+		    thread_id = talloc_strdup (ctx, value.c_str ());
+	    } catch (const Xapian::Error &) {
+		/* Read the thread term instead. */
+	    }
+	}
+
+	if (thread_id == NULL) {
+	    seed_message = _notmuch_message_create (ctx, notmuch, doc_id, NULL);
+	    if (! seed_message)
+		INTERNAL_ERROR ("Thread seed message %u does not exist", doc_id);
+
+	    thread_id = _notmuch_message_get_thread_id_only (seed_message);
+	    if (unlikely (thread_id == NULL))
+		continue;
+	}
+
+	if (g_hash_table_lookup_extended (batch_ids, thread_id, NULL, NULL))
+	    continue;
+
+	g_hash_table_insert (batch_ids, (void *) thread_id, NULL);
+	thread_ids[count++] = thread_id;
+
+	if (max_messages) {
+	    try {
+		messages += notmuch->xapian_db->get_termfreq (
+		    std::string (_find_prefix ("thread")) + thread_id);
+	    } catch (const Xapian::Error &) {
+		/* Leave the batch at its size. */
+	    }
+	    if (messages >= max_messages)
+		break;
+	}
+    }
+
+    g_hash_table_unref (batch_ids);
+
+    return count;
+}
+
+/* Build the threads of the next batch of unseen matches and queue
+ * them. All the threads of a batch are built from two queries: one
+ * for their matched messages, and one for all of their messages.
+ * Threads with an up-to-date summary skip both, if the query allows.
+ * Return false if there are no more threads (or on error). */
+static bool
+_notmuch_threads_fill_batch (notmuch_threads_t *threads)
+{
+    notmuch_database_t *notmuch = threads->query->notmuch;
+    notmuch_doc_id_set_t match_set;
+    notmuch_thread_t **built, **rest;
+    const char **thread_ids, **rest_ids;
+    unsigned int count, rest_count = 0;
+    bool ret = false;
+    void *local;
+
+    local = talloc_new (threads);
+    thread_ids = talloc_array (local, const char *, threads->batch_size);
+    built = talloc_array (local, notmuch_thread_t *, threads->batch_size);
+    rest_ids = talloc_array (local, const char *, threads->batch_size);
+    rest = talloc_array (local, notmuch_thread_t *, threads->batch_size);
+    if (unlikely (thread_ids == NULL || built == NULL ||
+		  rest_ids == NULL || rest == NULL)) {
+	talloc_free (local);
+	return false;
+    }
+
+    count = _notmuch_threads_next_thread_ids (threads, local, thread_ids,
+					      threads->batch_size,
+					      NOTMUCH_THREADS_MAX_BATCH_MESSAGES);
+    if (count == 0)
+	goto DONE;
+
+    for (unsigned int i = 0; i < count; i++) {
+	built[i] = NULL;
+	if (_notmuch_threads_use_summaries (threads))
+	    built[i] = _notmuch_threads_create_from_summary (threads, local,
+							     thread_ids[i]);
+	if (built[i] == NULL)
+	    rest_ids[rest_count++] = thread_ids[i];
+    }
+
+    if (rest_count) {
+	if (_notmuch_threads_get_match_set (threads, local, rest_ids,
+					    rest_count, &match_set))
+	    goto DONE;
+
+	if (_notmuch_thread_create_batch (local, notmuch, rest_ids, rest_count,
+					  &match_set,
+					  threads->query->exclude_terms,
+					  threads->query->omit_excluded,
+					  threads->query->sort,
+					  rest))
+	    goto DONE;
+
+	for (unsigned int i = 0, j = 0; i < count; i++) {
+	    if (built[i] == NULL)
+		built[i] = rest[j++];
+	}
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+	notmuch_batched_thread_t *entry;
+
+	entry = talloc (threads, notmuch_batched_thread_t);
+	if (unlikely (entry == NULL))
+	    goto DONE;
+
+	entry->thread = talloc_steal (entry, built[i]);
+	entry->thread_id = talloc_strdup (entry, thread_ids[i]);
+	g_queue_push_tail (threads->batch, entry);
+    }
+
+    threads->batch_size = MIN (threads->batch_size * 2,
+			       NOTMUCH_THREADS_MAX_BATCH);
+    ret = true;
+
+  DONE:
+    talloc_free (local);
+    return ret;
+}
+
 notmuch_status_t
 notmuch_query_search_threads_st (notmuch_query_t *query, notmuch_threads_t **out)
 {
@@ -496,38 +1048,90 @@ notmuch_status_t
 notmuch_query_search_threads (notmuch_query_t *query,
 			      notmuch_threads_t **out)
 {
+    notmuch_database_t *notmuch = query->notmuch;
     notmuch_threads_t *threads;
-    notmuch_messages_t *messages;
     notmuch_status_t status;
 
+    status = _notmuch_query_ensure_parsed (query);
+    if (status)
+	return status;
+
     threads = talloc (query, notmuch_threads_t);
     if (threads == NULL)
 	return NOTMUCH_STATUS_OUT_OF_MEMORY;
-    threads->doc_ids = NULL;
+
+    new (&threads->match_query) Xapian::Query ();
+    new (&threads->mset) Xapian::MSet ();
+    threads->enquire = NULL;
+    threads->seen_doc_ids = NULL;
+    threads->batch = NULL;
     talloc_set_destructor (threads, _notmuch_threads_destructor);
 
     threads->query = query;
+    threads->mset_pos = 0;
+    threads->window_size = NOTMUCH_THREADS_FIRST_WINDOW;
+    threads->last_window = false;
+    threads->window_failed = false;
+    threads->snapshot = notmuch->mode == NOTMUCH_DATABASE_MODE_READ_WRITE;
+    threads->batch_size = NOTMUCH_THREADS_FIRST_BATCH;
+
+    threads->seen_doc_ids = g_hash_table_new (NULL, NULL);
+    threads->batch = g_queue_new ();
+    if (threads->seen_doc_ids == NULL || threads->batch == NULL) {
+	talloc_free (threads);
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
 
-    status = notmuch_query_search_messages (query, &messages);
-    if (status) {
+    try {
+	threads->match_query = _notmuch_query_match_query (query, "mail");
+
+	threads->enquire = new Xapian::Enquire (*notmuch->xapian_db);
+	threads->enquire->set_weighting_scheme (Xapian::BoolWeight ());
+	_notmuch_enquire_set_sort (*threads->enquire, query->sort);
+	threads->enquire->set_query (threads->match_query);
+
+	if (threads->snapshot)
+	    threads->window_size = MAX (notmuch->xapian_db->get_doccount (), 1);
+
+	if (_debug_query ()) {
+	    fprintf (stderr, "Final query is:\n%s\n",
+		     threads->match_query.get_description ().c_str ());
+	}
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch,
+			       "A Xapian exception occurred performing query: %s\n",
+			       error.get_msg ().c_str ());
+	_notmuch_database_log_append (notmuch,
+				      "Query string was: %s\n",
+				      query->query_string);
+	notmuch->exception_reported = true;
 	talloc_free (threads);
-	return status;
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
     }
 
-    threads->doc_ids = g_array_new (false, false, sizeof (unsigned int));
-    while (notmuch_messages_valid (messages)) {
-	unsigned int doc_id = _notmuch_mset_messages_get_doc_id (messages);
-	g_array_append_val (threads->doc_ids, doc_id);
-	notmuch_messages_move_to_next (messages);
+    /* Fetch the first window right away, so that errors running the
+     * query are reported here. */
+    if (! _notmuch_threads_next_window (threads)) {
+	talloc_free (threads);
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
     }
-    threads->doc_id_pos = 0;
 
-    talloc_free (messages);
+    if (threads->snapshot) {
+	GArray *doc_ids = g_array_new (false, false, sizeof (unsigned int));
+	bool ok;
 
-    if (! _notmuch_doc_id_set_init (threads, &threads->match_set,
-				    threads->doc_ids)) {
-	talloc_free (threads);
-	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+	for (Xapian::MSetIterator i = threads->mset.begin ();
+	     i != threads->mset.end (); i++) {
+	    unsigned int doc_id = *i;
+	    g_array_append_val (doc_ids, doc_id);
+	}
+	ok = _notmuch_doc_id_set_init (threads, &threads->snapshot_doc_ids,
+				       doc_ids);
+	g_array_unref (doc_ids);
+	if (! ok) {
+	    talloc_free (threads);
+	    return NOTMUCH_STATUS_OUT_OF_MEMORY;
+	}
     }
 
     *out = threads;
@@ -543,46 +1147,115 @@ notmuch_query_destroy (notmuch_query_t *query)
 notmuch_bool_t
 notmuch_threads_valid (notmuch_threads_t *threads)
 {
-    unsigned int doc_id;
-
     if (! threads)
 	return false;
 
-    while (threads->doc_id_pos < threads->doc_ids->len) {
-	doc_id = g_array_index (threads->doc_ids, unsigned int,
-				threads->doc_id_pos);
-	if (_notmuch_doc_id_set_contains (&threads->match_set, doc_id))
-	    break;
-
-	threads->doc_id_pos++;
-    }
+    if (! g_queue_is_empty (threads->batch))
+	return true;
 
-    return threads->doc_id_pos < threads->doc_ids->len;
+    return _notmuch_threads_fill_batch (threads);
 }
 
 notmuch_thread_t *
 notmuch_threads_get (notmuch_threads_t *threads)
 {
-    unsigned int doc_id;
+    notmuch_batched_thread_t *entry;
+    notmuch_doc_id_set_t match_set;
+    notmuch_thread_t *thread = NULL;
+    const char *thread_id;
+    void *local;
 
     if (! notmuch_threads_valid (threads))
 	return NULL;
 
-    doc_id = g_array_index (threads->doc_ids, unsigned int,
-			    threads->doc_id_pos);
-    return _notmuch_thread_create (threads->query,
-				   threads->query->notmuch,
-				   doc_id,
-				   &threads->match_set,
-				   threads->query->exclude_terms,
-				   threads->query->omit_excluded,
-				   threads->query->sort);
+    entry = (notmuch_batched_thread_t *) g_queue_peek_head (threads->batch);
+
+    if (entry->thread) {
+	thread = talloc_steal (threads->query, entry->thread);
+	entry->thread = NULL;
+	return thread;
+    }
+
+    /* The current thread was already handed out, so build it again
+     * on its own. */
+    local = talloc_new (threads);
+    thread_id = entry->thread_id;
+
+    if (_notmuch_threads_get_match_set (threads, local, &thread_id, 1,
+					&match_set) == NOTMUCH_STATUS_SUCCESS)
+	(void) _notmuch_thread_create_batch (threads->query,
+					     threads->query->notmuch,
+					     &thread_id, 1,
+					     &match_set,
+					     threads->query->exclude_terms,
+					     threads->query->omit_excluded,
+					     threads->query->sort,
+					     &thread);
+
+    talloc_free (local);
+    return thread;
 }
 
 void
 notmuch_threads_move_to_next (notmuch_threads_t *threads)
 {
-    threads->doc_id_pos++;
+    if (! notmuch_threads_valid (threads))
+	return;
+
+    talloc_free (g_queue_pop_head (threads->batch));
+}
+
+notmuch_status_t
+notmuch_threads_skip (notmuch_threads_t *threads, unsigned int count)
+{
+    const char **thread_ids;
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+    void *local;
+
+    if (! threads)
+	return NOTMUCH_STATUS_NULL_POINTER;
+
+    /* First drop the threads already built. */
+    while (count && ! g_queue_is_empty (threads->batch)) {
+	talloc_free (g_queue_pop_head (threads->batch));
+	count--;
+    }
+
+    /* Then pass over the following threads by their IDs, only
+     * recording their matched messages as seen, in large groups. */
+    local = talloc_new (threads);
+    thread_ids = talloc_array (local, const char *,
+			       NOTMUCH_THREADS_SKIP_BATCH);
+    if (unlikely (thread_ids == NULL)) {
+	status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+	goto DONE;
+    }
+
+    while (count) {
+	notmuch_doc_id_set_t match_set;
+	unsigned int found;
+	void *group = talloc_new (local);
+
+	found = _notmuch_threads_next_thread_ids (
+	    threads, group, thread_ids,
+	    MIN (count, NOTMUCH_THREADS_SKIP_BATCH), 0);
+	if (found)
+	    status = _notmuch_threads_get_match_set (threads, group,
+						     thread_ids, found,
+						     &match_set);
+	talloc_free (group);
+	if (found == 0 || status)
+	    break;
+
+	count -= found;
+    }
+
+    if (status == NOTMUCH_STATUS_SUCCESS && threads->window_failed)
+	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+
+  DONE:
+    talloc_free (local);
+    return status;
 }
 
 void
@@ -607,7 +1280,6 @@ notmuch_status_t
 _notmuch_query_count_documents (notmuch_query_t *query, const char *type, unsigned *count_out)
 {
     notmuch_database_t *notmuch = query->notmuch;
-    const char *query_string = query->query_string;
     Xapian::doccount count = 0;
     notmuch_status_t status;
 
@@ -617,32 +1289,13 @@ _notmuch_query_count_documents (notmuch_query_t *query, const char *type, unsign
 
     try {
 	Xapian::Enquire enquire (*notmuch->xapian_db);
-	Xapian::Query mail_query (talloc_asprintf (query, "%s%s",
-						   _find_prefix ("type"),
-						   type));
-	Xapian::Query final_query, exclude_query;
+	Xapian::Query final_query = _notmuch_query_match_query (query, type);
 	Xapian::MSet mset;
 
-	if (strcmp (query_string, "") == 0 ||
-	    strcmp (query_string, "*") == 0)
-	{
-	    final_query = mail_query;
-	} else {
-	    final_query = Xapian::Query (Xapian::Query::OP_AND,
-					 mail_query, query->xapian_query);
-	}
-
-	exclude_query = _notmuch_exclude_tags (query);
-
-	final_query = Xapian::Query (Xapian::Query::OP_AND_NOT,
-					 final_query, exclude_query);
-
 	enquire.set_weighting_scheme(Xapian::BoolWeight());
 	enquire.set_docid_order(Xapian::Enquire::ASCENDING);
 
 	if (_debug_query ()) {
-	    fprintf (stderr, "Exclude query is:\n%s\n",
-		     exclude_query.get_description ().c_str ());
 	    fprintf (stderr, "Final query is:\n%s\n",
 		     final_query.get_description ().c_str ());
 	}
@@ -679,6 +1332,88 @@ notmuch_query_count_threads_st (notmuch_query_t *query, unsigned *count)
     return notmuch_query_count_threads (query, count);
 }
 
+/* Find one match of 'query' per thread, by collapsing the matches on
+ * their thread ID values, which needs no document to be read.  The
+ * thread ID of each match is its collapse key. */
+static notmuch_status_t
+_notmuch_query_collapse_threads (notmuch_query_t *query, Xapian::MSet &mset)
+{
+    notmuch_database_t *notmuch = query->notmuch;
+    notmuch_status_t status;
+
+    status = _notmuch_query_ensure_parsed (query);
+    if (status)
+	return status;
+
+    try {
+	Xapian::Query final_query = _notmuch_query_match_query (query, "mail");
+	Xapian::Enquire enquire (*notmuch->xapian_db);
+
+	enquire.set_weighting_scheme (Xapian::BoolWeight ());
+	enquire.set_docid_order (Xapian::Enquire::ASCENDING);
+	enquire.set_collapse_key (NOTMUCH_VALUE_THREAD_ID);
+	enquire.set_query (final_query);
+
+	if (_debug_query ()) {
+	    fprintf (stderr, "Final query is:\n%s\n",
+		     final_query.get_description ().c_str ());
+	}
+
+	mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch,
+			       "A Xapian exception occurred performing query: %s\n",
+			       error.get_msg ().c_str ());
+	_notmuch_database_log_append (notmuch,
+				      "Query string was: %s\n",
+				      query->query_string);
+	notmuch->exception_reported = true;
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_status_t
+_notmuch_query_get_thread_ids (notmuch_query_t *query,
+			       std::set<std::string> &thread_ids)
+{
+    notmuch_messages_t *messages;
+    notmuch_status_t status;
+
+    if (query->notmuch->features & NOTMUCH_FEATURE_THREAD_ID_VALUES) {
+	Xapian::MSet mset;
+
+	status = _notmuch_query_collapse_threads (query, mset);
+	if (status)
+	    return status;
+
+	try {
+	    for (Xapian::MSetIterator i = mset.begin (); i != mset.end (); ++i)
+		thread_ids.insert (i.get_collapse_key ());
+	} catch (const Xapian::Error &error) {
+	    _notmuch_database_log (query->notmuch,
+				   "A Xapian exception occurred reading thread IDs: %s\n",
+				   error.get_msg ().c_str ());
+	    query->notmuch->exception_reported = true;
+	    return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+	}
+
+	return NOTMUCH_STATUS_SUCCESS;
+    }
+
+    status = notmuch_query_search_messages (query, &messages);
+    if (status)
+	return status;
+
+    for (; notmuch_messages_valid (messages); notmuch_messages_move_to_next (messages)) {
+	notmuch_message_t *message = notmuch_messages_get (messages);
+	thread_ids.insert (_notmuch_message_get_thread_id_only (message));
+    }
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
 notmuch_status_t
 notmuch_query_count_threads (notmuch_query_t *query, unsigned *count)
 {
@@ -687,6 +1422,15 @@ notmuch_query_count_threads (notmuch_query_t *query, unsigned *count)
     notmuch_sort_t sort;
     notmuch_status_t ret = NOTMUCH_STATUS_SUCCESS;
 
+    if (query->notmuch->features & NOTMUCH_FEATURE_THREAD_ID_VALUES) {
+	Xapian::MSet mset;
+
+	ret = _notmuch_query_collapse_threads (query, mset);
+	if (ret == NOTMUCH_STATUS_SUCCESS)
+	    *count = mset.size ();
+	return ret;
+    }
+
     sort = query->sort;
     query->sort = NOTMUCH_SORT_UNSORTED;
     ret = notmuch_query_search_messages (query, &messages);
@@ -725,6 +1469,180 @@ notmuch_query_count_threads (notmuch_query_t *query, unsigned *count)
     return ret;
 }
 
+/* Number of documents retagged by notmuch_query_apply_tag_ops
+ * between commits. */
+#define NOTMUCH_TAG_BATCH_SIZE 1000
+
+/* Give the document 'doc_id' the tags resulting from the given
+ * changes, writing it back only if they differ from its current
+ * tags.  Only the tag terms and the last modification value are
+ * touched. */
+static void
+_notmuch_retag_document (notmuch_database_t *notmuch,
+			 Xapian::WritableDatabase *db,
+			 Xapian::docid doc_id,
+			 const std::string &tag_prefix,
+			 const std::set<std::string> &add_terms,
+			 const std::set<std::string> &remove_terms,
+			 bool remove_all,
+			 const std::string &last_mod)
+{
+    Xapian::Document doc = db->get_document (doc_id);
+    std::set<std::string> old_terms, new_terms;
+    std::set<std::string>::const_iterator it;
+    Xapian::TermIterator i;
+
+    i = doc.termlist_begin ();
+    for (i.skip_to (tag_prefix);
+	 i != doc.termlist_end () &&
+	     (*i).compare (0, tag_prefix.length (), tag_prefix) == 0;
+	 i++)
+	old_terms.insert (*i);
+
+    if (! remove_all)
+	new_terms = old_terms;
+    for (it = remove_terms.begin (); it != remove_terms.end (); ++it)
+	new_terms.erase (*it);
+    new_terms.insert (add_terms.begin (), add_terms.end ());
+
+    if (new_terms == old_terms)
+	return;
+
+    for (it = old_terms.begin (); it != old_terms.end (); ++it)
+	if (! new_terms.count (*it))
+	    doc.remove_term (*it);
+    for (it = new_terms.begin (); it != new_terms.end (); ++it)
+	if (! old_terms.count (*it))
+	    doc.add_term (*it, 0);
+
+    if (! last_mod.empty ())
+	doc.add_value (NOTMUCH_VALUE_LAST_MOD, last_mod);
+
+    db->replace_document (doc_id, doc);
+
+    if (notmuch->dirty_thread_summaries) {
+	const std::string thread_prefix = _find_prefix ("thread");
+
+	i = doc.termlist_begin ();
+	i.skip_to (thread_prefix);
+	if (i != doc.termlist_end () &&
+	    (*i).compare (0, thread_prefix.length (), thread_prefix) == 0)
+	    _notmuch_database_thread_changed (notmuch,
+					      (*i).c_str () + thread_prefix.length ());
+    }
+}
+
+/* Collect the tag terms for the NULL-terminated array 'tags'. */
+static notmuch_status_t
+_notmuch_tag_terms (const char **tags, const std::string &tag_prefix,
+		    std::set<std::string> &terms)
+{
+    if (tags == NULL)
+	return NOTMUCH_STATUS_SUCCESS;
+
+    for (; *tags; tags++) {
+	if (strlen (*tags) > NOTMUCH_TAG_MAX)
+	    return NOTMUCH_STATUS_TAG_TOO_LONG;
+	terms.insert (tag_prefix + *tags);
+    }
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_status_t
+notmuch_query_apply_tag_ops (notmuch_query_t *query,
+			     const char **add_tags,
+			     const char **remove_tags,
+			     notmuch_bool_t remove_all)
+{
+    notmuch_database_t *notmuch = query->notmuch;
+    const std::string tag_prefix = _find_prefix ("tag");
+    std::set<std::string> add_terms, remove_terms;
+    Xapian::WritableDatabase *db;
+    notmuch_status_t status;
+    bool in_atomic = false;
+
+    status = _notmuch_database_ensure_writable (notmuch);
+    if (status)
+	return status;
+
+    status = _notmuch_tag_terms (add_tags, tag_prefix, add_terms);
+    if (! status)
+	status = _notmuch_tag_terms (remove_tags, tag_prefix, remove_terms);
+    if (status)
+	return status;
+
+    status = _notmuch_query_ensure_parsed (query);
+    if (status)
+	return status;
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+
+    try {
+	Xapian::Query final_query = _notmuch_query_match_query (query, "mail");
+	Xapian::Enquire enquire (*notmuch->xapian_db);
+	Xapian::MSet mset;
+	Xapian::MSetIterator i;
+	unsigned int count = 0;
+	std::string last_mod;
+
+	/* Walk the matches in document order, which keeps the
+	 * changes of a batch close together in the database. */
+	enquire.set_weighting_scheme (Xapian::BoolWeight ());
+	enquire.set_docid_order (Xapian::Enquire::ASCENDING);
+	enquire.set_query (final_query);
+
+	if (_debug_query ()) {
+	    fprintf (stderr, "Final query is:\n%s\n",
+		     final_query.get_description ().c_str ());
+	}
+
+	mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+
+	for (i = mset.begin (); i != mset.end (); ++i) {
+	    if (! in_atomic) {
+		status = notmuch_database_begin_atomic (notmuch);
+		if (status)
+		    return status;
+		in_atomic = true;
+
+		/* All the changes of an atomic section get the same
+		 * revision. */
+		if (notmuch->features & NOTMUCH_FEATURE_LAST_MOD)
+		    last_mod = Xapian::sortable_serialise (
+			_notmuch_database_new_revision (notmuch));
+	    }
+
+	    _notmuch_retag_document (notmuch, db, *i, tag_prefix, add_terms,
+				     remove_terms, remove_all, last_mod);
+
+	    if (++count % NOTMUCH_TAG_BATCH_SIZE == 0) {
+		in_atomic = false;
+		status = notmuch_database_end_atomic (notmuch);
+		if (status)
+		    return status;
+	    }
+	}
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch,
+			       "A Xapian exception occurred applying tags: %s\n",
+			       error.get_msg ().c_str ());
+	_notmuch_database_log_append (notmuch,
+				      "Query string was: %s\n",
+				      query->query_string);
+	notmuch->exception_reported = true;
+	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    if (in_atomic) {
+	notmuch_status_t end_status = notmuch_database_end_atomic (notmuch);
+	if (! status)
+	    status = end_status;
+    }
+
+    return status;
+}
+
 notmuch_database_t *
 notmuch_query_get_database (const notmuch_query_t *query)
 {
@@ -26,6 +26,67 @@
 #include "notmuch-private.h"
 #include "database-private.h"
 
+#include <algorithm>
+
+const char *
+_notmuch_trigram_prefix (Xapian::valueno slot)
+{
+    switch (slot) {
+    case NOTMUCH_VALUE_FROM:
+	return _find_prefix ("from-trigram");
+    case NOTMUCH_VALUE_SUBJECT:
+	return _find_prefix ("subject-trigram");
+    case NOTMUCH_VALUE_MESSAGE_ID:
+	return _find_prefix ("mid-trigram");
+    default:
+	return NULL;
+    }
+}
+
+void
+_notmuch_trigram_terms (const char *prefix, const std::string &str,
+			std::set<std::string> &terms)
+{
+    size_t i;
+
+    for (i = 0; i + 3 <= str.size (); i++)
+	terms.insert (prefix + str.substr (i, 3));
+}
+
+void
+_notmuch_document_set_regexp_value (notmuch_database_t *notmuch,
+				    Xapian::Document &doc,
+				    Xapian::valueno slot,
+				    const std::string &value)
+{
+    const char *prefix = _notmuch_trigram_prefix (slot);
+
+    if (prefix && (notmuch->features & NOTMUCH_FEATURE_REGEXP_TRIGRAMS)) {
+	std::set<std::string> old_terms, new_terms;
+	std::set<std::string>::iterator it;
+
+	_notmuch_trigram_terms (prefix, doc.get_value (slot), old_terms);
+	_notmuch_trigram_terms (prefix, value, new_terms);
+
+	for (it = old_terms.begin (); it != old_terms.end (); ++it) {
+	    if (new_terms.count (*it))
+		continue;
+	    try {
+		doc.remove_term (*it);
+	    } catch (const Xapian::InvalidArgumentError &error) {
+		/* The trigrams of the previous value may never have
+		 * been added, e.g. for ghost messages of an upgraded
+		 * database. */
+	    }
+	}
+
+	for (it = new_terms.begin (); it != new_terms.end (); ++it)
+	    doc.add_term (*it, 0);
+    }
+
+    doc.add_value (slot, value);
+}
+
 #if HAVE_XAPIAN_FIELD_PROCESSOR
 static void
 compile_regex (regex_t &regexp, const char *str)
@@ -44,8 +105,9 @@ compile_regex (regex_t &regexp, const char *str)
     }
 }
 
-RegexpPostingSource::RegexpPostingSource (Xapian::valueno slot, const std::string &regexp)
-    : slot_ (slot)
+RegexpPostingSource::RegexpPostingSource (Xapian::valueno slot, const std::string &regexp,
+					  const std::vector<std::string> &terms)
+    : slot_ (slot), terms_ (terms)
 {
     compile_regex (regexp_, regexp.c_str ());
 }
@@ -62,6 +124,55 @@ RegexpPostingSource::init (const Xapian::Database &db)
     it_ = db_.valuestream_begin (slot_);
     end_ = db.valuestream_end (slot_);
     started_ = false;
+
+    postings_.clear ();
+    for (size_t i = 0; i < terms_.size (); i++)
+	postings_.push_back (db_.postlist_begin (terms_[i]));
+    docid_ = 0;
+    at_end_ = false;
+}
+
+/* Test if the value of document 'did' matches the regexp, when
+ * looking at documents in increasing order. */
+bool
+RegexpPostingSource::value_matches (Xapian::docid did)
+{
+    if (it_ == end_)
+	return false;
+
+    it_.skip_to (did);
+    return (it_ != end_ && it_.get_docid () == did &&
+	    regexec (&regexp_, (*it_).c_str (), 0, NULL, 0) == 0);
+}
+
+/* Move to the first document from 'did' on that has all of terms_
+ * and a value matching the regexp. */
+void
+RegexpPostingSource::find_match (Xapian::docid did)
+{
+    size_t i;
+
+    for (;;) {
+	for (i = 0; i < postings_.size (); i++) {
+	    postings_[i].skip_to (did);
+	    if (postings_[i] == db_.postlist_end (terms_[i])) {
+		at_end_ = true;
+		return;
+	    }
+	    if (*postings_[i] > did) {
+		did = *postings_[i];
+		break;
+	    }
+	}
+
+	if (i == postings_.size ()) {
+	    if (value_matches (did)) {
+		docid_ = did;
+		return;
+	    }
+	    did++;
+	}
+    }
 }
 
 Xapian::doccount
@@ -79,24 +190,41 @@ RegexpPostingSource::get_termfreq_est () const
 Xapian::doccount
 RegexpPostingSource::get_termfreq_max () const
 {
-    return db_.get_value_freq (slot_);
+    Xapian::doccount max = db_.get_value_freq (slot_);
+
+    for (size_t i = 0; i < terms_.size (); i++)
+	max = std::min (max, db_.get_termfreq (terms_[i]));
+
+    return max;
 }
 
 Xapian::docid
 RegexpPostingSource::get_docid () const
 {
+    if (! terms_.empty ())
+	return docid_;
+
     return it_.get_docid ();
 }
 
 bool
 RegexpPostingSource::at_end () const
 {
+    if (! terms_.empty ())
+	return at_end_;
+
     return it_ == end_;
 }
 
 void
 RegexpPostingSource::next (unused (double min_wt))
 {
+    if (! terms_.empty ()) {
+	find_match (started_ ? docid_ + 1 : 1);
+	started_ = true;
+	return;
+    }
+
     if (started_ && ! at_end ())
 	++it_;
     started_ = true;
@@ -111,6 +239,13 @@ RegexpPostingSource::next (unused (double min_wt))
 void
 RegexpPostingSource::skip_to (Xapian::docid did, unused (double min_wt))
 {
+    if (! terms_.empty ()) {
+	if (! started_ || did > docid_)
+	    find_match (did);
+	started_ = true;
+	return;
+    }
+
     started_ = true;
     it_.skip_to (did);
     for (; ! at_end (); ++it_) {
@@ -121,14 +256,170 @@ RegexpPostingSource::skip_to (Xapian::docid did, unused (double min_wt))
 }
 
 bool
-RegexpPostingSource::check (Xapian::docid did, unused (double min_wt))
+RegexpPostingSource::check (Xapian::docid did, double min_wt)
 {
+    if (! terms_.empty ()) {
+	skip_to (did, min_wt);
+	return true;
+    }
+
     started_ = true;
     if (!it_.check (did) || at_end ())
 	return false;
     return (regexec (&regexp_, (*it_).c_str (), 0, NULL, 0) == 0);
 }
 
+/* Return the index just past the bracket expression starting at
+ * regexp[i]. */
+static size_t
+_skip_bracket (const std::string &regexp, size_t i)
+{
+    size_t j = i + 1;
+
+    if (j < regexp.size () && regexp[j] == '^')
+	j++;
+    if (j < regexp.size () && regexp[j] == ']')
+	j++;
+
+    while (j < regexp.size () && regexp[j] != ']') {
+	if (regexp[j] == '[' && j + 1 < regexp.size () &&
+	    (regexp[j + 1] == ':' || regexp[j + 1] == '.' || regexp[j + 1] == '=')) {
+	    /* A character class such as [:alpha:] */
+	    std::string close = std::string (1, regexp[j + 1]) + "]";
+	    size_t end = regexp.find (close, j + 2);
+	    j = (end == std::string::npos) ? regexp.size () : end + 2;
+	} else {
+	    j++;
+	}
+    }
+
+    return j < regexp.size () ? j + 1 : j;
+}
+
+/* Return the index just past the group starting at regexp[i]. */
+static size_t
+_skip_group (const std::string &regexp, size_t i)
+{
+    int depth = 0;
+    size_t j = i;
+
+    while (j < regexp.size ()) {
+	if (regexp[j] == '\\') {
+	    j += 2;
+	} else if (regexp[j] == '[') {
+	    j = _skip_bracket (regexp, j);
+	} else {
+	    if (regexp[j] == '(')
+		depth++;
+	    else if (regexp[j] == ')' && --depth == 0)
+		return j + 1;
+	    j++;
+	}
+    }
+
+    return j;
+}
+
+/* Remove the last (possibly multibyte UTF-8) character of 'run'. */
+static void
+_drop_last_char (std::string &run)
+{
+    while (! run.empty () && (run[run.size () - 1] & 0xc0) == 0x80)
+	run.erase (run.size () - 1);
+    if (! run.empty ())
+	run.erase (run.size () - 1);
+}
+
+/* Find, for each top-level alternative of the extended regular
+ * expression 'regexp', the trigram terms (with 'prefix') that any
+ * string it matches must contain.  This only looks at runs of
+ * literal characters, skipping anything more complex (bracket
+ * expressions, groups, back-references, ...), so the trigrams found
+ * are necessary but not sufficient for a match.
+ *
+ * Returns false if some alternative has no such trigram, so that
+ * candidates cannot be narrowed down. */
+static bool
+_regexp_required_trigrams (const std::string &regexp, const char *prefix,
+			   std::vector<std::vector<std::string> > &alternatives)
+{
+    std::set<std::string> terms;
+    std::string run;
+    size_t i = 0;
+
+    alternatives.clear ();
+
+    for (;;) {
+	char c = i < regexp.size () ? regexp[i] : '|';
+
+	switch (c) {
+	case '|':
+	    _notmuch_trigram_terms (prefix, run, terms);
+	    run.clear ();
+	    if (terms.empty ())
+		return false;
+	    alternatives.push_back (std::vector<std::string> (terms.begin (), terms.end ()));
+	    terms.clear ();
+	    if (i >= regexp.size ())
+		return true;
+	    i++;
+	    continue;
+	case '\\':
+	    /* An escaped letter or digit may be special (e.g. \w or
+	     * \1), anything else stands for itself. */
+	    if (i + 1 < regexp.size () && ! isalnum ((unsigned char) regexp[i + 1])) {
+		run += regexp[i + 1];
+	    } else {
+		_notmuch_trigram_terms (prefix, run, terms);
+		run.clear ();
+	    }
+	    i += 2;
+	    continue;
+	case '[':
+	    _notmuch_trigram_terms (prefix, run, terms);
+	    run.clear ();
+	    i = _skip_bracket (regexp, i);
+	    continue;
+	case '(':
+	    _notmuch_trigram_terms (prefix, run, terms);
+	    run.clear ();
+	    i = _skip_group (regexp, i);
+	    continue;
+	case '{':
+	    if (i + 1 >= regexp.size () || ! isdigit ((unsigned char) regexp[i + 1])) {
+		run += c;
+		i++;
+		continue;
+	    }
+	    /* An interval may allow zero repetitions, so it is
+	     * treated like '*'. */
+	    i = regexp.find ('}', i);
+	    if (i == std::string::npos)
+		i = regexp.size ();
+	    /* fall through */
+	case '*':
+	case '?':
+	    _drop_last_char (run);
+	    _notmuch_trigram_terms (prefix, run, terms);
+	    run.clear ();
+	    break;
+	case '+':
+	case '.':
+	case '^':
+	case '$':
+	case ')':
+	    _notmuch_trigram_terms (prefix, run, terms);
+	    run.clear ();
+	    break;
+	default:
+	    run += c;
+	    break;
+	}
+	if (i < regexp.size ())
+	    i++;
+    }
+}
+
 static inline Xapian::valueno _find_slot (std::string prefix)
 {
     if (prefix == "from")
@@ -170,6 +461,26 @@ RegexpFieldProcessor::operator() (const std::string & str)
 	if (str.length() > 1 && str.at (str.size () - 1) == '/'){
 	    std::string regexp_str = str.substr(1,str.size () - 2);
 	    if (slot != Xapian::BAD_VALUENO) {
+		std::vector<std::vector<std::string> > alternatives;
+
+		/* With trigram terms in the database, only look at the
+		 * values of the documents that have the trigrams of
+		 * one of the alternatives. */
+		if ((notmuch->features & NOTMUCH_FEATURE_REGEXP_TRIGRAMS) &&
+		    _regexp_required_trigrams (regexp_str,
+					       _notmuch_trigram_prefix (slot),
+					       alternatives)) {
+		    std::vector<Xapian::Query> queries;
+
+		    for (size_t i = 0; i < alternatives.size (); i++) {
+			RegexpPostingSource *postings =
+			    new RegexpPostingSource (slot, regexp_str, alternatives[i]);
+			queries.push_back (Xapian::Query (postings->release ()));
+		    }
+		    return Xapian::Query (Xapian::Query::OP_OR,
+					  queries.begin (), queries.end ());
+		}
+
 		RegexpPostingSource *postings = new RegexpPostingSource (slot, regexp_str);
 		return Xapian::Query (postings->release ());
 	    } else {
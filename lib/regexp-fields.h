@@ -32,6 +32,10 @@
 
 /* A posting source that returns documents where a value matches a
  * regexp.
+ *
+ * If 'terms' are given, only documents with all of them are
+ * considered; these are found by intersecting the posting lists of
+ * the terms rather than by scanning every value.
  */
 class RegexpPostingSource : public Xapian::PostingSource
 {
@@ -42,12 +46,21 @@ class RegexpPostingSource : public Xapian::PostingSource
     bool started_;
     Xapian::ValueIterator it_, end_;
 
+    const std::vector<std::string> terms_;
+    std::vector<Xapian::PostingIterator> postings_;
+    Xapian::docid docid_;
+    bool at_end_;
+
+    bool value_matches (Xapian::docid did);
+    void find_match (Xapian::docid did);
+
 /* No copying */
     RegexpPostingSource (const RegexpPostingSource &);
     RegexpPostingSource &operator= (const RegexpPostingSource &);
 
  public:
-    RegexpPostingSource (Xapian::valueno slot, const std::string &regexp);
+    RegexpPostingSource (Xapian::valueno slot, const std::string &regexp,
+			 const std::vector<std::string> &terms = std::vector<std::string> ());
     ~RegexpPostingSource ();
     void init (const Xapian::Database &db);
     Xapian::doccount get_termfreq_min () const;
@@ -57,7 +70,7 @@ class RegexpPostingSource : public Xapian::PostingSource
     bool at_end () const;
     void next (unused (double min_wt));
     void skip_to (Xapian::docid did, unused (double min_wt));
-    bool check (Xapian::docid did, unused (double min_wt));
+    bool check (Xapian::docid did, double min_wt);
 };
 
 
@@ -26,6 +26,38 @@
 
 #if HAVE_XAPIAN_FIELD_PROCESSOR
 
+static void
+_thread_subquery_free (gpointer data)
+{
+    delete static_cast <Xapian::Query *> (data);
+}
+
+/* Return the cache of thread:{subquery} queries, emptied if the
+ * database changed since they were evaluated, either by this process
+ * (a new revision) or by another one (a new view).  Returns NULL if
+ * changes can't be detected, i.e. without revisions or with
+ * uncommitted changes in an atomic section. */
+static GHashTable *
+_thread_subquery_cache (notmuch_database_t *notmuch)
+{
+    if (! (notmuch->features & NOTMUCH_FEATURE_LAST_MOD) ||
+	notmuch->atomic_dirty)
+	return NULL;
+
+    if (notmuch->thread_subqueries == NULL) {
+	notmuch->thread_subqueries = g_hash_table_new_full (g_str_hash, g_str_equal,
+							    g_free,
+							    _thread_subquery_free);
+    } else if (notmuch->thread_subqueries_view != notmuch->view ||
+	       notmuch->thread_subqueries_revision != notmuch->revision) {
+	g_hash_table_remove_all (notmuch->thread_subqueries);
+    }
+    notmuch->thread_subqueries_view = notmuch->view;
+    notmuch->thread_subqueries_revision = notmuch->revision;
+
+    return notmuch->thread_subqueries;
+}
+
 Xapian::Query
 ThreadFieldProcessor::operator() (const std::string & str)
 {
@@ -37,29 +69,57 @@ ThreadFieldProcessor::operator() (const std::string & str)
 	    throw Xapian::QueryParserError ("missing } in '" + str + "'");
 	} else {
 	    std::string subquery_str = str.substr (1, str.size () - 2);
-	    notmuch_query_t *subquery = notmuch_query_create (notmuch, subquery_str.c_str ());
-	    notmuch_messages_t *messages;
-	    std::set<std::string> terms;
+	    GHashTable *cache = _thread_subquery_cache (notmuch);
+	    Xapian::Query *cached = NULL;
+	    notmuch_query_t *subquery;
+	    std::set<std::string> thread_ids;
+	    std::vector<std::string> terms;
+
+	    if (cache)
+		cached = static_cast <Xapian::Query *> (
+		    g_hash_table_lookup (cache, subquery_str.c_str ()));
+	    if (cached)
+		return *cached;
 
+	    subquery = notmuch_query_create (notmuch, subquery_str.c_str ());
 	    if (! subquery)
 		throw Xapian::QueryParserError ("failed to create subquery for '" + subquery_str + "'");
 
-	    status = notmuch_query_search_messages (subquery, &messages);
+	    status = _notmuch_query_get_thread_ids (subquery, thread_ids);
+	    notmuch_query_destroy (subquery);
 	    if (status)
 		throw Xapian::QueryParserError ("failed to search messages for '" + subquery_str + "'");
 
-	    for (; notmuch_messages_valid (messages); notmuch_messages_move_to_next (messages)) {
-		std::string term = thread_prefix;
-		notmuch_message_t *message;
-		message = notmuch_messages_get (messages);
-		term += _notmuch_message_get_thread_id_only (message);
-		terms.insert (term);
-	    }
-	    return Xapian::Query (Xapian::Query::OP_OR, terms.begin (), terms.end ());
+	    for (std::set<std::string>::iterator it = thread_ids.begin ();
+		 it != thread_ids.end (); ++it)
+		terms.push_back (thread_prefix + *it);
+
+	    Xapian::Query query (Xapian::Query::OP_OR, terms.begin (), terms.end ());
+
+	    /* Evaluating the subquery may have changed the cache
+	     * (through nested subqueries), so look it up again. */
+	    cache = _thread_subquery_cache (notmuch);
+	    if (cache &&
+		_notmuch_query_string_cacheable (subquery_str.c_str ()))
+		g_hash_table_insert (cache, g_strdup (subquery_str.c_str ()),
+				     new Xapian::Query (query));
+
+	    return query;
 	}
     } else {
 	/* literal thread id */
 	std::string term = thread_prefix + str;
+
+	/* The thread may have been merged into another one since its
+	 * ID was obtained. */
+	if (! notmuch->xapian_db->term_exists (term)) {
+	    void *local = talloc_new (notmuch);
+
+	    term = thread_prefix;
+	    term += _notmuch_database_resolve_thread_alias (notmuch, local,
+							    str.c_str ());
+	    talloc_free (local);
+	}
 	return Xapian::Query (term);
     }
 
@@ -32,6 +32,17 @@
 
 #define EMPTY_STRING(s) ((s)[0] == '\0')
 
+#define ARRAY_SIZE(arr) (sizeof (arr) / sizeof (arr[0]))
+
+/* A slot of the table of the messages of a thread, keyed by message
+ * ID.  The key is the message's own message ID, hashed once when the
+ * message is added. */
+typedef struct {
+    const char *message_id;
+    unsigned int hash;
+    notmuch_message_t *message;
+} thread_message_slot_t;
+
 struct _notmuch_thread {
     notmuch_database_t *notmuch;
     char *thread_id;
@@ -48,7 +59,12 @@ struct _notmuch_thread {
     /* Top-level messages, oldest first. */
     notmuch_message_list_t *toplevel_list;
 
-    GHashTable *message_hash;
+    /* Open-addressing table of all messages, with linear probing.
+     * The size is a power of two, and at most half of the slots are
+     * used. */
+    thread_message_slot_t *message_slots;
+    unsigned int message_slots_size;
+    unsigned int message_slots_used;
     int total_messages;
     int total_files;
     int matched_messages;
@@ -62,7 +78,6 @@ _notmuch_thread_destructor (notmuch_thread_t *thread)
     g_hash_table_unref (thread->authors_hash);
     g_hash_table_unref (thread->matched_authors_hash);
     g_hash_table_unref (thread->tags);
-    g_hash_table_unref (thread->message_hash);
 
     if (thread->authors_array) {
 	g_ptr_array_free (thread->authors_array, true);
@@ -231,12 +246,88 @@ _thread_cleanup_author (notmuch_thread_t *thread,
     return clean_author;
 }
 
+/* Return the slot for 'message_id' (with hash 'hash') in 'slots', of
+ * 'size' slots: either the slot holding it, or the empty slot where
+ * it belongs. */
+static thread_message_slot_t *
+_thread_message_slot (thread_message_slot_t *slots, unsigned int size,
+		      const char *message_id, unsigned int hash)
+{
+    unsigned int i = hash & (size - 1);
+
+    while (slots[i].message_id &&
+	   (slots[i].hash != hash || strcmp (slots[i].message_id, message_id)))
+	i = (i + 1) & (size - 1);
+
+    return &slots[i];
+}
+
+/* Return the message of 'thread' with 'message_id', or NULL. */
+static notmuch_message_t *
+_thread_find_message (notmuch_thread_t *thread, const char *message_id)
+{
+    if (thread->message_slots_used == 0)
+	return NULL;
+
+    return _thread_message_slot (thread->message_slots,
+				 thread->message_slots_size,
+				 message_id, g_str_hash (message_id))->message;
+}
+
+/* Add 'message' to the message table of 'thread', replacing any
+ * message with the same ID. */
+static void
+_thread_insert_message (notmuch_thread_t *thread, notmuch_message_t *message)
+{
+    const char *message_id = notmuch_message_get_message_id (message);
+    unsigned int hash = g_str_hash (message_id);
+    thread_message_slot_t *slot;
+
+    if (2 * (thread->message_slots_used + 1) > thread->message_slots_size) {
+	unsigned int size = thread->message_slots_size ? 2 * thread->message_slots_size : 16;
+	thread_message_slot_t *slots = talloc_zero_array (thread, thread_message_slot_t, size);
+	unsigned int i;
+
+	/* Without a free slot left, the message can't be found as a
+	 * parent. */
+	if (unlikely (slots == NULL)) {
+	    if (thread->message_slots_used + 1 >= thread->message_slots_size)
+		return;
+	    goto INSERT;
+	}
+
+	for (i = 0; i < thread->message_slots_size; i++) {
+	    thread_message_slot_t *old = &thread->message_slots[i];
+
+	    if (old->message_id)
+		*_thread_message_slot (slots, size, old->message_id, old->hash) = *old;
+	}
+
+	talloc_free (thread->message_slots);
+	thread->message_slots = slots;
+	thread->message_slots_size = size;
+    }
+
+  INSERT:
+    slot = _thread_message_slot (thread->message_slots,
+				 thread->message_slots_size,
+				 message_id, hash);
+    if (! slot->message_id) {
+	slot->message_id = message_id;
+	slot->hash = hash;
+	thread->message_slots_used++;
+    }
+    slot->message = message;
+}
+
 /* Add 'message' as a message that belongs to 'thread'.
  *
  * The 'thread' will talloc_steal the 'message' and hold onto a
  * reference to it.
+ *
+ * Returns false if the message is excluded and omitted instead.
  */
-static void
+static bool
 _thread_add_message (notmuch_thread_t *thread,
 		     notmuch_message_t *message,
 		     notmuch_string_list_t *exclude_terms,
@@ -271,16 +362,14 @@ _thread_add_message (notmuch_thread_t *thread,
     }
 
     if (message_excluded && omit_exclude == NOTMUCH_EXCLUDE_ALL)
-	return;
+	return false;
 
     _notmuch_message_list_add_message (thread->message_list,
 				       talloc_steal (thread, message));
     thread->total_messages++;
     thread->total_files += notmuch_message_count_files (message);
 
-    g_hash_table_insert (thread->message_hash,
-			 xstrdup (notmuch_message_get_message_id (message)),
-			 message);
+    _thread_insert_message (thread, message);
 
     from = notmuch_message_get_header (message, "from");
     if (from)
@@ -320,6 +409,8 @@ _thread_add_message (notmuch_thread_t *thread,
     /* Mark excluded messages. */
     if (message_excluded)
 	notmuch_message_set_flag (message, NOTMUCH_MESSAGE_FLAG_EXCLUDED, true);
+
+    return true;
 }
 
 static void
@@ -354,7 +445,8 @@ _thread_set_subject_from_message (notmuch_thread_t *thread,
 }
 
 /* Add a message to this thread which is known to match the original
- * search specification. The 'sort' parameter controls whether the
+ * search specification, and which was added to the thread by
+ * _thread_add_message. The 'sort' parameter controls whether the
  * oldest or newest matching subject is applied to the thread as a
  * whole. */
 static void
@@ -363,7 +455,6 @@ _thread_add_matched_message (notmuch_thread_t *thread,
 			     notmuch_sort_t sort)
 {
     time_t date;
-    notmuch_message_t *hashed_message;
 
     date = notmuch_message_get_date (message);
 
@@ -383,14 +474,9 @@ _thread_add_matched_message (notmuch_thread_t *thread,
     if (!notmuch_message_get_flag (message, NOTMUCH_MESSAGE_FLAG_EXCLUDED))
 	thread->matched_messages++;
 
-    if (g_hash_table_lookup_extended (thread->message_hash,
-			    notmuch_message_get_message_id (message), NULL,
-			    (void **) &hashed_message)) {
-	notmuch_message_set_flag (hashed_message,
-				  NOTMUCH_MESSAGE_FLAG_MATCH, 1);
-    }
+    notmuch_message_set_flag (message, NOTMUCH_MESSAGE_FLAG_MATCH, 1);
 
-    _thread_add_matched_author (thread, _notmuch_message_get_author (hashed_message));
+    _thread_add_matched_author (thread, _notmuch_message_get_author (message));
 }
 
 static bool
@@ -403,9 +489,7 @@ _parent_via_in_reply_to (notmuch_thread_t *thread, notmuch_message_t *message) {
 		 notmuch_message_get_message_id (message), in_reply_to);
 
     if (in_reply_to && (! EMPTY_STRING(in_reply_to)) &&
-	g_hash_table_lookup_extended (thread->message_hash,
-				      in_reply_to, NULL,
-				      (void **) &parent)) {
+	(parent = _thread_find_message (thread, in_reply_to))) {
 	_notmuch_message_add_reply (parent, message);
 	return true;
     } else {
@@ -428,9 +512,7 @@ _parent_or_toplevel (notmuch_thread_t *thread, notmuch_message_t *message)
     for (notmuch_string_node_t *ref_node = references->head;
 	 ref_node; ref_node = ref_node->next) {
 	THREAD_DEBUG("checking reference=%s\n", ref_node->string);
-	if ((g_hash_table_lookup_extended (thread->message_hash,
-					   ref_node->string, NULL,
-					   (void **) &new_parent))) {
+	if ((new_parent = _thread_find_message (thread, ref_node->string))) {
 	    size_t new_depth = _notmuch_message_get_thread_depth (new_parent);
 	    THREAD_DEBUG("got depth %lu\n", new_depth);
 	    if (new_depth > max_depth || !parent) {
@@ -519,59 +601,18 @@ _resolve_thread_relationships (notmuch_thread_t *thread)
     talloc_free (local);
 }
 
-/* Create a new notmuch_thread_t object by finding the thread
- * containing the message with the given doc ID, treating any messages
- * contained in match_set as "matched".  Remove all messages in the
- * thread from match_set.
- *
- * Creating the thread will perform a database search to get all
- * messages belonging to the thread and will get the first subject
- * line, the total count of messages, and all authors in the thread.
- * Each message in the thread is checked against match_set to allow
- * for a separate count of matched messages, and to allow a viewer to
- * display these messages differently.
- *
- * Here, 'ctx' is talloc context for the resulting thread object.
- *
- * This function returns NULL in the case of any error.
- */
-notmuch_thread_t *
-_notmuch_thread_create (void *ctx,
-			notmuch_database_t *notmuch,
-			unsigned int seed_doc_id,
-			notmuch_doc_id_set_t *match_set,
-			notmuch_string_list_t *exclude_terms,
-			notmuch_exclude_t omit_excluded,
-			notmuch_sort_t sort)
+/* Allocate an empty notmuch_thread_t object for 'thread_id', with
+ * 'ctx' as its talloc context. Returns NULL if out of memory. */
+static notmuch_thread_t *
+_thread_new (void *ctx,
+	     notmuch_database_t *notmuch,
+	     const char *thread_id)
 {
-    void *local = talloc_new (ctx);
-    notmuch_thread_t *thread = NULL;
-    notmuch_message_t *seed_message;
-    const char *thread_id;
-    char *thread_id_query_string;
-    notmuch_query_t *thread_id_query;
-
-    notmuch_messages_t *messages;
-    notmuch_message_t *message;
-    notmuch_status_t status;
-
-    seed_message = _notmuch_message_create (local, notmuch, seed_doc_id, NULL);
-    if (! seed_message)
-	INTERNAL_ERROR ("Thread seed message %u does not exist", seed_doc_id);
+    notmuch_thread_t *thread;
 
-    thread_id = notmuch_message_get_thread_id (seed_message);
-    thread_id_query_string = talloc_asprintf (local, "thread:%s", thread_id);
-    if (unlikely (thread_id_query_string == NULL))
-	goto DONE;
-
-    thread_id_query = talloc_steal (
-	local, notmuch_query_create (notmuch, thread_id_query_string));
-    if (unlikely (thread_id_query == NULL))
-	goto DONE;
-
-    thread = talloc (local, notmuch_thread_t);
+    thread = talloc (ctx, notmuch_thread_t);
     if (unlikely (thread == NULL))
-	goto DONE;
+	return NULL;
 
     talloc_set_destructor (thread, _notmuch_thread_destructor);
 
@@ -589,66 +630,487 @@ _notmuch_thread_create (void *ctx,
     thread->tags = g_hash_table_new_full (g_str_hash, g_str_equal,
 					  free, NULL);
 
+    thread->message_slots = NULL;
+    thread->message_slots_size = 0;
+    thread->message_slots_used = 0;
+
     thread->message_list = _notmuch_message_list_create (thread);
     thread->toplevel_list = _notmuch_message_list_create (thread);
-    if (unlikely (thread->message_list == NULL ||
+    if (unlikely (thread->thread_id == NULL ||
+		  thread->message_list == NULL ||
 		  thread->toplevel_list == NULL)) {
-	thread = NULL;
-	goto DONE;
+	talloc_free (thread);
+	return NULL;
     }
 
-    thread->message_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
-						  free, NULL);
-
     thread->total_messages = 0;
     thread->total_files = 0;
     thread->matched_messages = 0;
     thread->oldest = 0;
     thread->newest = 0;
 
-    /* We use oldest-first order unconditionally here to obtain the
-     * proper author ordering for the thread. The 'sort' parameter
-     * passed to this function is used only to indicate whether the
-     * oldest or newest subject is desired. */
-    notmuch_query_set_sort (thread_id_query, NOTMUCH_SORT_OLDEST_FIRST);
-
-    status = notmuch_query_search_messages (thread_id_query, &messages);
-    if (status)
-	goto DONE;
+    return thread;
+}
 
-    for (;
-	 notmuch_messages_valid (messages);
-	 notmuch_messages_move_to_next (messages))
-    {
-	unsigned int doc_id;
+/* Add 'message' to 'thread', treating it as "matched" if it is
+ * contained in match_set (and removing it from match_set). Messages
+ * must be added oldest first. */
+static void
+_thread_add_member (notmuch_thread_t *thread,
+		    notmuch_message_t *message,
+		    notmuch_doc_id_set_t *match_set,
+		    notmuch_string_list_t *exclude_terms,
+		    notmuch_exclude_t omit_excluded,
+		    notmuch_sort_t sort)
+{
+    unsigned int doc_id = _notmuch_message_get_doc_id (message);
 
-	message = notmuch_messages_get (messages);
-	doc_id = _notmuch_message_get_doc_id (message);
-	if (doc_id == seed_doc_id)
-	    message = seed_message;
+    bool added;
 
-	_thread_add_message (thread, message, exclude_terms, omit_excluded);
+    added = _thread_add_message (thread, message, exclude_terms, omit_excluded);
 
-	if ( _notmuch_doc_id_set_contains (match_set, doc_id)) {
-	    _notmuch_doc_id_set_remove (match_set, doc_id);
+    if (_notmuch_doc_id_set_contains (match_set, doc_id)) {
+	_notmuch_doc_id_set_remove (match_set, doc_id);
+	if (added)
 	    _thread_add_matched_message (thread, message, sort);
+    }
+
+    _notmuch_message_close (message);
+}
+
+/* Create a notmuch_thread_t object for each of the 'count' threads
+ * named in 'thread_ids', storing them in the corresponding elements
+ * of 'threads'. Any messages contained in match_set are treated as
+ * "matched", and are removed from match_set.
+ *
+ * All messages of all the threads are fetched by a single database
+ * search, so building the threads of a whole page of search results
+ * costs one pass over the thread terms rather than one query per
+ * thread. Each thread gets its first subject line, the total count
+ * of messages, and all of its authors. Each message is checked
+ * against match_set to allow for a separate count of matched
+ * messages, and to allow a viewer to display these messages
+ * differently.
+ *
+ * The messages of all the threads are held until they are all built,
+ * and then by their threads, so callers bound the number of messages
+ * rather than only the number of threads (see
+ * NOTMUCH_THREADS_MAX_BATCH_MESSAGES in query.cc).
+ *
+ * Here, 'ctx' is talloc context for the resulting thread objects.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: All threads were created.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Memory allocation failed.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred
+ *	searching for the messages of the threads.
+ *
+ * On error, every element of 'threads' is set to NULL.
+ */
+notmuch_status_t
+_notmuch_thread_create_batch (void *ctx,
+			      notmuch_database_t *notmuch,
+			      const char **thread_ids,
+			      unsigned int count,
+			      notmuch_doc_id_set_t *match_set,
+			      notmuch_string_list_t *exclude_terms,
+			      notmuch_exclude_t omit_excluded,
+			      notmuch_sort_t sort,
+			      notmuch_thread_t **threads)
+{
+    void *local = talloc_new (ctx);
+    GHashTable *thread_hash;
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+    unsigned int i;
+
+    thread_hash = g_hash_table_new (g_str_hash, g_str_equal);
+
+    for (i = 0; i < count; i++)
+	threads[i] = NULL;
+
+    for (i = 0; i < count; i++) {
+	threads[i] = _thread_new (local, notmuch, thread_ids[i]);
+	if (unlikely (threads[i] == NULL)) {
+	    status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+	    goto DONE;
 	}
+	g_hash_table_insert (thread_hash, threads[i]->thread_id, threads[i]);
+    }
+
+    try {
+	Xapian::Query mail_query (std::string (_find_prefix ("type")) + "mail");
+	std::vector<std::string> thread_terms;
+	Xapian::Enquire enquire (*notmuch->xapian_db);
+	Xapian::MSet mset;
+
+	for (i = 0; i < count; i++)
+	    thread_terms.push_back (std::string (_find_prefix ("thread")) +
+				    thread_ids[i]);
+
+	enquire.set_weighting_scheme (Xapian::BoolWeight ());
+	/* We use oldest-first order unconditionally here to obtain the
+	 * proper author ordering for each thread. The 'sort' parameter
+	 * passed to this function is used only to indicate whether the
+	 * oldest or newest subject is desired. */
+	enquire.set_sort_by_value (NOTMUCH_VALUE_TIMESTAMP, false);
+	enquire.set_query (Xapian::Query (Xapian::Query::OP_AND, mail_query,
+					  Xapian::Query (Xapian::Query::OP_OR,
+							 thread_terms.begin (),
+							 thread_terms.end ())));
+
+	mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+
+	for (Xapian::MSetIterator iter = mset.begin (); iter != mset.end (); iter++) {
+	    notmuch_private_status_t private_status;
+	    notmuch_message_t *message;
+	    notmuch_thread_t *thread;
+	    const char *thread_id;
+
+	    message = _notmuch_message_create (local, notmuch, *iter,
+					       &private_status);
+	    if (message == NULL) {
+		if (private_status == NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND)
+		    INTERNAL_ERROR ("a thread contains a non-existent document ID.\n");
+		status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+		goto DONE;
+	    }
 
-	_notmuch_message_close (message);
+	    thread_id = _notmuch_message_get_thread_id_only (message);
+	    thread = thread_id ? (notmuch_thread_t *)
+		g_hash_table_lookup (thread_hash, thread_id) : NULL;
+	    if (thread)
+		_thread_add_member (thread, message, match_set,
+				    exclude_terms, omit_excluded, sort);
+	}
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch,
+			       "A Xapian exception occurred building threads: %s\n",
+			       error.get_msg ().c_str ());
+	notmuch->exception_reported = true;
+	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+	goto DONE;
     }
 
-    _resolve_thread_authors_string (thread);
+    for (i = 0; i < count; i++) {
+	_resolve_thread_authors_string (threads[i]);
 
-    _resolve_thread_relationships (thread);
+	_resolve_thread_relationships (threads[i]);
 
-    /* Commit to returning thread. */
-    (void) talloc_steal (ctx, thread);
+	/* Commit to returning thread. */
+	(void) talloc_steal (ctx, threads[i]);
+    }
 
   DONE:
+    if (status) {
+	for (i = 0; i < count; i++)
+	    threads[i] = NULL;
+    }
+
+    g_hash_table_unref (thread_hash);
     talloc_free (local);
+    return status;
+}
+
+/* Thread summaries
+ *
+ * The data of a thread summary document (see database.cc) is a list
+ * of fields, each terminated by a NUL byte, in the order of the
+ * following enum.  The remaining fields are the tags of the thread.
+ */
+enum {
+    SUMMARY_VERSION,
+    SUMMARY_DOC_COUNT,
+    SUMMARY_REVISION,
+    SUMMARY_TOTAL_MESSAGES,
+    SUMMARY_TOTAL_FILES,
+    SUMMARY_OLDEST,
+    SUMMARY_NEWEST,
+    SUMMARY_AUTHORS,
+    SUMMARY_SUBJECT_OLDEST_FIRST,
+    SUMMARY_SUBJECT_NEWEST_FIRST,
+    SUMMARY_TAGS,
+};
+
+#define SUMMARY_FORMAT_VERSION "1"
+
+/* Find the number of documents (mail and ghost) of the thread
+ * 'thread_id', and the highest revision among them.  Any change to
+ * the thread either adds a document, removes one, or gives one a new
+ * revision, so these two numbers tell whether a summary is still up
+ * to date.  Only the thread's posting list and the LAST_MOD value
+ * stream are read. */
+static void
+_thread_get_fingerprint (notmuch_database_t *notmuch,
+			 const char *thread_id,
+			 Xapian::doccount *doc_count,
+			 unsigned long *revision)
+{
+    const std::string term = std::string (_find_prefix ("thread")) + thread_id;
+    Xapian::PostingIterator p, p_end;
+    Xapian::ValueIterator v, v_end;
+
+    *doc_count = 0;
+    *revision = 0;
+
+    v = notmuch->xapian_db->valuestream_begin (NOTMUCH_VALUE_LAST_MOD);
+    v_end = notmuch->xapian_db->valuestream_end (NOTMUCH_VALUE_LAST_MOD);
+    p_end = notmuch->xapian_db->postlist_end (term);
+    for (p = notmuch->xapian_db->postlist_begin (term); p != p_end; p++) {
+	(*doc_count)++;
+
+	if (v == v_end)
+	    continue;
+	v.skip_to (*p);
+	if (v != v_end && v.get_docid () == *p) {
+	    unsigned long doc_revision = Xapian::sortable_unserialise (*v);
+
+	    if (doc_revision > *revision)
+		*revision = doc_revision;
+	}
+    }
+}
+
+/* Create a thread for 'thread_id' from its summary document, as it
+ * would be built for a query matching all messages, with 'sort'
+ * choosing the subject.
+ *
+ * Returns NULL if there is no summary, if it is out of date, or if
+ * one of the thread's tags is in 'exclude_terms' (which would make
+ * the matched messages differ from all messages). */
+notmuch_thread_t *
+_notmuch_thread_create_from_summary (void *ctx,
+				     notmuch_database_t *notmuch,
+				     const char *thread_id,
+				     notmuch_string_list_t *exclude_terms,
+				     notmuch_sort_t sort)
+{
+    const std::string summary_term = std::string (_find_prefix ("thread-summary")) +
+				     thread_id;
+    std::vector<std::string> fields;
+    std::string data;
+    Xapian::PostingIterator p;
+    Xapian::doccount doc_count;
+    unsigned long revision;
+    notmuch_thread_t *thread;
+    size_t start, end;
+
+    /* Without revisions, there is no telling whether a summary is
+     * out of date. */
+    if (! (notmuch->features & NOTMUCH_FEATURE_LAST_MOD))
+	return NULL;
+
+    try {
+	p = notmuch->xapian_db->postlist_begin (summary_term);
+	if (p == notmuch->xapian_db->postlist_end (summary_term))
+	    return NULL;
+
+	data = notmuch->xapian_db->get_document (*p).get_data ();
+	for (start = 0; (end = data.find ('\0', start)) != std::string::npos;
+	     start = end + 1)
+	    fields.push_back (data.substr (start, end - start));
+
+	if (fields.size () < SUMMARY_TAGS ||
+	    fields[SUMMARY_VERSION] != SUMMARY_FORMAT_VERSION)
+	    return NULL;
+
+	_thread_get_fingerprint (notmuch, thread_id, &doc_count, &revision);
+    } catch (const Xapian::Error &) {
+	/* Build the thread from its messages instead. */
+	return NULL;
+    }
+
+    if (strtoul (fields[SUMMARY_DOC_COUNT].c_str (), NULL, 10) != doc_count ||
+	strtoul (fields[SUMMARY_REVISION].c_str (), NULL, 10) != revision)
+	return NULL;
+
+    for (size_t i = SUMMARY_TAGS; i < fields.size (); i++) {
+	for (notmuch_string_node_t *term = exclude_terms->head;
+	     term != NULL;
+	     term = term->next) {
+	    /* Check for an empty string, and then ignore initial 'K'. */
+	    if (*(term->string) && fields[i] == term->string + 1)
+		return NULL;
+	}
+    }
+
+    thread = _thread_new (ctx, notmuch, thread_id);
+    if (unlikely (thread == NULL))
+	return NULL;
+
+    thread->total_messages = strtol (fields[SUMMARY_TOTAL_MESSAGES].c_str (), NULL, 10);
+    thread->total_files = strtol (fields[SUMMARY_TOTAL_FILES].c_str (), NULL, 10);
+    thread->matched_messages = thread->total_messages;
+    thread->oldest = strtoll (fields[SUMMARY_OLDEST].c_str (), NULL, 10);
+    thread->newest = strtoll (fields[SUMMARY_NEWEST].c_str (), NULL, 10);
+    if (! fields[SUMMARY_AUTHORS].empty ())
+	thread->authors = talloc_strdup (thread, fields[SUMMARY_AUTHORS].c_str ());
+    thread->subject = talloc_strdup (thread, sort == NOTMUCH_SORT_OLDEST_FIRST ?
+				     fields[SUMMARY_SUBJECT_OLDEST_FIRST].c_str () :
+				     fields[SUMMARY_SUBJECT_NEWEST_FIRST].c_str ());
+    for (size_t i = SUMMARY_TAGS; i < fields.size (); i++)
+	g_hash_table_insert (thread->tags, xstrdup (fields[i].c_str ()), NULL);
+
     return thread;
 }
 
+static void
+_summary_append (std::string &data, const char *field)
+{
+    data += field ? field : "";
+    data.push_back ('\0');
+}
+
+static void
+_summary_append_number (std::string &data, long long number)
+{
+    char buf[32];
+
+    snprintf (buf, sizeof (buf), "%lld", number);
+    _summary_append (data, buf);
+}
+
+/* Create the set of all documents of the 'count' threads in
+ * 'thread_ids'. Returns NULL if out of memory. */
+static notmuch_doc_id_set_t *
+_thread_get_all_documents (void *ctx,
+			   notmuch_database_t *notmuch,
+			   const char **thread_ids,
+			   unsigned int count)
+{
+    GArray *doc_ids = g_array_new (false, false, sizeof (unsigned int));
+    notmuch_doc_id_set_t *match_set;
+
+    for (unsigned int i = 0; i < count; i++) {
+	const std::string term = std::string (_find_prefix ("thread")) + thread_ids[i];
+	Xapian::PostingIterator p, p_end = notmuch->xapian_db->postlist_end (term);
+
+	/* Ghost documents are never added to a thread, so there is no
+	 * need to skip them. */
+	for (p = notmuch->xapian_db->postlist_begin (term); p != p_end; p++) {
+	    unsigned int doc_id = *p;
+	    g_array_append_val (doc_ids, doc_id);
+	}
+    }
+
+    match_set = _notmuch_doc_id_set_create (ctx, doc_ids);
+    g_array_unref (doc_ids);
+
+    return match_set;
+}
+
+/* Write (or remove, for threads without messages) the summary
+ * documents of the 'count' threads in 'thread_ids', from the threads
+ * built with all their messages matching and no exclusions. */
+notmuch_status_t
+_notmuch_thread_update_summaries (notmuch_database_t *notmuch,
+				  const char **thread_ids,
+				  unsigned int count)
+{
+    const notmuch_sort_t sorts[] = {
+	NOTMUCH_SORT_OLDEST_FIRST,
+	NOTMUCH_SORT_NEWEST_FIRST,
+    };
+    void *local = talloc_new (notmuch);
+    notmuch_thread_t **threads[ARRAY_SIZE (sorts)];
+    notmuch_string_list_t *no_excludes;
+    notmuch_doc_id_set_t *match_set;
+    Xapian::WritableDatabase *db;
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+
+    no_excludes = _notmuch_string_list_create (local);
+    if (unlikely (no_excludes == NULL)) {
+	status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+	goto DONE;
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE (sorts); i++) {
+	threads[i] = talloc_array (local, notmuch_thread_t *, count);
+	if (unlikely (threads[i] == NULL)) {
+	    status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+	    goto DONE;
+	}
+
+	/* Building the threads empties the set, so each pass needs its
+	 * own. */
+	try {
+	    match_set = _thread_get_all_documents (local, notmuch, thread_ids, count);
+	    if (unlikely (match_set == NULL)) {
+		status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+		goto DONE;
+	    }
+	} catch (const Xapian::Error &error) {
+	    _notmuch_database_log (notmuch,
+				   "A Xapian exception occurred summarizing threads: %s\n",
+				   error.get_msg ().c_str ());
+	    notmuch->exception_reported = true;
+	    status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+	    goto DONE;
+	}
+
+	status = _notmuch_thread_create_batch (local, notmuch, thread_ids, count,
+					       match_set, no_excludes,
+					       NOTMUCH_EXCLUDE_FALSE, sorts[i],
+					       threads[i]);
+	if (status)
+	    goto DONE;
+    }
+
+    try {
+	for (unsigned int i = 0; i < count; i++) {
+	    notmuch_thread_t *oldest_first = threads[0][i];
+	    notmuch_thread_t *newest_first = threads[1][i];
+	    const std::string term = std::string (_find_prefix ("thread-summary")) +
+				     thread_ids[i];
+	    Xapian::doccount doc_count;
+	    unsigned long revision;
+	    Xapian::Document doc;
+	    std::string data;
+	    GHashTableIter iter;
+	    gpointer tag;
+
+	    if (newest_first->total_messages == 0) {
+		db->delete_document (term);
+		continue;
+	    }
+
+	    _thread_get_fingerprint (notmuch, thread_ids[i], &doc_count, &revision);
+
+	    _summary_append (data, SUMMARY_FORMAT_VERSION);
+	    _summary_append_number (data, doc_count);
+	    _summary_append_number (data, revision);
+	    _summary_append_number (data, newest_first->total_messages);
+	    _summary_append_number (data, newest_first->total_files);
+	    _summary_append_number (data, newest_first->oldest);
+	    _summary_append_number (data, newest_first->newest);
+	    _summary_append (data, newest_first->authors);
+	    _summary_append (data, oldest_first->subject);
+	    _summary_append (data, newest_first->subject);
+	    g_hash_table_iter_init (&iter, newest_first->tags);
+	    while (g_hash_table_iter_next (&iter, &tag, NULL))
+		_summary_append (data, (const char *) tag);
+
+	    doc.add_term (term, 0);
+	    doc.set_data (data);
+	    db->replace_document (term, doc);
+	}
+    } catch (const Xapian::Error &error) {
+	_notmuch_database_log (notmuch,
+			       "A Xapian exception occurred writing thread summaries: %s\n",
+			       error.get_msg ().c_str ());
+	notmuch->exception_reported = true;
+	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+  DONE:
+    talloc_free (local);
+    return status;
+}
+
 notmuch_messages_t *
 notmuch_thread_get_toplevel_messages (notmuch_thread_t *thread)
 {
@@ -210,6 +210,16 @@ notmuch_config_command (notmuch_config_t *config, int argc, char *argv[]);
 int
 notmuch_compact_command (notmuch_config_t *config, int argc, char *argv[]);
 
+int
+notmuch_server_command (notmuch_config_t *config, int argc, char *argv[]);
+
+/* Open the database of 'config' for a command.  Within notmuch
+ * server, read-only opens share the database held by the server. */
+notmuch_status_t
+notmuch_client_open_database (notmuch_config_t *config,
+			      notmuch_database_mode_t mode,
+			      notmuch_database_t **notmuch);
+
 const char *
 notmuch_time_relative_date (const void *ctx, time_t then);
 
@@ -269,6 +279,9 @@ notmuch_config_save (notmuch_config_t *config);
 bool
 notmuch_config_is_new (notmuch_config_t *config);
 
+const char *
+notmuch_config_get_filename (notmuch_config_t *config);
+
 const char *
 notmuch_config_get_database_path (notmuch_config_t *config);
 
@@ -316,6 +329,9 @@ notmuch_config_set_new_ignore (notmuch_config_t *config,
 			       const char *new_ignore[],
 			       size_t length);
 
+int
+notmuch_config_get_new_batch_size (notmuch_config_t *config);
+
 bool
 notmuch_config_get_maildir_synchronize_flags (notmuch_config_t *config);
 
@@ -461,7 +477,9 @@ notmuch_database_dump (notmuch_database_t *notmuch,
 		       const char *query_str,
 		       dump_format_t output_format,
 		       dump_include_t include,
-		       bool gzip_output);
+		       bool gzip_output,
+		       int jobs,
+		       long since_revision);
 
 /* If status is non-zero (i.e. error) print appropriate
    messages to stderr.
@@ -51,7 +51,12 @@ static const char new_config_comment[] =
     "\n"
     "\t	NOTE: *Every* file/directory that goes by one of those\n"
     "\t	names will be ignored, independent of its depth/location\n"
-    "\t	in the mail store.\n";
+    "\t	in the mail store.\n"
+    "\n"
+    "\tbatch_size	The number of messages that \"notmuch new\" adds\n"
+    "\t	or removes before committing its changes to the database.\n"
+    "\t	If unset (or 0), changes are committed as Xapian sees fit,\n"
+    "\t	one message at a time.\n";
 
 static const char user_config_comment[] =
     " User configuration\n"
@@ -571,6 +576,12 @@ notmuch_config_is_new (notmuch_config_t *config)
     return config->is_new;
 }
 
+const char *
+notmuch_config_get_filename (notmuch_config_t *config)
+{
+    return config->filename;
+}
+
 static const char *
 _config_get (notmuch_config_t *config, char **field,
 	     const char *group, const char *key)
@@ -718,6 +729,22 @@ notmuch_config_get_new_ignore (notmuch_config_t *config, size_t *length)
 			     &(config->new_ignore_length), length);
 }
 
+int
+notmuch_config_get_new_batch_size (notmuch_config_t *config)
+{
+    GError *error = NULL;
+    int batch_size;
+
+    batch_size = g_key_file_get_integer (config->key_file,
+					 "new", "batch_size", &error);
+    if (error) {
+	g_error_free (error);
+	return 0;
+    }
+
+    return batch_size;
+}
+
 void
 notmuch_config_set_user_other_email (notmuch_config_t *config,
 				     const char *list[],
@@ -797,6 +824,8 @@ _stored_in_db (const char *item)
 {
     const char * db_configs[] = {
 	"index.decrypt",
+	"index.thread_summaries",
+	"index.regexp_trigrams",
     };
     if (STRNCMP_LITERAL (item, "query.") == 0)
 	return true;
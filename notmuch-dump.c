@@ -89,97 +89,229 @@ print_dump_header (gzFile output, int output_format, int include)
     gzputs (output, "\n");
 }
 
+/* For an incremental dump, list the messages deleted after
+ * 'since_revision', one "#- <encoded-message-id>" line each. */
 static int
-dump_properties_message (void *ctx,
-			 notmuch_message_t *message,
-			 gzFile output,
-			 char **buffer_p, size_t *size_p)
+dump_deleted_messages (notmuch_database_t *notmuch, gzFile output,
+		       unsigned long since_revision)
 {
+    notmuch_deleted_messages_t *deleted;
+    char *buffer = NULL;
+    size_t buffer_size = 0;
+    int ret = EXIT_FAILURE;
+
+    if (print_status_database ("notmuch dump", notmuch,
+			       notmuch_database_get_deleted_messages (notmuch, since_revision,
+								      &deleted)))
+	return EXIT_FAILURE;
+
+    for (; notmuch_deleted_messages_valid (deleted);
+	 notmuch_deleted_messages_move_to_next (deleted)) {
+	const char *message_id = notmuch_deleted_messages_get_message_id (deleted);
+
+	if (hex_encode (notmuch, message_id, &buffer, &buffer_size) != HEX_SUCCESS) {
+	    fprintf (stderr, "Error: failed to hex-encode message-id %s\n",
+		     message_id);
+	    goto DONE;
+	}
+	gzprintf (output, "#- %s\n", buffer);
+    }
+
+    ret = EXIT_SUCCESS;
+
+  DONE:
+    notmuch_deleted_messages_destroy (deleted);
+
+    if (buffer)
+	talloc_free (buffer);
+
+    return ret;
+}
+
+/* With more than one job, messages are read from the database by the
+ * main thread and handed in chunks of this many to worker threads,
+ * which format and (with --gzip) compress them.  Chunks are written
+ * out in the order they were read, each compressed chunk as a gzip
+ * member of its own. */
+#define DUMP_CHUNK_SIZE 1000
+
+/* What is dumped of a single message, copied out of the database so
+ * that it can be formatted without it. */
+typedef struct {
     const char *message_id;
-    notmuch_message_properties_t *list;
-    bool first = true;
+    bool has_tags;
+    const char **tags;
+    size_t num_tags;
+    bool has_properties;
+    /* Alternating keys and values. */
+    const char **properties;
+    size_t num_properties;
+} dump_record_t;
+
+typedef struct {
+    /* Owns the records and the output.  Only the thread currently
+     * holding the chunk touches it. */
+    void *ctx;
+    dump_record_t records[DUMP_CHUNK_SIZE];
+    int count;
+    char *output;
+    size_t output_len;
+    /* Set, under the state lock, once a worker is done with the
+     * chunk. */
+    bool is_done;
+    bool failed;
+} dump_chunk_t;
+
+typedef struct {
+    int output_format;
+    bool gzip_output;
+    GMutex lock;
+    GCond cond;
+} dump_state_t;
+
+/* Copy what is to be dumped of 'message' into 'record'.  Messages
+ * whose id contains a line break are reported here, in database
+ * order, rather than when they are formatted. */
+static int
+collect_message (void *ctx, notmuch_message_t *message,
+		 int output_format, int include, dump_record_t *record)
+{
+    const char *message_id;
+    bool has_line_break;
+    size_t count = 0, allocated = 0;
 
     message_id = notmuch_message_get_message_id (message);
+    has_line_break = strchr (message_id, '\n') != NULL;
 
-    if (strchr (message_id, '\n')) {
-	fprintf (stderr, "Warning: skipping message id containing line break: \"%s\"\n", message_id);
-	return 0;
+    memset (record, 0, sizeof (*record));
+    record->message_id = talloc_strdup (ctx, message_id);
+    if (record->message_id == NULL)
+	goto OUT_OF_MEMORY;
+
+    if (include & DUMP_INCLUDE_TAGS) {
+	if (output_format == DUMP_FORMAT_BATCH_TAG && has_line_break) {
+	    /* This will produce a line break in the output, which
+	     * would be difficult to handle in tools.  However, it's
+	     * also impossible to produce an email containing a line
+	     * break in a message ID because of unfolding, so we can
+	     * safely disallow it. */
+	    fprintf (stderr, "Warning: skipping message id containing line break: \"%s\"\n", message_id);
+	} else {
+	    record->has_tags = true;
+	    for (notmuch_tags_t *tags = notmuch_message_get_tags (message);
+		 notmuch_tags_valid (tags);
+		 notmuch_tags_move_to_next (tags)) {
+		if (count == allocated) {
+		    allocated = allocated ? 2 * allocated : 8;
+		    record->tags = talloc_realloc (ctx, record->tags,
+						   const char *, allocated);
+		    if (record->tags == NULL)
+			goto OUT_OF_MEMORY;
+		}
+		record->tags[count] = talloc_strdup (ctx, notmuch_tags_get (tags));
+		if (record->tags[count++] == NULL)
+		    goto OUT_OF_MEMORY;
+	    }
+	    record->num_tags = count;
+	}
     }
 
-    for (list = notmuch_message_get_properties (message, "", false);
-	 notmuch_message_properties_valid (list); notmuch_message_properties_move_to_next (list)) {
-	const char *key, *val;
+    if (include & DUMP_INCLUDE_PROPERTIES) {
+	notmuch_message_properties_t *list;
+
+	if (has_line_break) {
+	    fprintf (stderr, "Warning: skipping message id containing line break: \"%s\"\n", message_id);
+	    return 0;
+	}
 
-	if (first) {
-	    if (hex_encode (ctx, message_id, buffer_p, size_p) != HEX_SUCCESS) {
-		fprintf (stderr, "Error: failed to hex-encode message-id %s\n", message_id);
-		return 1;
+	record->has_properties = true;
+	count = allocated = 0;
+	for (list = notmuch_message_get_properties (message, "", false);
+	     notmuch_message_properties_valid (list); notmuch_message_properties_move_to_next (list)) {
+	    if (count == allocated) {
+		allocated = allocated ? 2 * allocated : 8;
+		record->properties = talloc_realloc (ctx, record->properties,
+						     const char *, allocated);
+		if (record->properties == NULL)
+		    goto OUT_OF_MEMORY;
 	    }
-	    gzprintf (output, "#= %s", *buffer_p);
-	    first = false;
+	    record->properties[count] =
+		talloc_strdup (ctx, notmuch_message_properties_key (list));
+	    record->properties[count + 1] =
+		talloc_strdup (ctx, notmuch_message_properties_value (list));
+	    if (record->properties[count] == NULL ||
+		record->properties[count + 1] == NULL)
+		goto OUT_OF_MEMORY;
+	    count += 2;
 	}
+	notmuch_message_properties_destroy (list);
+	record->num_properties = count;
+    }
+
+    return 0;
+
+  OUT_OF_MEMORY:
+    fprintf (stderr, "Out of memory\n");
+    return 1;
+}
+
+static int
+format_properties (void *ctx, const dump_record_t *record,
+		   char **output_p, char **buffer_p, size_t *size_p)
+{
+    size_t i;
+
+    if (record->num_properties == 0)
+	return 0;
+
+    if (hex_encode (ctx, record->message_id, buffer_p, size_p) != HEX_SUCCESS) {
+	fprintf (stderr, "Error: failed to hex-encode message-id %s\n",
+		 record->message_id);
+	return 1;
+    }
+    *output_p = talloc_asprintf_append_buffer (*output_p, "#= %s", *buffer_p);
 
-	key = notmuch_message_properties_key (list);
-	val = notmuch_message_properties_value (list);
+    for (i = 0; i < record->num_properties; i += 2) {
+	const char *key = record->properties[i];
+	const char *val = record->properties[i + 1];
 
 	if (hex_encode (ctx, key, buffer_p, size_p) != HEX_SUCCESS) {
 	    fprintf (stderr, "Error: failed to hex-encode key %s\n", key);
 	    return 1;
 	}
-	gzprintf (output, " %s", *buffer_p);
+	*output_p = talloc_asprintf_append_buffer (*output_p, " %s", *buffer_p);
 
 	if (hex_encode (ctx, val, buffer_p, size_p) != HEX_SUCCESS) {
 	    fprintf (stderr, "Error: failed to hex-encode value %s\n", val);
 	    return 1;
 	}
-	gzprintf (output, "=%s", *buffer_p);
+	*output_p = talloc_asprintf_append_buffer (*output_p, "=%s", *buffer_p);
     }
-    notmuch_message_properties_destroy (list);
 
-    if (! first)
-	gzprintf (output, "\n", *buffer_p);
+    *output_p = talloc_strdup_append_buffer (*output_p, "\n");
 
     return 0;
 }
 
 static int
-dump_tags_message (void *ctx,
-		   notmuch_message_t *message, int output_format,
-		   gzFile output,
-		   char **buffer_p, size_t *size_p)
+format_tags (void *ctx, const dump_record_t *record, int output_format,
+	     char **output_p, char **buffer_p, size_t *size_p)
 {
-    int first = 1;
-    const char *message_id;
-
-    message_id = notmuch_message_get_message_id (message);
-
-    if (output_format == DUMP_FORMAT_BATCH_TAG &&
-	strchr (message_id, '\n')) {
-	/* This will produce a line break in the output, which
-	 * would be difficult to handle in tools.  However, it's
-	 * also impossible to produce an email containing a line
-	 * break in a message ID because of unfolding, so we can
-	 * safely disallow it. */
-	fprintf (stderr, "Warning: skipping message id containing line break: \"%s\"\n", message_id);
-	return EXIT_SUCCESS;
-    }
+    size_t i;
 
     if (output_format == DUMP_FORMAT_SUP) {
-	gzprintf (output, "%s (", message_id);
+	*output_p = talloc_asprintf_append_buffer (*output_p, "%s (",
+						   record->message_id);
     }
 
-    for (notmuch_tags_t *tags = notmuch_message_get_tags (message);
-	 notmuch_tags_valid (tags);
-	 notmuch_tags_move_to_next (tags)) {
-	const char *tag_str = notmuch_tags_get (tags);
-
-	if (! first)
-	    gzputs (output, " ");
+    for (i = 0; i < record->num_tags; i++) {
+	const char *tag_str = record->tags[i];
 
-	first = 0;
+	if (i > 0)
+	    *output_p = talloc_strdup_append_buffer (*output_p, " ");
 
 	if (output_format == DUMP_FORMAT_SUP) {
-	    gzputs (output, tag_str);
+	    *output_p = talloc_strdup_append_buffer (*output_p, tag_str);
 	} else {
 	    if (hex_encode (ctx, tag_str,
 			    buffer_p, size_p) != HEX_SUCCESS) {
@@ -187,37 +319,229 @@ dump_tags_message (void *ctx,
 			 tag_str);
 		return EXIT_FAILURE;
 	    }
-	    gzprintf (output, "+%s", *buffer_p);
+	    *output_p = talloc_asprintf_append_buffer (*output_p, "+%s",
+						       *buffer_p);
 	}
     }
 
     if (output_format == DUMP_FORMAT_SUP) {
-	gzputs (output, ")\n");
+	*output_p = talloc_strdup_append_buffer (*output_p, ")\n");
     } else {
-	if (make_boolean_term (ctx, "id", message_id,
+	if (make_boolean_term (ctx, "id", record->message_id,
 			       buffer_p, size_p)) {
 	    fprintf (stderr, "Error quoting message id %s: %s\n",
-		     message_id, strerror (errno));
+		     record->message_id, strerror (errno));
 	    return EXIT_FAILURE;
 	}
-	gzprintf (output, " -- %s\n", *buffer_p);
+	*output_p = talloc_asprintf_append_buffer (*output_p, " -- %s\n",
+						   *buffer_p);
     }
     return EXIT_SUCCESS;
 }
 
+/* Compress the output of 'chunk' into a complete gzip member. */
+static int
+compress_chunk (dump_chunk_t *chunk)
+{
+    z_stream stream;
+    unsigned char *compressed;
+    int zerr;
+
+    memset (&stream, 0, sizeof (stream));
+    /* 16 + MAX_WBITS asks for a gzip header and trailer. */
+    if (deflateInit2 (&stream, 9, Z_DEFLATED, 16 + MAX_WBITS, 8,
+		      Z_DEFAULT_STRATEGY) != Z_OK) {
+	fprintf (stderr, "Error initializing compression: %s\n",
+		 stream.msg ? stream.msg : "unknown error");
+	return 1;
+    }
+
+    compressed = talloc_size (chunk->ctx,
+			      deflateBound (&stream, chunk->output_len));
+    if (compressed == NULL) {
+	deflateEnd (&stream);
+	fprintf (stderr, "Out of memory\n");
+	return 1;
+    }
+
+    stream.next_in = (unsigned char *) chunk->output;
+    stream.avail_in = chunk->output_len;
+    stream.next_out = compressed;
+    stream.avail_out = talloc_get_size (compressed);
+
+    zerr = deflate (&stream, Z_FINISH);
+    if (zerr != Z_STREAM_END) {
+	fprintf (stderr, "Error compressing output: %s\n",
+		 stream.msg ? stream.msg : "unknown error");
+	deflateEnd (&stream);
+	return 1;
+    }
+
+    chunk->output = (char *) compressed;
+    chunk->output_len = stream.total_out;
+
+    deflateEnd (&stream);
+
+    return 0;
+}
+
+/* Format the records of 'chunk' into its output, compressing it if
+ * 'compress' is set.  Only touches the chunk, so that it can run in a
+ * worker thread. */
+static int
+format_chunk (dump_chunk_t *chunk, const dump_state_t *state, bool compress)
+{
+    char *buffer = NULL;
+    size_t buffer_size = 0;
+    int i;
+
+    chunk->output = talloc_strdup (chunk->ctx, "");
+
+    for (i = 0; i < chunk->count; i++) {
+	dump_record_t *record = &chunk->records[i];
+
+	if (record->has_tags &&
+	    format_tags (chunk->ctx, record, state->output_format,
+			 &chunk->output, &buffer, &buffer_size))
+	    return 1;
+
+	if (record->has_properties &&
+	    format_properties (chunk->ctx, record,
+			       &chunk->output, &buffer, &buffer_size))
+	    return 1;
+
+	if (chunk->output == NULL) {
+	    fprintf (stderr, "Out of memory\n");
+	    return 1;
+	}
+    }
+
+    chunk->output_len = strlen (chunk->output);
+
+    if (compress && chunk->output_len > 0)
+	return compress_chunk (chunk);
+
+    return 0;
+}
+
+/* Worker thread: format and compress one chunk. */
+static void
+format_chunk_worker (gpointer data, gpointer user_data)
+{
+    dump_chunk_t *chunk = data;
+    dump_state_t *state = user_data;
+    bool failed;
+
+    failed = format_chunk (chunk, state, state->gzip_output);
+
+    g_mutex_lock (&state->lock);
+    chunk->failed = failed;
+    chunk->is_done = true;
+    g_cond_broadcast (&state->cond);
+    g_mutex_unlock (&state->lock);
+}
+
+static int
+write_all (int fd, const char *buf, size_t len)
+{
+    ssize_t written;
+
+    while (len > 0) {
+	written = write (fd, buf, len);
+	if (written < 0) {
+	    if (errno == EINTR)
+		continue;
+	    fprintf (stderr, "Error writing output: %s\n", strerror (errno));
+	    return 1;
+	}
+	buf += written;
+	len -= written;
+    }
+
+    return 0;
+}
+
+/* Wait for the oldest chunk queued in 'pending' to be formatted, and
+ * write it straight to 'outfd', bypassing the gzFile. */
 static int
-database_dump_file (notmuch_database_t *notmuch, gzFile output,
-		    const char *query_str, int output_format, int include)
+write_pending_chunk (GQueue *pending, dump_state_t *state, int outfd)
+{
+    dump_chunk_t *chunk = g_queue_pop_head (pending);
+    int ret;
+
+    g_mutex_lock (&state->lock);
+    while (! chunk->is_done)
+	g_cond_wait (&state->cond, &state->lock);
+    g_mutex_unlock (&state->lock);
+
+    ret = chunk->failed;
+    if (! ret)
+	ret = write_all (outfd, chunk->output, chunk->output_len);
+
+    talloc_free (chunk);
+
+    return ret;
+}
+
+/* Without workers: format 'chunk' in this thread, and write it
+ * through the gzFile. */
+static int
+write_chunk (dump_chunk_t *chunk, dump_state_t *state, gzFile output)
+{
+    if (format_chunk (chunk, state, false))
+	return 1;
+
+    if (chunk->output_len &&
+	gzwrite (output, chunk->output, chunk->output_len) == 0) {
+	fprintf (stderr, "Error writing output: %s\n",
+		 gzerror (output, NULL));
+	return 1;
+    }
+
+    return 0;
+}
+
+static dump_chunk_t *
+dump_chunk_create (void *ctx)
+{
+    dump_chunk_t *chunk = talloc_zero (ctx, dump_chunk_t);
+
+    if (chunk && (chunk->ctx = talloc_new (chunk)) == NULL) {
+	talloc_free (chunk);
+	chunk = NULL;
+    }
+    if (chunk == NULL)
+	fprintf (stderr, "Out of memory\n");
+
+    return chunk;
+}
+
+static int
+database_dump_file (notmuch_database_t *notmuch, gzFile output, int outfd,
+		    const char *query_str, int output_format, int include,
+		    bool gzip_output, int jobs, long since_revision)
 {
     notmuch_query_t *query;
     notmuch_messages_t *messages;
     notmuch_message_t *message;
     notmuch_status_t status;
-    char *buffer = NULL;
-    size_t buffer_size = 0;
+    dump_state_t state;
+    dump_chunk_t *chunk = NULL;
+    GThreadPool *pool = NULL;
+    GQueue *pending = NULL;
+    void *chunks_ctx = NULL;
+    int ret = EXIT_FAILURE;
 
     print_dump_header (output, output_format, include);
 
+    if (since_revision >= 0) {
+	const char *uuid;
+	unsigned long revision = notmuch_database_get_revision (notmuch, &uuid);
+
+	/* The next incremental dump can start from here. */
+	gzprintf (output, "#notmuch-revision %s %lu\n", uuid, revision);
+    }
+
     if (include & DUMP_INCLUDE_CONFIG) {
 	if (print_status_database ("notmuch dump", notmuch,
 				   database_dump_config(notmuch,output)))
@@ -230,6 +554,22 @@ database_dump_file (notmuch_database_t *notmuch, gzFile output,
     if (! query_str)
 	query_str = "";
 
+    if (since_revision >= 0) {
+	if (dump_deleted_messages (notmuch, output, since_revision))
+	    return EXIT_FAILURE;
+
+	if (*query_str)
+	    query_str = talloc_asprintf (notmuch, "(%s) and lastmod:%ld..",
+					 query_str, since_revision + 1);
+	else
+	    query_str = talloc_asprintf (notmuch, "lastmod:%ld..",
+					 since_revision + 1);
+	if (query_str == NULL) {
+	    fprintf (stderr, "Out of memory\n");
+	    return EXIT_FAILURE;
+	}
+    }
+
     query = notmuch_query_create (notmuch, query_str);
     if (query == NULL) {
 	fprintf (stderr, "Out of memory\n");
@@ -242,30 +582,97 @@ database_dump_file (notmuch_database_t *notmuch, gzFile output,
 
     status = notmuch_query_search_messages (query, &messages);
     if (print_status_query ("notmuch dump", query, status))
-	return EXIT_FAILURE;
+	goto DONE;
+
+    state.output_format = output_format;
+    state.gzip_output = gzip_output;
+
+    if (jobs <= 0)
+	jobs = sysconf (_SC_NPROCESSORS_ONLN);
+
+    chunks_ctx = talloc_new (notmuch);
+
+    if (jobs > 1) {
+	/* Everything written through the gzFile so far must be out
+	 * (and, with --gzip, a complete gzip member) before chunks
+	 * are written to the file descriptor directly. */
+	if (gzflush (output, Z_FINISH) != Z_OK) {
+	    fprintf (stderr, "Error flushing output: %s\n", gzerror (output, NULL));
+	    goto DONE;
+	}
+
+	g_mutex_init (&state.lock);
+	g_cond_init (&state.cond);
+	pending = g_queue_new ();
+	pool = g_thread_pool_new (format_chunk_worker, &state, jobs, true, NULL);
+    }
 
     for (;
 	 notmuch_messages_valid (messages);
 	 notmuch_messages_move_to_next (messages)) {
 
-	message = notmuch_messages_get (messages);
+	if (chunk == NULL && (chunk = dump_chunk_create (chunks_ctx)) == NULL)
+	    goto DONE;
 
-	if ((include & DUMP_INCLUDE_TAGS) &&
-	    dump_tags_message (notmuch, message, output_format, output,
-			       &buffer, &buffer_size))
-	    return EXIT_FAILURE;
+	message = notmuch_messages_get (messages);
 
-	if ((include & DUMP_INCLUDE_PROPERTIES) &&
-	    dump_properties_message (notmuch, message, output,
-				     &buffer, &buffer_size))
-	    return EXIT_FAILURE;
+	if (collect_message (chunk->ctx, message, output_format, include,
+			     &chunk->records[chunk->count++]))
+	    goto DONE;
 
 	notmuch_message_destroy (message);
+
+	if (chunk->count < DUMP_CHUNK_SIZE)
+	    continue;
+
+	if (pool) {
+	    g_queue_push_tail (pending, chunk);
+	    g_thread_pool_push (pool, chunk, NULL);
+	    chunk = NULL;
+
+	    /* Bound the memory used by chunks waiting to be written. */
+	    while (g_queue_get_length (pending) >= 2 * (unsigned) jobs)
+		if (write_pending_chunk (pending, &state, outfd))
+		    goto DONE;
+	} else {
+	    if (write_chunk (chunk, &state, output))
+		goto DONE;
+	    talloc_free_children (chunk->ctx);
+	    chunk->count = 0;
+	}
+    }
+
+    if (chunk && chunk->count > 0) {
+	if (pool) {
+	    g_queue_push_tail (pending, chunk);
+	    g_thread_pool_push (pool, chunk, NULL);
+	    chunk = NULL;
+	} else {
+	    if (write_chunk (chunk, &state, output))
+		goto DONE;
+	}
+    }
+
+    while (pending && ! g_queue_is_empty (pending))
+	if (write_pending_chunk (pending, &state, outfd))
+	    goto DONE;
+
+    ret = EXIT_SUCCESS;
+
+  DONE:
+    if (pool) {
+	/* Drop the chunks not yet started, and wait for the others. */
+	g_thread_pool_free (pool, true, true);
+	g_queue_free (pending);
+	g_mutex_clear (&state.lock);
+	g_cond_clear (&state.cond);
     }
 
+    talloc_free (chunks_ctx);
+
     notmuch_query_destroy (query);
 
-    return EXIT_SUCCESS;
+    return ret;
 }
 
 /* Dump database into output_file_name if it's non-NULL, stdout
@@ -277,7 +684,9 @@ notmuch_database_dump (notmuch_database_t *notmuch,
 		       const char *query_str,
 		       dump_format_t output_format,
 		       dump_include_t include,
-		       bool gzip_output)
+		       bool gzip_output,
+		       int jobs,
+		       long since_revision)
 {
     gzFile output = NULL;
     const char *mode = gzip_output ? "w9" : "wT";
@@ -311,7 +720,9 @@ notmuch_database_dump (notmuch_database_t *notmuch,
 	goto DONE;
     }
 
-    ret = database_dump_file (notmuch, output, query_str, output_format, include);
+    ret = database_dump_file (notmuch, output, outfd, query_str,
+			      output_format, include, gzip_output, jobs,
+			      since_revision);
     if (ret) goto DONE;
 
     ret = gzflush (output, Z_FINISH);
@@ -375,6 +786,9 @@ notmuch_dump_command (notmuch_config_t *config, int argc, char *argv[])
     int output_format = DUMP_FORMAT_BATCH_TAG;
     int include = 0;
     bool gzip_output = 0;
+    int jobs = 0;
+    const char *since_revision_str = NULL;
+    long since_revision = -1;
 
     notmuch_opt_desc_t options[] = {
 	{ .opt_keyword = &output_format, .name = "format", .keywords =
@@ -387,6 +801,8 @@ notmuch_dump_command (notmuch_config_t *config, int argc, char *argv[])
 				  { "tags", DUMP_INCLUDE_TAGS} } },
 	{ .opt_string = &output_file_name, .name = "output" },
 	{ .opt_bool = &gzip_output, .name = "gzip" },
+	{ .opt_int = &jobs, .name = "jobs" },
+	{ .opt_string = &since_revision_str, .name = "since-revision" },
 	{ .opt_inherit = notmuch_shared_options },
 	{ }
     };
@@ -400,6 +816,17 @@ notmuch_dump_command (notmuch_config_t *config, int argc, char *argv[])
     if (include == 0)
 	include = DUMP_INCLUDE_CONFIG | DUMP_INCLUDE_TAGS | DUMP_INCLUDE_PROPERTIES;
 
+    if (since_revision_str) {
+	char *end;
+
+	errno = 0;
+	since_revision = strtol (since_revision_str, &end, 10);
+	if (errno || *end || end == since_revision_str || since_revision < 0) {
+	    fprintf (stderr, "Error: invalid revision: %s\n", since_revision_str);
+	    return EXIT_FAILURE;
+	}
+    }
+
     if (opt_index < argc) {
 	query_str = query_string_from_args (notmuch, argc - opt_index, argv + opt_index);
 	if (query_str == NULL) {
@@ -409,7 +836,8 @@ notmuch_dump_command (notmuch_config_t *config, int argc, char *argv[])
     }
 
     ret = notmuch_database_dump (notmuch, output_file_name, query_str,
-				 output_format, include, gzip_output);
+				 output_format, include, gzip_output, jobs,
+				 since_revision);
 
     notmuch_database_destroy (notmuch);
 
@@ -23,6 +23,11 @@
 
 #include <unistd.h>
 
+#if HAVE_INOTIFY
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
 typedef struct _filename_node {
     char *filename;
     time_t mtime;
@@ -66,8 +71,65 @@ typedef struct {
     _filename_list_t *directory_mtimes;
 
     bool synchronize_flags;
+
+    /* Files to add are parsed by a pool of 'index_jobs' threads, see
+     * queue_file.  Access to 'pending_files' is protected by
+     * 'pending_lock'. */
+    int index_jobs;
+    GThreadPool *index_pool;
+    GQueue *pending_files;
+    GMutex pending_lock;
+    GCond pending_cond;
+
+    /* With more than one job, add_files also reads sub-directories
+     * ahead of time in a pool of threads, see prefetch_directory.
+     * Scans waiting to be used by add_files are in 'scans', keyed by
+     * path; their completion is signalled through 'pending_lock' and
+     * 'pending_cond'. */
+    GThreadPool *scan_pool;
+    GHashTable *scans;
 } add_files_state_t;
 
+/* A directory entry, with its type as returned by dirent_type (or -1,
+ * with the errno in 'type_errno'). */
+typedef struct {
+    struct dirent *dirent;
+    int type;
+    int type_errno;
+} _scanned_entry_t;
+
+/* What add_files needs to know about a directory from the file
+ * system: the result of stat, then of scandir and of dirent_type for
+ * each entry. */
+typedef struct {
+    char *path;
+    /* The mtime of the directory in the database, or -1 if unknown.
+     * A prefetched directory with no sub-directories and this mtime
+     * is only stat'ed, since add_files will most likely skip it. */
+    time_t db_mtime;
+
+    struct stat st;
+    int stat_errno;
+    time_t stat_time;
+
+    bool is_read;
+    /* In inode order. */
+    _scanned_entry_t *entries;
+    int num_entries;
+    int read_errno;
+
+    /* Set once a scan worker is done with this directory. */
+    bool is_scanned;
+} _scanned_dir_t;
+
+/* A file found by add_files, waiting to be added to the database. */
+typedef struct {
+    notmuch_database_t *notmuch;
+    char *filename;
+    notmuch_prepared_file_t *prepared;
+    bool is_prepared;
+} _pending_file_t;
+
 static volatile sig_atomic_t do_print_progress = 0;
 
 static void
@@ -162,12 +224,6 @@ dirent_sort_inode (const struct dirent **a, const struct dirent **b)
     return ((*a)->d_ino < (*b)->d_ino) ? -1 : 1;
 }
 
-static int
-dirent_sort_strcmp_name (const struct dirent **a, const struct dirent **b)
-{
-    return strcmp ((*a)->d_name, (*b)->d_name);
-}
-
 /* Return the type of a directory entry relative to path as a stat(2)
  * mode.  Like stat, this follows symlinks.  Returns -1 and sets errno
  * if the file's type cannot be determined (which includes dangling
@@ -195,14 +251,12 @@ dirent_type (const char *path, const struct dirent *entry)
 	return modes[entry->d_type];
 #endif
 
-    abspath = talloc_asprintf (NULL, "%s/%s", path, entry->d_name);
-    if (!abspath) {
-	errno = ENOMEM;
-	return -1;
-    }
+    /* Scan workers call this too, so don't allocate with talloc,
+     * which isn't thread-safe. */
+    abspath = g_strconcat (path, "/", entry->d_name, NULL);
     err = stat(abspath, &statbuf);
     saved_errno = errno;
-    talloc_free (abspath);
+    g_free (abspath);
     if (err < 0) {
 	errno = saved_errno;
 	return -1;
@@ -218,17 +272,17 @@ dirent_type (const char *path, const struct dirent *entry)
  * Return 1 if the directory looks like a Maildir and 0 otherwise.
  */
 static int
-_entries_resemble_maildir (const char *path, struct dirent **entries, int count)
+_entries_resemble_maildir (_scanned_entry_t *entries, int count)
 {
     int i, found = 0;
 
     for (i = 0; i < count; i++) {
-	if (dirent_type (path, entries[i]) != S_IFDIR)
+	if (entries[i].type != S_IFDIR)
 	    continue;
 
-	if (strcmp(entries[i]->d_name, "new") == 0 ||
-	    strcmp(entries[i]->d_name, "cur") == 0 ||
-	    strcmp(entries[i]->d_name, "tmp") == 0)
+	if (strcmp(entries[i].dirent->d_name, "new") == 0 ||
+	    strcmp(entries[i].dirent->d_name, "cur") == 0 ||
+	    strcmp(entries[i].dirent->d_name, "tmp") == 0)
 	{
 	    found++;
 	    if (found == 3)
@@ -366,9 +420,11 @@ _entry_in_ignore_list (add_files_state_t *state, const char *dirpath,
     return ret;
 }
 
-/* Add a single file to the database. */
+/* Add a single file to the database, using 'prepared' (see
+ * notmuch_database_prepare_file) if it is not NULL. */
 static notmuch_status_t
 add_file (notmuch_database_t *notmuch, const char *filename,
+	  notmuch_prepared_file_t *prepared,
 	  add_files_state_t *state)
 {
     notmuch_message_t *message = NULL;
@@ -379,7 +435,10 @@ add_file (notmuch_database_t *notmuch, const char *filename,
     if (status)
 	goto DONE;
 
-    status = notmuch_database_index_file (notmuch, filename, indexing_cli_choices.opts, &message);
+    if (prepared)
+	status = notmuch_database_index_prepared_file (notmuch, prepared, &message);
+    else
+	status = notmuch_database_index_file (notmuch, filename, indexing_cli_choices.opts, &message);
     switch (status) {
     /* Success. */
     case NOTMUCH_STATUS_SUCCESS:
@@ -431,6 +490,303 @@ add_file (notmuch_database_t *notmuch, const char *filename,
     return status;
 }
 
+/* Worker thread: parse a file and generate its terms. */
+static void
+prepare_file (gpointer data, gpointer user_data)
+{
+    _pending_file_t *pending = data;
+    add_files_state_t *state = user_data;
+    notmuch_prepared_file_t *prepared;
+
+    /* On failure, prepared is NULL and the file will simply be
+     * indexed by add_file as usual.  The main thread leaves
+     * 'pending' alone until it is prepared, so the result can be
+     * allocated under it. */
+    (void) notmuch_database_prepare_file (pending->notmuch, pending,
+					  pending->filename,
+					  indexing_cli_choices.opts, &prepared);
+
+    g_mutex_lock (&state->pending_lock);
+    pending->prepared = prepared;
+    pending->is_prepared = true;
+    g_cond_broadcast (&state->pending_cond);
+    g_mutex_unlock (&state->pending_lock);
+}
+
+static void
+_pending_file_destroy (_pending_file_t *pending)
+{
+    if (pending->prepared)
+	notmuch_prepared_file_destroy (pending->prepared);
+    talloc_free (pending);
+}
+
+/* Add files from the pending queue to the database, in the order in
+ * which they were queued, until no more than 'keep' are left. */
+static notmuch_status_t
+add_pending_files (notmuch_database_t *notmuch, add_files_state_t *state,
+		   unsigned keep)
+{
+    _pending_file_t *pending;
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+
+    if (! state->pending_files)
+	return NOTMUCH_STATUS_SUCCESS;
+
+    while (g_queue_get_length (state->pending_files) > keep && ! interrupted) {
+	pending = g_queue_pop_head (state->pending_files);
+
+	g_mutex_lock (&state->pending_lock);
+	while (! pending->is_prepared)
+	    g_cond_wait (&state->pending_cond, &state->pending_lock);
+	g_mutex_unlock (&state->pending_lock);
+
+	status = add_file (notmuch, pending->filename, pending->prepared, state);
+	_pending_file_destroy (pending);
+	if (status)
+	    break;
+    }
+
+    return status;
+}
+
+/* Add the file 'filename' (which is stolen) to the database.
+ *
+ * With more than one index job, parsing the file and generating its
+ * terms is handed off to a worker thread, and the file is added
+ * later, once enough files are queued for the workers to stay
+ * busy.  All database access still happens in this thread, and files
+ * are added in the same order as without workers. */
+static notmuch_status_t
+queue_file (notmuch_database_t *notmuch, char *filename,
+	    add_files_state_t *state)
+{
+    _pending_file_t *pending;
+    notmuch_status_t status;
+
+    if (! state->index_pool) {
+	status = add_file (notmuch, filename, NULL, state);
+	talloc_free (filename);
+	return status;
+    }
+
+    pending = talloc_zero (NULL, _pending_file_t);
+    pending->notmuch = notmuch;
+    pending->filename = talloc_steal (pending, filename);
+
+    g_queue_push_tail (state->pending_files, pending);
+    g_thread_pool_push (state->index_pool, pending, NULL);
+
+    return add_pending_files (notmuch, state, 4 * state->index_jobs);
+}
+
+static int
+_scanned_dir_destructor (_scanned_dir_t *scan)
+{
+    int i;
+
+    for (i = 0; i < scan->num_entries; i++)
+	free (scan->entries[i].dirent);
+
+    return 0;
+}
+
+static _scanned_dir_t *
+_scanned_dir_create (const char *path, time_t db_mtime)
+{
+    _scanned_dir_t *scan;
+
+    scan = talloc_zero (NULL, _scanned_dir_t);
+    if (scan == NULL)
+	return NULL;
+
+    scan->path = talloc_strdup (scan, path);
+    scan->db_mtime = db_mtime;
+    talloc_set_destructor (scan, _scanned_dir_destructor);
+
+    return scan;
+}
+
+static void
+_scanned_dir_stat (_scanned_dir_t *scan)
+{
+    if (stat (scan->path, &scan->st))
+	scan->stat_errno = errno;
+    scan->stat_time = time (NULL);
+}
+
+/* Read the entries of the directory, and find their types. */
+static void
+_scanned_dir_read (_scanned_dir_t *scan)
+{
+    struct dirent **fs_entries = NULL;
+    int i, num_fs_entries;
+
+    scan->is_read = true;
+
+    num_fs_entries = scandir (scan->path, &fs_entries, 0, dirent_sort_inode);
+    if (num_fs_entries == -1) {
+	scan->read_errno = errno;
+	return;
+    }
+
+    scan->entries = talloc_array (scan, _scanned_entry_t, num_fs_entries);
+    if (num_fs_entries && scan->entries == NULL) {
+	for (i = 0; i < num_fs_entries; i++)
+	    free (fs_entries[i]);
+	free (fs_entries);
+	scan->read_errno = ENOMEM;
+	return;
+    }
+
+    for (i = 0; i < num_fs_entries; i++) {
+	scan->entries[i].dirent = fs_entries[i];
+	scan->entries[i].type = dirent_type (scan->path, fs_entries[i]);
+	scan->entries[i].type_errno = errno;
+    }
+    scan->num_entries = num_fs_entries;
+
+    free (fs_entries);
+}
+
+static int
+_scanned_entry_cmp_name (const void *a, const void *b)
+{
+    return strcmp (((const _scanned_entry_t *) a)->dirent->d_name,
+		   ((const _scanned_entry_t *) b)->dirent->d_name);
+}
+
+/* Worker thread: stat and read a directory ahead of add_files. */
+static void
+scan_directory (gpointer data, gpointer user_data)
+{
+    _scanned_dir_t *scan = data;
+    add_files_state_t *state = user_data;
+
+    _scanned_dir_stat (scan);
+    if (! scan->stat_errno && S_ISDIR (scan->st.st_mode) &&
+	! (scan->st.st_mtime == scan->db_mtime && scan->st.st_nlink == 2))
+	_scanned_dir_read (scan);
+
+    g_mutex_lock (&state->pending_lock);
+    scan->is_scanned = true;
+    g_cond_broadcast (&state->pending_cond);
+    g_mutex_unlock (&state->pending_lock);
+}
+
+/* Start reading the directory 'path' in a scan worker, so that it is
+ * ready by the time add_files gets to it.  To bound the memory used,
+ * nothing is done if many scans are already waiting. */
+static void
+prefetch_directory (notmuch_database_t *notmuch, const char *path,
+		    add_files_state_t *state)
+{
+    notmuch_directory_t *directory;
+    time_t db_mtime = -1;
+    _scanned_dir_t *scan;
+
+    if (! state->scan_pool ||
+	g_hash_table_size (state->scans) >= 8 * (unsigned) state->index_jobs ||
+	g_hash_table_lookup (state->scans, path))
+	return;
+
+    if (! state->full_scan &&
+	notmuch_database_get_directory (notmuch, path, &directory) == NOTMUCH_STATUS_SUCCESS &&
+	directory) {
+	db_mtime = notmuch_directory_get_mtime (directory);
+	notmuch_directory_destroy (directory);
+    }
+
+    scan = _scanned_dir_create (path, db_mtime);
+    if (scan == NULL)
+	return;
+
+    g_hash_table_insert (state->scans, scan->path, scan);
+    g_thread_pool_push (state->scan_pool, scan, NULL);
+}
+
+/* Return the scan of the directory 'path', which the caller must
+ * talloc_free.  The directory has been stat'ed, but possibly not yet
+ * read (see _scanned_dir_read).  Returns NULL if out of memory. */
+static _scanned_dir_t *
+get_scanned_directory (const char *path, add_files_state_t *state)
+{
+    _scanned_dir_t *scan = NULL;
+
+    if (state->scans)
+	scan = g_hash_table_lookup (state->scans, path);
+
+    if (scan) {
+	g_hash_table_remove (state->scans, path);
+
+	g_mutex_lock (&state->pending_lock);
+	while (! scan->is_scanned)
+	    g_cond_wait (&state->pending_cond, &state->pending_lock);
+	g_mutex_unlock (&state->pending_lock);
+
+	return scan;
+    }
+
+    scan = _scanned_dir_create (path, -1);
+    if (scan)
+	_scanned_dir_stat (scan);
+
+    return scan;
+}
+
+static void
+start_index_jobs (add_files_state_t *state)
+{
+    if (state->index_jobs <= 0)
+	state->index_jobs = sysconf (_SC_NPROCESSORS_ONLN);
+
+    if (state->index_jobs <= 1)
+	return;
+
+    state->pending_files = g_queue_new ();
+    g_mutex_init (&state->pending_lock);
+    g_cond_init (&state->pending_cond);
+
+    state->index_pool = g_thread_pool_new (prepare_file, state,
+					   state->index_jobs, true, NULL);
+
+    state->scans = g_hash_table_new (g_str_hash, g_str_equal);
+    state->scan_pool = g_thread_pool_new (scan_directory, state,
+					  state->index_jobs, true, NULL);
+}
+
+/* Wait for the workers to finish, throwing away any files that were
+ * not added (e.g. because of an error or interruption). */
+static void
+stop_index_jobs (add_files_state_t *state)
+{
+    _pending_file_t *pending;
+    GHashTableIter iter;
+    gpointer scan;
+
+    if (! state->index_pool)
+	return;
+
+    g_thread_pool_free (state->index_pool, true, true);
+    state->index_pool = NULL;
+
+    g_thread_pool_free (state->scan_pool, true, true);
+    state->scan_pool = NULL;
+
+    g_hash_table_iter_init (&iter, state->scans);
+    while (g_hash_table_iter_next (&iter, NULL, &scan))
+	talloc_free (scan);
+    g_hash_table_unref (state->scans);
+    state->scans = NULL;
+
+    while ((pending = g_queue_pop_head (state->pending_files)))
+	_pending_file_destroy (pending);
+
+    g_queue_free (state->pending_files);
+    g_mutex_clear (&state->pending_lock);
+    g_cond_clear (&state->pending_cond);
+}
+
 /* Examine 'path' recursively as follows:
  *
  *   o Ask the filesystem for the mtime of 'path' (fs_mtime)
@@ -481,28 +837,34 @@ add_files (notmuch_database_t *notmuch,
     char *next = NULL;
     time_t fs_mtime, db_mtime;
     notmuch_status_t status, ret = NOTMUCH_STATUS_SUCCESS;
-    struct dirent **fs_entries = NULL;
+    _scanned_dir_t *scan;
+    _scanned_entry_t *fs_entries = NULL;
     int i, num_fs_entries = 0, entry_type;
-    notmuch_directory_t *directory;
+    notmuch_directory_t *directory = NULL;
     notmuch_filenames_t *db_files = NULL;
     notmuch_filenames_t *db_subdirs = NULL;
     time_t stat_time;
-    struct stat st;
     bool is_maildir;
 
-    if (stat (path, &st)) {
+    scan = get_scanned_directory (path, state);
+    if (scan == NULL)
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    if (scan->stat_errno) {
 	fprintf (stderr, "Error reading directory %s: %s\n",
-		 path, strerror (errno));
+		 path, strerror (scan->stat_errno));
+	talloc_free (scan);
 	return NOTMUCH_STATUS_FILE_ERROR;
     }
-    stat_time = time (NULL);
+    stat_time = scan->stat_time;
 
-    if (! S_ISDIR (st.st_mode)) {
+    if (! S_ISDIR (scan->st.st_mode)) {
 	fprintf (stderr, "Error: %s is not a directory.\n", path);
+	talloc_free (scan);
 	return NOTMUCH_STATUS_FILE_ERROR;
     }
 
-    fs_mtime = st.st_mtime;
+    fs_mtime = scan->st.st_mtime;
 
     status = notmuch_database_get_directory (notmuch, path, &directory);
     if (status) {
@@ -528,7 +890,7 @@ add_files (notmuch_database_t *notmuch,
      * mistakenly return the total number of directory entries, since
      * that only inflates the count beyond 2.
      */
-    if (directory && (! state->full_scan) && fs_mtime == db_mtime && st.st_nlink == 2) {
+    if (directory && (! state->full_scan) && fs_mtime == db_mtime && scan->st.st_nlink == 2) {
 	/* There's one catch: pass 1 below considers symlinks to
 	 * directories to be directories, but these don't increase the
 	 * file system link count.  So, only bail early if the
@@ -540,16 +902,15 @@ add_files (notmuch_database_t *notmuch,
 	db_subdirs = NULL;
     }
 
-    /* If the database knows about this directory, then we sort based
-     * on strcmp to match the database sorting. Otherwise, we can do
-     * inode-based sorting for faster filesystem operation. */
-    num_fs_entries = scandir (path, &fs_entries, 0,
-			      directory ?
-			      dirent_sort_strcmp_name : dirent_sort_inode);
+    /* The entries are read in inode order, for faster filesystem
+     * operation.  If the database knows about this directory, then
+     * we sort them based on strcmp to match the database sorting. */
+    if (! scan->is_read)
+	_scanned_dir_read (scan);
 
-    if (num_fs_entries == -1) {
+    if (scan->read_errno) {
 	fprintf (stderr, "Error opening directory %s: %s\n",
-		 path, strerror (errno));
+		 path, strerror (scan->read_errno));
 	/* We consider this a fatal error because, if a user moved a
 	 * message from another directory that we were able to scan
 	 * into this directory, skipping this directory will cause
@@ -558,11 +919,36 @@ add_files (notmuch_database_t *notmuch,
 	goto DONE;
     }
 
-    /* Pass 1: Recurse into all sub-directories. */
-    is_maildir = _entries_resemble_maildir (path, fs_entries, num_fs_entries);
+    fs_entries = scan->entries;
+    num_fs_entries = scan->num_entries;
+
+    if (directory)
+	qsort (fs_entries, num_fs_entries, sizeof (_scanned_entry_t),
+	       _scanned_entry_cmp_name);
 
+    is_maildir = _entries_resemble_maildir (fs_entries, num_fs_entries);
+
+    /* Start reading the sub-directories that pass 1 will recurse
+     * into, so that they're ready by the time we get to them. */
+    for (i = 0; i < num_fs_entries && state->scan_pool; i++) {
+	entry = fs_entries[i].dirent;
+
+	if (_special_directory (entry->d_name) ||
+	    fs_entries[i].type != S_IFDIR ||
+	    (is_maildir && strcmp (entry->d_name, "tmp") == 0) ||
+	    strcmp (entry->d_name, ".notmuch") == 0 ||
+	    _entry_in_ignore_list (state, path, entry->d_name))
+	    continue;
+
+	next = talloc_asprintf (notmuch, "%s/%s", path, entry->d_name);
+	prefetch_directory (notmuch, next, state);
+	talloc_free (next);
+	next = NULL;
+    }
+
+    /* Pass 1: Recurse into all sub-directories. */
     for (i = 0; i < num_fs_entries && ! interrupted; i++) {
-	entry = fs_entries[i];
+	entry = fs_entries[i].dirent;
 
 	/* Ignore special directories to avoid infinite recursion. */
 	if (_special_directory (entry->d_name))
@@ -582,13 +968,14 @@ add_files (notmuch_database_t *notmuch,
 
 	/* We only want to descend into directories (and symlinks to
 	 * directories). */
-	entry_type = dirent_type (path, entry);
+	entry_type = fs_entries[i].type;
 	if (entry_type == -1) {
 	    /* Be pessimistic, e.g. so we don't lose lots of mail just
 	     * because a user broke a symlink. */
 	    fprintf (stderr, "Error reading file %s/%s: %s\n",
-		     path, entry->d_name, strerror (errno));
-	    return NOTMUCH_STATUS_FILE_ERROR;
+		     path, entry->d_name, strerror (fs_entries[i].type_errno));
+	    ret = NOTMUCH_STATUS_FILE_ERROR;
+	    goto DONE;
 	} else if (entry_type != S_IFDIR) {
 	    continue;
 	}
@@ -631,7 +1018,7 @@ add_files (notmuch_database_t *notmuch,
 
     /* Pass 2: Scan for new files, removed files, and removed directories. */
     for (i = 0; i < num_fs_entries && ! interrupted; i++) {
-        entry = fs_entries[i];
+	entry = fs_entries[i].dirent;
 
 	/* Ignore special directories early. */
 	if (_special_directory (entry->d_name))
@@ -683,11 +1070,12 @@ add_files (notmuch_database_t *notmuch,
 	}
 
 	/* Only add regular files (and symlinks to regular files). */
-	entry_type = dirent_type (path, entry);
+	entry_type = fs_entries[i].type;
 	if (entry_type == -1) {
 	    fprintf (stderr, "Error reading file %s/%s: %s\n",
-		     path, entry->d_name, strerror (errno));
-	    return NOTMUCH_STATUS_FILE_ERROR;
+		     path, entry->d_name, strerror (fs_entries[i].type_errno));
+	    ret = NOTMUCH_STATUS_FILE_ERROR;
+	    goto DONE;
 	} else if (entry_type != S_IFREG) {
 	    continue;
 	}
@@ -717,7 +1105,8 @@ add_files (notmuch_database_t *notmuch,
 	    fflush (stdout);
 	}
 
-	status = add_file (notmuch, next, state);
+	status = queue_file (notmuch, next, state);
+	next = NULL;
 	if (status) {
 	    ret = status;
 	    goto DONE;
@@ -728,9 +1117,6 @@ add_files (notmuch_database_t *notmuch,
 	    generic_print_progress ("Processed", "files", state->tv_start,
 				    state->processed_files, state->total_files);
 	}
-
-	talloc_free (next);
-	next = NULL;
     }
 
     if (interrupted)
@@ -778,12 +1164,7 @@ add_files (notmuch_database_t *notmuch,
   DONE:
     if (next)
 	talloc_free (next);
-    if (fs_entries) {
-	for (i = 0; i < num_fs_entries; i++)
-	    free (fs_entries[i]);
-
-	free (fs_entries);
-    }
+    talloc_free (scan);
     if (db_subdirs)
 	notmuch_filenames_destroy (db_subdirs);
     if (db_files)
@@ -1047,6 +1428,499 @@ print_results (const add_files_state_t *state)
     printf ("\n");
 }
 
+#if HAVE_INOTIFY
+/* The events that --watch needs from each watched directory. */
+#define WATCH_EVENTS (IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | \
+		      IN_DELETE | IN_MOVED_FROM)
+
+/* Once some changes were seen, wait this long (in milliseconds) for
+ * more before applying them, e.g. so that both halves of a rename are
+ * applied together. */
+#define WATCH_SETTLE_MS 100
+
+/* Apply the changes seen so far once there are this many, even if
+ * more keep coming. */
+#define WATCH_MAX_PENDING 1000
+
+/* The state of notmuch new --watch. */
+typedef struct {
+    int fd;
+
+    /* The watched directories, by inotify watch descriptor. */
+    GHashTable *paths;
+
+    /* The changes seen since they were last applied to the database,
+     * as sets of paths. */
+    GHashTable *added_files;
+    GHashTable *removed_files;
+    GHashTable *added_directories;
+    GHashTable *removed_directories;
+
+    /* Set when the kernel dropped some events, so that the whole mail
+     * store must be scanned again. */
+    bool rescan;
+} _watch_t;
+
+static int
+_watch_destructor (_watch_t *watch)
+{
+    if (watch->fd >= 0)
+	close (watch->fd);
+
+    g_hash_table_unref (watch->paths);
+    g_hash_table_unref (watch->added_files);
+    g_hash_table_unref (watch->removed_files);
+    g_hash_table_unref (watch->added_directories);
+    g_hash_table_unref (watch->removed_directories);
+
+    return 0;
+}
+
+static _watch_t *
+_watch_create (const void *ctx)
+{
+    _watch_t *watch;
+
+    watch = talloc_zero (ctx, _watch_t);
+    if (watch == NULL)
+	return NULL;
+
+    watch->paths = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+    watch->added_files = g_hash_table_new_full (g_str_hash, g_str_equal,
+						g_free, NULL);
+    watch->removed_files = g_hash_table_new_full (g_str_hash, g_str_equal,
+						  g_free, NULL);
+    watch->added_directories = g_hash_table_new_full (g_str_hash, g_str_equal,
+						      g_free, NULL);
+    watch->removed_directories = g_hash_table_new_full (g_str_hash, g_str_equal,
+							g_free, NULL);
+
+    watch->fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    talloc_set_destructor (watch, _watch_destructor);
+
+    if (watch->fd < 0) {
+	fprintf (stderr, "Error: cannot watch for new mail: %s\n",
+		 strerror (errno));
+	talloc_free (watch);
+	return NULL;
+    }
+
+    return watch;
+}
+
+static unsigned int
+_watch_pending (_watch_t *watch)
+{
+    return g_hash_table_size (watch->added_files) +
+	g_hash_table_size (watch->removed_files) +
+	g_hash_table_size (watch->added_directories) +
+	g_hash_table_size (watch->removed_directories);
+}
+
+static bool
+_path_has_type (const char *path, mode_t type)
+{
+    struct stat st;
+
+    return stat (path, &st) == 0 && (st.st_mode & S_IFMT) == type;
+}
+
+/* Test if 'name' is the "tmp" directory of a maildir in 'path', which
+ * add_files ignores. */
+static bool
+_is_maildir_tmp (const char *path, const char *name)
+{
+    char *cur_path, *new_path;
+    bool ret;
+
+    if (strcmp (name, "tmp") != 0)
+	return false;
+
+    cur_path = talloc_asprintf (NULL, "%s/cur", path);
+    new_path = talloc_asprintf (NULL, "%s/new", path);
+    ret = _path_has_type (cur_path, S_IFDIR) && _path_has_type (new_path, S_IFDIR);
+    talloc_free (cur_path);
+    talloc_free (new_path);
+
+    return ret;
+}
+
+/* Watch the directory 'path' and, recursively, those of its
+ * sub-directories that add_files would descend into. */
+static notmuch_status_t
+watch_directory (_watch_t *watch, const char *path, add_files_state_t *state)
+{
+    _scanned_dir_t *scan;
+    const char *name;
+    char *next;
+    int wd, i;
+    bool is_maildir;
+    notmuch_status_t ret = NOTMUCH_STATUS_SUCCESS;
+
+    wd = inotify_add_watch (watch->fd, path, WATCH_EVENTS | IN_ONLYDIR);
+    if (wd < 0) {
+	/* The directory is already gone again, which will be seen
+	 * in its parent. */
+	if (errno == ENOENT || errno == ENOTDIR)
+	    return NOTMUCH_STATUS_SUCCESS;
+
+	fprintf (stderr, "Error watching directory %s: %s\n",
+		 path, strerror (errno));
+	if (errno == ENOSPC)
+	    fprintf (stderr, "Note: The limit is set in /proc/sys/fs/inotify/max_user_watches.\n");
+	return NOTMUCH_STATUS_FILE_ERROR;
+    }
+    g_hash_table_replace (watch->paths, GINT_TO_POINTER (wd), g_strdup (path));
+
+    /* The directory is read only once it is watched, so that no
+     * sub-directory created in between is missed. */
+    scan = _scanned_dir_create (path, -1);
+    if (scan == NULL)
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    _scanned_dir_read (scan);
+    if (scan->read_errno && scan->read_errno != ENOENT) {
+	fprintf (stderr, "Error opening directory %s: %s\n",
+		 path, strerror (scan->read_errno));
+	ret = NOTMUCH_STATUS_FILE_ERROR;
+	goto DONE;
+    }
+
+    is_maildir = _entries_resemble_maildir (scan->entries, scan->num_entries);
+
+    for (i = 0; i < scan->num_entries; i++) {
+	name = scan->entries[i].dirent->d_name;
+
+	if (_special_directory (name) ||
+	    scan->entries[i].type != S_IFDIR ||
+	    (is_maildir && strcmp (name, "tmp") == 0) ||
+	    strcmp (name, ".notmuch") == 0 ||
+	    _entry_in_ignore_list (state, path, name))
+	    continue;
+
+	next = talloc_asprintf (scan, "%s/%s", path, name);
+	ret = watch_directory (watch, next, state);
+	if (ret)
+	    break;
+    }
+
+  DONE:
+    talloc_free (scan);
+    return ret;
+}
+
+/* Stop watching 'path' and the directories below it, which were moved
+ * elsewhere. */
+static void
+unwatch_directory (_watch_t *watch, const char *path)
+{
+    GHashTableIter iter;
+    gpointer wd, watched;
+    size_t len = strlen (path);
+
+    g_hash_table_iter_init (&iter, watch->paths);
+    while (g_hash_table_iter_next (&iter, &wd, &watched)) {
+	if (strncmp (watched, path, len) == 0 &&
+	    (((char *) watched)[len] == '\0' || ((char *) watched)[len] == '/')) {
+	    inotify_rm_watch (watch->fd, GPOINTER_TO_INT (wd));
+	    g_hash_table_iter_remove (&iter);
+	}
+    }
+}
+
+static notmuch_status_t
+watch_record_event (_watch_t *watch, const struct inotify_event *event,
+		    add_files_state_t *state)
+{
+    const char *dir;
+    char *path;
+    notmuch_status_t status;
+
+    if (event->mask & IN_Q_OVERFLOW) {
+	watch->rescan = true;
+	return NOTMUCH_STATUS_SUCCESS;
+    }
+
+    if (event->mask & IN_IGNORED) {
+	g_hash_table_remove (watch->paths, GINT_TO_POINTER (event->wd));
+	return NOTMUCH_STATUS_SUCCESS;
+    }
+
+    dir = g_hash_table_lookup (watch->paths, GINT_TO_POINTER (event->wd));
+    if (dir == NULL || event->len == 0)
+	return NOTMUCH_STATUS_SUCCESS;
+
+    if (_entry_in_ignore_list (state, dir, event->name)) {
+	if (state->debug)
+	    printf ("(D) watch: explicitly ignoring %s/%s\n",
+		    dir, event->name);
+	return NOTMUCH_STATUS_SUCCESS;
+    }
+
+    if (event->mask & IN_ISDIR) {
+	if (strcmp (event->name, ".notmuch") == 0 ||
+	    _is_maildir_tmp (dir, event->name))
+	    return NOTMUCH_STATUS_SUCCESS;
+
+	path = g_strdup_printf ("%s/%s", dir, event->name);
+	if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+	    /* Watch the new directory right away, so that no message
+	     * delivered into it from now on is missed. */
+	    status = watch_directory (watch, path, state);
+	    if (status) {
+		g_free (path);
+		return status;
+	    }
+	    g_hash_table_add (watch->added_directories, path);
+	} else {
+	    if (event->mask & IN_MOVED_FROM)
+		unwatch_directory (watch, path);
+	    g_hash_table_add (watch->removed_directories, path);
+	}
+    } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+	g_hash_table_add (watch->added_files,
+			  g_strdup_printf ("%s/%s", dir, event->name));
+    } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+	g_hash_table_add (watch->removed_files,
+			  g_strdup_printf ("%s/%s", dir, event->name));
+    }
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+/* Record all the events that can be read without blocking. */
+static notmuch_status_t
+watch_read_events (_watch_t *watch, add_files_state_t *state)
+{
+    char buf[4096]
+	__attribute__ ((aligned (__alignof__ (struct inotify_event))));
+    const struct inotify_event *event;
+    ssize_t len;
+    char *p;
+    notmuch_status_t status;
+
+    for (;;) {
+	len = read (watch->fd, buf, sizeof (buf));
+	if (len < 0) {
+	    if (errno == EAGAIN)
+		return NOTMUCH_STATUS_SUCCESS;
+	    if (errno == EINTR && ! interrupted)
+		continue;
+	    if (errno == EINTR)
+		return NOTMUCH_STATUS_SUCCESS;
+	    fprintf (stderr, "Error reading file system events: %s\n",
+		     strerror (errno));
+	    return NOTMUCH_STATUS_FILE_ERROR;
+	}
+
+	for (p = buf; p < buf + len; p += sizeof (struct inotify_event) + event->len) {
+	    event = (const struct inotify_event *) p;
+	    status = watch_record_event (watch, event, state);
+	    if (status)
+		return status;
+	}
+    }
+}
+
+/* Wait until some changes to the mail store were seen, and then until
+ * either no more come for WATCH_SETTLE_MS, or WATCH_MAX_PENDING were
+ * seen. */
+static notmuch_status_t
+watch_wait (_watch_t *watch, add_files_state_t *state)
+{
+    struct pollfd pfd = { .fd = watch->fd, .events = POLLIN };
+    int timeout = -1;
+    int n;
+    notmuch_status_t status;
+
+    while (! interrupted) {
+	n = poll (&pfd, 1, timeout);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    fprintf (stderr, "Error waiting for file system events: %s\n",
+		     strerror (errno));
+	    return NOTMUCH_STATUS_FILE_ERROR;
+	}
+	if (n == 0)
+	    break;
+
+	status = watch_read_events (watch, state);
+	if (status)
+	    return status;
+
+	if (_watch_pending (watch) >= WATCH_MAX_PENDING)
+	    break;
+	if (_watch_pending (watch) || watch->rescan)
+	    timeout = WATCH_SETTLE_MS;
+    }
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+/* Apply the changes seen by the watch to the database.  The database
+ * is only open while doing so, so that other commands can modify it
+ * in between.
+ *
+ * Each path is looked at again in the file system before it is added
+ * or removed, so that the result does not depend on the order of the
+ * events (e.g. a file deleted and then created again is kept).  As in
+ * a normal run, additions come before removals, so that renamed
+ * messages keep their tags. */
+static notmuch_status_t
+watch_apply (notmuch_config_t *config, _watch_t *watch,
+	     add_files_state_t *state, int batch_size)
+{
+    notmuch_database_t *notmuch;
+    char *status_string = NULL;
+    GHashTableIter iter;
+    gpointer path;
+    _filename_node_t *f;
+    notmuch_status_t status, ret;
+
+    state->processed_files = 0;
+    state->added_messages = 0;
+    state->removed_messages = 0;
+    state->renamed_messages = 0;
+    gettimeofday (&state->tv_start, NULL);
+
+    ret = notmuch_database_open_verbose (state->db_path,
+					 NOTMUCH_DATABASE_MODE_READ_WRITE,
+					 &notmuch, &status_string);
+    if (ret) {
+	if (status_string) {
+	    fputs (status_string, stderr);
+	    free (status_string);
+	}
+	return ret;
+    }
+
+    /* The indexing options of the previous database handle were
+     * freed with it. */
+    indexing_cli_choices.opts = NULL;
+    ret = notmuch_process_shared_indexing_options (notmuch);
+    if (ret)
+	goto DONE;
+
+    if (batch_size > 1) {
+	ret = notmuch_database_begin_batch (notmuch, batch_size);
+	if (ret)
+	    goto DONE;
+    }
+
+    state->removed_files = _filename_list_create (config);
+    state->removed_directories = _filename_list_create (config);
+    state->directory_mtimes = _filename_list_create (config);
+
+    if (watch->rescan) {
+	if (state->verbosity >= VERBOSITY_NORMAL)
+	    printf ("Some changes were missed, scanning all mail.\n");
+	ret = add_files (notmuch, state->db_path, state);
+	if (ret == NOTMUCH_STATUS_SUCCESS)
+	    watch->rescan = false;
+    }
+
+    g_hash_table_iter_init (&iter, watch->added_directories);
+    while (! ret && ! interrupted && g_hash_table_iter_next (&iter, &path, NULL)) {
+	if (_path_has_type (path, S_IFDIR))
+	    ret = add_files (notmuch, path, state);
+    }
+
+    g_hash_table_iter_init (&iter, watch->added_files);
+    while (! ret && ! interrupted && g_hash_table_iter_next (&iter, &path, NULL)) {
+	if (! _path_has_type (path, S_IFREG))
+	    continue;
+	state->processed_files++;
+	if (state->verbosity >= VERBOSITY_VERBOSE)
+	    printf ("%s\n", (char *) path);
+	ret = add_file (notmuch, path, NULL, state);
+    }
+
+    g_hash_table_iter_init (&iter, watch->removed_files);
+    while (! ret && ! interrupted && g_hash_table_iter_next (&iter, &path, NULL)) {
+	if (! _path_has_type (path, S_IFREG))
+	    ret = remove_filename (notmuch, path, state);
+    }
+
+    g_hash_table_iter_init (&iter, watch->removed_directories);
+    while (! ret && ! interrupted && g_hash_table_iter_next (&iter, &path, NULL)) {
+	if (! _path_has_type (path, S_IFDIR))
+	    ret = _remove_directory (config, notmuch, path, state);
+    }
+
+    /* Then the removals found by add_files, as in a normal run. */
+    for (f = state->removed_files->head; f && ! ret && ! interrupted; f = f->next)
+	ret = remove_filename (notmuch, f->filename, state);
+
+    for (f = state->removed_directories->head; f && ! ret && ! interrupted; f = f->next)
+	ret = _remove_directory (config, notmuch, f->filename, state);
+
+    for (f = state->directory_mtimes->head; f && ! ret && ! interrupted; f = f->next) {
+	notmuch_directory_t *directory;
+	status = notmuch_database_get_directory (notmuch, f->filename, &directory);
+	if (status == NOTMUCH_STATUS_SUCCESS && directory) {
+	    notmuch_directory_set_mtime (directory, f->mtime);
+	    notmuch_directory_destroy (directory);
+	}
+    }
+
+    talloc_free (state->removed_files);
+    talloc_free (state->removed_directories);
+    talloc_free (state->directory_mtimes);
+
+    g_hash_table_remove_all (watch->added_files);
+    g_hash_table_remove_all (watch->removed_files);
+    g_hash_table_remove_all (watch->added_directories);
+    g_hash_table_remove_all (watch->removed_directories);
+
+    if (batch_size > 1) {
+	status = notmuch_database_end_batch (notmuch);
+	if (status && ! ret)
+	    ret = status;
+    }
+
+  DONE:
+    status = notmuch_database_destroy (notmuch);
+    if (status && ! ret)
+	ret = status;
+    indexing_cli_choices.opts = NULL;
+
+    return ret;
+}
+
+/* Keep the database up to date with the changes to the mail store
+ * until interrupted, running the post-new hook after each change if
+ * 'hooks' is set. */
+static notmuch_status_t
+watch_changes (notmuch_config_t *config, _watch_t *watch,
+	       add_files_state_t *state, int batch_size, bool hooks)
+{
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+
+    while (! interrupted) {
+	status = watch_wait (watch, state);
+	if (status || interrupted)
+	    break;
+
+	status = watch_apply (config, watch, state, batch_size);
+	if (status)
+	    break;
+
+	if (state->added_messages || state->removed_messages ||
+	    state->renamed_messages) {
+	    if (state->verbosity >= VERBOSITY_NORMAL) {
+		print_results (state);
+		fflush (stdout);
+	    }
+	    if (hooks)
+		(void) notmuch_run_hook (state->db_path, "post-new");
+	}
+    }
+
+    return status;
+}
+#endif
+
 int
 notmuch_new_command (notmuch_config_t *config, int argc, char *argv[])
 {
@@ -1069,6 +1943,12 @@ notmuch_new_command (notmuch_config_t *config, int argc, char *argv[])
     bool timer_is_active = false;
     bool hooks = true;
     bool quiet = false, verbose = false;
+    bool watch = false;
+#if HAVE_INOTIFY
+    _watch_t *watcher = NULL;
+#endif
+    int batch_size;
+    bool batched = false;
     notmuch_status_t status;
 
     notmuch_opt_desc_t options[] = {
@@ -1077,6 +1957,8 @@ notmuch_new_command (notmuch_config_t *config, int argc, char *argv[])
 	{ .opt_bool = &add_files_state.debug, .name = "debug" },
 	{ .opt_bool = &add_files_state.full_scan, .name = "full-scan" },
 	{ .opt_bool = &hooks, .name = "hooks" },
+	{ .opt_int = &add_files_state.index_jobs, .name = "jobs" },
+	{ .opt_bool = &watch, .name = "watch" },
 	{ .opt_inherit = notmuch_shared_indexing_options },
 	{ .opt_inherit = notmuch_shared_options },
 	{ }
@@ -1088,6 +1970,13 @@ notmuch_new_command (notmuch_config_t *config, int argc, char *argv[])
 
     notmuch_process_shared_options (argv[0]);
 
+#if ! HAVE_INOTIFY
+    if (watch) {
+	fprintf (stderr, "Error: --watch is not available, since notmuch was built without inotify.\n");
+	return EXIT_FAILURE;
+    }
+#endif
+
     /* quiet trumps verbose */
     if (quiet)
 	add_files_state.verbosity = VERBOSITY_QUIET;
@@ -1096,6 +1985,7 @@ notmuch_new_command (notmuch_config_t *config, int argc, char *argv[])
 
     add_files_state.new_tags = notmuch_config_get_new_tags (config, &add_files_state.new_tags_length);
     add_files_state.synchronize_flags = notmuch_config_get_maildir_synchronize_flags (config);
+    batch_size = notmuch_config_get_new_batch_size (config);
     db_path = notmuch_config_get_database_path (config);
     add_files_state.db_path = db_path;
 
@@ -1172,7 +2062,8 @@ notmuch_new_command (notmuch_config_t *config, int argc, char *argv[])
 	    }
 
 	    if (notmuch_database_dump (notmuch, backup_name, "",
-				       DUMP_FORMAT_BATCH_TAG, DUMP_INCLUDE_DEFAULT, true)) {
+				       DUMP_FORMAT_BATCH_TAG, DUMP_INCLUDE_DEFAULT, true,
+				       add_files_state.index_jobs, -1)) {
 		fprintf (stderr, "Backup failed. Aborting upgrade.");
 		return EXIT_FAILURE;
 	    }
@@ -1217,6 +2108,21 @@ notmuch_new_command (notmuch_config_t *config, int argc, char *argv[])
     talloc_free (dot_notmuch_path);
     dot_notmuch_path = NULL;
 
+#if HAVE_INOTIFY
+    /* Start watching before scanning, so that no message delivered
+     * during the scan is missed. */
+    if (watch) {
+	sigaction (SIGTERM, &action, NULL);
+
+	watcher = _watch_create (config);
+	if (watcher == NULL ||
+	    watch_directory (watcher, db_path, &add_files_state)) {
+	    notmuch_database_destroy (notmuch);
+	    return EXIT_FAILURE;
+	}
+    }
+#endif
+
     gettimeofday (&add_files_state.tv_start, NULL);
 
     add_files_state.removed_files = _filename_list_create (config);
@@ -1229,7 +2135,22 @@ notmuch_new_command (notmuch_config_t *config, int argc, char *argv[])
 	timer_is_active = true;
     }
 
+    /* Group the changes for many messages into each commit. */
+    if (batch_size > 1) {
+	ret = notmuch_database_begin_batch (notmuch, batch_size);
+	if (ret)
+	    goto DONE;
+	batched = true;
+    }
+
+    start_index_jobs (&add_files_state);
+
     ret = add_files (notmuch, db_path, &add_files_state);
+    if (ret == NOTMUCH_STATUS_SUCCESS)
+	ret = add_pending_files (notmuch, &add_files_state, 0);
+
+    stop_index_jobs (&add_files_state);
+
     if (ret)
 	goto DONE;
 
@@ -1269,6 +2190,12 @@ notmuch_new_command (notmuch_config_t *config, int argc, char *argv[])
     }
 
   DONE:
+    if (batched) {
+	status = notmuch_database_end_batch (notmuch);
+	if (status && ! ret)
+	    ret = status;
+    }
+
     talloc_free (add_files_state.removed_files);
     talloc_free (add_files_state.removed_directories);
     talloc_free (add_files_state.directory_mtimes);
@@ -1284,6 +2211,7 @@ notmuch_new_command (notmuch_config_t *config, int argc, char *argv[])
 		 notmuch_status_to_string (ret));
 
     notmuch_database_destroy (notmuch);
+    indexing_cli_choices.opts = NULL;
 
     if (hooks && !ret && !interrupted)
 	ret = notmuch_run_hook (db_path, "post-new");
@@ -1291,6 +2219,15 @@ notmuch_new_command (notmuch_config_t *config, int argc, char *argv[])
     if (ret || interrupted)
 	return EXIT_FAILURE;
 
+#if HAVE_INOTIFY
+    if (watch) {
+	ret = watch_changes (config, watcher, &add_files_state,
+			     batch_size, hooks);
+	talloc_free (watcher);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+#endif
+
     if (add_files_state.vanished_files)
 	return NOTMUCH_EXIT_TEMPFAIL;
 
@@ -125,16 +125,74 @@ process_properties_line (notmuch_database_t *notmuch, const char* line)
 
 static regex_t regex;
 
+/* Input is read, decompressed and parsed by a reader thread, which
+ * hands it to the main thread in batches of at most this many
+ * records.  Each batch is applied to the database in one atomic
+ * section, with the messages looked up in message-id order. */
+#define RESTORE_BATCH_SIZE 1000
+
+/* Number of batches shared between the reader and the main thread. */
+#define RESTORE_QUEUE_DEPTH 4
+
+typedef enum {
+    RESTORE_RECORD_CONFIG,
+    RESTORE_RECORD_PROPERTIES,
+    RESTORE_RECORD_TAGS,
+    /* A skipped line, kept only for its warning. */
+    RESTORE_RECORD_SKIPPED
+} restore_record_kind_t;
+
+typedef struct {
+    restore_record_kind_t kind;
+    /* The rest of the line for config and properties records, the
+     * message-id for tag records. */
+    char *text;
+    tag_op_list_t *tag_ops;
+    /* Warning to print, in input order, once the batch is applied. */
+    char *warning;
+} restore_record_t;
+
+typedef struct {
+    /* Owns everything allocated for the records.  Only the thread
+     * currently holding the batch touches it. */
+    void *ctx;
+    /* A line can produce a properties record and a warning. */
+    restore_record_t records[RESTORE_BATCH_SIZE + 1];
+    int count;
+    /* Number of input lines read up to the end of this batch. */
+    unsigned long line_count;
+    /* The reader has stopped; this is the last batch. */
+    bool last;
+    /* The reader stopped because of an error it has reported. */
+    bool failed;
+} restore_batch_t;
+
+typedef struct {
+    gzFile input;
+    int include;
+    int input_format;
+    /* Lines already applied by an earlier, interrupted restore. */
+    unsigned long skip_lines;
+    bool in_header;
+    void *line_ctx;
+    /* Filled batches, for the main thread to apply. */
+    GAsyncQueue *full;
+    /* Applied batches, for the reader to fill again. */
+    GAsyncQueue *empty;
+    gint cancelled;
+} restore_reader_t;
+
 /* Non-zero return indicates an error in retrieving the message,
- * or in applying the tags.  Missing messages are reported, but not
- * considered errors.
+ * or in applying the tags.  Missing messages are reported in
+ * '*warning', but not considered errors.
  */
 static int
-tag_message (unused (void *ctx),
+tag_message (void *ctx,
 	     notmuch_database_t *notmuch,
 	     const char *message_id,
 	     tag_op_list_t *tag_ops,
-	     tag_op_flag_t flags)
+	     tag_op_flag_t flags,
+	     char **warning)
 {
     notmuch_status_t status;
     notmuch_message_t *message = NULL;
@@ -147,8 +205,9 @@ tag_message (unused (void *ctx),
 	return 1;
     }
     if (message == NULL) {
-	fprintf (stderr, "Warning: cannot apply tags to missing message: %s\n",
-		 message_id);
+	*warning = talloc_asprintf (ctx,
+				    "Warning: cannot apply tags to missing message: %s",
+				    message_id);
 	/* We consider this a non-fatal error. */
 	return 0;
     }
@@ -170,7 +229,8 @@ tag_message (unused (void *ctx),
 
 static int
 parse_sup_line (void *ctx, char *line,
-		char **query_str, tag_op_list_t *tag_ops)
+		char **query_str, tag_op_list_t *tag_ops,
+		char **warning)
 {
 
     regmatch_t match[3];
@@ -188,8 +248,9 @@ parse_sup_line (void *ctx, char *line,
 
     rerr = xregexec (&regex, line, 3, match, 0);
     if (rerr == REG_NOMATCH) {
-	fprintf (stderr, "Warning: Ignoring invalid sup format line: %s\n",
-		 line);
+	*warning = talloc_asprintf (ctx,
+				    "Warning: Ignoring invalid sup format line: %s",
+				    line);
 	return 1;
     }
 
@@ -219,25 +280,356 @@ parse_sup_line (void *ctx, char *line,
 
 }
 
+static restore_record_t *
+batch_append (restore_batch_t *batch, restore_record_kind_t kind)
+{
+    restore_record_t *record = &batch->records[batch->count++];
+
+    record->kind = kind;
+    record->text = NULL;
+    record->tag_ops = NULL;
+    record->warning = NULL;
+
+    return record;
+}
+
+/* Parse one input line into records of 'batch'.  'skip' lines are
+ * only looked at to find the input format.  Returns 0 to go on, 1 at
+ * the end of the interesting input, and -1 on a fatal error (which
+ * has been reported). */
+static int
+read_line (restore_reader_t *reader, restore_batch_t *batch,
+	   const char *line, ssize_t line_len, bool skip)
+{
+    restore_record_t *record;
+    char *copy, *query_string, *prefix, *term;
+    char *warning = NULL;
+    tag_op_list_t *tag_ops;
+    int ret;
+
+    if (reader->in_header && (reader->include & DUMP_INCLUDE_CONFIG) &&
+	line_len >= 2 && line[0] == '#' && line[1] == '@' && ! skip) {
+	record = batch_append (batch, RESTORE_RECORD_CONFIG);
+	record->text = talloc_strndup (batch->ctx, line + 2, line_len - 2);
+	if (record->text == NULL)
+	    goto OUT_OF_MEMORY;
+    }
+
+    if ((reader->include & DUMP_INCLUDE_PROPERTIES) &&
+	line_len >= 2 && line[0] == '#' && line[1] == '=' && ! skip) {
+	record = batch_append (batch, RESTORE_RECORD_PROPERTIES);
+	record->text = talloc_strndup (batch->ctx, line + 2, line_len - 2);
+	if (record->text == NULL)
+	    goto OUT_OF_MEMORY;
+    }
+
+    if (reader->in_header) {
+	const char *p;
+
+	if ((line_len == 0) ||
+	    (line[0] == '#') ||
+	    /* the cast is safe because gz_getline never returns a
+	     * negative length on success */
+	    (strspn (line, " \t\n") == (unsigned) line_len))
+	    return 0;
+
+	if (! ((reader->include & DUMP_INCLUDE_TAGS) ||
+	       (reader->include & DUMP_INCLUDE_PROPERTIES)))
+	    return 1;
+
+	reader->in_header = false;
+
+	for (p = line; (reader->input_format == DUMP_FORMAT_AUTO) && *p; p++) {
+	    if (*p == '(')
+		reader->input_format = DUMP_FORMAT_SUP;
+	}
+
+	if (reader->input_format == DUMP_FORMAT_AUTO)
+	    reader->input_format = DUMP_FORMAT_BATCH_TAG;
+
+	if (reader->input_format == DUMP_FORMAT_SUP)
+	    if ( xregcomp (&regex,
+			   "^([^ ]+) \\(([^)]*)\\)$",
+			   REG_EXTENDED) )
+		INTERNAL_ERROR ("compile time constant regex failed.");
+    }
+
+    if (skip)
+	return 0;
+
+    /* The tag operations point into the line, so each line needs its
+     * own copy. */
+    copy = talloc_strndup (batch->ctx, line, line_len);
+    tag_ops = tag_op_list_create (batch->ctx);
+    if (copy == NULL || tag_ops == NULL)
+	goto OUT_OF_MEMORY;
+
+    if (reader->input_format == DUMP_FORMAT_SUP) {
+	ret = parse_sup_line (batch->ctx, copy, &query_string, tag_ops,
+			      &warning);
+    } else {
+	ret = parse_tag_line_deferred (batch->ctx, copy, TAG_FLAG_BE_GENEROUS,
+				       &query_string, tag_ops, &warning);
+
+	if (ret == 0) {
+	    ret = parse_boolean_term (batch->ctx, query_string,
+				      &prefix, &term);
+	    if (ret && errno == EINVAL) {
+		warning = talloc_asprintf (batch->ctx,
+					   "Warning: cannot parse query: %s (skipping)",
+					   query_string);
+		ret = 1;
+	    } else if (ret) {
+		/* This is more fatal (e.g., out of memory) */
+		fprintf (stderr, "Error parsing query: %s\n",
+			 strerror (errno));
+		return -1;
+	    } else if (strcmp ("id", prefix) != 0) {
+		warning = talloc_asprintf (batch->ctx,
+					   "Warning: not an id query: %s (skipping)",
+					   query_string);
+		ret = 1;
+	    }
+	    query_string = term;
+	}
+    }
+
+    if (ret < 0)
+	return -1;
+
+    if (warning) {
+	record = batch_append (batch, RESTORE_RECORD_SKIPPED);
+	record->warning = warning;
+    }
+
+    if (ret > 0)
+	return 0;
+
+    record = batch_append (batch, RESTORE_RECORD_TAGS);
+    record->text = query_string;
+    record->tag_ops = tag_ops;
+
+    return 0;
+
+  OUT_OF_MEMORY:
+    fprintf (stderr, "Out of memory.\n");
+    return -1;
+}
+
+/* Reader thread: fill batches from the input until it ends, there is
+ * an error, or the main thread asks to stop. */
+static gpointer
+read_input (gpointer data)
+{
+    restore_reader_t *reader = data;
+    restore_batch_t *batch;
+    char *line = NULL;
+    ssize_t line_len;
+    unsigned long line_count = 0;
+    util_status_t status;
+    int ret = 0;
+
+    batch = g_async_queue_pop (reader->empty);
+
+    while (! g_atomic_int_get (&reader->cancelled)) {
+	status = gz_getline (reader->line_ctx, &line, &line_len, reader->input);
+
+	/* empty input file not considered an error */
+	if (status == UTIL_EOF)
+	    break;
+
+	if (status) {
+	    fprintf (stderr, "Error reading (gzipped) input: %s\n",
+		     gz_error_string (status, reader->input));
+	    batch->failed = true;
+	    break;
+	}
+
+	line_count++;
+
+	ret = read_line (reader, batch, line, line_len,
+			 line_count <= reader->skip_lines);
+	if (ret < 0)
+	    batch->failed = true;
+	if (ret)
+	    break;
+
+	if (batch->count >= RESTORE_BATCH_SIZE) {
+	    batch->line_count = line_count;
+	    g_async_queue_push (reader->full, batch);
+	    batch = g_async_queue_pop (reader->empty);
+	}
+    }
+
+    batch->line_count = line_count;
+    batch->last = true;
+    g_async_queue_push (reader->full, batch);
+
+    return NULL;
+}
+
+static int
+_record_cmp_message_id (const void *a, const void *b)
+{
+    const restore_record_t *ra = *(const restore_record_t * const *) a;
+    const restore_record_t *rb = *(const restore_record_t * const *) b;
+    int cmp = strcmp (ra->text, rb->text);
+
+    /* Records are in input order in the batch; keep that order for
+     * repeated message-ids, so the last line still wins. */
+    if (cmp == 0)
+	cmp = (ra < rb) ? -1 : (ra > rb);
+
+    return cmp;
+}
+
+/* Apply the records of 'batch' in one atomic section.  Config and
+ * properties lines are applied in input order; tags are applied in
+ * message-id order, which keeps the database lookups close together.
+ * Warnings are printed afterwards, in input order. */
+static int
+apply_batch (notmuch_database_t *notmuch, restore_batch_t *batch,
+	     tag_op_flag_t flags)
+{
+    restore_record_t **sorted;
+    int i, count = 0;
+    int ret = 0;
+
+    sorted = talloc_array (batch->ctx, restore_record_t *, batch->count);
+    if (sorted == NULL) {
+	fprintf (stderr, "Out of memory.\n");
+	return 1;
+    }
+
+    if (print_status_database ("notmuch restore", notmuch,
+			       notmuch_database_begin_atomic (notmuch)))
+	return 1;
+
+    for (i = 0; i < batch->count && ! ret; i++) {
+	restore_record_t *record = &batch->records[i];
+
+	switch (record->kind) {
+	case RESTORE_RECORD_CONFIG:
+	    ret = process_config_line (notmuch, record->text);
+	    break;
+	case RESTORE_RECORD_PROPERTIES:
+	    ret = process_properties_line (notmuch, record->text);
+	    break;
+	case RESTORE_RECORD_TAGS:
+	    sorted[count++] = record;
+	    break;
+	case RESTORE_RECORD_SKIPPED:
+	    break;
+	}
+    }
+
+    qsort (sorted, count, sizeof (*sorted), _record_cmp_message_id);
+
+    for (i = 0; i < count && ! ret; i++)
+	ret = tag_message (batch->ctx, notmuch, sorted[i]->text,
+			   sorted[i]->tag_ops, flags, &sorted[i]->warning);
+
+    /* Keep what was applied before an error, as a line at a time
+     * restore would have. */
+    if (print_status_database ("notmuch restore", notmuch,
+			       notmuch_database_end_atomic (notmuch)))
+	ret = 1;
+
+    for (i = 0; i < batch->count; i++) {
+	if (batch->records[i].warning)
+	    fprintf (stderr, "%s\n", batch->records[i].warning);
+    }
+
+    return ret;
+}
+
+/* Read the number of input lines applied by an interrupted restore
+ * from 'path'.  A missing file means none were. */
+static int
+read_checkpoint (const char *path, unsigned long *line_count)
+{
+    FILE *file;
+    int ret = 0;
+
+    *line_count = 0;
+
+    file = fopen (path, "r");
+    if (file == NULL) {
+	if (errno == ENOENT)
+	    return 0;
+	fprintf (stderr, "Error opening checkpoint %s: %s\n",
+		 path, strerror (errno));
+	return 1;
+    }
+
+    if (fscanf (file, "%lu", line_count) != 1) {
+	fprintf (stderr, "Error: invalid checkpoint %s\n", path);
+	ret = 1;
+    }
+
+    fclose (file);
+
+    return ret;
+}
+
+/* Record in 'path' that the first 'line_count' input lines have been
+ * applied.  The file is replaced atomically. */
+static int
+write_checkpoint (void *ctx, const char *path, unsigned long line_count)
+{
+    char *tmp_path;
+    FILE *file;
+    int ret = 1;
+
+    tmp_path = talloc_asprintf (ctx, "%s.tmp", path);
+    if (tmp_path == NULL) {
+	fprintf (stderr, "Out of memory.\n");
+	return 1;
+    }
+
+    file = fopen (tmp_path, "w");
+    if (file == NULL)
+	goto DONE;
+
+    fprintf (file, "%lu\n", line_count);
+    if (fclose (file) == EOF || rename (tmp_path, path)) {
+	unlink (tmp_path);
+	goto DONE;
+    }
+
+    ret = 0;
+
+  DONE:
+    if (ret)
+	fprintf (stderr, "Error writing checkpoint %s: %s\n",
+		 path, strerror (errno));
+    talloc_free (tmp_path);
+    return ret;
+}
+
 int
 notmuch_restore_command (notmuch_config_t *config, int argc, char *argv[])
 {
     notmuch_database_t *notmuch;
     bool accumulate = false;
     tag_op_flag_t flags = 0;
-    tag_op_list_t *tag_ops;
 
     const char *input_file_name = NULL;
     const char *name_for_error = NULL;
+    const char *checkpoint_file_name = NULL;
     gzFile input = NULL;
-    char *line = NULL;
-    void *line_ctx = NULL;
-    ssize_t line_len;
+    restore_reader_t reader;
+    restore_batch_t *batch;
+    GThread *reader_thread;
+    void *batches_ctx;
+    bool last = false;
+    bool output_is_a_tty;
 
     int ret = 0;
     int opt_index;
     int include = 0;
     int input_format = DUMP_FORMAT_AUTO;
+    int i;
 
     if (notmuch_database_open (notmuch_config_get_database_path (config),
 			       NOTMUCH_DATABASE_MODE_READ_WRITE, &notmuch))
@@ -258,6 +650,7 @@ notmuch_restore_command (notmuch_config_t *config, int argc, char *argv[])
 				  { "tags", DUMP_INCLUDE_TAGS} } },
 
 	{ .opt_string = &input_file_name, .name = "input" },
+	{ .opt_string = &checkpoint_file_name, .name = "checkpoint" },
 	{ .opt_bool = &accumulate, .name = "accumulate" },
 	{ .opt_inherit = notmuch_shared_options },
 	{ }
@@ -310,142 +703,88 @@ notmuch_restore_command (notmuch_config_t *config, int argc, char *argv[])
 	goto DONE;
     }
 
-    tag_ops = tag_op_list_create (config);
-    if (tag_ops == NULL) {
-	fprintf (stderr, "Out of memory.\n");
+    memset (&reader, 0, sizeof (reader));
+    reader.input = input;
+    reader.include = include;
+    reader.input_format = input_format;
+    reader.in_header = true;
+
+    if (checkpoint_file_name &&
+	read_checkpoint (checkpoint_file_name, &reader.skip_lines)) {
 	ret = EXIT_FAILURE;
 	goto DONE;
     }
 
-    do {
-	util_status_t status;
-
-	status = gz_getline (line_ctx, &line, &line_len, input);
-
-	/* empty input file not considered an error */
-	if (status == UTIL_EOF) {
-	    ret = EXIT_SUCCESS;
-	    goto DONE;
-	}
-
-	if (status) {
-	    fprintf (stderr, "Error reading (gzipped) input: %s\n",
-		     gz_error_string(status, input));
+    /* The reader thread only allocates from contexts it is handed, so
+     * that it never races the main thread for a talloc parent. */
+    batches_ctx = talloc_new (config);
+    reader.line_ctx = talloc_new (batches_ctx);
+    reader.full = g_async_queue_new ();
+    reader.empty = g_async_queue_new ();
+    for (i = 0; i < RESTORE_QUEUE_DEPTH; i++) {
+	batch = talloc_zero (batches_ctx, restore_batch_t);
+	if (batch == NULL || (batch->ctx = talloc_new (batch)) == NULL) {
+	    fprintf (stderr, "Out of memory.\n");
 	    ret = EXIT_FAILURE;
-	    goto DONE;
-	}
-
-	if ((include & DUMP_INCLUDE_CONFIG) && line_len >= 2 && line[0] == '#' && line[1] == '@') {
-	    ret = process_config_line(notmuch, line+2);
-	    if (ret)
-		goto DONE;
-	}
-	if ((include & DUMP_INCLUDE_PROPERTIES) && line_len >= 2 && line[0] == '#' && line[1] == '=') {
-	    ret = process_properties_line (notmuch, line + 2);
-	    if (ret)
-		goto DONE;
+	    goto DONE_BATCHES;
 	}
-
-    } while ((line_len == 0) ||
-	     (line[0] == '#') ||
-	     /* the cast is safe because we checked about for line_len < 0 */
-	     (strspn (line, " \t\n") == (unsigned)line_len));
-
-    if (! ((include & DUMP_INCLUDE_TAGS) || (include & DUMP_INCLUDE_PROPERTIES))) {
-	ret = EXIT_SUCCESS;
-	goto DONE;
+	g_async_queue_push (reader.empty, batch);
     }
 
-    char *p;
-    for (p = line; (input_format == DUMP_FORMAT_AUTO) && *p; p++) {
-	if (*p == '(')
-	    input_format = DUMP_FORMAT_SUP;
-    }
+    output_is_a_tty = isatty (fileno (stdout));
 
-    if (input_format == DUMP_FORMAT_AUTO)
-	input_format = DUMP_FORMAT_BATCH_TAG;
+    reader_thread = g_thread_new ("restore-reader", read_input, &reader);
 
-    if (input_format == DUMP_FORMAT_SUP)
-	if ( xregcomp (&regex,
-		       "^([^ ]+) \\(([^)]*)\\)$",
-		       REG_EXTENDED) )
-	    INTERNAL_ERROR ("compile time constant regex failed.");
+    while (! last) {
+	batch = g_async_queue_pop (reader.full);
+	last = batch->last;
 
-    do {
-	char *query_string, *prefix, *term;
+	if (batch->failed)
+	    ret = 1;
 
-	if (line_ctx != NULL)
-	    talloc_free (line_ctx);
+	/* After an error, only wait for the reader to stop. */
+	if (! ret && batch->count)
+	    ret = apply_batch (notmuch, batch, flags);
 
-	line_ctx = talloc_new (config);
+	if (! ret && checkpoint_file_name && ! last)
+	    ret = write_checkpoint (batches_ctx, checkpoint_file_name,
+				    batch->line_count);
 
-	if ((include & DUMP_INCLUDE_PROPERTIES) && line_len >= 2 && line[0] == '#' && line[1] == '=') {
-	    ret = process_properties_line (notmuch, line + 2);
-	    if (ret)
-		goto DONE;
+	if (! ret && output_is_a_tty && ! last) {
+	    printf ("\r\033[KRestored %lu lines...", batch->line_count);
+	    fflush (stdout);
 	}
 
-	if (input_format == DUMP_FORMAT_SUP) {
-	    ret = parse_sup_line (line_ctx, line, &query_string, tag_ops);
-	} else {
-	    ret = parse_tag_line (line_ctx, line, TAG_FLAG_BE_GENEROUS,
-				  &query_string, tag_ops);
-
-	    if (ret == 0) {
-		ret = parse_boolean_term (line_ctx, query_string,
-					  &prefix, &term);
-		if (ret && errno == EINVAL) {
-		    fprintf (stderr, "Warning: cannot parse query: %s (skipping)\n", query_string);
-		    continue;
-		} else if (ret) {
-		    /* This is more fatal (e.g., out of memory) */
-		    fprintf (stderr, "Error parsing query: %s\n",
-			     strerror (errno));
-		    ret = 1;
-		    break;
-		} else if (strcmp ("id", prefix) != 0) {
-		    fprintf (stderr, "Warning: not an id query: %s (skipping)\n", query_string);
-		    continue;
-		}
-		query_string = term;
-	    }
-	}
-
-	if (ret > 0)
-	    continue;
-
-	if (ret < 0)
-	    break;
-
-	ret = tag_message (line_ctx, notmuch, query_string,
-			   tag_ops, flags);
 	if (ret)
-	    break;
+	    g_atomic_int_set (&reader.cancelled, 1);
 
-    }  while (! (ret = gz_getline (line_ctx, &line, &line_len, input)));
+	talloc_free_children (batch->ctx);
+	batch->count = 0;
+	g_async_queue_push (reader.empty, batch);
+    }
 
+    g_thread_join (reader_thread);
 
-    /* EOF is normal loop termination condition, UTIL_SUCCESS is
-     * impossible here */
-    if (ret == UTIL_EOF) {
-	ret = EXIT_SUCCESS;
-    } else {
-	fprintf (stderr, "Error reading (gzipped) input: %s\n",
-		 gz_error_string (ret, input));
-	ret = EXIT_FAILURE;
-    }
+    if (output_is_a_tty)
+	printf ("\r\033[K");
 
-    /* currently this should not be after DONE: since we don't 
-     * know if the xregcomp was reached
-     */
+    /* The input is done with, so a later run must start over. */
+    if (! ret && checkpoint_file_name && unlink (checkpoint_file_name) &&
+	errno != ENOENT) {
+	fprintf (stderr, "Error removing checkpoint %s: %s\n",
+		 checkpoint_file_name, strerror (errno));
+	ret = 1;
+    }
 
-    if (input_format == DUMP_FORMAT_SUP)
+    if (reader.input_format == DUMP_FORMAT_SUP && ! reader.in_header)
 	regfree (&regex);
 
- DONE:
-    if (line_ctx != NULL)
-	talloc_free (line_ctx);
+  DONE_BATCHES:
+    g_async_queue_unref (reader.full);
+    g_async_queue_unref (reader.empty);
+    talloc_free (batches_ctx);
 
+ DONE:
     if (notmuch)
 	notmuch_database_destroy (notmuch);
 
@@ -61,16 +61,50 @@ typedef struct {
     int offset;
     int limit;
     int dupe;
-    GHashTable *addresses;
+    struct _address_table *addresses;
     int dedup;
+    int top;
 } search_context_t;
 
 typedef struct {
     const char *name;
     const char *addr;
     int count;
+    /* In an address table: the hash of the name and address, the
+     * hash of the address ignoring case, and the index of the
+     * previous mailbox with the same address ignoring case, or -1. */
+    unsigned int hash;
+    unsigned int address_hash;
+    int previous;
 } mailbox_t;
 
+/* Size of the blocks the names and addresses of an address table are
+ * copied into. */
+#define ADDRESS_STRINGS_BLOCK 65536
+
+/* The distinct mailboxes seen by "notmuch address", for
+ * deduplication. */
+typedef struct _address_table {
+    /* All distinct mailboxes, in order of first appearance. There is
+     * room for slots_size / 2 of them. */
+    mailbox_t *mailboxes;
+    unsigned int mailboxes_used;
+
+    /* Open-addressing tables with linear probing, of one plus the
+     * index of a mailbox, or 0 for an empty slot. 'slots' is keyed
+     * by the name and address of each mailbox, 'address_slots' by the
+     * address ignoring case, and leads to the latest mailbox with
+     * that address. The size is a power of two, and at most half of
+     * the slots are used. */
+    unsigned int *slots;
+    unsigned int *address_slots;
+    unsigned int slots_size;
+
+    /* The rest of the current block of names and addresses. */
+    char *strings;
+    size_t strings_left;
+} address_table_t;
+
 /* Return two stable query strings that identify exactly the matched
  * and unmatched messages currently in thread.  If there are no
  * matched or unmatched messages, the returned buffers will be
@@ -133,23 +167,28 @@ do_search_threads (search_context_t *ctx)
 	    ctx->offset = 0;
     }
 
+    /* Only the queries of structured output (format version 2 and
+     * later) need the messages of each thread. */
+    if (ctx->output == OUTPUT_THREADS || format->is_text_printer ||
+	notmuch_format_version < 2)
+	notmuch_query_set_use_thread_summaries (ctx->query, true);
+
     status = notmuch_query_search_threads (ctx->query, &threads);
     if (print_status_query("notmuch search", ctx->query, status))
 	return 1;
 
+    status = notmuch_threads_skip (threads, ctx->offset);
+    if (print_status_query ("notmuch search", ctx->query, status))
+	return 1;
+
     format->begin_list (format);
 
     for (i = 0;
-	 notmuch_threads_valid (threads) && (ctx->limit < 0 || i < ctx->offset + ctx->limit);
+	 notmuch_threads_valid (threads) && (ctx->limit < 0 || i < ctx->limit);
 	 notmuch_threads_move_to_next (threads), i++)
     {
 	thread = notmuch_threads_get (threads);
 
-	if (i < ctx->offset) {
-	    notmuch_thread_destroy (thread);
-	    continue;
-	}
-
 	if (ctx->output == OUTPUT_THREADS) {
 	    format->set_prefix (format, "thread");
 	    format->string (format,
@@ -269,31 +308,146 @@ do_search_threads (search_context_t *ctx)
     return 0;
 }
 
-static mailbox_t *new_mailbox (void *ctx, const char *name, const char *addr)
+/* Whether addresses are printed only after a full pass over the
+ * matching messages. */
+static bool
+is_full_pass (const search_context_t *ctx)
 {
-    mailbox_t *mailbox;
+    return (ctx->output & OUTPUT_COUNT || ctx->dedup == DEDUP_ADDRESS ||
+	    ctx->top > 0);
+}
 
-    mailbox = talloc (ctx, mailbox_t);
-    if (! mailbox)
-	return NULL;
+/* Hash 'name', which may be NULL, and 'addr' together, as by the djb2
+ * hash of strcase_hash. */
+static unsigned int
+mailbox_hash (const char *name, const char *addr)
+{
+    unsigned int hash = 5381;
+    const char *s;
+
+    if (name) {
+	/* Include the terminating nul, so that a NULL name and an
+	 * empty one hash differently. */
+	for (s = name; ; s++) {
+	    hash = ((hash << 5) + hash) + (unsigned char) *s;
+	    if (*s == '\0')
+		break;
+	}
+    }
 
-    mailbox->name = talloc_strdup (mailbox, name);
-    mailbox->addr = talloc_strdup (mailbox, addr);
-    mailbox->count = 1;
+    for (s = addr; *s; s++)
+	hash = ((hash << 5) + hash) + (unsigned char) *s;
 
-    return mailbox;
+    return hash;
+}
+
+/* Return the slot of 'table' for the mailbox 'name' and 'addr' (with
+ * hash 'hash'): either the slot holding it, or the empty slot where it
+ * belongs. */
+static unsigned int *
+mailbox_slot (const address_table_t *table,
+	      const char *name, const char *addr, unsigned int hash)
+{
+    unsigned int i = hash & (table->slots_size - 1);
+
+    while (table->slots[i]) {
+	const mailbox_t *mailbox = &table->mailboxes[table->slots[i] - 1];
+
+	if (mailbox->hash == hash &&
+	    strcmp_null (mailbox->name, name) == 0 &&
+	    strcmp (mailbox->addr, addr) == 0)
+	    break;
+	i = (i + 1) & (table->slots_size - 1);
+    }
+
+    return &table->slots[i];
+}
+
+/* Return the slot of 'table' for the address 'addr' (with hash 'hash'
+ * ignoring case), as for mailbox_slot. */
+static unsigned int *
+address_slot (const address_table_t *table,
+	      const char *addr, unsigned int hash)
+{
+    unsigned int i = hash & (table->slots_size - 1);
+
+    while (table->address_slots[i]) {
+	const mailbox_t *mailbox = &table->mailboxes[table->address_slots[i] - 1];
+
+	if (mailbox->address_hash == hash &&
+	    strcasecmp (mailbox->addr, addr) == 0)
+	    break;
+	i = (i + 1) & (table->slots_size - 1);
+    }
+
+    return &table->address_slots[i];
 }
 
-static int mailbox_compare (const void *v1, const void *v2)
+/* Double the size of 'table'. Returns false if out of memory, leaving
+ * 'table' as it was. */
+static bool
+address_table_grow (address_table_t *table)
 {
-    const mailbox_t *m1 = v1, *m2 = v2;
-    int ret;
+    unsigned int size = table->slots_size ? 2 * table->slots_size : 256;
+    unsigned int *slots, *address_slots;
+    mailbox_t *mailboxes;
+    unsigned int i;
+
+    mailboxes = talloc_realloc (table, table->mailboxes, mailbox_t, size / 2);
+    if (! mailboxes)
+	return false;
+    table->mailboxes = mailboxes;
 
-    ret = strcmp_null (m1->name, m2->name);
-    if (! ret)
-	ret = strcmp (m1->addr, m2->addr);
+    slots = talloc_zero_array (table, unsigned int, size);
+    address_slots = talloc_zero_array (table, unsigned int, size);
+    if (! slots || ! address_slots) {
+	talloc_free (slots);
+	talloc_free (address_slots);
+	return false;
+    }
+
+    talloc_free (table->slots);
+    talloc_free (table->address_slots);
+    table->slots = slots;
+    table->address_slots = address_slots;
+    table->slots_size = size;
+
+    /* Later mailboxes take over the address slots of earlier ones. */
+    for (i = 0; i < table->mailboxes_used; i++) {
+	mailbox_t *mailbox = &table->mailboxes[i];
 
-    return ret;
+	*mailbox_slot (table, mailbox->name, mailbox->addr, mailbox->hash) = i + 1;
+	*address_slot (table, mailbox->addr, mailbox->address_hash) = i + 1;
+    }
+
+    return true;
+}
+
+/* Copy 'str' into the current block of names and addresses of
+ * 'table', starting a new block if needed. */
+static const char *
+address_table_strdup (address_table_t *table, const char *str)
+{
+    size_t len = strlen (str) + 1;
+    char *copy;
+
+    if (len > table->strings_left) {
+	size_t size = MAX (len, ADDRESS_STRINGS_BLOCK);
+
+	table->strings = talloc_size (table, size);
+	if (! table->strings) {
+	    table->strings_left = 0;
+	    return NULL;
+	}
+	table->strings_left = size;
+    }
+
+    copy = table->strings;
+    memcpy (copy, str, len);
+    table->strings += len;
+    table->strings_left -= len;
+
+    return copy;
 }
 
 /* Returns true iff name and addr is duplicate. If not, stores the
@@ -301,53 +455,39 @@ static int mailbox_compare (const void *v1, const void *v2)
 static bool
 is_duplicate (const search_context_t *ctx, const char *name, const char *addr)
 {
-    char *key;
-    GList *list, *l;
+    address_table_t *table = ctx->addresses;
+    unsigned int hash = mailbox_hash (name, addr);
+    unsigned int *slot, *addr_slot;
     mailbox_t *mailbox;
 
-    list = g_hash_table_lookup (ctx->addresses, addr);
-    if (list) {
-	mailbox_t find = {
-	    .name = name,
-	    .addr = addr,
-	};
-
-	l = g_list_find_custom (list, &find, mailbox_compare);
-	if (l) {
-	    mailbox = l->data;
-	    mailbox->count++;
+    if (table->slots_size) {
+	slot = mailbox_slot (table, name, addr, hash);
+	if (*slot) {
+	    table->mailboxes[*slot - 1].count++;
 	    return true;
 	}
-
-	mailbox = new_mailbox (ctx->format, name, addr);
-	if (! mailbox)
-	    return false;
-
-	/*
-	 * XXX: It would be more efficient to prepend to the list, but
-	 * then we'd have to store the changed list head back to the
-	 * hash table. This check is here just to avoid the compiler
-	 * warning for unused result.
-	 */
-	if (list != g_list_append (list, mailbox))
-	    INTERNAL_ERROR ("appending to list changed list head\n");
-
-	return false;
     }
 
-    key = talloc_strdup (ctx->format, addr);
-    if (! key)
+    if (2 * (table->mailboxes_used + 1) > table->slots_size &&
+	! address_table_grow (table))
 	return false;
 
-    mailbox = new_mailbox (ctx->format, name, addr);
-    if (! mailbox)
+    mailbox = &table->mailboxes[table->mailboxes_used];
+    mailbox->name = name ? address_table_strdup (table, name) : NULL;
+    mailbox->addr = address_table_strdup (table, addr);
+    if ((name && ! mailbox->name) || ! mailbox->addr)
 	return false;
 
-    list = g_list_append (NULL, mailbox);
-    if (! list)
-	return false;
+    mailbox->count = 1;
+    mailbox->hash = hash;
+    mailbox->address_hash = strcase_hash (addr);
+
+    addr_slot = address_slot (table, addr, mailbox->address_hash);
+    mailbox->previous = (int) *addr_slot - 1;
 
-    g_hash_table_insert (ctx->addresses, key, list);
+    table->mailboxes_used++;
+    *addr_slot = table->mailboxes_used;
+    *mailbox_slot (table, name, addr, hash) = table->mailboxes_used;
 
     return false;
 }
@@ -428,8 +568,9 @@ process_address_list (const search_context_t *ctx,
 		is_duplicate (ctx, mbx.name, mbx.addr))
 		continue;
 
-	    /* OUTPUT_COUNT and DEDUP_ADDRESS require a full pass. */
-	    if (ctx->output & OUTPUT_COUNT || ctx->dedup == DEDUP_ADDRESS)
+	    /* OUTPUT_COUNT, DEDUP_ADDRESS and --top require a full
+	     * pass. */
+	    if (is_full_pass (ctx))
 		continue;
 
 	    print_mailbox (ctx, &mbx);
@@ -455,62 +596,143 @@ process_address_header (const search_context_t *ctx, const char *value)
     g_object_unref (list);
 }
 
-/* Destructor for talloc-allocated GHashTable keys and values. */
-static void
-_talloc_free_for_g_hash (void *ptr)
-{
-    talloc_free (ptr);
-}
-
-static void
-_list_free_for_g_hash (void *ptr)
-{
-    g_list_free_full (ptr, _talloc_free_for_g_hash);
-}
-
-/* Print the most common variant of a list of unique mailboxes, and
- * conflate the counts. */
-static void
-print_popular (const search_context_t *ctx, GList *list)
+/* Return the most common variant of the mailboxes with the address of
+ * 'first', the first one to appear, with the counts of all variants
+ * conflated. Of equally common variants, the first to appear wins. */
+static mailbox_t *
+popular_variant (const address_table_t *table, mailbox_t *first)
 {
-    GList *l;
     mailbox_t *mailbox = NULL, *m;
-    int max = 0;
     int total = 0;
+    int i;
 
-    for (l = list; l; l = l->next) {
-	m = l->data;
+    /* Walk back from the latest variant. */
+    for (i = *address_slot (table, first->addr, first->address_hash) - 1;
+	 i >= 0; i = m->previous) {
+	m = &table->mailboxes[i];
 	total += m->count;
-	if (m->count > max) {
+	if (! mailbox || m->count >= mailbox->count)
 	    mailbox = m;
-	    max = m->count;
-	}
     }
 
-    if (! mailbox)
-	INTERNAL_ERROR("Empty list in address hash table\n");
-
     /* The original count is no longer needed, so overwrite. */
     mailbox->count = total;
 
-    print_mailbox (ctx, mailbox);
+    return mailbox;
 }
 
+/* Whether 'results[a]' ranks below 'results[b]' for --top: it has a
+ * lower count, or the same count and appeared later. */
+static bool
+ranks_below (mailbox_t **results, unsigned int a, unsigned int b)
+{
+    return (results[a]->count < results[b]->count ||
+	    (results[a]->count == results[b]->count && a > b));
+}
+
+/* Restore the heap property of 'heap', a min-heap of 'size' indices
+ * into 'results', below 'i'. */
 static void
-print_list_value (void *mailbox, void *context)
+top_heap_sift_down (mailbox_t **results, unsigned int *heap,
+		    unsigned int size, unsigned int i)
 {
-    print_mailbox (context, mailbox);
+    for (;;) {
+	unsigned int lowest = i, child = 2 * i + 1;
+
+	if (child < size && ranks_below (results, heap[child], heap[lowest]))
+	    lowest = child;
+	if (child + 1 < size && ranks_below (results, heap[child + 1], heap[lowest]))
+	    lowest = child + 1;
+	if (lowest == i)
+	    return;
+
+	unsigned int tmp = heap[i];
+	heap[i] = heap[lowest];
+	heap[lowest] = tmp;
+	i = lowest;
+    }
+}
+
+/* Reorder the 'count' results to put the 'top' highest ranking first,
+ * highest first, using a heap of 'top' entries. Returns the new number
+ * of results. */
+static unsigned int
+select_top (void *ctx, mailbox_t **results, unsigned int count,
+	    unsigned int top)
+{
+    unsigned int *heap;
+    mailbox_t **selected;
+    unsigned int i, size;
+
+    if (count <= top)
+	top = count;
+
+    heap = talloc_array (ctx, unsigned int, top);
+    selected = talloc_array (ctx, mailbox_t *, top);
+    if (! heap || ! selected)
+	return count;
+
+    for (i = 0; i < top; i++)
+	heap[i] = i;
+    for (i = top / 2; i-- > 0; )
+	top_heap_sift_down (results, heap, top, i);
+
+    for (i = top; i < count; i++) {
+	if (ranks_below (results, heap[0], i)) {
+	    heap[0] = i;
+	    top_heap_sift_down (results, heap, top, 0);
+	}
+    }
+
+    /* Take out the lowest ranking one at a time. */
+    for (size = top; size > 0; size--) {
+	selected[size - 1] = results[heap[0]];
+	heap[0] = heap[size - 1];
+	top_heap_sift_down (results, heap, size - 1, 0);
+    }
+
+    memcpy (results, selected, top * sizeof (mailbox_t *));
+
+    return top;
 }
 
+/* Print the addresses collected in a full pass: each mailbox, or for
+ * DEDUP_ADDRESS the most common variant of each address. With --top,
+ * print only the most common ones, most common first. */
 static void
-print_hash_value (unused (void *key), void *list, void *context)
+print_addresses (const search_context_t *ctx)
 {
-    const search_context_t *ctx = context;
+    address_table_t *table = ctx->addresses;
+    mailbox_t **results;
+    unsigned int i, count = 0;
+
+    if (table->mailboxes_used == 0)
+	return;
+
+    results = talloc_array (table, mailbox_t *, table->mailboxes_used);
+    if (! results)
+	return;
+
+    for (i = 0; i < table->mailboxes_used; i++) {
+	mailbox_t *mailbox = &table->mailboxes[i];
+
+	if (ctx->dedup == DEDUP_ADDRESS) {
+	    /* Only once per address. */
+	    if (mailbox->previous >= 0)
+		continue;
+	    mailbox = popular_variant (table, mailbox);
+	}
+
+	results[count++] = mailbox;
+    }
+
+    if (ctx->top > 0)
+	count = select_top (results, results, count, ctx->top);
+
+    for (i = 0; i < count; i++)
+	print_mailbox (ctx, results[i]);
 
-    if (ctx->dedup == DEDUP_ADDRESS)
-	print_popular (ctx, list);
-    else
-	g_list_foreach (list, print_list_value, context);
+    talloc_free (results);
 }
 
 static int
@@ -615,9 +837,8 @@ do_search_messages (search_context_t *ctx)
 	notmuch_message_destroy (message);
     }
 
-    if (ctx->addresses &&
-	(ctx->output & OUTPUT_COUNT || ctx->dedup == DEDUP_ADDRESS))
-	g_hash_table_foreach (ctx->addresses, print_hash_value, ctx);
+    if (ctx->addresses && is_full_pass (ctx))
+	print_addresses (ctx);
 
     notmuch_messages_destroy (messages);
 
@@ -681,7 +902,6 @@ _notmuch_search_prepare (search_context_t *ctx, notmuch_config_t *config, int ar
 {
     char *query_str;
     unsigned int i;
-    char *status_string = NULL;
 
     switch (ctx->format_sel) {
     case NOTMUCH_FORMAT_TEXT:
@@ -707,17 +927,9 @@ _notmuch_search_prepare (search_context_t *ctx, notmuch_config_t *config, int ar
 
     notmuch_exit_if_unsupported_format ();
 
-    if (notmuch_database_open_verbose (
-	    notmuch_config_get_database_path (config),
-	    NOTMUCH_DATABASE_MODE_READ_ONLY, &ctx->notmuch, &status_string)) {
-
-	if (status_string) {
-	    fputs (status_string, stderr);
-	    free (status_string);
-	}
-
+    if (notmuch_client_open_database (config, NOTMUCH_DATABASE_MODE_READ_ONLY,
+				      &ctx->notmuch))
 	return EXIT_FAILURE;
-    }
 
     notmuch_exit_if_unmatched_db_uuid (ctx->notmuch);
 
@@ -892,6 +1104,7 @@ notmuch_address_command (notmuch_config_t *config, int argc, char *argv[])
 				  { "mailbox", DEDUP_MAILBOX },
 				  { "address", DEDUP_ADDRESS },
 				  { 0, 0 } } },
+	{ .opt_int = &ctx->top, .name = "top" },
 	{ .opt_inherit = common_options },
 	{ .opt_inherit = notmuch_shared_options },
 	{ }
@@ -911,22 +1124,36 @@ notmuch_address_command (notmuch_config_t *config, int argc, char *argv[])
 	return EXIT_FAILURE;
     }
 
+    if (ctx->top < 0) {
+	fprintf (stderr, "--top must not be negative\n");
+	return EXIT_FAILURE;
+    }
+
+    if (ctx->top > 0 && ctx->dedup == DEDUP_NONE) {
+	fprintf (stderr, "--top is not applicable with --deduplicate=no\n");
+	return EXIT_FAILURE;
+    }
+
     if (_notmuch_search_prepare (ctx, config,
 				 argc - opt_index, argv + opt_index))
 	return EXIT_FAILURE;
 
-    ctx->addresses = g_hash_table_new_full (strcase_hash, strcase_equal,
-					    _talloc_free_for_g_hash,
-					    _list_free_for_g_hash);
+    ctx->addresses = talloc_zero (ctx->format, address_table_t);
+    if (! ctx->addresses) {
+	fprintf (stderr, "Out of memory.\n");
+	_notmuch_search_cleanup (ctx);
+	return EXIT_FAILURE;
+    }
 
     /* The order is not guaranteed if a full pass is required, so go
      * for fastest. */
-    if (ctx->output & OUTPUT_COUNT || ctx->dedup == DEDUP_ADDRESS)
+    if (is_full_pass (ctx))
 	notmuch_query_set_sort (ctx->query, NOTMUCH_SORT_UNSORTED);
 
     ret = do_search_messages (ctx);
 
-    g_hash_table_unref (ctx->addresses);
+    talloc_free (ctx->addresses);
+    ctx->addresses = NULL;
 
 
     _notmuch_search_cleanup (ctx);
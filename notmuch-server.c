@@ -0,0 +1,381 @@
+/* notmuch - Not much of an email program, (just index and search)
+ *
+ * Copyright © 2019 The Notmuch Developers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-client.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/* The read-only database held open by "notmuch server" while it runs
+ * a request, or NULL. */
+static notmuch_database_t *server_notmuch = NULL;
+
+notmuch_status_t
+notmuch_client_open_database (notmuch_config_t *config,
+			      notmuch_database_mode_t mode,
+			      notmuch_database_t **notmuch)
+{
+    if (server_notmuch && mode == NOTMUCH_DATABASE_MODE_READ_ONLY) {
+	*notmuch = server_notmuch;
+	return NOTMUCH_STATUS_SUCCESS;
+    }
+
+    return notmuch_database_open (notmuch_config_get_database_path (config),
+				  mode, notmuch);
+}
+
+typedef struct {
+    const char *name;
+    int (*function) (notmuch_config_t *config, int argc, char *argv[]);
+} server_command_t;
+
+static const server_command_t server_commands[] = {
+    { "search", notmuch_search_command },
+    { "address", notmuch_address_command },
+    { "show", notmuch_show_command },
+    { "count", notmuch_count_command },
+    { "tag", notmuch_tag_command },
+};
+
+/* Append the UTF-8 encoding of 'code_point' to 'str'. */
+static char *
+_append_utf8 (char *str, unsigned int code_point)
+{
+    if (code_point < 0x80)
+	return talloc_asprintf_append_buffer (str, "%c", code_point);
+    else if (code_point < 0x800)
+	return talloc_asprintf_append_buffer (str, "%c%c",
+					      0xc0 | (code_point >> 6),
+					      0x80 | (code_point & 0x3f));
+    else
+	return talloc_asprintf_append_buffer (str, "%c%c%c",
+					      0xe0 | (code_point >> 12),
+					      0x80 | ((code_point >> 6) & 0x3f),
+					      0x80 | (code_point & 0x3f));
+}
+
+/* Parse the double-quoted string at '*pos', advancing '*pos' past
+ * it. Both JSON and S-expression escapes are understood. Returns NULL
+ * on a syntax error. */
+static char *
+_parse_string (void *ctx, const char **pos)
+{
+    const char *p = *pos + 1;
+    char *str = talloc_strdup (ctx, "");
+
+    while (str && *p != '"') {
+	const char *start = p;
+
+	while (*p && *p != '"' && *p != '\\')
+	    p++;
+	str = talloc_strndup_append_buffer (str, start, p - start);
+	if (str == NULL || *p == '"')
+	    break;
+	if (*p == '\0' || *(p + 1) == '\0')
+	    return NULL;
+
+	p++;
+	switch (*p) {
+	case 'n':
+	    str = talloc_strdup_append_buffer (str, "\n");
+	    break;
+	case 't':
+	    str = talloc_strdup_append_buffer (str, "\t");
+	    break;
+	case 'r':
+	    str = talloc_strdup_append_buffer (str, "\r");
+	    break;
+	case 'u': {
+	    char hex[5] = { 0 };
+	    char *end;
+	    unsigned int code_point;
+
+	    strncpy (hex, p + 1, 4);
+	    code_point = strtoul (hex, &end, 16);
+	    if (end != hex + 4 || code_point == 0)
+		return NULL;
+	    str = _append_utf8 (str, code_point);
+	    p += 4;
+	    break;
+	}
+	default:
+	    /* \" \\ \/ and any other escaped character stand for
+	     * themselves. */
+	    str = talloc_strndup_append_buffer (str, p, 1);
+	}
+	p++;
+    }
+
+    *pos = p + 1;
+    return str;
+}
+
+/* Parse a request: a JSON array or an S-expression list of strings,
+ * such as ["search", "--format=json", "tag:inbox"] or ("search"
+ * "--format=sexp" "tag:inbox"). On success, return the strings as a
+ * NULL-terminated array and store their number in 'argc'. Returns
+ * NULL on a syntax error. */
+static char **
+_parse_request (void *ctx, const char *line, int *argc)
+{
+    const char *p = line;
+    char **argv = talloc_array (ctx, char *, 1);
+    char list_end;
+
+    *argc = 0;
+
+    while (isspace (*p))
+	p++;
+    if (*p == '[')
+	list_end = ']';
+    else if (*p == '(')
+	list_end = ')';
+    else
+	return NULL;
+    p++;
+
+    for (;;) {
+	while (isspace (*p) || (list_end == ']' && *p == ','))
+	    p++;
+
+	if (*p == list_end)
+	    break;
+	if (*p != '"')
+	    return NULL;
+
+	argv = talloc_realloc (ctx, argv, char *, *argc + 2);
+	if (argv == NULL)
+	    return NULL;
+	argv[*argc] = _parse_string (argv, &p);
+	if (argv[*argc] == NULL)
+	    return NULL;
+	(*argc)++;
+    }
+
+    p++;
+    while (isspace (*p))
+	p++;
+    if (*p != '\0' || *argc == 0)
+	return NULL;
+
+    argv[*argc] = NULL;
+    return argv;
+}
+
+/* Copy all of 'file' to stdout. */
+static void
+_copy_to_stdout (FILE *file)
+{
+    char buf[BUFSIZ];
+    size_t nread;
+
+    rewind (file);
+    while ((nread = fread (buf, 1, sizeof (buf), file)) > 0)
+	fwrite (buf, 1, nread, stdout);
+}
+
+/* Run the command of a request in a child process, which sees the
+ * server's database and configuration as they are, but cannot change
+ * them for later requests. Its output and error output are collected
+ * in 'out' and 'err'. Returns the command's exit status. */
+static int
+_run_request (notmuch_config_t *config, notmuch_database_t *notmuch,
+	      const server_command_t *command, int argc, char *argv[],
+	      FILE *out, FILE *err)
+{
+    int status;
+    pid_t pid;
+
+    fflush (stdout);
+    fflush (stderr);
+
+    pid = fork ();
+    if (pid < 0) {
+	fprintf (err, "Error: fork failed: %s\n", strerror (errno));
+	return EXIT_FAILURE;
+    }
+
+    if (pid == 0) {
+	int null_fd = open ("/dev/null", O_RDONLY);
+
+	if (null_fd < 0 ||
+	    dup2 (null_fd, STDIN_FILENO) < 0 ||
+	    dup2 (fileno (out), STDOUT_FILENO) < 0 ||
+	    dup2 (fileno (err), STDERR_FILENO) < 0)
+	    _exit (EXIT_FAILURE);
+	close (null_fd);
+
+	server_notmuch = notmuch;
+	status = (command->function) (config, argc, argv);
+
+	fflush (stdout);
+	fflush (stderr);
+	_exit (status);
+    }
+
+    if (waitpid (pid, &status, 0) < 0) {
+	fprintf (err, "Error: waiting for request failed: %s\n", strerror (errno));
+	return EXIT_FAILURE;
+    }
+
+    if (WIFEXITED (status))
+	return WEXITSTATUS (status);
+
+    fprintf (err, "Error: %s request terminated by signal %d\n",
+	     command->name, WTERMSIG (status));
+    return EXIT_FAILURE;
+}
+
+/* Answer one request line with its status and the lengths of its
+ * output and error output, followed by the outputs themselves. */
+static void
+_serve_request (notmuch_config_t *config, notmuch_database_t *notmuch,
+		const char *line)
+{
+    void *local = talloc_new (NULL);
+    const server_command_t *command = NULL;
+    FILE *out = NULL, *err = NULL;
+    char **argv;
+    int argc, status = EXIT_FAILURE;
+
+    out = tmpfile ();
+    err = tmpfile ();
+    if (out == NULL || err == NULL) {
+	fprintf (stderr, "Error: cannot create temporary file: %s\n",
+		 strerror (errno));
+	exit (EXIT_FAILURE);
+    }
+
+    argv = _parse_request (local, line, &argc);
+    if (argv == NULL) {
+	fprintf (err, "Error: malformed request: %s\n", line);
+	goto DONE;
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE (server_commands); i++) {
+	if (strcmp (argv[0], server_commands[i].name) == 0)
+	    command = &server_commands[i];
+    }
+    if (command == NULL) {
+	fprintf (err, "Error: '%s' is not available in notmuch server\n",
+		 argv[0]);
+	goto DONE;
+    }
+
+    if (print_status_database ("notmuch server", notmuch,
+			       notmuch_database_reopen (notmuch)))
+	exit (EXIT_FAILURE);
+
+    status = _run_request (config, notmuch, command, argc, argv, out, err);
+
+  DONE:
+    fflush (out);
+    fflush (err);
+    printf ("%d %ld %ld\n", status, ftell (out), ftell (err));
+    _copy_to_stdout (out);
+    _copy_to_stdout (err);
+    fflush (stdout);
+
+    fclose (out);
+    fclose (err);
+    talloc_free (local);
+}
+
+/* Whether 'a' and 'b' describe the same version of a file, as far as
+ * its replacement or modification can be seen. */
+static bool
+_same_file_version (const struct stat *a, const struct stat *b)
+{
+    return (a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+	    a->st_size == b->st_size && a->st_mtime == b->st_mtime);
+}
+
+/* If the file of 'config' changed since 'file_stat' was taken, read
+ * it again into a new configuration (talloc'ed under 'ctx'), and
+ * update 'file_stat' to match.  Returns NULL if the file did not
+ * change, or cannot be read again. */
+static notmuch_config_t *
+_reload_config (void *ctx, notmuch_config_t *config, struct stat *file_stat)
+{
+    const char *filename = notmuch_config_get_filename (config);
+    notmuch_config_t *new_config;
+    struct stat st;
+
+    if (stat (filename, &st) < 0 || _same_file_version (&st, file_stat))
+	return NULL;
+
+    new_config = notmuch_config_open (ctx, filename, NOTMUCH_CONFIG_OPEN);
+    if (new_config)
+	*file_stat = st;
+
+    return new_config;
+}
+
+int
+notmuch_server_command (notmuch_config_t *config, int argc, char *argv[])
+{
+    notmuch_database_t *notmuch;
+    notmuch_config_t *current_config = config, *new_config;
+    struct stat config_stat;
+    char *line = NULL;
+    size_t line_size;
+    ssize_t line_len;
+    int opt_index;
+
+    opt_index = notmuch_minimal_options ("server", argc, argv);
+    if (opt_index < 0)
+	return EXIT_FAILURE;
+
+    if (opt_index != argc) {
+	fprintf (stderr, "Error: notmuch server takes no arguments\n");
+	return EXIT_FAILURE;
+    }
+
+    if (notmuch_database_open (notmuch_config_get_database_path (config),
+			       NOTMUCH_DATABASE_MODE_READ_ONLY, &notmuch))
+	return EXIT_FAILURE;
+
+    notmuch_exit_if_unmatched_db_uuid (notmuch);
+
+    if (stat (notmuch_config_get_filename (config), &config_stat) < 0)
+	memset (&config_stat, 0, sizeof (config_stat));
+
+    while ((line_len = getline (&line, &line_size, stdin)) != -1) {
+	chomp_newline (line);
+	if (*line == '\0')
+	    continue;
+
+	/* The configuration given by the caller belongs to it. */
+	new_config = _reload_config (config, current_config, &config_stat);
+	if (new_config) {
+	    if (current_config != config)
+		notmuch_config_close (current_config);
+	    current_config = new_config;
+	}
+
+	_serve_request (current_config, notmuch, line);
+    }
+
+    free (line);
+    if (current_config != config)
+	notmuch_config_close (current_config);
+    notmuch_database_destroy (notmuch);
+
+    return EXIT_SUCCESS;
+}
@@ -118,6 +118,15 @@ tag_query (void *ctx, notmuch_database_t *notmuch, const char *query_string,
 	return 1;
     }
 
+    /* Unless maildir flags have to be synchronized, the database
+     * can change the tags of all the messages at once. */
+    status = tag_op_list_apply_query (query, tag_ops, flags);
+    if (status != NOTMUCH_STATUS_UNSUPPORTED_OPERATION) {
+	ret = print_status_query ("notmuch tag", query, status);
+	notmuch_query_destroy (query);
+	return ret || interrupted;
+    }
+
     /* tagging is not interested in any special sort order */
     notmuch_query_set_sort (query, NOTMUCH_SORT_UNSORTED);
 
@@ -140,6 +149,185 @@ tag_query (void *ctx, notmuch_database_t *notmuch, const char *query_string,
     return ret || interrupted;
 }
 
+/* Consecutive batch lines tagging a single message by id are
+ * collected into a run of at most this many lines, which is applied
+ * in one atomic section. */
+#define TAG_RUN_SIZE 1000
+
+/* A batch line of the form "<tag-ops> -- id:<message-id>". */
+typedef struct {
+    const char *message_id;
+    tag_op_list_t *tag_ops;
+    /* Identifies the list of operations, so that the lines with the
+     * same operations can be applied with a single query. */
+    char *ops_key;
+} tag_run_line_t;
+
+typedef struct {
+    /* Owns the lines. */
+    void *ctx;
+    tag_run_line_t lines[TAG_RUN_SIZE];
+    int count;
+    /* Message-ids of the lines, to keep each message to one line. */
+    GHashTable *message_ids;
+} tag_run_t;
+
+static char *
+_tag_ops_key (void *ctx, const tag_op_list_t *tag_ops)
+{
+    char *key = talloc_strdup (ctx, "");
+    size_t i;
+
+    for (i = 0; i < tag_op_list_size (tag_ops) && key; i++) {
+	const char *tag = tag_op_list_tag (tag_ops, i);
+
+	key = talloc_asprintf_append_buffer (key, "%c%zu:%s",
+					     tag_op_list_isremove (tag_ops, i) ? '-' : '+',
+					     strlen (tag), tag);
+    }
+
+    return key;
+}
+
+/* Apply the lines of 'run', with one query per distinct list of
+ * operations, in a single atomic section, and empty it.
+ *
+ * Each message appears on at most one line of a run, so the order in
+ * which the lines are applied doesn't matter. */
+static int
+tag_run_flush (notmuch_database_t *notmuch, tag_run_t *run,
+	       tag_op_flag_t flags)
+{
+    char *escaped = NULL;
+    size_t escaped_len = 0;
+    bool *done;
+    int i, j, ret = 0;
+
+    if (run->count == 0)
+	return 0;
+
+    done = talloc_zero_array (run->ctx, bool, run->count);
+    if (done == NULL) {
+	fprintf (stderr, "Out of memory.\n");
+	return 1;
+    }
+
+    if (print_status_database ("notmuch tag", notmuch,
+			       notmuch_database_begin_atomic (notmuch)))
+	return 1;
+
+    for (i = 0; i < run->count && ! ret && ! interrupted; i++) {
+	char *query_string;
+	const char *join = "";
+
+	if (done[i])
+	    continue;
+
+	query_string = talloc_strdup (run->ctx, "");
+	if (query_string == NULL) {
+	    fprintf (stderr, "Out of memory.\n");
+	    ret = 1;
+	    break;
+	}
+
+	for (j = i; j < run->count; j++) {
+	    if (done[j] || strcmp (run->lines[i].ops_key, run->lines[j].ops_key))
+		continue;
+
+	    if (make_boolean_term (run->ctx, "id", run->lines[j].message_id,
+				   &escaped, &escaped_len)) {
+		fprintf (stderr, "Error quoting message id %s: %s\n",
+			 run->lines[j].message_id, strerror (errno));
+		ret = 1;
+		break;
+	    }
+	    query_string = talloc_asprintf_append_buffer (query_string, "%s%s",
+							  join, escaped);
+	    if (query_string == NULL) {
+		fprintf (stderr, "Out of memory.\n");
+		ret = 1;
+		break;
+	    }
+	    join = " or ";
+	    done[j] = true;
+	}
+
+	if (! ret)
+	    ret = tag_query (run->ctx, notmuch, query_string,
+			     run->lines[i].tag_ops, flags);
+    }
+
+    if (print_status_database ("notmuch tag", notmuch,
+			       notmuch_database_end_atomic (notmuch)))
+	ret = 1;
+
+    g_hash_table_remove_all (run->message_ids);
+    talloc_free_children (run->ctx);
+    run->count = 0;
+
+    return ret;
+}
+
+/* If 'query_string' only selects a message by id, add the line to
+ * 'run' (flushing it first if needed) and return 1.  Returns 0 if the
+ * line has to be applied on its own, and -1 on error. */
+static int
+tag_run_add (notmuch_database_t *notmuch, tag_run_t *run,
+	     const char *query_string, const tag_op_list_t *tag_ops,
+	     tag_op_flag_t flags)
+{
+    tag_run_line_t *line;
+    char *prefix, *term;
+    size_t i;
+
+    if (parse_boolean_term (run->ctx, query_string, &prefix, &term)) {
+	if (errno == EINVAL)
+	    return 0;
+	fprintf (stderr, "Error parsing query: %s\n", strerror (errno));
+	return -1;
+    }
+
+    if (strcmp (prefix, "id") != 0)
+	return 0;
+
+    if (run->count == TAG_RUN_SIZE ||
+	g_hash_table_contains (run->message_ids, term)) {
+	/* 'term' belongs to the run, so save it. */
+	term = talloc_strdup (NULL, term);
+	if (term == NULL || tag_run_flush (notmuch, run, flags)) {
+	    talloc_free (term);
+	    return -1;
+	}
+	talloc_steal (run->ctx, term);
+    }
+
+    line = &run->lines[run->count];
+    line->message_id = term;
+    /* The operations point into the input line, which is reused. */
+    line->tag_ops = tag_op_list_create (run->ctx);
+    if (line->tag_ops == NULL)
+	goto OUT_OF_MEMORY;
+    for (i = 0; i < tag_op_list_size (tag_ops); i++) {
+	char *tag = talloc_strdup (run->ctx, tag_op_list_tag (tag_ops, i));
+
+	if (tag == NULL ||
+	    tag_op_list_append (line->tag_ops, tag, tag_op_list_isremove (tag_ops, i)))
+	    goto OUT_OF_MEMORY;
+    }
+    line->ops_key = _tag_ops_key (run->ctx, tag_ops);
+    if (line->ops_key == NULL)
+	goto OUT_OF_MEMORY;
+
+    g_hash_table_add (run->message_ids, term);
+    run->count++;
+
+    return 1;
+
+  OUT_OF_MEMORY:
+    fprintf (stderr, "Out of memory.\n");
+    return -1;
+}
+
 static int
 tag_file (void *ctx, notmuch_database_t *notmuch, tag_op_flag_t flags,
 	  FILE *input)
@@ -151,12 +339,16 @@ tag_file (void *ctx, notmuch_database_t *notmuch, tag_op_flag_t flags,
     int ret = 0;
     int warn = 0;
     tag_op_list_t *tag_ops;
+    tag_run_t *run;
 
     tag_ops = tag_op_list_create (ctx);
-    if (tag_ops == NULL) {
+    run = talloc_zero (ctx, tag_run_t);
+    if (tag_ops == NULL || run == NULL ||
+	(run->ctx = talloc_new (run)) == NULL) {
 	fprintf (stderr, "Out of memory.\n");
 	return 1;
     }
+    run->message_ids = g_hash_table_new (g_str_hash, g_str_equal);
 
     while ((line_len = getline (&line, &line_size, input)) != -1 &&
 	   ! interrupted) {
@@ -175,11 +367,31 @@ tag_file (void *ctx, notmuch_database_t *notmuch, tag_op_flag_t flags,
 	if (ret < 0)
 	    break;
 
+	ret = tag_run_add (notmuch, run, query_string, tag_ops, flags);
+	if (ret > 0) {
+	    ret = 0;
+	    continue;
+	}
+	if (ret < 0)
+	    break;
+
+	/* Other queries may depend on the tags changed by the lines
+	 * before, so they are applied in order, one at a time. */
+	ret = tag_run_flush (notmuch, run, flags);
+	if (ret)
+	    break;
+
 	ret = tag_query (ctx, notmuch, query_string, tag_ops, flags);
 	if (ret)
 	    break;
     }
 
+    if (! ret)
+	ret = tag_run_flush (notmuch, run, flags);
+
+    g_hash_table_unref (run->message_ids);
+    talloc_free (run);
+
     if (line)
 	free (line);
 
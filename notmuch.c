@@ -164,6 +164,8 @@ static command_t commands[] = {
       "Re-index all messages matching the search terms." },
     { "config", notmuch_config_command, NOTMUCH_CONFIG_OPEN,
       "Get or set settings in the notmuch configuration file." },
+    { "server", notmuch_server_command, NOTMUCH_CONFIG_OPEN,
+      "Answer search, show, tag, count and address requests from stdin." },
 #if WITH_EMACS
     { "emacs-mua", NULL, 0,
       "send mail with notmuch and emacs." },
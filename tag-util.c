@@ -16,8 +16,12 @@ struct _tag_op_list_t {
     size_t size;
 };
 
+/* Report a problem with 'line'.  Warnings are stored in '*warning'
+ * (allocated from 'ctx') if 'warning' is not NULL; everything else is
+ * printed to stderr. */
 static tag_parse_status_t
 line_error (tag_parse_status_t status,
+	    void *ctx, char **warning,
 	    const char *line,
 	    const char *format, ...)
 {
@@ -25,9 +29,17 @@ line_error (tag_parse_status_t status,
 
     va_start (va_args, format);
 
-    fprintf (stderr, status < 0 ? "Error: " : "Warning: ");
-    vfprintf (stderr, format, va_args);
-    fprintf (stderr, " [%s]\n", line);
+    if (status > 0 && warning) {
+	char *msg = talloc_vasprintf (ctx, format, va_args);
+
+	*warning = talloc_asprintf (ctx, "Warning: %s [%s]",
+				    msg ? msg : format, line);
+	talloc_free (msg);
+    } else {
+	fprintf (stderr, status < 0 ? "Error: " : "Warning: ");
+	vfprintf (stderr, format, va_args);
+	fprintf (stderr, " [%s]\n", line);
+    }
 
     va_end (va_args);
 
@@ -56,6 +68,17 @@ parse_tag_line (void *ctx, char *line,
 		tag_op_flag_t flags,
 		char **query_string,
 		tag_op_list_t *tag_ops)
+{
+    return parse_tag_line_deferred (ctx, line, flags, query_string,
+				    tag_ops, NULL);
+}
+
+tag_parse_status_t
+parse_tag_line_deferred (void *ctx, char *line,
+			 tag_op_flag_t flags,
+			 char **query_string,
+			 tag_op_list_t *tag_ops,
+			 char **warning)
 {
     char *tok = line;
     size_t tok_len = 0;
@@ -91,8 +114,8 @@ parse_tag_line (void *ctx, char *line,
 	if (tok_len == 2 && strncmp (tok, "--", tok_len) == 0) {
 	    tok = strtok_len (tok + tok_len, " ", &tok_len);
 	    if (tok == NULL) {
-		ret = line_error (TAG_PARSE_INVALID, line_for_error,
-				  "no query string after --");
+		ret = line_error (TAG_PARSE_INVALID, ctx, warning,
+				  line_for_error, "no query string after --");
 		goto DONE;
 	    }
 	    break;
@@ -104,8 +127,8 @@ parse_tag_line (void *ctx, char *line,
 
 	/* If tag is terminated by NUL, there's no query string. */
 	if (*(tok + tok_len) == '\0') {
-	    ret = line_error (TAG_PARSE_INVALID, line_for_error,
-			      "no query string");
+	    ret = line_error (TAG_PARSE_INVALID, ctx, warning,
+			      line_for_error, "no query string");
 	    goto DONE;
 	}
 
@@ -119,29 +142,30 @@ parse_tag_line (void *ctx, char *line,
 	if (! (flags & TAG_FLAG_BE_GENEROUS)) {
 	    const char *msg = illegal_tag (tag, remove);
 	    if (msg) {
-		ret = line_error (TAG_PARSE_INVALID, line_for_error, msg);
+		ret = line_error (TAG_PARSE_INVALID, ctx, warning,
+				  line_for_error, msg);
 		goto DONE;
 	    }
 	}
 
 	/* Decode tag. */
 	if (hex_decode_inplace (tag) != HEX_SUCCESS) {
-	    ret = line_error (TAG_PARSE_INVALID, line_for_error,
-			      "hex decoding of tag %s failed", tag);
+	    ret = line_error (TAG_PARSE_INVALID, ctx, warning,
+			      line_for_error, "hex decoding of tag %s failed", tag);
 	    goto DONE;
 	}
 
 	if (tag_op_list_append (tag_ops, tag, remove)) {
-	    ret = line_error (TAG_PARSE_OUT_OF_MEMORY, line_for_error,
-			      "aborting");
+	    ret = line_error (TAG_PARSE_OUT_OF_MEMORY, ctx, warning,
+			      line_for_error, "aborting");
 	    goto DONE;
 	}
     }
 
     if (tok == NULL) {
 	/* use a different error message for testing */
-	ret = line_error (TAG_PARSE_INVALID, line_for_error,
-			  "missing query string");
+	ret = line_error (TAG_PARSE_INVALID, ctx, warning,
+			  line_for_error, "missing query string");
 	goto DONE;
     }
 
@@ -333,6 +357,59 @@ tag_op_list_apply (notmuch_message_t *message,
 }
 
 
+notmuch_status_t
+tag_op_list_apply_query (notmuch_query_t *query,
+			 tag_op_list_t *list,
+			 tag_op_flag_t flags)
+{
+    const char **add_tags, **remove_tags;
+    size_t i, j, num_add = 0, num_remove = 0;
+    notmuch_status_t status;
+
+    if ((flags & TAG_FLAG_MAILDIR_SYNC) && (flags & TAG_FLAG_REMOVE_ALL))
+	return NOTMUCH_STATUS_UNSUPPORTED_OPERATION;
+
+    if (list->count == 0 && ! (flags & TAG_FLAG_REMOVE_ALL))
+	return NOTMUCH_STATUS_SUCCESS;
+
+    add_tags = talloc_zero_array (list, const char *, list->count + 1);
+    remove_tags = talloc_zero_array (list, const char *, list->count + 1);
+    if (add_tags == NULL || remove_tags == NULL)
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    /* Only the last operation on each tag matters. */
+    for (i = 0; i < list->count; i++) {
+	const char *tag = list->ops[i].tag;
+
+	if ((flags & TAG_FLAG_MAILDIR_SYNC) &&
+	    notmuch_tag_is_maildir_flag (tag)) {
+	    status = NOTMUCH_STATUS_UNSUPPORTED_OPERATION;
+	    goto DONE;
+	}
+
+	for (j = i + 1; j < list->count; j++)
+	    if (strcmp (tag, list->ops[j].tag) == 0)
+		break;
+	if (j < list->count)
+	    continue;
+
+	if (list->ops[i].remove)
+	    remove_tags[num_remove++] = tag;
+	else
+	    add_tags[num_add++] = tag;
+    }
+
+    status = notmuch_query_apply_tag_ops (query, add_tags, remove_tags,
+					  (flags & TAG_FLAG_REMOVE_ALL) != 0);
+
+  DONE:
+    talloc_free (add_tags);
+    talloc_free (remove_tags);
+
+    return status;
+}
+
+
 /* Array of tagging operations (add or remove.  Size will be increased
  * as necessary. */
 
@@ -72,6 +72,16 @@ parse_tag_line (void *ctx, char *line,
 		tag_op_flag_t flags,
 		char **query_str, tag_op_list_t *ops);
 
+/* As parse_tag_line, but if 'warning' is not NULL, a warning about
+ * an invalid line is stored there (allocated from 'ctx') instead of
+ * being printed, so that the caller can report it later.
+ */
+tag_parse_status_t
+parse_tag_line_deferred (void *ctx, char *line,
+			 tag_op_flag_t flags,
+			 char **query_str, tag_op_list_t *ops,
+			 char **warning);
+
 
 
 /* Parse a command line of the following format:
@@ -131,6 +141,21 @@ tag_op_list_apply (notmuch_message_t *message,
 		   tag_op_list_t *tag_ops,
 		   tag_op_flag_t flags);
 
+/*
+ * Apply a list of tag operations to all messages matching 'query',
+ * with the same result as tag_op_list_apply on each message, but
+ * without creating message objects (see notmuch_query_apply_tag_ops).
+ *
+ * Returns NOTMUCH_STATUS_UNSUPPORTED_OPERATION, without changing any
+ * message, if the operations need maildir flags to be synchronized;
+ * the caller should then apply them to each message.
+ */
+
+notmuch_status_t
+tag_op_list_apply_query (notmuch_query_t *query,
+			 tag_op_list_t *tag_ops,
+			 tag_op_flag_t flags);
+
 /*
  * Return the number of operations in a list
  */
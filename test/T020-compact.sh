@@ -43,4 +43,71 @@ thread:XXX   2001-01-05 [1/1] Notmuch Test Suite; One (inbox tag1 unread)
 thread:XXX   2001-01-05 [1/1] Notmuch Test Suite; Two (inbox tag1 tag2 unread)
 thread:XXX   2001-01-05 [1/1] Notmuch Test Suite; Three (inbox tag3 unread)"
 
+add_message '[dir]=old-dir' '[subject]=Four'
+basename=$(basename $gen_msg_filename)
+
+test_begin_subtest "Filenames read again after a rename and a compact"
+test_C ${MAIL_DIR} <<'EOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include <notmuch.h>
+
+static void
+print_filename (notmuch_database_t *db)
+{
+   notmuch_query_t *query = notmuch_query_create (db, "subject:Four");
+   notmuch_messages_t *messages;
+   notmuch_status_t stat;
+
+   stat = notmuch_query_search_messages (query, &messages);
+   if (stat != NOTMUCH_STATUS_SUCCESS) {
+     fprintf (stderr, "error querying messages: %d\n", stat);
+     exit (1);
+   }
+   for (; notmuch_messages_valid (messages); notmuch_messages_move_to_next (messages))
+     printf ("%s\n", notmuch_message_get_filename (notmuch_messages_get (messages)));
+   notmuch_query_destroy (query);
+}
+
+int main (int argc, char** argv)
+{
+   notmuch_database_t *db;
+   notmuch_status_t stat;
+   char command[4096];
+
+   stat = notmuch_database_open (argv[1], NOTMUCH_DATABASE_MODE_READ_ONLY, &db);
+   if (stat != NOTMUCH_STATUS_SUCCESS) {
+     fprintf (stderr, "error opening database: %d\n", stat);
+     exit (1);
+   }
+
+   print_filename (db);
+
+   snprintf (command, sizeof (command),
+	     "mv %s/old-dir %s/new-dir && notmuch new > /dev/null",
+	     argv[1], argv[1]);
+   if (system (command) || notmuch_database_reopen (db)) {
+     fprintf (stderr, "error renaming directory\n");
+     exit (1);
+   }
+   print_filename (db);
+
+   if (system ("notmuch compact --quiet") || notmuch_database_reopen (db)) {
+     fprintf (stderr, "error compacting database\n");
+     exit (1);
+   }
+   print_filename (db);
+
+   notmuch_database_destroy (db);
+}
+EOF
+cat <<EOF > EXPECTED
+== stdout ==
+MAIL_DIR/old-dir/${basename}
+MAIL_DIR/new-dir/${basename}
+MAIL_DIR/new-dir/${basename}
+== stderr ==
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
 test_done
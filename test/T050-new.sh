@@ -322,6 +322,63 @@ notmuch search --format=text0 --output=files --offset=1 --limit=1 '*' | xargs -0
 output=$(NOTMUCH_NEW --quiet)
 test_expect_equal "$output" ""
 
+test_begin_subtest "Indexing with several jobs matches indexing with one"
+generate_message '[body]="parallel indexing"'
+generate_message '[subject]="parallel thread"'
+generate_message '[subject]="Re: parallel thread"' "[in-reply-to]=\<$gen_msg_id\>"
+rm -rf "${MAIL_DIR}"/.notmuch
+NOTMUCH_NEW --jobs=1 > /dev/null
+notmuch search '*' > EXPECTED
+notmuch search --output=messages 'parallel AND (indexing OR thread)' >> EXPECTED
+rm -rf "${MAIL_DIR}"/.notmuch
+NOTMUCH_NEW --jobs=4 > /dev/null
+notmuch search '*' > OUTPUT
+notmuch search --output=messages 'parallel AND (indexing OR thread)' >> OUTPUT
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "Adding and removing messages in batches"
+notmuch config set new.batch_size 2
+generate_message
+generate_message
+generate_message
+generate_message
+generate_message
+output=$(NOTMUCH_NEW 2>&1)
+rm -f "$gen_msg_filename"
+output="$output
+$(NOTMUCH_NEW 2>&1)"
+notmuch config set new.batch_size
+test_expect_equal "$output" "Added 5 new messages to the database.
+No new mail. Removed 1 message."
+
+test_begin_subtest "Messages added in one batch share a revision"
+notmuch config set new.batch_size 2
+before=$(notmuch count --lastmod '*' | cut -f3)
+generate_message
+generate_message
+generate_message
+generate_message
+generate_message
+NOTMUCH_NEW > /dev/null
+after=$(notmuch count --lastmod '*' | cut -f3)
+output=$(for revision in $(seq $((before + 1)) $after); do
+	     notmuch count lastmod:$revision..$revision
+	 done | grep -v '^0$' | tr '\n' ' ')
+notmuch config set new.batch_size
+test_expect_equal "$output" "2 2 1 "
+
+test_begin_subtest "Scanning directories ahead finds the same files"
+for dir in a a/b a/b/c d d/cur d/new d/tmp e/f/g; do
+    generate_message "[dir]=scan/$dir"
+done
+rm -rf "${MAIL_DIR}"/.notmuch
+NOTMUCH_NEW --jobs=1 > /dev/null
+notmuch search --output=files '*' | sort > EXPECTED
+rm -rf "${MAIL_DIR}"/.notmuch
+NOTMUCH_NEW --jobs=4 > /dev/null
+notmuch search --output=files '*' | sort > OUTPUT
+test_expect_equal_file EXPECTED OUTPUT
+
 OLDCONFIG=$(notmuch config get new.tags)
 
 test_begin_subtest "Empty tags in new.tags are forbidden"
@@ -352,7 +409,8 @@ test_begin_subtest "Handle files vanishing between scandir and add_file"
 # A file for scandir to find. It won't get indexed, so can be empty.
 touch ${MAIL_DIR}/vanish
 
-# Breakpoint to remove the file before indexing
+# Breakpoint to remove the file before indexing.  With several jobs,
+# the file is first read by notmuch_database_prepare_file.
 cat <<EOF > notmuch-new-vanish.gdb
 set breakpoint pending on
 set logging file notmuch-new-vanish-gdb.log
@@ -362,6 +420,11 @@ commands
 shell rm -f ${MAIL_DIR}/vanish
 continue
 end
+break notmuch_database_prepare_file
+commands
+shell rm -f ${MAIL_DIR}/vanish
+continue
+end
 run
 EOF
 
@@ -380,6 +443,14 @@ exit status: 75
 EOF
 test_expect_equal_file EXPECTED OUTPUT
 
+test_begin_subtest "Handle files vanishing between scandir and add_file (--jobs=1)"
+touch ${MAIL_DIR}/vanish
+${TEST_GDB} --batch-silent --return-child-result -x notmuch-new-vanish.gdb \
+    --args notmuch new --jobs=1 2>OUTPUT 1>/dev/null
+echo "exit status: $?" >> OUTPUT
+rm -f ${MAIL_DIR}/vanish
+test_expect_equal_file EXPECTED OUTPUT
+
 add_email_corpus broken
 test_begin_subtest "reference loop does not crash"
 test_expect_code 0 "notmuch show --format=json id:mid-loop-12@example.org id:mid-loop-21@example.org > OUTPUT"
@@ -0,0 +1,93 @@
+#!/usr/bin/env bash
+test_description='"notmuch new --watch"'
+. $(dirname "$0")/test-lib.sh || exit 1
+
+if [ $NOTMUCH_HAVE_INOTIFY -eq 0 ]; then
+    test_begin_subtest "--watch unsupported: error message"
+    output=$(notmuch new --watch 2>&1)
+    test_expect_equal "$output" "Error: --watch is not available, since notmuch was built without inotify."
+
+    test_done
+fi
+
+# Wait (up to five seconds) until the query $1 matches $2 messages.
+wait_for_count () {
+    local i
+    for i in $(seq 50); do
+	if [ "$(notmuch count "$1")" = "$2" ]; then
+	    return 0
+	fi
+	sleep 0.1
+    done
+    return 1
+}
+
+generate_message
+notmuch new > /dev/null
+
+notmuch new --watch --quiet &
+watch_pid=$!
+
+test_begin_subtest "Message delivered while watching is added"
+generate_message '[subject]="watched delivery"'
+wait_for_count 'subject:"watched delivery"' 1
+output=$(notmuch search --output=tags 'subject:"watched delivery"' | tr '\n' ' ')
+test_expect_equal "$output" "inbox unread "
+
+test_begin_subtest "Message in a new directory is added"
+generate_message '[dir]=fresh/sub' '[subject]="watched new directory"'
+wait_for_count 'subject:"watched new directory"' 1
+output=$(notmuch search --output=files 'subject:"watched new directory"')
+test_expect_equal "$output" "${MAIL_DIR}/fresh/sub/msg-003"
+
+test_begin_subtest "Renamed message keeps its tags"
+notmuch tag +kept 'subject:"watched delivery"'
+mv "${MAIL_DIR}/msg-002" "${MAIL_DIR}/msg-002-renamed"
+wait_for_count "path:msg-002-renamed" 1
+output=$(notmuch search --output=files tag:kept)
+test_expect_equal "$output" "${MAIL_DIR}/msg-002-renamed"
+
+test_begin_subtest "Deleted message is removed"
+rm "${MAIL_DIR}/msg-002-renamed"
+wait_for_count 'subject:"watched delivery"' 0
+output=$(notmuch count 'subject:"watched delivery"')
+test_expect_equal "$output" "0"
+
+test_begin_subtest "Deleted directory is removed"
+rm -r "${MAIL_DIR}/fresh"
+wait_for_count 'subject:"watched new directory"' 0
+output=$(notmuch count 'subject:"watched new directory"')
+test_expect_equal "$output" "0"
+
+test_begin_subtest "Ignored files are not added"
+notmuch config set new.ignore ignored
+# The watcher read the ignore list when it started.
+kill $watch_pid
+wait $watch_pid
+notmuch new --watch --quiet &
+watch_pid=$!
+generate_message '[filename]=ignored'
+generate_message '[subject]="after ignored"'
+wait_for_count 'subject:"after ignored"' 1
+output=$(notmuch count path:ignored)
+test_expect_equal "$output" "0"
+
+test_begin_subtest "Watching stops on SIGTERM"
+kill -TERM $watch_pid
+wait $watch_pid
+test_expect_equal "$?" "0"
+notmuch config set new.ignore
+
+test_begin_subtest "Indexing options survive reopening the database"
+notmuch new --watch --quiet --decrypt=true &
+watch_pid=$!
+generate_message '[subject]="first with decrypt"'
+wait_for_count 'subject:"first with decrypt"' 1
+generate_message '[subject]="second with decrypt"'
+wait_for_count 'subject:"second with decrypt"' 1
+kill -TERM $watch_pid
+wait $watch_pid
+output=$(notmuch count 'subject:"first with decrypt" or subject:"second with decrypt"')
+test_expect_equal "$output" "2"
+
+test_done
@@ -443,4 +443,16 @@ notmuch search --format=json "no-message-matches-this" > OUTPUT
 echo "[]" >EXPECTED
 test_expect_equal_file EXPECTED OUTPUT
 
+test_begin_subtest "search with thread summaries"
+notmuch search '*' >EXPECTED
+notmuch search --sort=oldest-first '*' >>EXPECTED
+notmuch config set index.thread_summaries true
+# Closing the database after a change writes all summaries.
+notmuch tag +summarized id:20091117190054.GU3165@dottiness.seas.harvard.edu
+notmuch tag -summarized id:20091117190054.GU3165@dottiness.seas.harvard.edu
+notmuch search '*' >OUTPUT
+notmuch search --sort=oldest-first '*' >>OUTPUT
+notmuch config set index.thread_summaries false
+test_expect_equal_file EXPECTED OUTPUT
+
 test_done
@@ -325,4 +325,32 @@ cat <<EOF >EXPECTED
 EOF
 test_expect_equal_file EXPECTED OUTPUT
 
+test_begin_subtest "--deduplicate=address --output=sender --output=count --top=1"
+notmuch address --deduplicate=address --output=sender --output=count --top=1 from:example.com >OUTPUT
+cat <<EOF >EXPECTED
+7	Foo Bar <foo.bar@example.com>
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "--output=count --top=3"
+notmuch address --output=sender --output=count --top=3 from:example.com | sort >OUTPUT
+cat <<EOF >EXPECTED
+2	Baz <foo.bar+baz@example.com>
+2	Foo Bar <foo.bar@example.com>
+2	foo.bar@example.com
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "--top is not applicable with --deduplicate=no"
+test_expect_code 1 "notmuch address --deduplicate=no --top=1 '*'"
+
+test_begin_subtest "--output=recipients does not read mail files"
+notmuch address --output=recipients '*' | sort >EXPECTED
+cp -a "${MAIL_DIR}" "${MAIL_DIR}.saved"
+find "${MAIL_DIR}" -path "${MAIL_DIR}/.notmuch" -prune -o -type f -print | xargs rm -f
+notmuch address --output=recipients '*' | sort >OUTPUT
+rm -rf "${MAIL_DIR}"
+mv "${MAIL_DIR}.saved" "${MAIL_DIR}"
+test_expect_equal_file EXPECTED OUTPUT
+
 test_done
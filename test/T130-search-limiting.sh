@@ -68,4 +68,9 @@ for outp in messages threads; do
     test_expect_equal_file expected output
 done
 
+test_begin_subtest "summary: offset within threads of several matches"
+notmuch search --sort=oldest-first "from:cworth or to:notmuch" | tail -n +6 | head -n 10 >expected
+notmuch search --sort=oldest-first --offset=5 --limit=10 "from:cworth or to:notmuch" >output
+test_expect_equal_file expected output
+
 test_done
@@ -60,6 +60,32 @@ test_expect_equal "$output" "\
 thread:XXX   2001-01-05 [1/1] Notmuch Test Suite; One (inbox tag1 unread)
 thread:XXX   2001-01-05 [1/1] Notmuch Test Suite; Two (inbox tag1 unread)"
 
+# Without maildir synchronization, notmuch tag changes all matching
+# messages at once, in a single revision.
+OLDCONFIG=$(notmuch config get maildir.synchronize_flags)
+notmuch config set maildir.synchronize_flags false
+
+test_begin_subtest "Remove all without maildir synchronization"
+before=$(notmuch count --lastmod '*' | cut -f3)
+notmuch tag --remove-all +tag5 +unread \*
+output=$(notmuch search \* | notmuch_search_sanitize)
+output+="
+$(notmuch count lastmod:$((before + 1))..$((before + 1)))"
+test_expect_equal "$output" "\
+thread:XXX   2001-01-05 [1/1] Notmuch Test Suite; One (tag5 unread)
+thread:XXX   2001-01-05 [1/1] Notmuch Test Suite; Two (tag5 unread)
+2"
+
+test_begin_subtest "Last operation on a tag wins without maildir synchronization"
+notmuch tag +tag6 -tag6 -tag5 +tag5 -unread One
+output=$(notmuch search \* | notmuch_search_sanitize)
+test_expect_equal "$output" "\
+thread:XXX   2001-01-05 [1/1] Notmuch Test Suite; One (tag5)
+thread:XXX   2001-01-05 [1/1] Notmuch Test Suite; Two (tag5 unread)"
+
+notmuch tag --remove-all +inbox +tag1 +unread \*
+notmuch config set maildir.synchronize_flags $OLDCONFIG
+
 test_begin_subtest "Special characters in tags"
 notmuch tag +':" ' \*
 notmuch tag -':" ' Two
@@ -143,6 +169,23 @@ cat <<EOF >EXPECTED
 EOF
 test_expect_equal_file EXPECTED OUTPUT
 
+test_begin_subtest "--batch, consecutive id lines"
+notmuch dump --format=batch-tag > backup.tags
+notmuch tag --batch <<EOF
++run1 -- id:msg-001@notmuch-test-suite
++run1 -- id:msg-002@notmuch-test-suite
++run2 -run1 -- id:msg-001@notmuch-test-suite
++run3 -- tag:run2
++run4 -- id:msg-002@notmuch-test-suite
+EOF
+NOTMUCH_DUMP_TAGS tag:run1 or tag:run2 > OUTPUT
+notmuch restore --format=batch-tag < backup.tags
+cat <<EOF >EXPECTED
++inbox +run2 +run3 +tag5 +unread -- id:msg-001@notmuch-test-suite
++inbox +run1 +run4 +tag4 +tag5 +unread -- id:msg-002@notmuch-test-suite
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
 test_begin_subtest "--batch, blank lines and comments"
 notmuch dump | sort > EXPECTED
 notmuch tag --batch <<EOF
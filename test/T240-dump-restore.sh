@@ -94,6 +94,16 @@ notmuch dump --gzip --output=dump-gzip-outfile.gz
 gunzip dump-gzip-outfile.gz
 test_expect_equal_file dump.expected dump-gzip-outfile
 
+test_begin_subtest "dump --jobs=1 and --jobs=4 agree"
+notmuch dump --jobs=1 > dump-jobs-1
+notmuch dump --jobs=4 > dump-jobs-4
+test_expect_equal_file dump-jobs-1 dump-jobs-4
+
+test_begin_subtest "dump --gzip --jobs=4"
+notmuch dump --gzip --jobs=4 --output=dump-gzip-jobs.gz
+gunzip dump-gzip-jobs.gz
+test_expect_equal_file dump.expected dump-gzip-jobs
+
 test_begin_subtest "restoring gzipped stdin"
 notmuch dump --gzip --output=backup.gz
 notmuch tag +new_tag '*'
@@ -322,6 +332,93 @@ EOF
 
 test_expect_equal_file EXPECTED OUTPUT
 
+test_begin_subtest "restore: the last line for a message wins across batches"
+notmuch dump --format=batch-tag --include=tags > EXPECTED
+sed -n 's/^.*\(-- id:.*\)$/+stale \1/p' EXPECTED > STALE
+for i in $(seq 30); do cat STALE; done > INPUT
+cat EXPECTED >> INPUT
+notmuch restore --input=INPUT
+notmuch dump --format=batch-tag --include=tags > OUTPUT
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "restore --checkpoint skips lines already restored"
+notmuch dump --format=batch-tag --include=tags > BEFORE
+sed 's/^.*\(-- id:.*\)$/+resumed \1/' BEFORE > INPUT
+# The header and the first two messages were restored before.
+echo 3 > CHECKPOINT
+notmuch restore --checkpoint=CHECKPOINT --input=INPUT
+{ head -n 3 BEFORE; tail -n +4 INPUT; } > EXPECTED
+notmuch dump --format=batch-tag --include=tags > OUTPUT
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "restore --checkpoint removes the checkpoint when done"
+test_expect_success '! test -e CHECKPOINT'
+
+test_begin_subtest "dump --since-revision lists changed and deleted messages"
+generate_message
+deleted_id=$gen_msg_id
+deleted_file=$gen_msg_filename
+generate_message
+changed_id=$gen_msg_id
+notmuch new > /dev/null
+since=$(notmuch count --lastmod '*' | cut -f3)
+notmuch tag -inbox -unread +changed id:$changed_id
+rm -f "$deleted_file"
+notmuch new > /dev/null
+notmuch count --lastmod '*' | cut -f2,3 --output-delimiter=' ' > REVISION
+cat <<EOF > EXPECTED
+#notmuch-dump batch-tag:3 tags
+#notmuch-revision $(cat REVISION)
+#- $deleted_id
++changed -- id:$changed_id
+EOF
+notmuch dump --include=tags --since-revision=$since > OUTPUT
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "dump --since-revision from the revision of the last dump"
+cat <<EOF > EXPECTED
+#notmuch-dump batch-tag:3 tags
+#notmuch-revision $(cat REVISION)
+EOF
+notmuch dump --include=tags --since-revision=$(cut -d' ' -f2 REVISION) > OUTPUT
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "prune deletions up to the revision of the last dump"
+test_C ${MAIL_DIR} $(cut -d' ' -f2 REVISION) <<'EOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include <notmuch.h>
+int main (int argc, char** argv)
+{
+   notmuch_database_t *db;
+   notmuch_status_t stat;
+   stat = notmuch_database_open (argv[1], NOTMUCH_DATABASE_MODE_READ_WRITE, &db);
+   if (stat != NOTMUCH_STATUS_SUCCESS) {
+     fprintf (stderr, "error opening database: %d\n", stat);
+     exit (1);
+   }
+
+   stat = notmuch_database_prune_deleted_messages (db, strtoul (argv[2], NULL, 10));
+   printf ("%d\n", stat);
+   notmuch_database_destroy (db);
+}
+EOF
+cat <<EOF > EXPECTED
+== stdout ==
+0
+== stderr ==
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "dump --since-revision omits pruned deletions"
+cat <<EOF > EXPECTED
+#notmuch-dump batch-tag:3 tags
+#notmuch-revision $(cat REVISION)
++changed -- id:$changed_id
+EOF
+notmuch dump --include=tags --since-revision=$since > OUTPUT
+test_expect_equal_file EXPECTED OUTPUT
+
 test_begin_subtest 'roundtripping random message-ids and tags'
 
     ${TEST_DIRECTORY}/random-corpus --config-path=${NOTMUCH_CONFIG} \
@@ -206,4 +206,32 @@ for tag in draft flagged passed replied; do
     test_expect_equal "$(< output)" \
 		      "thread:XXX   2001-01-05 [1/1] Notmuch Test Suite; $tag sync in new ($tag unread)"
 done
+
+# Tag changes involving maildir flags cannot be applied to all
+# messages at once, and go through each message instead.
+test_begin_subtest "Tagging several messages with a flag tag renames their files"
+add_message [subject]='"Flag sync for several"' [dir]=cur [filename]='flag-sync-1:2,'
+add_message [subject]='"Flag sync for several"' [dir]=cur [filename]='flag-sync-2:2,'
+notmuch tag +flagged +several subject:"Flag sync for several"
+output=$(cd $MAIL_DIR/cur/; ls flag-sync-*)
+output+="
+$(notmuch count tag:flagged and tag:several)"
+test_expect_equal "$output" "flag-sync-1:2,F
+flag-sync-2:2,F
+2"
+
+test_begin_subtest "Last operation on a flag tag wins"
+notmuch tag -flagged +flagged +replied -replied subject:"Flag sync for several"
+test_expect_equal "$(cd $MAIL_DIR/cur/; ls flag-sync-*)" "flag-sync-1:2,F
+flag-sync-2:2,F"
+
+test_begin_subtest "Remove all with maildir synchronization renames files"
+notmuch tag --remove-all +several subject:"Flag sync for several"
+output=$(cd $MAIL_DIR/cur/; ls flag-sync-*)
+output+="
+$(notmuch search --output=tags subject:"Flag sync for several")"
+test_expect_equal "$output" "flag-sync-1:2,S
+flag-sync-2:2,S
+several"
+
 test_done
@@ -41,6 +41,11 @@ test_begin_subtest "tag backup matches pre-upgrade dump"
 gunzip -c ${MAIL_DIR}/.notmuch/dump-*.gz | sort > backup-dump
 test_expect_equal_file pre-upgrade-dump backup-dump
 
+test_begin_subtest "thread count after upgrade"
+test_expect_equal \
+    "$(notmuch search --output=threads '*' | wc -l)" \
+    "$(notmuch count --output=threads '*')"
+
 test_begin_subtest "folder: no longer matches in the middle of path"
 output=$(notmuch search folder:baz)
 test_expect_equal "$output" ""
@@ -133,4 +138,70 @@ d
 EOF
 test_expect_equal_file EXPECTED OUTPUT
 
+test_declare_external_prereq xapian-metadata
+
+# Start over from the version 1 database, and kill the upgrade right
+# after its first chunk of messages was committed.
+rm -rf ${MAIL_DIR}/.notmuch
+tar xf $TEST_DIRECTORY/test-databases/${dbtarball} -C ${MAIL_DIR} --strip-components=1
+notmuch dump | sort > pre-interrupt-dump
+notmuch count '*' > pre-interrupt-count
+
+cat <<EOF > upgrade-interrupt.gdb
+set breakpoint pending on
+set logging file upgrade-interrupt-gdb.log
+set logging on
+break _upgrade_chunk_destroy
+commands
+kill
+end
+run
+EOF
+
+test_begin_subtest "interrupted upgrade leaves a checkpoint"
+${TEST_GDB} --batch-silent -x upgrade-interrupt.gdb \
+    --args notmuch new > /dev/null 2>&1
+output=$(xapian-metadata get ${MAIL_DIR}/.notmuch/xapian upgrade_checkpoint |
+	     sed -e 's/^[0-9a-f]\+ [0-9]\+$/FEATURES LAST_DOC_ID/')
+test_expect_equal "$output" "FEATURES LAST_DOC_ID"
+
+cat <<EOF > upgrade-resume.gdb
+set breakpoint pending on
+set logging file upgrade-resume-gdb.log
+set logging on
+break _upgrade_chunk_apply
+commands
+shell echo "chunk upgraded again" >> upgrade-resume.log
+continue
+end
+run
+EOF
+
+test_begin_subtest "interrupted upgrade resumes after its checkpoint"
+rm -f upgrade-resume.log
+${TEST_GDB} --batch-silent --return-child-result -x upgrade-resume.gdb \
+    --args notmuch new 2>&1 |
+    sed -e 's/^Backing up tags to .*$/Backing up tags to FILENAME/' > OUTPUT
+test -e upgrade-resume.log && cat upgrade-resume.log >> OUTPUT
+cat <<EOF > EXPECTED
+Welcome to a new version of notmuch! Your database will now be upgraded.
+This process is safe to interrupt.
+Backing up tags to FILENAME
+Your notmuch database has now been upgraded.
+No new mail.
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "resumed upgrade removes the checkpoint"
+output=$(xapian-metadata get ${MAIL_DIR}/.notmuch/xapian upgrade_checkpoint)
+test_expect_equal "$output" ""
+
+test_begin_subtest "resumed upgrade keeps all tags"
+notmuch dump | sort > OUTPUT
+test_expect_equal_file pre-interrupt-dump OUTPUT
+
+test_begin_subtest "resumed upgrade keeps all messages"
+notmuch count '*' > OUTPUT
+test_expect_equal_file pre-interrupt-count OUTPUT
+
 test_done
@@ -90,4 +90,11 @@ subtotal=$(notmuch count lastmod:..$lastmod)
 result=$(($subtotal == $total-1))
 test_expect_equal 1 "$result"
 
+test_begin_subtest 'tagging many messages uses a single revision'
+before=$(notmuch count --lastmod '*' | cut -f3)
+notmuch tag +bulk-tag from:cworth
+after=$(notmuch count --lastmod '*' | cut -f3)
+test_expect_equal "$((before + 1)) $(notmuch count from:cworth)" \
+		  "$after $(notmuch count lastmod:$after..$after)"
+
 test_done
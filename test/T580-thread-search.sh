@@ -38,5 +38,132 @@ done
 
 test_expect_equal "$count" "$success"
 
+add_email_corpus lkml
+
+test_begin_subtest "Threads are returned in order of their first matching message"
+for id in $(notmuch search --output=messages '*'); do
+    notmuch search --output=threads "$id"
+done | awk '!seen[$0]++' > EXPECTED
+notmuch search --output=threads '*' > OUTPUT
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "Matched message counts are complete across result windows"
+notmuch search date:2010 | \
+    sed 's/^[^[]*\[\([0-9]*\)\/.*$/\1/' | awk '{ n += $1 } END { print n }' > OUTPUT
+notmuch count date:2010 > EXPECTED
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "Threads built in batches match threads built one at a time"
+for thread in $(notmuch search --output=threads '*'); do
+    notmuch search "$thread"
+done > EXPECTED
+notmuch search '*' > OUTPUT
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "Retagging threads while iterating skips none of them"
+notmuch tag +retag '*'
+threads=$(notmuch count --output=threads tag:retag)
+test_C ${MAIL_DIR} <<'EOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include <notmuch.h>
+int main (int argc, char** argv)
+{
+   notmuch_database_t *db;
+   notmuch_status_t stat;
+   notmuch_query_t *query;
+   notmuch_threads_t *threads;
+   unsigned int count = 0;
+
+   stat = notmuch_database_open (argv[1], NOTMUCH_DATABASE_MODE_READ_WRITE, &db);
+   if (stat != NOTMUCH_STATUS_SUCCESS) {
+     fprintf (stderr, "error opening database: %d\n", stat);
+     exit (1);
+   }
+
+   query = notmuch_query_create (db, "tag:retag");
+   stat = notmuch_query_search_threads (query, &threads);
+   if (stat != NOTMUCH_STATUS_SUCCESS) {
+     fprintf (stderr, "error querying threads: %d\n", stat);
+     exit (1);
+   }
+
+   for (; notmuch_threads_valid (threads); notmuch_threads_move_to_next (threads)) {
+     notmuch_thread_t *thread = notmuch_threads_get (threads);
+     char thread_query[256];
+     notmuch_query_t *members;
+     notmuch_messages_t *messages;
+
+     snprintf (thread_query, sizeof (thread_query), "thread:%s",
+	       notmuch_thread_get_thread_id (thread));
+     members = notmuch_query_create (db, thread_query);
+     if (notmuch_query_search_messages (members, &messages))
+       exit (1);
+     for (; notmuch_messages_valid (messages); notmuch_messages_move_to_next (messages))
+       notmuch_message_remove_tag (notmuch_messages_get (messages), "retag");
+     notmuch_query_destroy (members);
+
+     notmuch_thread_destroy (thread);
+     count++;
+   }
+
+   printf ("%u\n", count);
+   notmuch_query_destroy (query);
+   notmuch_database_destroy (db);
+}
+EOF
+cat <<EOF > EXPECTED
+== stdout ==
+${threads}
+== stderr ==
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "Merged threads can be found by either thread ID"
+if [ $NOTMUCH_HAVE_XAPIAN_FIELD_PROCESSOR -eq 0 ]; then
+    test_subtest_known_broken
+fi
+add_message '[id]=merge-a@example.net' '[subject]="merge a"' \
+	    '[references]="<merge-root@example.net>"'
+thread_a=$(notmuch search --output=threads id:merge-a@example.net)
+add_message '[id]=merge-b@example.net' '[subject]="merge b"' \
+	    '[references]="<merge-other@example.net>"'
+thread_b=$(notmuch search --output=threads id:merge-b@example.net)
+add_message '[id]=merge-c@example.net' '[subject]="merge c"' \
+	    '[references]="<merge-root@example.net> <merge-other@example.net>"'
+for thread in $thread_a $thread_b; do
+    notmuch search --output=messages $thread | sort
+done > OUTPUT
+cat <<EOF > EXPECTED
+id:merge-a@example.net
+id:merge-b@example.net
+id:merge-c@example.net
+id:merge-a@example.net
+id:merge-b@example.net
+id:merge-c@example.net
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "Merged threads can be found by either thread ID after compact"
+if [ $NOTMUCH_HAVE_XAPIAN_FIELD_PROCESSOR -eq 0 ]; then
+    test_subtest_known_broken
+fi
+add_message '[id]=merge-d@example.net' '[subject]="merge d"' \
+	    '[references]="<merge-third@example.net>"'
+thread_d=$(notmuch search --output=threads id:merge-d@example.net)
+add_message '[id]=merge-e@example.net' '[subject]="merge e"' \
+	    '[references]="<merge-third@example.net> <merge-root@example.net>"'
+notmuch compact --quiet
+for thread in $thread_a $thread_b $thread_d; do
+    notmuch search --output=messages $thread | sort | tr '\n' ' '
+    echo
+done > OUTPUT
+members="id:merge-a@example.net id:merge-b@example.net id:merge-c@example.net id:merge-d@example.net id:merge-e@example.net "
+cat <<EOF > EXPECTED
+$members
+$members
+$members
+EOF
+test_expect_equal_file EXPECTED OUTPUT
 
 test_done
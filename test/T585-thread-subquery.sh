@@ -43,6 +43,28 @@ thread:XXX   2009-11-18 [7/7] Lars Kellogg-Stedman, Mikhail Gusarov, Keith Packa
 EOF
 test_expect_equal_file EXPECTED OUTPUT
 
+test_begin_subtest "Nested subquery"
+if [ $NOTMUCH_HAVE_XAPIAN_FIELD_PROCESSOR -eq 0 ]; then
+    test_subtest_known_broken
+fi
+notmuch search thread:{from:keithp} | notmuch_search_sanitize > EXPECTED
+notmuch search 'thread:"{thread:{from:keithp}}"' | notmuch_search_sanitize > OUTPUT
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "Subquery sees earlier changes in the same process"
+if [ $NOTMUCH_HAVE_XAPIAN_FIELD_PROCESSOR -eq 0 ]; then
+    test_subtest_known_broken
+fi
+notmuch tag --batch <<EOF
++subquery-marker -- from:keithp
++subquery-first -- thread:{tag:subquery-marker}
++subquery-marker -- from:cworth
++subquery-second -- thread:{tag:subquery-marker}
+EOF
+notmuch search --output=threads 'thread:{from:keithp} or thread:{from:cworth}' > EXPECTED
+notmuch search --output=threads tag:subquery-second > OUTPUT
+test_expect_equal_file EXPECTED OUTPUT
+
 test_begin_subtest "Syntax/quoting error in subquery"
 if [ $NOTMUCH_HAVE_XAPIAN_FIELD_PROCESSOR -eq 0 ]; then
     test_subtest_known_broken
@@ -71,4 +71,11 @@ notmuch search query:test2 > OUTPUT
 notmuch search $QUERYSTR2 > EXPECTED
 test_expect_equal_file EXPECTED OUTPUT
 
+test_begin_subtest "search named query referring to itself"
+notmuch config set query.loop "query:loop or subject:Maildir"
+if [ $NOTMUCH_HAVE_XAPIAN_FIELD_PROCESSOR -ne 1 ]; then
+    test_subtest_known_broken
+fi
+test_expect_code 1 "notmuch search query:loop"
+
 test_done
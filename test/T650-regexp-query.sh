@@ -171,6 +171,38 @@ thread:XXX   2009-11-18 [1/2] Carl Worth| Jan Janak; [notmuch] [PATCH] Older ver
 EOF
 test_expect_equal_file EXPECTED OUTPUT
 
+add_message '[subject]="Reply to a missing parent"' \
+	    '[in-reply-to]="<missing-parent@trigrams.example>"'
+
+notmuch config set index.regexp_trigrams true
+notmuch new > /dev/null
+
+test_begin_subtest "regexp mid search for a ghost indexed before trigrams"
+add_message '[subject]="The missing parent"' \
+	    '[id]=missing-parent@trigrams.example'
+notmuch search --output=messages 'mid:/missing-parent@trigrams/' > OUTPUT
+echo "id:missing-parent@trigrams.example" > EXPECTED
+test_expect_equal_file EXPECTED OUTPUT
+
+# A group hides the literal text from the trigram pre-filter, so the
+# first search in each of these scans all values.
+test_begin_subtest "regexp with alternatives narrowed by trigrams"
+notmuch search --output=messages 'subject:"/(^Older versions|support -C|Worth)/"' > EXPECTED
+notmuch search --output=messages 'subject:"/^Older versions|support -C|Worth/"' > OUTPUT
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "regexp with optional characters narrowed by trigrams"
+notmuch search --output=messages 'from:"/(Carl? Worth)/"' > EXPECTED
+notmuch search --output=messages 'from:"/Carl? Worth/"' > OUTPUT
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "regexp search after disabling trigram terms"
+notmuch config set index.regexp_trigrams false
+add_message '[subject]="Added without trigrams"'
+notmuch search --output=messages 'subject:/without trigrams/' > OUTPUT
+echo "id:$gen_msg_id" > EXPECTED
+test_expect_equal_file EXPECTED OUTPUT
+
 test_begin_subtest "unanchored tag search"
 notmuch search tag:signed or tag:inbox > EXPECTED
 notmuch search tag:/i/ > OUTPUT
@@ -80,4 +80,108 @@ Reply id: B01-child@example.org
 EOF
 test_expect_equal_file EXPECTED OUTPUT
 
+test_begin_subtest "Query outlives the query it shares its parse with"
+
+test_C ${MAIL_DIR} <<'EOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include <notmuch.h>
+int main (int argc, char** argv)
+{
+   notmuch_database_t *db;
+   notmuch_status_t stat;
+   unsigned int count;
+   unsigned long hits, misses;
+   stat = notmuch_database_open (argv[1], NOTMUCH_DATABASE_MODE_READ_ONLY, &db);
+   if (stat != NOTMUCH_STATUS_SUCCESS) {
+     fprintf (stderr, "error opening database: %d\n", stat);
+     exit (1);
+   }
+
+   notmuch_query_t *first = notmuch_query_create (db, "id:B00-root@example.org");
+   notmuch_query_t *second = notmuch_query_create (db, "id:B00-root@example.org");
+
+   if (notmuch_query_count_messages (first, &count) ||
+       notmuch_query_count_messages (second, &count)) {
+     fprintf (stderr, "error counting messages\n");
+     exit (1);
+   }
+
+   notmuch_query_destroy (first); // the parse should not get destroyed here
+
+   if (notmuch_query_count_messages (second, &count)) {
+     fprintf (stderr, "error counting messages\n");
+     exit (1);
+   }
+
+   notmuch_database_get_parse_cache_stats (db, &hits, &misses);
+   fprintf (stdout, "Count: %u, hits: %lu, misses: %lu\n", count, hits, misses);
+   notmuch_query_destroy (second);
+   notmuch_database_destroy (db);
+}
+EOF
+cat <<'EOF' >EXPECTED
+== stdout ==
+Count: 1, hits: 1, misses: 1
+== stderr ==
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "Thread served from its summary has no messages"
+notmuch config set index.thread_summaries true
+# Closing the database after a change writes all summaries.
+notmuch tag +summarized id:B00-root@example.org
+notmuch tag -summarized id:B00-root@example.org
+threads=$(notmuch count --output=threads '*')
+
+test_C ${MAIL_DIR} <<'EOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include <notmuch.h>
+int main (int argc, char** argv)
+{
+   notmuch_database_t *db;
+   notmuch_status_t stat;
+   unsigned int total = 0, empty = 0;
+   stat = notmuch_database_open (argv[1], NOTMUCH_DATABASE_MODE_READ_ONLY, &db);
+   if (stat != NOTMUCH_STATUS_SUCCESS) {
+     fprintf (stderr, "error opening database: %d\n", stat);
+     exit (1);
+   }
+
+   notmuch_query_t *query = notmuch_query_create (db, "*");
+   notmuch_threads_t *threads;
+
+   notmuch_query_set_use_thread_summaries (query, TRUE);
+   stat = notmuch_query_search_threads (query, &threads);
+   if (stat != NOTMUCH_STATUS_SUCCESS) {
+     fprintf (stderr, "error querying threads: %d\n", stat);
+     exit (1);
+   }
+
+   for (; notmuch_threads_valid (threads); notmuch_threads_move_to_next (threads)) {
+     notmuch_thread_t *thread = notmuch_threads_get (threads);
+     notmuch_messages_t *messages = notmuch_thread_get_messages (thread);
+
+     total++;
+     if (!notmuch_messages_valid (messages) &&
+	 notmuch_thread_get_total_messages (thread) > 0)
+       empty++;
+     notmuch_thread_destroy (thread);
+   }
+
+   fprintf (stdout, "Threads: %u, without messages: %u\n", total, empty);
+   notmuch_threads_destroy (threads);
+   notmuch_query_destroy (query);
+   notmuch_database_destroy (db);
+}
+EOF
+cat <<EOF >EXPECTED
+== stdout ==
+Threads: ${threads}, without messages: ${threads}
+== stderr ==
+EOF
+notmuch config set index.thread_summaries false
+test_expect_equal_file EXPECTED OUTPUT
+
 test_done
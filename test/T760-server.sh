@@ -0,0 +1,85 @@
+#!/usr/bin/env bash
+test_description='"notmuch server" requests'
+. $(dirname "$0")/test-lib.sh || exit 1
+
+add_email_corpus
+
+test_begin_subtest "JSON search request"
+notmuch search --format=json tag:inbox and from:cworth > search.out
+echo '["search", "--format=json", "tag:inbox and from:cworth"]' |
+    notmuch server > OUTPUT
+{ echo "0 $(wc -c < search.out) 0"; cat search.out; } > EXPECTED
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "S-expression requests"
+notmuch count --output=threads '*' > count.out
+notmuch search --output=tags '*' > tags.out
+cat <<EOF | notmuch server > OUTPUT
+("count" "--output=threads" "*")
+
+("search" "--output=tags" "*")
+EOF
+{
+    echo "0 $(wc -c < count.out) 0"; cat count.out
+    echo "0 $(wc -c < tags.out) 0"; cat tags.out
+} > EXPECTED
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "Requests see tag changes"
+cat <<EOF | notmuch server > OUTPUT
+["tag", "+served", "id:87iqd9rn3l.fsf@vertex.dottedmag"]
+["count", "tag:served"]
+EOF
+cat <<EOF > EXPECTED
+0 0 0
+0 2 0
+1
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "Options do not carry over between requests"
+notmuch search --output=threads tag:served > threads.out
+notmuch search tag:served > summary.out
+cat <<EOF | notmuch server > OUTPUT
+["search", "--output=threads", "tag:served"]
+["search", "tag:served"]
+EOF
+{
+    echo "0 $(wc -c < threads.out) 0"; cat threads.out
+    echo "0 $(wc -c < summary.out) 0"; cat summary.out
+} > EXPECTED
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "Requests see configuration changes"
+old_excludes=$(notmuch config get search.exclude_tags)
+{
+    echo '["count", "id:87iqd9rn3l.fsf@vertex.dottedmag"]'
+    sleep 1
+    notmuch config set search.exclude_tags served
+    echo '["count", "id:87iqd9rn3l.fsf@vertex.dottedmag"]'
+} | notmuch server > OUTPUT
+notmuch config set search.exclude_tags $old_excludes
+cat <<EOF > EXPECTED
+0 2 0
+1
+0 2 0
+0
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+test_begin_subtest "Malformed and unknown requests"
+cat <<EOF | notmuch server > OUTPUT
+search tag:inbox
+["new"]
+EOF
+error1="Error: malformed request: search tag:inbox"
+error2="Error: 'new' is not available in notmuch server"
+cat <<EOF > EXPECTED
+1 0 $((${#error1} + 1))
+$error1
+1 0 $((${#error2} + 1))
+$error2
+EOF
+test_expect_equal_file EXPECTED OUTPUT
+
+test_done